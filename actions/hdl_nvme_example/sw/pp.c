@@ -37,6 +37,14 @@
 #include "snap_internal.h"	/* ARRAY_SIZE, ... */
 
 #define PP_HISTORY		10000
+#define PP_PREFETCH_MAX		32	/* offsets we can publish */
+
+/* PP_STRATEGY_SMART */
+#define PP_STREAMS		16	/* sequential streams tracked at once */
+#define PP_OFFS_MAX		256	/* max. prefetch distance in blocks */
+#define PP_MIN_SAMPLES		64	/* reads needed before we predict */
+#define PP_MIN_PERMILLE		50	/* offsets hit less often are dropped */
+#define PP_PRED_SIZE		4096	/* remembered predictions, power of 2 */
 
 static int _pp_strategy = PP_STRATEGY_UPDOWN;
 static int _pp_history = PP_HISTORY;
@@ -45,6 +53,15 @@ struct __lba {
 	off_t lba;
 	unsigned int nblocks;
 	unsigned long usecs;
+	int _read;
+};
+
+/* Recently requested LBAs which are close to each other */
+struct __stream {
+	off_t lba[PP_PREFETCH_MAX];	/* ring of the last requests */
+	unsigned int n;
+	unsigned int idx;
+	unsigned int used;		/* history index of the last request */
 };
 
 struct __pp {
@@ -58,6 +75,17 @@ struct __pp {
 	unsigned int lba_num;	/* valid entries */
 	pthread_t tid;
 
+	/* PP_STRATEGY_SMART */
+	int offslist[PP_PREFETCH_MAX];	/* published, best first */
+	int offs_n;			/* -1 until we have a prediction */
+	struct __stream stream[PP_STREAMS];
+	unsigned int score[2 * PP_OFFS_MAX + 1];
+	off_t pred[PP_PRED_SIZE];	/* LBAs we told to prefetch, + 1 */
+	unsigned long reads;		/* reads seen */
+	unsigned long pred_hits;	/* reads we predicted */
+	unsigned long last_reads;
+	unsigned long last_pred_hits;
+
 	void *put_data;
 	size_t put_nblocks;
 	int (* pp_put_offslist)(void *put_data, int *offslist, unsigned int n, size_t nblocks);
@@ -84,10 +112,8 @@ static struct __pp pp;
  * @lba:       requested LBA
  * @nblocks:   how many blocks per LBA
  */
-static int __pp_add_lba(off_t lba  __attribute__((unused)),
-		size_t nblocks  __attribute__((unused)),
-		unsigned long usecs  __attribute__((unused)),
-		int _read __attribute__((unused)))
+static int __pp_add_lba(off_t lba, size_t nblocks, unsigned long usecs,
+		int _read)
 {
 	if ((pp.f->flags & PP_FLAG_ALLOC_LBA_LIST) != PP_FLAG_ALLOC_LBA_LIST)
 		return -1;
@@ -97,6 +123,7 @@ static int __pp_add_lba(off_t lba  __attribute__((unused)),
 	pp.lba_list[pp.lba_widx].lba = lba;
 	pp.lba_list[pp.lba_widx].nblocks = nblocks;
 	pp.lba_list[pp.lba_widx].usecs = usecs;
+	pp.lba_list[pp.lba_widx]._read = _read;
 
 	if (pp.lba_num < pp.lba_max) {
 		pp.lba_num++;
@@ -113,7 +140,7 @@ static int __pp_add_lba(off_t lba  __attribute__((unused)),
 static inline void __print_offslist(int *offslist, unsigned int n)
 {
 	unsigned int i;
-	char s[128], num[32];
+	char s[256], num[32];
 
 	strcpy(s, " ");
 	for (i = 0; i < n; i++) {
@@ -146,7 +173,7 @@ static int __pp_updown_offslist(int *offslist, unsigned int n, size_t nblocks)
 
 	pthread_mutex_unlock(&pp.lock);
 	__print_offslist(offslist, n);
-	return 0;
+	return n;
 }
 
 static int __pp_up_offslist(int *offslist, unsigned int n, size_t nblocks)
@@ -161,7 +188,7 @@ static int __pp_up_offslist(int *offslist, unsigned int n, size_t nblocks)
 
 	pthread_mutex_unlock(&pp.lock);
 	__print_offslist(offslist, n);
-	return 0;
+	return n;
 }
 
 static int __pp_down_offslist(int *offslist, unsigned int n, size_t nblocks)
@@ -176,7 +203,7 @@ static int __pp_down_offslist(int *offslist, unsigned int n, size_t nblocks)
 
 	pthread_mutex_unlock(&pp.lock);
 	__print_offslist(offslist, n);
-	return 0;
+	return n;
 }
 
 static void *__pp_thread(struct __pp *pp)
@@ -187,6 +214,161 @@ static void *__pp_thread(struct __pp *pp)
 	return NULL;
 }
 
+/*
+ * PP_STRATEGY_SMART
+ *
+ * The history is split into streams: a read belongs to the stream
+ * whose last read is closest, if that is at most PP_OFFS_MAX blocks
+ * away. Interleaved sequential scans end up in different streams,
+ * random reads mostly in short-lived ones. For every read we count
+ * the offsets to the previous pp_prefetch reads of its stream, i.e.
+ * how far ahead a prefetch would have been useful. Strides show up
+ * as stride, 2 * stride, ..., recurring patterns like +1, +3 as the
+ * sums they produce. The offsets found most often are published,
+ * none if nothing qualifies, such that we do not waste request slots
+ * on random access.
+ */
+static struct __stream *__pp_stream(struct __pp *pp, off_t lba,
+				unsigned int now)
+{
+	unsigned int i;
+	off_t d, best_d = PP_OFFS_MAX + 1;
+	struct __stream *s, *best = NULL, *lru = &pp->stream[0];
+
+	for (i = 0; i < PP_STREAMS; i++) {
+		s = &pp->stream[i];
+		if (s->used < lru->used)
+			lru = s;
+		if (s->n == 0)
+			continue;
+
+		d = lba - s->lba[(s->idx + PP_PREFETCH_MAX - 1) % PP_PREFETCH_MAX];
+		if (d < 0)
+			d = -d;
+		if (d < best_d) {
+			best_d = d;
+			best = s;
+		}
+	}
+
+	if (best == NULL) {		/* start a new stream */
+		best = lru;
+		best->n = 0;
+		best->idx = 0;
+	}
+	best->used = now;
+	return best;
+}
+
+static void *__pp_smart_thread(struct __pp *pp)
+{
+	unsigned int i, j, k, n, reads = 0, lookahead;
+	unsigned int best, limit;
+	long offs;
+	struct __lba *l;
+	struct __stream *s;
+	unsigned long dreads, dhits;
+
+	lookahead = MIN((unsigned int)pp->pp_prefetch, (unsigned int)PP_PREFETCH_MAX);
+	memset(pp->stream, 0, sizeof(pp->stream));
+	memset(pp->score, 0, sizeof(pp->score));
+
+	for (i = 0; i < pp->lba_num; i++) {
+		l = &pp->lba_list[(pp->lba_ridx + i) % pp->lba_max];
+		if (!l->_read)
+			continue;
+
+		reads++;
+		s = __pp_stream(pp, l->lba, i + 1);
+		for (j = 0; j < MIN(s->n, lookahead); j++) {
+			offs = l->lba - s->lba[(s->idx + PP_PREFETCH_MAX - 1 - j) %
+					       PP_PREFETCH_MAX];
+			if ((offs != 0) && (offs >= -PP_OFFS_MAX) &&
+			    (offs <= PP_OFFS_MAX))
+				pp->score[offs + PP_OFFS_MAX]++;
+		}
+		s->lba[s->idx] = l->lba;
+		s->idx = (s->idx + 1) % PP_PREFETCH_MAX;
+		if (s->n < PP_PREFETCH_MAX)
+			s->n++;
+	}
+
+	if (reads >= PP_MIN_SAMPLES) {
+		/* Pick the best offsets, scores are consumed on the way */
+		limit = MAX(reads * PP_MIN_PERMILLE / 1000, 1u);
+		for (n = 0; n < lookahead; n++) {
+			best = 0;
+			for (k = 1; k < ARRAY_SIZE(pp->score); k++)
+				if (pp->score[k] > pp->score[best])
+					best = k;
+			if (pp->score[best] < limit)
+				break;
+			pp->offslist[n] = (int)best - PP_OFFS_MAX;
+			pp->score[best] = 0;
+		}
+		pp->offs_n = n;
+	}
+
+	dreads = pp->reads - pp->last_reads;
+	dhits = pp->pred_hits - pp->last_pred_hits;
+	pp->last_reads = pp->reads;
+	pp->last_pred_hits = pp->pred_hits;
+
+	pp_trace("[%s] reads=%u offsets=%d predicted %lu of %lu reads (%lu%%)\n",
+		__func__, reads, pp->offs_n, dhits, dreads,
+		dreads ? dhits * 100 / dreads : 0);
+	if (pp->offs_n > 0)
+		__print_offslist(pp->offslist, pp->offs_n);
+
+	return NULL;
+}
+
+/*
+ * Account reads we predicted, and remember what we predict now. This
+ * approximates what was prefetched, it does not know if the device
+ * actually had a free slot for it.
+ */
+static int __pp_smart_add_lba(off_t lba, size_t nblocks, unsigned long usecs,
+		int _read)
+{
+	int i, rc;
+	off_t *p;
+
+	rc = __pp_add_lba(lba, nblocks, usecs, _read);
+	if ((rc != 0) || !_read)
+		return rc;
+
+	pthread_mutex_lock(&pp.lock);
+	pp.reads++;
+	p = &pp.pred[lba & (PP_PRED_SIZE - 1)];
+	if (*p == lba + 1) {
+		pp.pred_hits++;
+		*p = 0;
+	}
+	for (i = 0; i < pp.offs_n; i++) {
+		off_t _lba = lba + pp.offslist[i];
+
+		pp.pred[_lba & (PP_PRED_SIZE - 1)] = _lba + 1;
+	}
+	pthread_mutex_unlock(&pp.lock);
+	return 0;
+}
+
+static int __pp_smart_offslist(int *offslist, unsigned int n, size_t nblocks)
+{
+	int i;
+
+	if (pp.offs_n < 0)	/* nothing learned yet */
+		return __pp_updown_offslist(offslist, n, nblocks);
+
+	pthread_mutex_lock(&pp.lock);
+	for (i = 0; (i < pp.offs_n) && (i < (int)n); i++)
+		offslist[i] = pp.offslist[i];
+	pthread_mutex_unlock(&pp.lock);
+	__print_offslist(offslist, i);
+	return i;
+}
+
 static struct pp_funcs pp_funcs[] = {
 	/* 0: PP_STRATEGY_UP */
 	{ .flags = 0x0,
@@ -205,9 +387,9 @@ static struct pp_funcs pp_funcs[] = {
 	  .pp_thread = __pp_thread },
 	/* 3: PP_STRATEGY_SMART */
 	{ .flags = (PP_FLAG_ALLOC_LBA_LIST | PP_FLAG_START_THREAD),
-	  .pp_add_lba = __pp_add_lba,
-	  .pp_get_offslist = __pp_updown_offslist,
-	  .pp_thread = __pp_thread },
+	  .pp_add_lba = __pp_smart_add_lba,
+	  .pp_get_offslist = __pp_smart_offslist,
+	  .pp_thread = __pp_smart_thread },
 };
 
 int pp_add_lba(off_t lba, size_t nblocks, unsigned long usecs, int _read)
@@ -237,13 +419,16 @@ static void *pp_thread(void *arg __attribute__((unused)))
 	while (1) {
 		/* Do something useful */
 		if (pp->f->pp_thread) {
+			/* Tracing may be a cancellation point, keep the lock sane */
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 			pthread_mutex_lock(&pp->lock);
 			pp->f->pp_thread(pp);
 			pthread_mutex_unlock(&pp->lock);
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 		}
-		if (pp->pp_put_offslist)
-			pp->pp_put_offslist(pp->put_data, NULL,
-				pp->pp_prefetch, pp->put_nblocks);
+		if (pp->pp_put_offslist && (pp->offs_n >= 0))
+			pp->pp_put_offslist(pp->put_data, pp->offslist,
+				pp->offs_n, pp->put_nblocks);
 
 		sleep(1);
 		pthread_testcancel();	/* go home if requested */
@@ -266,6 +451,11 @@ int pp_init(int pp_prefetch, pp_put_offslist_t put,  size_t put_nblocks,
 
 	pp.f = &pp_funcs[_pp_strategy];
 	pp.lba_list = NULL;
+	pp.lba_num = 0;
+	pp.offs_n = -1;
+	pp.reads = pp.pred_hits = 0;
+	pp.last_reads = pp.last_pred_hits = 0;
+	memset(pp.pred, 0, sizeof(pp.pred));
 
 	if (pp.f->flags & PP_FLAG_ALLOC_LBA_LIST) {
 		pp.lba_list = calloc(1, _pp_history * sizeof(struct __lba));
@@ -276,7 +466,7 @@ int pp_init(int pp_prefetch, pp_put_offslist_t put,  size_t put_nblocks,
 		pp.lba_max = _pp_history;
 	}
 
-	pp.pp_prefetch = pp_prefetch;
+	pp.pp_prefetch = MIN(pp_prefetch, PP_PREFETCH_MAX);
 	pp.pp_put_offslist = put;
 	pp.put_nblocks = put_nblocks;
 	pp.put_data = put_data;
@@ -294,16 +484,21 @@ int pp_init(int pp_prefetch, pp_put_offslist_t put,  size_t put_nblocks,
 }
 void pp_done(void)
 {
-	if (pp.lba_list) {
-		free(pp.lba_list);
-		pp.lba_list = NULL;
-	}
-
+	/* Stop the thread first, it works on the history */
 	if (pp.tid != 0) {
 		pthread_cancel(pp.tid);
 		pthread_join(pp.tid, NULL);
 		pp.tid = 0;
 	}
+
+	if (pp.reads)
+		pp_trace("[%s] predicted %lu of %lu reads (%lu%%)\n", __func__,
+			pp.pred_hits, pp.reads, pp.pred_hits * 100 / pp.reads);
+
+	if (pp.lba_list) {
+		free(pp.lba_list);
+		pp.lba_list = NULL;
+	}
 }
 
 static void _init(void) __attribute__((constructor));
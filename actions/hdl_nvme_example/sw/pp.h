@@ -60,6 +60,8 @@ int pp_add_lba(off_t lba, size_t nblocks, unsigned long usecs, int _read);
  *
  * @priolist:  array of lba offsets e.g. -4, -2, 2, 4
  * @n:         size of priorization list
+ *
+ * Returns the number of offsets put into the list, at most n.
  */
 int pp_get_offslist(int *offslist, unsigned int n, size_t nblocks);
 
@@ -59,7 +59,8 @@ static chunk_id_t cid = (chunk_id_t)-1; /* global to close device via sig_INT */
 static void usage(const char *prog)
 {
 	printf("Usage: %s [-h] [-v,--verbose]\n"
-	       "  -C, --card <cardno> can be (0...3)\n"
+	       "  -C, --card <cardno> can be (0...3), a list like 0,1\n"
+	       "                            stripes over the cards (RAID0).\n"
 	       "  -V, --version             print version.\n"
 	       "  -X, --cpu <id>            only run on this CPU.\n"
 	       "  -f, --format              write entire device with pattern.\n"
@@ -523,6 +524,9 @@ int main(int argc, char *argv[])
 {
 	int ch, rc = 0;
 	int card_no = 0;
+	const char *cards = "0";
+	char *p, *end;
+	unsigned int ncards = 0;
 	int cpu = -1;
 	const char *fname = "snap_cblk.bin";
 	uint8_t *buf = NULL;
@@ -581,7 +585,7 @@ int main(int argc, char *argv[])
 		switch (ch) {
 		/* which card to use */
 		case 'C':
-			card_no = strtol(optarg, (char **)NULL, 0);
+			cards = optarg;
 			break;
 		case 'X':
 			cpu = strtoul(optarg, NULL, 0);
@@ -654,17 +658,24 @@ int main(int argc, char *argv[])
 	switch_cpu(cpu, verbose_flag);
 	cblk_init(NULL, 0);
 
-	if ((card_no < 0) || (card_no > 4)) {
-		fprintf(stderr, "err: (%d) is a invalid card number!\n",
-			card_no);
-		usage(argv[0]);
-		goto err_out;
+	/* Several cards give a RAID0 chunk: "/dev/cxl/afu0.0s:/dev/..." */
+	device[0] = 0;
+	for (p = (char *)cards; *p; p = (*end == ',') ? end + 1 : end) {
+		card_no = strtol(p, &end, 0);
+		if ((end == p) || (*end && (*end != ',')) ||
+		    (card_no < 0) || (card_no > 4)) {
+			fprintf(stderr, "err: (%s) is a invalid card number!\n",
+				cards);
+			usage(argv[0]);
+			goto err_out;
+		}
+		snprintf(device + strlen(device), sizeof(device) - strlen(device),
+			 "%s/dev/cxl/afu%d.0s", ncards ? ":" : "", card_no);
+		ncards++;
 	}
 
-	/* FIXME Fill in function ... */
-	snprintf(device, sizeof(device)-1, "/dev/cxl/afu%d.0s", card_no);
-
-	cid = cblk_open(device, 128, O_RDWR, 0ull, 0);
+	cid = cblk_open(device, 128, O_RDWR, 0ull,
+			(ncards > 1) ? CBLK_GROUP_RAID0 : 0);
 	if (cid < 0) {
 		fprintf(stderr, "err: opening %s failed rc=%d!\n",
 			device, (int)cid);
@@ -19,6 +19,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <err.h>
 #include <pthread.h>
@@ -43,20 +44,32 @@
 #define CBLK_PREFETCH_THRESHOLD		10 /* only prefetch if reads_in_flight is small than the threshold */
 #define CBLK_NBLOCKS			2 /* tuneup for the prefetch strategy */
 
-#define CONFIG_COMPLETION_THREADS	1 /* 1 works best */
+#define CONFIG_COMPLETION_THREADS	1 /* Default, 1 works best */
+#define CONFIG_COMPLETION_THREADS_MAX	4
+#define CONFIG_COMPLETION_BATCH		8 /* completions harvested per pass */
+#define CONFIG_COMPLETION_USEC		0 /* sleep after an empty poll, 0: spin */
+#define CONFIG_TIMEOUT_CHECK_USEC	10000 /* look for stuck requests */
 #define CONFIG_MAX_RETRIES		0 /* 5 is good, 0: no retries */
 #define CONFIG_BUSY_TIMEOUT_SEC		10
 #define CONFIG_REQ_TIMEOUT_SEC		5
 #define CONFIG_REQ_DURATION_USEC	100000 /* usec */
+#define CONFIG_WRITEBACK_USEC		10000 /* flush dirty blocks this often */
 
 static int cblk_maxretries = CONFIG_MAX_RETRIES;
 static int cblk_reqtimeout = CONFIG_REQ_TIMEOUT_SEC;
 static int cblk_busytimeout = CONFIG_BUSY_TIMEOUT_SEC;
 
+static int cblk_completion_threads = CONFIG_COMPLETION_THREADS;
+static int cblk_completion_batch = CONFIG_COMPLETION_BATCH;
+static int cblk_completion_usec = CONFIG_COMPLETION_USEC;
+static int cblk_completion_cpu = -1;	/* pin completion threads from here */
+
 static int cblk_prefetch = 0;
 static int cblk_nblocks = CBLK_NBLOCKS;
 
 static int cblk_caching = 1;
+static int cblk_writeback = 0;
+static int cblk_writeback_usec = CONFIG_WRITEBACK_USEC;
 static int cblk_prefetch_threshold = CBLK_PREFETCH_THRESHOLD;
 
 static inline void _backtrace(const char *file, int line)
@@ -167,7 +180,14 @@ static inline unsigned long atomic_inc(atomic_t *a)
 
 #define CBLK_IDX_MAX		16	/* FIXME Should be 16 */
 #define CBLK_NBLOCKS_MAX	32	/* 128 KiB / 4KiB */
-#define CBLK_NBLOCKS_WRITE_MAX	2	/* writing is just 1 or 2 blocks */
+#define CBLK_NBLOCKS_WRITE_MAX	CBLK_NBLOCKS_MAX /* per hardware request */
+#define CBLK_ATAGS_MAX		256	/* outstanding async requests */
+#define CBLK_DEVS_MAX		8	/* cards */
+#define CBLK_CHUNKS_MAX		16	/* open chunks */
+#define CBLK_RAID0_STRIPE	1	/* Default, blocks per stripe */
+#define CBLK_DEV_SHIFT		48	/* cache keys: device above the LBA */
+
+static int cblk_queue_depth = CBLK_IDX_MAX;	/* request slots per card */
 
 enum cblk_status {
 	CBLK_IDLE = 0,
@@ -182,6 +202,45 @@ static const char *cblk_status_str[] = {
 };
 
 struct cache_way;
+struct cblk_dev;
+struct cblk_chunk;
+struct cblk_atag;
+
+enum cblk_atag_state {
+	CBLK_ATAG_FREE = 0,
+	CBLK_ATAG_QUEUED = 1,	/* waiting for a request slot */
+	CBLK_ATAG_ISSUED = 2,
+	CBLK_ATAG_DONE = 3,	/* waiting for cblk_aresult() */
+};
+
+/* The part of an async request which goes to one device */
+struct cblk_apiece {
+	struct cblk_apiece *next;	/* device queue */
+	struct cblk_atag *at;
+	struct cblk_dev *dev;
+	off_t lba;		/* on the device */
+	size_t nblocks;
+};
+
+/* cblk_aread(), cblk_awrite() and cblk_listio() requests */
+struct cblk_atag {
+	struct cblk_atag *next;	/* free or done list */
+	enum cblk_atag_state state;
+	int tag;		/* the caller knows us by that */
+	int user_tag;		/* tag was given by the caller */
+	int flags;		/* CBLK_ARW_* */
+	int is_write;
+	void *buf;
+	off_t lba;
+	size_t nblocks;
+	cblk_arw_status_t *status;	/* updated on completion if not NULL */
+	int rc;			/* blocks transferred or -1 */
+	int err;		/* errno if rc is -1 */
+	struct timeval stime;
+	struct cblk_chunk *ch;
+	unsigned int pieces;	/* parts not completed yet */
+	struct cblk_apiece piece[CBLK_DEVS_MAX];
+};
 
 struct cblk_req {
 	uint8_t slot;		/* r/w request slot number */
@@ -190,6 +249,7 @@ struct cblk_req {
 	enum cblk_status status;
 	sem_t wait_sem;		/* wait here for completion */
 	uint8_t *buf;		/* data is r/w from there */
+	void *dma_buf;		/* single block read into a cache buffer */
 
 	uint32_t action;
 	uint64_t dst;
@@ -204,6 +264,7 @@ struct cblk_req {
 	struct timeval h_stime;	/* hardware start time */
 	struct timeval h_etime;	/* hardware completion time */
 	int use_wait_sem;	/* blocking or prefetch */
+	struct cblk_apiece *apiece;	/* async request part, completed by the thread */
 	struct cache_way *pblock[CBLK_NBLOCKS_MAX];
 };
 
@@ -225,9 +286,13 @@ static inline int cblk_is_read(struct cblk_req *req)
 	return !cblk_is_write(req);
 }
 
+/* One card, shared by all chunks on it */
 struct cblk_dev {
 	struct snap_card *card;
 	struct snap_action *act;
+	char path[PATH_MAX];
+	unsigned int devno;		/* index in devs[], see dev_key() */
+	unsigned int users;		/* chunks using the device */
 	pthread_mutex_t dev_lock;
 	enum cblk_status status;
 	unsigned int status_read_count;
@@ -237,17 +302,25 @@ struct cblk_dev {
 	int timeout;
 	uint8_t *buf;
 
-	unsigned int idx;
+	uint32_t free_slots;		/* bitmap of IDLE request slots */
+	unsigned int depth;		/* request slots used */
 	struct cblk_req req[CBLK_IDX_MAX];
 	enum cblk_status req_status;
-	int prefetch_offs[CBLK_IDX_MAX];	/* list of LBA offsets to prefetch */
 
 	sem_t busy_sem;	/* wait if there is no slot */
 
-	pthread_t done_tid[CONFIG_COMPLETION_THREADS];	/* completion thread(s) */
+	pthread_t done_tid[CONFIG_COMPLETION_THREADS_MAX];	/* completion thread(s) */
+	unsigned int done_started;	/* completion threads running */
 	pthread_cond_t idle_c;	/* idle management for completion thread */
 	pthread_mutex_t idle_m;
 	int work_in_flight;
+	unsigned long long tcheck;	/* usec of last check_req_timeouts() */
+
+	/* async request parts waiting for a request slot */
+	pthread_mutex_t aq_lock;
+	struct cblk_apiece *aq_head;
+	struct cblk_apiece *aq_tail;
+	struct cblk_apiece *aq_prio;	/* last priority part in aq */
 
 	/* statistics */
 	long int prefetches;
@@ -266,6 +339,7 @@ struct cblk_dev {
 	struct timeval rtime_total;	/* total time spent in reads */
 	struct timeval wtime_total;	/* total time spent in writes */
 	long int idle_wakeups;
+	long int harvests;		/* polls which found completions */
 
 	time_t max_read_usecs;
 	time_t max_write_usecs;
@@ -277,11 +351,171 @@ struct cblk_dev {
 	time_t avg_hw_write_usecs;
 };
 
-/* Use just one for now ... */
-static struct cblk_dev chunk = {
-	.dev_lock = PTHREAD_MUTEX_INITIALIZER,
+/*
+ * What cblk_open() returns: a whole device, a slice of one (virtual
+ * LUN) or blocks striped over several devices (RAID0).
+ */
+struct cblk_chunk {
+	int used;
+	int flags;		/* CBLK_OPN_VIRT_LUN, CBLK_GROUP_RAID0 */
+	size_t nblocks;		/* size of the chunk */
+	off_t start;		/* virtual LUN: first block on the device */
+	unsigned int stripe;	/* RAID0: blocks per stripe */
+	unsigned int ndevs;
+	struct cblk_dev *dev[CBLK_DEVS_MAX];
+
+	/* async requests, lock order is async_lock, aq_lock, dev_lock */
+	pthread_mutex_t async_lock;
+	pthread_cond_t async_c;		/* a tag completed or became free */
+	struct cblk_atag atag[CBLK_ATAGS_MAX];
+	struct cblk_atag *atag_free;
+	struct cblk_atag *adone_head;	/* completed, for cblk_aresult() */
+	struct cblk_atag *adone_tail;
+	unsigned int aresults;		/* tags cblk_aresult() can return */
+	unsigned int ainflight;		/* parts given to the devices */
+};
+
+/* The blocks of a chunk request which are on one device */
+struct cblk_range {
+	struct cblk_dev *dev;
+	off_t lba;		/* on the device */
+	size_t nblocks;
 };
 
+static struct cblk_dev devs[CBLK_DEVS_MAX];
+static struct cblk_chunk chunks[CBLK_CHUNKS_MAX];
+static pthread_mutex_t cblk_lock = PTHREAD_MUTEX_INITIALIZER; /* open/close */
+static unsigned int cblk_chunks_open = 0;
+
+static size_t cblk_dev_nblocks = SNAP_N250S_NVME_SIZE / __CBLK_BLOCK_SIZE;
+static unsigned int cblk_raid0_stripe = CBLK_RAID0_STRIPE;
+
+/* Offsets to prefetch, learnt by pp over the reads of all chunks */
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int prefetch_offs[CBLK_IDX_MAX];
+static unsigned int prefetch_n = 0;	/* valid entries in prefetch_offs */
+
+static void async_dispatch(struct cblk_dev *c);
+static void async_complete(struct cblk_dev *c, struct cblk_req *req);
+static void async_init(struct cblk_chunk *ch);
+static void async_done(struct cblk_chunk *ch);
+static int cache_flush(void);
+static int wb_start(void);
+static void wb_stop(void);
+static size_t wb_write(struct cblk_chunk *ch, const uint8_t *buf,
+		       off_t lba, size_t nblocks);
+
+/* Cache key of a block, different devices have different keys */
+static inline off_t dev_key(struct cblk_dev *c, off_t lba)
+{
+	return ((off_t)c->devno << CBLK_DEV_SHIFT) | lba;
+}
+
+/* Device of block lba of a chunk, *plba gets the block on the device */
+static inline struct cblk_dev *chunk_map(struct cblk_chunk *ch, off_t lba,
+					 off_t *plba, unsigned int *d)
+{
+	off_t s;
+
+	if (ch->ndevs == 1) {
+		*plba = ch->start + lba;
+		*d = 0;
+		return ch->dev[0];
+	}
+	s = lba / ch->stripe;
+	*plba = (s / ch->ndevs) * ch->stripe + lba % ch->stripe;
+	*d = s % ch->ndevs;
+	return ch->dev[*d];
+}
+
+static inline struct cblk_dev *chunk_dev(struct cblk_chunk *ch, off_t lba)
+{
+	off_t plba;
+	unsigned int d;
+
+	return chunk_map(ch, lba, &plba, &d);
+}
+
+static inline off_t chunk_key(struct cblk_chunk *ch, off_t lba)
+{
+	off_t plba;
+	unsigned int d;
+	struct cblk_dev *c = chunk_map(ch, lba, &plba, &d);
+
+	return dev_key(c, plba);
+}
+
+/*
+ * The blocks a chunk range has on one device are consecutive there,
+ * so a request becomes at most one request per device. Ranges come in
+ * the order of the devices in the chunk. Taking request slots in that
+ * order cannot deadlock.
+ */
+static unsigned int chunk_split(struct cblk_chunk *ch, off_t lba,
+				size_t nblocks, struct cblk_range *r)
+{
+	size_t i, cnt[CBLK_DEVS_MAX];
+	off_t plba, first[CBLK_DEVS_MAX];
+	unsigned int d, n = 0;
+
+	if (ch->ndevs == 1) {
+		r[0].dev = ch->dev[0];
+		r[0].lba = ch->start + lba;
+		r[0].nblocks = nblocks;
+		return 1;
+	}
+
+	memset(cnt, 0, sizeof(cnt));
+	for (i = 0; i < nblocks; i++) {
+		chunk_map(ch, lba + i, &plba, &d);
+		if (cnt[d]++ == 0)
+			first[d] = plba;
+	}
+	for (d = 0; d < ch->ndevs; d++) {
+		if (cnt[d] == 0)
+			continue;
+		r[n].dev = ch->dev[d];
+		r[n].lba = first[d];
+		r[n].nblocks = cnt[d];
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Copy the blocks of range r between buf, which holds the chunk
+ * blocks lba..lba+nblocks-1, and data, which holds them as they are
+ * on the device.
+ */
+static void chunk_copy(struct cblk_chunk *ch, off_t lba, size_t nblocks,
+		       uint8_t *buf, const struct cblk_range *r,
+		       uint8_t *data, int to_buf)
+{
+	size_t i;
+	off_t plba;
+	unsigned int d;
+	uint8_t *b, *p;
+
+	if (ch->ndevs == 1) {
+		if (to_buf)
+			memcpy(buf, data, nblocks * __CBLK_BLOCK_SIZE);
+		else
+			memcpy(data, buf, nblocks * __CBLK_BLOCK_SIZE);
+		return;
+	}
+
+	for (i = 0; i < nblocks; i++) {
+		if (chunk_map(ch, lba + i, &plba, &d) != r->dev)
+			continue;
+		b = buf + i * __CBLK_BLOCK_SIZE;
+		p = data + (plba - r->lba) * __CBLK_BLOCK_SIZE;
+		if (to_buf)
+			memcpy(b, p, __CBLK_BLOCK_SIZE);
+		else
+			memcpy(p, b, __CBLK_BLOCK_SIZE);
+	}
+}
+
 /* Action related definitions. Used to access the hardware */
 
 /*
@@ -350,10 +584,24 @@ static const char *action_name[] = {
 #define NVME_DRIVE_SIZE		(4 * GIGA_BYTE)	  /* NVME Drive Size */
 #define NVME_MAX_TRANSFER_SIZE	(32 * MEGA_BYTE)  /* NVME limit to Transfer in one chunk */
 
-/* NVME lba cache */
-#define CACHE_MASK		0x000000ff
-#define CACHE_WAYS		16 /* 4 * n */
-#define CACHE_ENTRIES		(CACHE_MASK + 1)
+/*
+ * NVME lba cache
+ *
+ * The cache has cache_sets sets of cache_ways ways each. Both and the
+ * replacement policy are taken from the environment when cblk_open()
+ * sets up the cache. Changes to a set are serialized by its way_lock.
+ * Lookups do not take the lock: each way carries a sequence count which
+ * is odd while the way is being changed. A reader copies the data and
+ * checks afterwards that the count did not change (seqlock), such that
+ * cache hits do not wait for concurrent fills of the same set.
+ * Blocks are found by their dev_key(), the lba arguments below are
+ * such keys.
+ */
+#define CACHE_SETS		256	/* Default, power of 2 */
+#define CACHE_WAYS		16	/* Default */
+#define CACHE_WAYS_MAX		64
+#define CACHE_READ_RETRIES	4	/* Lock-free tries before locking */
+#define CACHE_PINS		1024	/* Default, blocks held by cblk_read_ref */
 
 enum cache_block_status {
 	CACHE_BLOCK_UNUSED = 0,	/* not in use yset */
@@ -365,1516 +613,3750 @@ static const char *block_status_str[] = {
 	"UNUSED", "VALID", "READING",
 };
 
+enum cache_policy {
+	CACHE_POLICY_LRU = 0,	/* default */
+	CACHE_POLICY_CLOCK,
+	CACHE_POLICY_2Q,
+	CACHE_POLICY_ARC,
+	CACHE_POLICY_MAX,
+};
+
+static const char *cache_policy_str[] = {
+	"LRU", "CLOCK", "2Q", "ARC",
+};
+
+/* 2Q: A1in and Am, ARC: T1 and T2 */
+enum cache_list {
+	CACHE_LIST_RECENT = 0,
+	CACHE_LIST_FREQUENT = 1,
+};
+
 struct cache_way {
+	unsigned int seq;	/* odd while the way is changed */
 	enum cache_block_status status;
 	off_t lba;		/* lba this cache entry is for */
 	size_t nblocks;		/* use 1 to keep things simple */
 	unsigned int used;	/* # times this block was used */
-	unsigned int count;	/* eviction counter */
+	unsigned int count;	/* LRU: last use, 2Q: insertion order */
+	uint8_t ref;		/* CLOCK, 2Q, ARC: used since last scan */
+	uint8_t list;		/* 2Q, ARC: enum cache_list */
+	uint8_t dirty;		/* write-back: not on the device yet */
+	unsigned int wgen;	/* write-back: bumped by each write */
 	void *buf;		/* data if status is CBLK_BLOCK_VALID */
 };
 
+/*
+ * Block buffers are reference counted. A way owns one reference to
+ * its buffer, cblk_read_ref() hands out more. Pinned buffers are not
+ * changed: the way gets a new buffer and the old one goes back to the
+ * pool once cblk_release() dropped the last pin. Single block reads
+ * DMA into a pool buffer which then replaces the buffer of the
+ * reserved way instead of being copied.
+ */
+struct cache_buf {
+	unsigned int refs;
+};
+
 struct cache_entry {
-	pthread_mutex_t way_lock;
+	pthread_mutex_t way_lock;	/* serializes changes, not lookups */
+	pthread_cond_t way_c;		/* a READING way was filled or dropped */
+	unsigned int waiters;		/* sleeping on way_c */
 	unsigned int count;
-	struct cache_way way[CACHE_WAYS];
+	unsigned int hand;		/* clock hand */
+	unsigned int p;			/* ARC: target size of T1 */
+	unsigned int nghost[2];		/* 2Q: A1out, ARC: B1 and B2 */
+	off_t *ghost[2];		/* lbas recently thrown out */
+	struct cache_way *way;
+} __attribute__((aligned(CACHELINE_BYTES)));
+
+/*
+ * Replacement policy. hit() is called without way_lock and may only
+ * update count and ref. insert() and victim() are called with way_lock
+ * held. insert() is called before e gets the new lba, such that it can
+ * remember the block being replaced. victim() must return a VALID way
+ * which is not dirty, see way_evictable(), or NULL.
+ */
+struct cache_funcs {
+	void (* hit)(struct cache_entry *entry, struct cache_way *e);
+	void (* insert)(struct cache_entry *entry, struct cache_way *e,
+			off_t lba);
+	struct cache_way * (* victim)(struct cache_entry *entry);
 };
 
 typedef uint8_t cache_block_t[__CBLK_BLOCK_SIZE];
 
-static struct cache_entry cache_entries[CACHE_ENTRIES];
+static unsigned int cache_sets = CACHE_SETS;
+static unsigned int cache_mask = CACHE_SETS - 1;
+static unsigned int cache_ways = CACHE_WAYS;
+static int cache_policy = CACHE_POLICY_LRU;
+static struct cache_funcs *cache_f = NULL;
+
+static struct cache_entry *cache_entries = NULL;
+static struct cache_way *cache_way_tab = NULL;
+static off_t *cache_ghost_tab = NULL;
 static cache_block_t *cache_blocks = NULL;
+static struct cache_buf *cache_bufs = NULL;
+static unsigned int cache_nbufs = 0;
+static unsigned int *cache_free = NULL;	/* stack of free buffers */
+static unsigned int cache_nfree = 0;
+static pthread_mutex_t cache_free_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int cache_pins = 0;
+static unsigned int cache_pins_max = CACHE_PINS;
 static long int cache_trashing = 0;	/* statistics */
-
-static int cache_init(void)
+static long int cache_lock_reads = 0;	/* lock-free lookup gave up */
+static long int cache_adopted = 0;	/* DMA buffers taken over */
+static long int cache_read_waits = 0;	/* slept on a READING block */
+static unsigned int cache_ndirty = 0;	/* write-back: dirty ways */
+static long int cache_flushed = 0;	/* write-back: blocks written */
+static long int cache_flushes = 0;	/* write-back: requests for them */
+static off_t *cache_wb_keys = NULL;	/* write-back: dirty keys to flush */
+
+/* The same LBA on other devices goes to other sets */
+static inline struct cache_entry *cache_set(off_t key)
 {
-	int rc;
-	unsigned int i, j;
+	uint64_t k = (uint64_t)key;
 
-	rc = posix_memalign((void **)&cache_blocks, __CBLK_BLOCK_SIZE,
-		CACHE_ENTRIES * CACHE_WAYS * __CBLK_BLOCK_SIZE);
-	if (rc != 0) {
-		perror("err: posix_memalign");
-		return rc;
-	}
+	return &cache_entries[(k + (k >> CBLK_DEV_SHIFT) * 0x9e3779b1ull) &
+			      cache_mask];
+}
 
-	for (i = 0; i < CACHE_ENTRIES; i++) {
-		struct cache_entry *entry = &cache_entries[i];
-		struct cache_way *way = entry->way;
+static inline struct cache_buf *cache_buf_of(const void *buf)
+{
+	return &cache_bufs[((const cache_block_t *)buf) - cache_blocks];
+}
 
-		pthread_mutex_init(&entry->way_lock, NULL);
-		for (j = 0; j < CACHE_WAYS; j++) {
-			way[j].status = CACHE_BLOCK_UNUSED;
-			way[j].count = 0;
-			way[j].used = 0;
-			way[j].buf = &cache_blocks[i * CACHE_WAYS + j];
-		}
-	}
-	return 0;
+static inline int cache_buf_valid(const void *buf)
+{
+	const uint8_t *b = buf, *p = (const uint8_t *)cache_blocks;
+
+	return (cache_blocks != NULL) && (b >= p) &&
+		(b < p + (size_t)cache_nbufs * __CBLK_BLOCK_SIZE) &&
+		(((b - p) % __CBLK_BLOCK_SIZE) == 0);
 }
 
-static inline void __dump_entry(struct cache_entry *entry)
+/* Returns a buffer with one reference, or NULL if the pool is empty */
+static void *cache_buf_get(void)
 {
 	unsigned int i;
-	struct cache_way *w = entry->way;
 
-	for (i = 0; i < CACHE_WAYS; i += 4) {
-		fprintf(stderr, "  e[%p/%2d]: "
-			"%s %ld %2d %d | %s %ld %2d %d | %s %ld %2d %d | %s %ld %2d %d\n",
-			entry, i,
-			block_status_str[w[i+0].status], w[i+0].lba, w[i+0].count, w[i+0].used,
-			block_status_str[w[i+1].status], w[i+1].lba, w[i+1].count, w[i+1].used,
-			block_status_str[w[i+2].status], w[i+2].lba, w[i+2].count, w[i+2].used,
-			block_status_str[w[i+3].status], w[i+3].lba, w[i+3].count, w[i+3].used);
+	pthread_mutex_lock(&cache_free_lock);
+	if (cache_nfree == 0) {
+		pthread_mutex_unlock(&cache_free_lock);
+		return NULL;
 	}
+	i = cache_free[--cache_nfree];
+	pthread_mutex_unlock(&cache_free_lock);
+
+	__atomic_store_n(&cache_bufs[i].refs, 1, __ATOMIC_RELAXED);
+	return &cache_blocks[i];
 }
 
-static void cache_done(void)
+static void cache_buf_put(void *buf)
 {
-	__free(cache_blocks);
-	cache_blocks = NULL;
+	struct cache_buf *b = cache_buf_of(buf);
+
+	if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	pthread_mutex_lock(&cache_free_lock);
+	cache_free[cache_nfree++] = b - cache_bufs;
+	pthread_mutex_unlock(&cache_free_lock);
 }
 
-/**
- * Returns 0 if data was found and copied to the output buffer.
- *         1 if data is in flight and requested for reading.
- *         negative on error.
+/*
+ * Take a reference unless the buffer went back to the pool. The
+ * caller must check afterwards that the way still uses it.
  */
-static int cache_read(off_t lba, void *buf)
+static int cache_buf_pin(void *buf)
 {
-	unsigned int i = lba & CACHE_MASK, j;
-	struct cache_entry *entry = &cache_entries[i];
-	struct cache_way *way = entry->way;
+	struct cache_buf *b = cache_buf_of(buf);
+	unsigned int refs = __atomic_load_n(&b->refs, __ATOMIC_RELAXED);
 
-	pthread_mutex_lock(&entry->way_lock);
-	for (j = 0; j < CACHE_WAYS; j++) {
-		if ((way[j].status == CACHE_BLOCK_VALID) && (lba == way[j].lba)) {
-			way[j].count = entry->count++;
-			way[j].used++;
-			memcpy(buf, way[j].buf, __CBLK_BLOCK_SIZE);
-			pthread_mutex_unlock(&entry->way_lock);
+	do {
+		if (refs == 0)
 			return 0;
-		}
-		if  ((way[j].status == CACHE_BLOCK_READING) && (lba == way[j].lba)) {
-			pthread_mutex_unlock(&entry->way_lock);
-			return 1;
-		}
-	}
-	pthread_mutex_unlock(&entry->way_lock);
-
-	return -1; /* not found */
+	} while (!__atomic_compare_exchange_n(&b->refs, &refs, refs + 1,
+			1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	return 1;
 }
 
-/**
- * Returns 0 if data was found and copied to the output buffer.
- *         1 if data is in flight and requested for reading.
- *         negative on error.
+/*
+ * Called with way_lock held and the change begun. Makes sure the way
+ * has a buffer which nobody else looks at, such that it can be filled
+ * in place. The full fence pairs with the one in cache_lookup(): either
+ * a new pin sees the odd sequence count, or we see the pin.
  */
-static enum cblk_status cache_info(off_t lba)
+static int way_buf_private(struct cache_way *e)
 {
-	unsigned int j;
-	struct cache_entry *entry = &cache_entries[lba & CACHE_MASK];
-	struct cache_way *way = entry->way;
+	void *buf;
 
-	pthread_mutex_lock(&entry->way_lock);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&cache_buf_of(e->buf)->refs,
+			    __ATOMIC_RELAXED) == 1)
+		return 0;
 
-	for (j = 0; j < CACHE_WAYS; j++) {
-		if ((lba == way[j].lba) &&
-		    ((way[j].status == CACHE_BLOCK_VALID) ||
-		     (way[j].status == CACHE_BLOCK_READING))) {
-			pthread_mutex_unlock(&entry->way_lock);
-			return way[j].status;
-		}
-	}
+	buf = cache_buf_get();
+	if (buf == NULL)
+		return -1;
+	cache_buf_put(e->buf);
+	__atomic_store_n(&e->buf, buf, __ATOMIC_RELAXED);
+	return 0;
+}
 
-	pthread_mutex_unlock(&entry->way_lock);
-	return CACHE_BLOCK_UNUSED;
+static inline void way_change_begin(struct cache_way *e)
+{
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
-/**
- * Lockfree version of cache_reserve. Please use this only if you hold
- * the lock to the cache entry.
- *
- * @force Enforce reservation. For read this is no trecommended, but
- *        for write it is, since we like to replace the old data as
- *        fast as needed once this LBA is written to.
- */
-static struct cache_way *__cache_reserve(off_t lba, int force)
+static inline void way_change_end(struct cache_way *e)
 {
-	unsigned int j;
-	struct cache_entry *entry = &cache_entries[lba & CACHE_MASK];
-	struct cache_way *e, *way = entry->way;
-	int reserve_idx = -1;
-	unsigned int min_count = INT_MAX;
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
 
-	for (j = 0; j < CACHE_WAYS; j++) {
-		e = &way[j];
+static inline unsigned int cache_next_count(struct cache_entry *entry)
+{
+	return __atomic_fetch_add(&entry->count, 1, __ATOMIC_RELAXED);
+}
 
-		switch (e->status) {
-		/* continue, since maybe we find one with matching lba */
-		case CACHE_BLOCK_UNUSED:
-			reserve_idx = j;
-			min_count = e->count;
-			break;
-		/* avoid double entries */
-		case CACHE_BLOCK_VALID:
-			if (e->lba == lba) {	/* entry is already in cache */
-				/* cache_trace("[%s] %p LBA=%ld/%ld is already VALID!\n",
-					__func__, e, lba, e->lba); */
-				if (force) {
-					min_count = e->count;
-					reserve_idx = j;
-					goto reserve_entry;
-				} else
-					return NULL;
-			}
-			if (e->count < min_count) {
-				min_count = e->count;
-				reserve_idx = j;/* replace candidate with smallest count */
-			}
-			break;
-		/* do not throw this out unless forced to */
-		case CACHE_BLOCK_READING:
-			if (e->lba == lba) {	/* entry is already in cache */
-				/* cache_trace("[%s] %p LBA=%ld/%ld is already READING!\n",
-					__func__, e, lba, e->lba); */
-				if (force) {
-					min_count = e->count;
-					reserve_idx = j;
-					goto reserve_entry;
-				} else
-					return NULL;
-			}
-			break;
-		}
-	}
-	if (reserve_idx == -1) {
-		dfprintf(stderr, "[%s] warn: No free entry found for LBA=%ld\n",
-			__func__, lba);
-		__dump_entry(entry);
-		return NULL;	/* no entry found! */
-	}
+static inline void way_set_ref(struct cache_way *e, uint8_t ref)
+{
+	if (__atomic_load_n(&e->ref, __ATOMIC_RELAXED) != ref)
+		__atomic_store_n(&e->ref, ref, __ATOMIC_RELAXED);
+}
 
-reserve_entry:
-	/* Now reserve */
-	e = &way[reserve_idx];
-	if ((e->status == CACHE_BLOCK_VALID) && (e->used == 0))
-		cache_trashing++;	/* discarding an used entry */
+/* Dirty ways wait for the write-back thread, they cannot be replaced */
+static inline int way_evictable(struct cache_way *e)
+{
+	return (e->status == CACHE_BLOCK_VALID) && !e->dirty;
+}
 
-	/* dfprintf(stderr, "[%s] debug: reserve %p for LBA=%ld %s\n",
-		__func__, e, lba, block_status_str[e->status]); */
-	e->lba = lba;
-	e->count = entry->count++;
-	e->used = 0;
-	e->status = CACHE_BLOCK_READING;
-	
-	return e;
+/* With way_lock held. Each write makes a new generation. */
+static inline void way_set_dirty(struct cache_way *e, int dirty)
+{
+	if (dirty)
+		e->wgen++;
+	if (e->dirty == !!dirty)
+		return;
+	e->dirty = !!dirty;
+	if (dirty)
+		__atomic_add_fetch(&cache_ndirty, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_sub_fetch(&cache_ndirty, 1, __ATOMIC_RELAXED);
 }
 
-/**
- * Reserve entry for reading later. Set status to READING and
- * therefore take it out of the replacement circle. After reserving
- * Filling it needs to happen under the way_lock, such that it can
- * be reused later on. Failing to fill the entry will cause resource
- * leakage and cache malfunction.
- */
-#if 0
-static struct cache_way *cache_reserve(off_t lba, int force)
+/* With way_lock held, after a way left READING */
+static inline void cache_wake(struct cache_entry *entry)
 {
-	struct cache_way *e;
-	struct cache_entry *entry = &cache_entries[lba & CACHE_MASK];
+	if (entry->waiters)
+		pthread_cond_broadcast(&entry->way_c);
+}
 
-	pthread_mutex_lock(&entry->way_lock);
-	e = __cache_reserve(lba, force);
-	pthread_mutex_unlock(&entry->way_lock);
+static int ghost_del(struct cache_entry *entry, unsigned int l, off_t lba)
+{
+	unsigned int i;
+	off_t *g = entry->ghost[l];
 
-	return e;
+	for (i = 0; i < entry->nghost[l]; i++) {
+		if (g[i] != lba)
+			continue;
+		memmove(&g[i], &g[i + 1],
+			(entry->nghost[l] - i - 1) * sizeof(*g));
+		entry->nghost[l]--;
+		return 1;
+	}
+	return 0;
 }
-#endif
 
-/**
- * It might happen that a prefetch/write operation changes the state
- * of the way entry. If that should happen, the status would not be
- * READING anymore and we should not write for now to avoid problems
- * when it is e.g. VALID. We might like to check, if the LBA is right,
- * but even that could have been overwritten if the READING state was
- * changed!
- *
- * We added _used to identify entries which were read by the prefetch
- * code but thrown out before they got actually used.
- */
-static int cache_write_reserved(struct cache_way **e,
-				off_t lba, const void *buf,
-				int _used)
+static void ghost_add(struct cache_entry *entry, unsigned int l, off_t lba,
+		      unsigned int max)
 {
-	struct cache_way *_e;
-	struct cache_entry *entry;
+	off_t *g = entry->ghost[l];
 
-	if (e == NULL)
-		return -1;
-
-	_e = *e;
-	if (_e == NULL)
-		return -2;
+	if (entry->nghost[l] >= max) {	/* forget the oldest */
+		memmove(&g[0], &g[1], (entry->nghost[l] - 1) * sizeof(*g));
+		entry->nghost[l]--;
+	}
+	g[entry->nghost[l]++] = lba;
+}
 
-	entry = &cache_entries[lba & CACHE_MASK];
-	pthread_mutex_lock(&entry->way_lock);
+/*
+ * Second chance scan over the VALID ways of list l, or of all ways
+ * if l is negative. Clears the ref bits it passes.
+ */
+static struct cache_way *__clock_victim(struct cache_entry *entry, int l)
+{
+	unsigned int n;
+	struct cache_way *e;
 
-	if (_e->lba != lba) {
-		dfprintf(stderr, "[%s] warn: %p LBA=%ld/%ld reservation lost %s\n",
-			__func__, _e, lba, _e->lba, block_status_str[_e->status]);
-		pthread_mutex_unlock(&entry->way_lock);
-		return -1;
-	}
+	for (n = 0; n < 2 * cache_ways; n++) {
+		e = &entry->way[entry->hand];
+		entry->hand = (entry->hand + 1) % cache_ways;
 
-	/* Reservation can be lost due to write happening in parallel */
-	if (_e->status != CACHE_BLOCK_READING) {
-		/* dfprintf(stderr, "[%s] warn: %p LBA=%ld/%ld State is not READING but %s\n",
-			__func__, _e, lba, _e->lba, block_status_str[_e->status]); */
-		pthread_mutex_unlock(&entry->way_lock);
-		return -2;
+		if (!way_evictable(e))
+			continue;
+		if ((l >= 0) && (e->list != l))
+			continue;
+		if (__atomic_load_n(&e->ref, __ATOMIC_RELAXED)) {
+			way_set_ref(e, 0);
+			continue;
+		}
+		return e;
 	}
+	return NULL;
+}
 
-	memcpy(_e->buf, buf, __CBLK_BLOCK_SIZE);
-	_e->used = _used;
-	_e->status = CACHE_BLOCK_VALID;
-	*e = NULL;	/* mark as not accessible anymore */
+/* LRU: replace the way with the oldest use */
+static void lru_hit(struct cache_entry *entry, struct cache_way *e)
+{
+	__atomic_store_n(&e->count, cache_next_count(entry), __ATOMIC_RELAXED);
+}
 
-	pthread_mutex_unlock(&entry->way_lock);
-	return 0;
+static void lru_insert(struct cache_entry *entry, struct cache_way *e,
+		       off_t lba __attribute__((unused)))
+{
+	e->count = cache_next_count(entry);
 }
 
-static int cache_unreserve(struct cache_way *e, off_t lba)
+static struct cache_way *lru_victim(struct cache_entry *entry)
 {
-	struct cache_entry *entry;
+	unsigned int j;
+	struct cache_way *e, *v = NULL;
 
-	if (e == NULL)
-		return -1;
+	for (j = 0; j < cache_ways; j++) {
+		e = &entry->way[j];
+		if (!way_evictable(e))
+			continue;
+		if ((v == NULL) || ((int)(e->count - v->count) < 0))
+			v = e;
+	}
+	return v;
+}
 
-	/* dfprintf(stderr, "[%s] debug: unreserve %p for LBA=%ld %s\n",
-		__func__, e, lba, block_status_str[e->status]); */
+/* CLOCK: hits only set the ref bit, no shared counter to bounce */
+static void clock_hit(struct cache_entry *entry __attribute__((unused)),
+		      struct cache_way *e)
+{
+	way_set_ref(e, 1);
+}
 
-	entry = &cache_entries[lba & CACHE_MASK];
-	pthread_mutex_lock(&entry->way_lock);
-
-	if (e->lba != lba) {
-		dfprintf(stderr, "[%s] err: LBA=%ld/%ld not consistent!\n",
-			__func__, lba, e->lba);
-		e->status = CACHE_BLOCK_UNUSED;
-		/* __backtrace(); */
-		pthread_mutex_unlock(&entry->way_lock);
-		return -1;
-	}
-	if (e->status == CACHE_BLOCK_READING) {
-		dfprintf(stderr, "[%s] warn: %p forcing status LBA=%ld/%ld "
-			"cache from %s to UNUSED!\n",
-			__func__, e, lba, e->lba, block_status_str[e->status]);
-		e->status = CACHE_BLOCK_UNUSED;
-		/* __backtrace(); */
-	}
+static void clock_insert(struct cache_entry *entry, struct cache_way *e,
+			 off_t lba __attribute__((unused)))
+{
+	e->count = cache_next_count(entry);
+	way_set_ref(e, 0);
+}
 
-	pthread_mutex_unlock(&entry->way_lock);
-	return 0;
+static struct cache_way *clock_victim(struct cache_entry *entry)
+{
+	return __clock_victim(entry, -1);
 }
 
-/**
- * FIXME The non-atomic cache_reserve() -> cache_write_reserved() 
- *       sequence is not working if we allow reservations to be
- *       changed in certain cases. This needs fixups.
+/*
+ * 2Q: New blocks go to A1in and are replaced in FIFO order once A1in
+ * has more than a quarter of the ways. Their lbas are remembered in
+ * A1out. A block which is read again while it is in A1out goes to Am,
+ * which is managed by CLOCK.
  */
-static int cache_write(off_t lba, const void *buf, int _used)
+static void twoq_insert(struct cache_entry *entry, struct cache_way *e,
+			off_t lba)
 {
-	struct cache_way *e;
-	struct cache_entry *entry;
+	if ((e->status == CACHE_BLOCK_VALID) &&
+	    (e->list == CACHE_LIST_RECENT))
+		ghost_add(entry, 0, e->lba, MAX(cache_ways / 2, 1u));
+
+	e->list = ghost_del(entry, 0, lba) ?
+		CACHE_LIST_FREQUENT : CACHE_LIST_RECENT;
+	e->count = cache_next_count(entry);
+	way_set_ref(e, 0);
+}
 
-	entry = &cache_entries[lba & CACHE_MASK];
-	pthread_mutex_lock(&entry->way_lock);
+static struct cache_way *twoq_victim(struct cache_entry *entry)
+{
+	unsigned int j, n1 = 0;
+	struct cache_way *e, *v = NULL;
 
-	e = __cache_reserve(lba, 1);	/* enforce reservation */
-	if (e == NULL) {
-		fprintf(stderr, "[%s] cache reservation for LBA=%ld failed!\n",
-			__func__, lba);
-		__dump_entry(entry);
-		pthread_mutex_unlock(&entry->way_lock);
-		return -1;	/* no entry free! */
+	for (j = 0; j < cache_ways; j++) {
+		e = &entry->way[j];
+		if ((e->status == CACHE_BLOCK_UNUSED) ||
+		    (e->list != CACHE_LIST_RECENT))
+			continue;
+		n1++;
+		if (way_evictable(e) &&
+		    ((v == NULL) || ((int)(e->count - v->count) < 0)))
+			v = e;
 	}
 
-	memcpy(e->buf, buf, __CBLK_BLOCK_SIZE);
-	e->used = _used;
-	e->status = CACHE_BLOCK_VALID;
-	pthread_mutex_unlock(&entry->way_lock);
+	if ((v != NULL) && (n1 > MAX(cache_ways / 4, 1u)))
+		return v;
 
-	return 0;
+	e = __clock_victim(entry, CACHE_LIST_FREQUENT);
+	return e ? e : v;
 }
 
-static void inc_work_in_flight(struct cblk_dev *c)
+/*
+ * ARC, in its CLOCK based form (CAR): T1 holds blocks seen once, T2
+ * blocks seen at least twice. B1 and B2 remember what was thrown out
+ * of T1 and T2. A miss found in B1 makes T1 larger, one found in B2
+ * makes T2 larger. A referenced block in T1 moves to T2 when the
+ * clock hand passes.
+ */
+static void arc_insert(struct cache_entry *entry, struct cache_way *e,
+		       off_t lba)
 {
-	pthread_mutex_lock(&c->idle_m);
-	c->work_in_flight++;
-	if (c->work_in_flight == 1)
-		/* pthread_cond_signal(&c->idle_c); */
-		pthread_cond_broadcast(&c->idle_c);
-	pthread_mutex_unlock(&c->idle_m);
-}
+	unsigned int b1 = entry->nghost[0], b2 = entry->nghost[1];
 
-static void dec_work_in_flight(struct cblk_dev *c)
-{
-	pthread_mutex_lock(&c->idle_m);
-	c->work_in_flight--;
-	pthread_mutex_unlock(&c->idle_m);
+	if (e->status == CACHE_BLOCK_VALID)
+		ghost_add(entry, e->list, e->lba, cache_ways);
+
+	if (ghost_del(entry, 0, lba)) {
+		entry->p = MIN(entry->p + MAX(b2 / b1, 1u), cache_ways);
+		e->list = CACHE_LIST_FREQUENT;
+	} else if (ghost_del(entry, 1, lba)) {
+		entry->p -= MIN(entry->p, MAX(b1 / b2, 1u));
+		e->list = CACHE_LIST_FREQUENT;
+	} else
+		e->list = CACHE_LIST_RECENT;
+
+	e->count = cache_next_count(entry);
+	way_set_ref(e, 0);
 }
 
-static inline unsigned int work_in_flight(struct cblk_dev *c)
+static struct cache_way *arc_victim(struct cache_entry *entry)
 {
-	int r;
+	unsigned int j, n, n1 = 0, v1 = 0, v2 = 0;
+	struct cache_way *e;
+	int recent;
 
-	sem_getvalue(&c->busy_sem, &r);
-	return CBLK_IDX_MAX - r;
+	for (j = 0; j < cache_ways; j++) {
+		e = &entry->way[j];
+		if (e->status == CACHE_BLOCK_UNUSED)
+			continue;
+		if (e->list == CACHE_LIST_RECENT) {
+			n1++;
+			if (way_evictable(e))
+				v1++;
+		} else if (way_evictable(e))
+			v2++;
+	}
+
+	for (n = 0; n < 3 * cache_ways; n++) {
+		recent = (v2 == 0) || ((v1 != 0) && (n1 >= MAX(entry->p, 1u)));
+
+		e = &entry->way[entry->hand];
+		entry->hand = (entry->hand + 1) % cache_ways;
+		if (!way_evictable(e) ||
+		    (e->list != (recent ? CACHE_LIST_RECENT :
+				 CACHE_LIST_FREQUENT)))
+			continue;
+
+		if (!__atomic_load_n(&e->ref, __ATOMIC_RELAXED))
+			return e;
+
+		way_set_ref(e, 0);
+		if (recent) {		/* used again, promote to T2 */
+			e->list = CACHE_LIST_FREQUENT;
+			n1--;
+			v1--;
+			v2++;
+		}
+	}
+	return lru_victim(entry);
 }
 
-static inline void dev_set_status(struct cblk_dev *c,
-				enum cblk_status status)
+static struct cache_funcs cache_funcs[] = {
+	/* 0: CACHE_POLICY_LRU */
+	{ .hit = lru_hit,
+	  .insert = lru_insert,
+	  .victim = lru_victim },
+	/* 1: CACHE_POLICY_CLOCK */
+	{ .hit = clock_hit,
+	  .insert = clock_insert,
+	  .victim = clock_victim },
+	/* 2: CACHE_POLICY_2Q */
+	{ .hit = clock_hit,
+	  .insert = twoq_insert,
+	  .victim = twoq_victim },
+	/* 3: CACHE_POLICY_ARC */
+	{ .hit = clock_hit,
+	  .insert = arc_insert,
+	  .victim = arc_victim },
+};
+
+static void cache_done(void)
 {
-	/* block_trace("  [%s] device new status is %s\n", __func__,
-		cblk_status_str[status]); */
-	c->status = status;
+	unsigned int i;
+
+	if (cache_entries != NULL)
+		for (i = 0; i < cache_sets; i++) {
+			pthread_mutex_destroy(&cache_entries[i].way_lock);
+			pthread_cond_destroy(&cache_entries[i].way_c);
+		}
+
+	__free(cache_entries);
+	__free(cache_way_tab);
+	__free(cache_ghost_tab);
+	__free(cache_blocks);
+	__free(cache_bufs);
+	__free(cache_free);
+	__free(cache_wb_keys);
+	cache_entries = NULL;
+	cache_way_tab = NULL;
+	cache_ghost_tab = NULL;
+	cache_blocks = NULL;
+	cache_bufs = NULL;
+	cache_free = NULL;
+	cache_wb_keys = NULL;
+	cache_nfree = cache_nbufs = 0;
+	cache_ndirty = 0;
 }
 
-/*
- * Action Write and Read are 32 bit MMIO
- *
- * Note:
- *   Adding pthread_setcancelstate() since the simulation version of
- *   libcxl is not really thead safe and keeps locks when interrupted
- *   with pthread_cancel(). That can lead to deadlocks. Marking the
- *   critical section as non-cancelable prevents this.
- */
-static int __cblk_write(struct cblk_dev *c, uint32_t addr, uint32_t data)
+static int cache_init(void)
 {
-	int rc, oldstate;
+	int rc;
+	unsigned int i, j;
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
-	rc = snap_mmio_write32(c->card, (uint64_t)addr, data);
-	if (0 != rc)
-		fprintf(stderr, "err: Write MMIO 32 Err %d\n", rc);
-	pthread_setcancelstate(oldstate, NULL);
-	return rc;
-}
+	/* Geometry: sets must be a power of 2 */
+	if (cache_sets == 0)
+		cache_sets = CACHE_SETS;
+	while (cache_sets & (cache_sets - 1))
+		cache_sets &= cache_sets - 1;
+	cache_mask = cache_sets - 1;
+	if (cache_ways == 0)
+		cache_ways = CACHE_WAYS;
+	cache_ways = MIN(cache_ways, (unsigned int)CACHE_WAYS_MAX);
+	cache_f = &cache_funcs[cache_policy];
 
+	/*
+	 * One buffer per way, plus the ones which can be replaced while
+	 * pinned, plus the single block reads in flight.
+	 */
+	cache_nbufs = cache_sets * cache_ways + cache_pins_max + CBLK_IDX_MAX;
+	rc = posix_memalign((void **)&cache_blocks, __CBLK_BLOCK_SIZE,
+		(size_t)cache_nbufs * __CBLK_BLOCK_SIZE);
+	if (rc != 0) {
+		cache_blocks = NULL;
+		perror("err: posix_memalign");
+		return rc;
+	}
+	cache_bufs = calloc(cache_nbufs, sizeof(*cache_bufs));
+	cache_free = calloc(cache_nbufs, sizeof(*cache_free));
+	if ((cache_bufs == NULL) || (cache_free == NULL)) {
+		rc = ENOMEM;
+		goto out_err;
+	}
+	for (i = 0; i < cache_nbufs; i++)
+		cache_free[i] = cache_nbufs - 1 - i;
+	cache_nfree = cache_nbufs;
+	cache_pins = 0;
 
-/* Action or Kernel Write and Read are 32 bit MMIO */
-static int __cblk_read(struct cblk_dev *c, uint32_t addr, uint32_t *data)
-{
-	int rc, oldstate;
+	rc = posix_memalign((void **)&cache_entries, CACHELINE_BYTES,
+		cache_sets * sizeof(*cache_entries));
+	if (rc != 0) {
+		cache_entries = NULL;
+		perror("err: posix_memalign");
+		goto out_err;
+	}
+	cache_way_tab = calloc((size_t)cache_sets * cache_ways,
+			       sizeof(*cache_way_tab));
+	cache_ghost_tab = calloc((size_t)cache_sets * 2 * cache_ways,
+				 sizeof(*cache_ghost_tab));
+	if (cblk_writeback)
+		cache_wb_keys = calloc((size_t)cache_sets * cache_ways,
+				       sizeof(*cache_wb_keys));
+	if ((cache_way_tab == NULL) || (cache_ghost_tab == NULL) ||
+	    (cblk_writeback && (cache_wb_keys == NULL))) {
+		rc = ENOMEM;
+		goto out_err;
+	}
+	memset(cache_entries, 0, cache_sets * sizeof(*cache_entries));
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	for (i = 0; i < cache_sets; i++) {
+		struct cache_entry *entry = &cache_entries[i];
+		struct cache_way *way = &cache_way_tab[i * cache_ways];
 
-#ifdef CONFIG_MMIO32_NOHWSYNC
-	rc = snap_mmio_read32_nohwsync(c->card, (uint64_t)addr, data);
-#else
-	rc = snap_mmio_read32(c->card, (uint64_t)addr, data);
-#endif
-	if (0 != rc)
-		fprintf(stderr, "err: Read MMIO 32 Err %d\n", rc);
+		pthread_mutex_init(&entry->way_lock, NULL);
+		pthread_cond_init(&entry->way_c, NULL);
+		entry->way = way;
+		entry->p = cache_ways / 2;
+		entry->ghost[0] = &cache_ghost_tab[i * 2 * cache_ways];
+		entry->ghost[1] = entry->ghost[0] + cache_ways;
+		for (j = 0; j < cache_ways; j++) {
+			way[j].status = CACHE_BLOCK_UNUSED;
+			way[j].lba = -1;
+			way[j].buf = cache_buf_get();
+		}
+	}
+	return 0;
 
-	pthread_setcancelstate(oldstate, NULL);
+ out_err:
+	__free(cache_way_tab);
+	__free(cache_ghost_tab);
+	__free(cache_entries);
+	__free(cache_blocks);
+	__free(cache_bufs);
+	__free(cache_free);
+	__free(cache_wb_keys);
+	cache_wb_keys = NULL;
+	cache_way_tab = NULL;
+	cache_ghost_tab = NULL;
+	cache_entries = NULL;
+	cache_blocks = NULL;
+	cache_bufs = NULL;
+	cache_free = NULL;
+	cache_nfree = cache_nbufs = 0;
 	return rc;
 }
 
-static void req_setup(struct cblk_req *req,
-		uint32_t action_code,
-		uint64_t dst,
-		uint64_t src,
-		uint32_t size)
+static inline void __dump_entry(struct cache_entry *entry)
 {
-	req->action = action_code | (req->slot << 8);
-	req->dst = dst;
-	req->src = src;
-	req->size = size;
-	req->tries = 0;
+	unsigned int i;
+	struct cache_way *w = entry->way;
+
+	for (i = 0; i < cache_ways; i++) {
+		if ((i % 4) == 0)
+			fprintf(stderr, "  e[%p/%2d]:", entry, i);
+		fprintf(stderr, " %s %ld %2d %d%s",
+			block_status_str[w[i].status], w[i].lba,
+			w[i].count, w[i].used,
+			((i % 4) == 3 || i == cache_ways - 1) ? "\n" : " |");
+	}
 }
 
-/*
- * NVMe: For NVMe transfers n is representing a NVME_LB_SIZE (512)
- *       byte block.
+/**
+ * Lock-free lookup of lba in a set. Copies the data to buf if it is
+ * VALID and buf is not NULL, or pins the cache buffer and returns it
+ * in pin if pin is not NULL. Returns the status of the block, or -1
+ * if a way changed while we looked at it.
  */
-static void req_start(struct cblk_req *req, struct cblk_dev *c)
+static int cache_lookup(struct cache_entry *entry, off_t lba, void *buf,
+			void **pin)
 {
-	uint8_t action_code = req->action & 0x00ff;
-	int slot = req->slot;
+	unsigned int j, seq;
+	struct cache_way *e;
+	enum cache_block_status status;
+	void *data;
+	int pinned = 0;
 
-	req->tries++;
-	block_trace("    [%s] HW %s memcpy_%x(slot=%u dest=0x%llx, "
-		"src=0x%llx n=%lld bytes) LBA=%ld attempts=%d\n",
-		__func__, action_name[action_code % ACTION_CONFIG_MAX],
-		req->action, slot, (long long)req->dst, (long long)req->src,
-		(long long)req->size, req->lba, req->tries);
+	for (j = 0; j < cache_ways; j++) {
+		e = &entry->way[j];
 
-	pthread_mutex_lock(&c->dev_lock);
+		seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			return -1;
+		if (__atomic_load_n(&e->lba, __ATOMIC_RELAXED) != lba)
+			continue;
+		status = __atomic_load_n(&e->status, __ATOMIC_RELAXED);
+		if (status == CACHE_BLOCK_UNUSED)
+			continue;
 
-	__cblk_write(c, ACTION_CONFIG,    req->action);
-	__cblk_write(c, ACTION_DEST_LOW,  (uint32_t)(req->dst & 0xffffffff));
-	__cblk_write(c, ACTION_DEST_HIGH, (uint32_t)(req->dst >> 32));
-	__cblk_write(c, ACTION_SRC_LOW,   (uint32_t)(req->src & 0xffffffff));
-	__cblk_write(c, ACTION_SRC_HIGH,  (uint32_t)(req->src >> 32));
-	__cblk_write(c, ACTION_CNT,       req->size);
+		data = __atomic_load_n(&e->buf, __ATOMIC_RELAXED);
+		if (status == CACHE_BLOCK_VALID) {
+			if (buf)
+				memcpy(buf, data, __CBLK_BLOCK_SIZE);
+			else if (pin) {
+				pinned = cache_buf_pin(data);
+				if (!pinned)
+					return -1;
+			}
+		}
 
-	/* Wait for Action to go back to Idle */
-	snap_action_start(c->act);
-	gettimeofday(&req->stime, NULL);
-	gettimeofday(&req->h_stime, NULL);
+		/* A pin must be visible before we check, see way_buf_private() */
+		__atomic_thread_fence(pinned ? __ATOMIC_SEQ_CST :
+				      __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) {
+			if (pinned)
+				cache_buf_put(data);
+			return -1;
+		}
 
-	/*
-	 * Update statistics under device lock.
-	 * Otherwise it might be off a little bit.
-	 */
-	req->tries++;
-	if (action_code == ACTION_CONFIG_COPY_HN) {
-		c->hw_block_writes++;
-		c->wbytes_total += req->size;
-	} else {
-		c->hw_block_reads++;
-		c->rbytes_total += req->size;
+		if ((status == CACHE_BLOCK_VALID) && (buf || pin)) {
+			__atomic_fetch_add(&e->used, 1, __ATOMIC_RELAXED);
+			cache_f->hit(entry, e);
+			if (pin)
+				*pin = data;
+		}
+		return status;
 	}
-
-	pthread_mutex_unlock(&c->dev_lock);
+	return CACHE_BLOCK_UNUSED;
 }
 
-int cblk_init(void *arg __attribute__((unused)),
-		uint64_t flags __attribute__((unused)))
+/*
+ * Lookup without lock first. If the set keeps changing under us,
+ * wait for the writers. Changes always hold way_lock, so the locked
+ * lookup cannot fail.
+ */
+static int __cache_lookup(off_t lba, void *buf, void **pin)
 {
-	block_trace("[%s] arg=%p flags=%llx\n", __func__, arg,
-		(long long)flags);
-	return 0;
+	unsigned int i;
+	int status;
+	struct cache_entry *entry = cache_set(lba);
+
+	for (i = 0; i < CACHE_READ_RETRIES; i++) {
+		status = cache_lookup(entry, lba, buf, pin);
+		if (status >= 0)
+			return status;
+	}
+
+	__atomic_fetch_add(&cache_lock_reads, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&entry->way_lock);
+	status = cache_lookup(entry, lba, buf, pin);
+	pthread_mutex_unlock(&entry->way_lock);
+	return status;
 }
 
-int cblk_term(void *arg __attribute__((unused)),
-		uint64_t flags __attribute__((unused)))
+/**
+ * Returns 0 if data was found and copied to the output buffer, or
+ *           pinned and returned in pin if buf is NULL.
+ *         1 if data is in flight and requested for reading.
+ *         negative on error.
+ */
+static int cache_read(off_t lba, void *buf, void **pin)
 {
-	block_trace("[%s] arg=%p flags=%llx\n", __func__, arg,
-		(long long)flags);
-	return 0;
+	switch (__cache_lookup(lba, buf, pin)) {
+	case CACHE_BLOCK_VALID:
+		return 0;
+	case CACHE_BLOCK_READING:
+		return 1;
+	default:
+		return -1; /* not found */
+	}
 }
 
-static void cblk_req_dump(struct cblk_dev *c)
+/**
+ * Like cache_read(), but if the block is READING, sleep until it was
+ * filled or dropped instead of polling. Returns 1 if it is still
+ * READING at deadline.
+ */
+static int cache_read_wait(off_t lba, void *buf, void **pin,
+			   const struct timespec *deadline)
 {
-	unsigned int i;
-	struct timeval now;
-	time_t usecs;
+	int rc, status;
+	struct cache_entry *entry = cache_set(lba);
 
-	gettimeofday(&now, NULL);
-	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
-		struct cblk_req *req = &c->req[i];
+	rc = cache_read(lba, buf, pin);
+	if (rc != 1)
+		return rc;
 
-		switch (req->status) {
-		case CBLK_IDLE:
-			usecs = 0;
-			break;
-		case CBLK_READY:
-			usecs = timediff_usec(&req->etime, &req->stime);
+	__atomic_fetch_add(&cache_read_waits, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&entry->way_lock);
+	while (1) {
+		status = cache_lookup(entry, lba, buf, pin);
+		if (status != CACHE_BLOCK_READING)
 			break;
-		default:
-			usecs = timediff_usec(&now, &req->stime);
+		entry->waiters++;
+		rc = pthread_cond_timedwait(&entry->way_c, &entry->way_lock,
+					    deadline);
+		entry->waiters--;
+		if (rc == ETIMEDOUT) {
+			status = cache_lookup(entry, lba, buf, pin);
 			break;
 		}
-		fprintf(stderr, "  req[%2d]: %s LBA=%ld %ld usec err_total=%d\n",
-			i, cblk_status_str[req->status], req->lba,
-			usecs, req->err_total);
+	}
+	pthread_mutex_unlock(&entry->way_lock);
+
+	switch (status) {
+	case CACHE_BLOCK_VALID:
+		return 0;
+	case CACHE_BLOCK_READING:
+		return 1;
+	default:
+		return -1;
 	}
 }
 
-static void stat_req_dump(struct cblk_dev *c)
+/**
+ * Returns the status of the block: VALID, READING or UNUSED if it
+ * is not in the cache.
+ */
+static enum cache_block_status cache_info(off_t lba)
 {
-	unsigned int i;
-	struct timeval now;
+	int status = __cache_lookup(lba, NULL, NULL);
+
+	return (status < 0) ? CACHE_BLOCK_UNUSED :
+		(enum cache_block_status)status;
+}
+
+/**
+ * Lockfree version of cache_reserve. Please use this only if you hold
+ * the lock to the cache entry.
+ *
+ * @force Enforce reservation. For read this is no trecommended, but
+ *        for write it is, since we like to replace the old data as
+ *        fast as needed once this LBA is written to.
+ */
+static struct cache_way *__cache_reserve(off_t lba, int force)
+{
+	unsigned int j;
+	struct cache_entry *entry = cache_set(lba);
+	struct cache_way *e = NULL, *way = entry->way;
+
+	for (j = 0; j < cache_ways; j++) {
+		/* continue, since maybe we find one with matching lba */
+		if (way[j].status == CACHE_BLOCK_UNUSED) {
+			if (e == NULL)
+				e = &way[j];
+			continue;
+		}
+		if (way[j].lba != lba)
+			continue;
+
+		/*
+		 * Avoid double entries: the block is VALID or READING
+		 * already. Do not throw READING out unless forced to.
+		 */
+		if (!force)
+			return NULL;
+
+		e = &way[j];
+		way_change_begin(e);
+		e->count = cache_next_count(entry);
+		e->used = 0;
+		e->status = CACHE_BLOCK_READING;
+		way_change_end(e);
+		way_set_ref(e, 1);
+		return e;
+	}
+
+	if (e == NULL)
+		e = cache_f->victim(entry);
+	if (e == NULL) {
+		dfprintf(stderr, "[%s] warn: No free entry found for LBA=%ld\n",
+			__func__, lba);
+		__dump_entry(entry);
+		return NULL;	/* no entry found! */
+	}
+
+	/* Now reserve */
+	if ((e->status == CACHE_BLOCK_VALID) && (e->used == 0))
+		cache_trashing++;	/* discarding an used entry */
+
+	/* dfprintf(stderr, "[%s] debug: reserve %p for LBA=%ld %s\n",
+		__func__, e, lba, block_status_str[e->status]); */
+	way_change_begin(e);
+	cache_f->insert(entry, e, lba);
+	e->lba = lba;
+	e->used = 0;
+	e->status = CACHE_BLOCK_READING;
+	way_change_end(e);
+
+	return e;
+}
+
+/**
+ * Reserve entry for reading later. Set status to READING and
+ * therefore take it out of the replacement circle. After reserving
+ * Filling it needs to happen under the way_lock, such that it can
+ * be reused later on. Failing to fill the entry will cause resource
+ * leakage and cache malfunction.
+ */
+static struct cache_way *cache_reserve(off_t lba, int force)
+{
+	struct cache_way *e;
+	struct cache_entry *entry = cache_set(lba);
+
+	pthread_mutex_lock(&entry->way_lock);
+	e = __cache_reserve(lba, force);
+	pthread_mutex_unlock(&entry->way_lock);
+
+	return e;
+}
+
+/**
+ * It might happen that a prefetch/write operation changes the state
+ * of the way entry. If that should happen, the status would not be
+ * READING anymore and we should not write for now to avoid problems
+ * when it is e.g. VALID. We might like to check, if the LBA is right,
+ * but even that could have been overwritten if the READING state was
+ * changed!
+ *
+ * We added _used to identify entries which were read by the prefetch
+ * code but thrown out before they got actually used.
+ *
+ * If adopt points to a cache buffer, that buffer replaces the one of
+ * the way instead of copying buf. *adopt is set to NULL then.
+ */
+static int cache_write_reserved(struct cache_way **e,
+				off_t lba, const void *buf,
+				void **adopt, int _used)
+{
+	void *old;
+	struct cache_way *_e;
+	struct cache_entry *entry;
+
+	if (e == NULL)
+		return -1;
+
+	_e = *e;
+	if (_e == NULL)
+		return -2;
+
+	entry = cache_set(lba);
+	pthread_mutex_lock(&entry->way_lock);
+
+	if (_e->lba != lba) {
+		dfprintf(stderr, "[%s] warn: %p LBA=%ld/%ld reservation lost %s\n",
+			__func__, _e, lba, _e->lba, block_status_str[_e->status]);
+		*e = NULL;	/* the way is somebody else's now */
+		pthread_mutex_unlock(&entry->way_lock);
+		return -1;
+	}
+
+	/* Reservation can be lost due to write happening in parallel */
+	if (_e->status != CACHE_BLOCK_READING) {
+		/* dfprintf(stderr, "[%s] warn: %p LBA=%ld/%ld State is not READING but %s\n",
+			__func__, _e, lba, _e->lba, block_status_str[_e->status]); */
+		*e = NULL;
+		pthread_mutex_unlock(&entry->way_lock);
+		return -2;
+	}
+
+	way_change_begin(_e);
+	if (adopt && *adopt) {
+		old = _e->buf;
+		__atomic_store_n(&_e->buf, *adopt, __ATOMIC_RELAXED);
+		*adopt = NULL;
+		cache_buf_put(old);
+		__atomic_fetch_add(&cache_adopted, 1, __ATOMIC_RELAXED);
+	} else if (way_buf_private(_e) == 0)
+		memcpy(_e->buf, buf, __CBLK_BLOCK_SIZE);
+	else {
+		_e->status = CACHE_BLOCK_UNUSED;
+		way_change_end(_e);
+		cache_wake(entry);
+		*e = NULL;
+		pthread_mutex_unlock(&entry->way_lock);
+		return -3;
+	}
+	_e->used = _used;
+	_e->status = CACHE_BLOCK_VALID;
+	way_change_end(_e);
+	cache_wake(entry);
+	*e = NULL;	/* mark as not accessible anymore */
+
+	pthread_mutex_unlock(&entry->way_lock);
+	return 0;
+}
+
+static int cache_unreserve(struct cache_way *e, off_t lba)
+{
+	struct cache_entry *entry;
+
+	if (e == NULL)
+		return -1;
+
+	/* dfprintf(stderr, "[%s] debug: unreserve %p for LBA=%ld %s\n",
+		__func__, e, lba, block_status_str[e->status]); */
+
+	entry = cache_set(lba);
+	pthread_mutex_lock(&entry->way_lock);
+
+	if (e->lba != lba) {
+		dfprintf(stderr, "[%s] err: LBA=%ld/%ld not consistent!\n",
+			__func__, lba, e->lba);
+		way_change_begin(e);
+		e->status = CACHE_BLOCK_UNUSED;
+		way_change_end(e);
+		cache_wake(entry);
+		/* __backtrace(); */
+		pthread_mutex_unlock(&entry->way_lock);
+		return -1;
+	}
+	if (e->status == CACHE_BLOCK_READING) {
+		dfprintf(stderr, "[%s] warn: %p forcing status LBA=%ld/%ld "
+			"cache from %s to UNUSED!\n",
+			__func__, e, lba, e->lba, block_status_str[e->status]);
+		way_change_begin(e);
+		e->status = CACHE_BLOCK_UNUSED;
+		way_change_end(e);
+		cache_wake(entry);
+		/* __backtrace(); */
+	}
+
+	pthread_mutex_unlock(&entry->way_lock);
+	return 0;
+}
+
+/**
+ * FIXME The non-atomic cache_reserve() -> cache_write_reserved() 
+ *       sequence is not working if we allow reservations to be
+ *       changed in certain cases. This needs fixups.
+ *
+ * With dirty set the block is only in the cache (write-back), it
+ * stays there until cache_flush() wrote it to the device.
+ */
+static int cache_write(off_t lba, const void *buf, int _used, int dirty)
+{
+	struct cache_way *e;
+	struct cache_entry *entry;
+
+	entry = cache_set(lba);
+	pthread_mutex_lock(&entry->way_lock);
+
+	e = __cache_reserve(lba, 1);	/* enforce reservation */
+	if (e == NULL) {
+		if (!dirty) {	/* a set full of dirty ones is no surprise */
+			fprintf(stderr, "[%s] cache reservation for LBA=%ld failed!\n",
+				__func__, lba);
+			__dump_entry(entry);
+		}
+		pthread_mutex_unlock(&entry->way_lock);
+		return -1;	/* no entry free! */
+	}
+
+	way_change_begin(e);
+	if (way_buf_private(e) != 0) {
+		fprintf(stderr, "[%s] no cache buffer for LBA=%ld!\n",
+			__func__, lba);
+		way_set_dirty(e, 0);	/* the caller has newer data */
+		e->status = CACHE_BLOCK_UNUSED;
+		way_change_end(e);
+		cache_wake(entry);
+		pthread_mutex_unlock(&entry->way_lock);
+		return -1;
+	}
+	memcpy(e->buf, buf, __CBLK_BLOCK_SIZE);
+	e->used = _used;
+	way_set_dirty(e, dirty);
+	e->status = CACHE_BLOCK_VALID;
+	way_change_end(e);
+	cache_wake(entry);
+	pthread_mutex_unlock(&entry->way_lock);
+
+	return 0;
+}
+
+/* With way_lock held: the VALID way holding lba or NULL */
+static struct cache_way *__cache_find(struct cache_entry *entry, off_t lba)
+{
+	unsigned int j;
+	struct cache_way *e;
+
+	for (j = 0; j < cache_ways; j++) {
+		e = &entry->way[j];
+		if ((e->status == CACHE_BLOCK_VALID) && (e->lba == lba))
+			return e;
+	}
+	return NULL;
+}
+
+/*
+ * Write-back: blocks read from the device are older than dirty ones
+ * in the cache. Copy those over buf, which holds blocks lba.. of the
+ * chunk. Only the blocks of range r if it is not NULL.
+ */
+static void cache_overlay_dirty(struct cblk_chunk *ch, off_t lba,
+				size_t nblocks, uint8_t *buf,
+				const struct cblk_range *r)
+{
+	size_t i;
+	off_t key;
+	struct cache_way *e;
+	struct cache_entry *entry;
+
+	if (!cblk_writeback ||
+	    (__atomic_load_n(&cache_ndirty, __ATOMIC_RELAXED) == 0))
+		return;
+
+	for (i = 0; i < nblocks; i++) {
+		if (r && (chunk_dev(ch, lba + i) != r->dev))
+			continue;
+		key = chunk_key(ch, lba + i);
+		entry = cache_set(key);
+		pthread_mutex_lock(&entry->way_lock);
+		e = __cache_find(entry, key);
+		if (e && e->dirty)
+			memcpy(buf + i * __CBLK_BLOCK_SIZE, e->buf,
+			       __CBLK_BLOCK_SIZE);
+		pthread_mutex_unlock(&entry->way_lock);
+	}
+}
+
+/* Copy a block to be written back, *wgen tells which write it was */
+static int cache_copy_dirty(off_t lba, void *buf, unsigned int *wgen)
+{
+	int rc = -1;
+	struct cache_way *e;
+	struct cache_entry *entry = cache_set(lba);
+
+	pthread_mutex_lock(&entry->way_lock);
+	e = __cache_find(entry, lba);
+	if (e != NULL) {
+		memcpy(buf, e->buf, __CBLK_BLOCK_SIZE);
+		*wgen = e->wgen;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&entry->way_lock);
+	return rc;
+}
+
+/* The device has the block, unless it was written again meanwhile */
+static void cache_clean(off_t lba, unsigned int wgen)
+{
+	struct cache_way *e;
+	struct cache_entry *entry = cache_set(lba);
+
+	pthread_mutex_lock(&entry->way_lock);
+	e = __cache_find(entry, lba);
+	if (e && e->dirty && (e->wgen == wgen))
+		way_set_dirty(e, 0);
+	pthread_mutex_unlock(&entry->way_lock);
+}
+
+/* Only waking up idle completion threads needs idle_m */
+static void inc_work_in_flight(struct cblk_dev *c)
+{
+	if (__atomic_add_fetch(&c->work_in_flight, 1, __ATOMIC_SEQ_CST) != 1)
+		return;
+
+	pthread_mutex_lock(&c->idle_m);
+	/* pthread_cond_signal(&c->idle_c); */
+	pthread_cond_broadcast(&c->idle_c);
+	pthread_mutex_unlock(&c->idle_m);
+}
+
+static void dec_work_in_flight(struct cblk_dev *c)
+{
+	__atomic_sub_fetch(&c->work_in_flight, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline unsigned int work_in_flight(struct cblk_dev *c)
+{
+	int r;
+
+	sem_getvalue(&c->busy_sem, &r);
+	return c->depth - r;
+}
+
+static inline void dev_set_status(struct cblk_dev *c,
+				enum cblk_status status)
+{
+	/* block_trace("  [%s] device new status is %s\n", __func__,
+		cblk_status_str[status]); */
+	c->status = status;
+}
+
+/*
+ * Action Write and Read are 32 bit MMIO
+ *
+ * Note:
+ *   Adding pthread_setcancelstate() since the simulation version of
+ *   libcxl is not really thead safe and keeps locks when interrupted
+ *   with pthread_cancel(). That can lead to deadlocks. Marking the
+ *   critical section as non-cancelable prevents this.
+ */
+static int __cblk_write(struct cblk_dev *c, uint32_t addr, uint32_t data)
+{
+	int rc, oldstate;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	rc = snap_mmio_write32(c->card, (uint64_t)addr, data);
+	if (0 != rc)
+		fprintf(stderr, "err: Write MMIO 32 Err %d\n", rc);
+	pthread_setcancelstate(oldstate, NULL);
+	return rc;
+}
+
+
+/* Action or Kernel Write and Read are 32 bit MMIO */
+static int __cblk_read(struct cblk_dev *c, uint32_t addr, uint32_t *data)
+{
+	int rc, oldstate;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+#ifdef CONFIG_MMIO32_NOHWSYNC
+	rc = snap_mmio_read32_nohwsync(c->card, (uint64_t)addr, data);
+#else
+	rc = snap_mmio_read32(c->card, (uint64_t)addr, data);
+#endif
+	if (0 != rc)
+		fprintf(stderr, "err: Read MMIO 32 Err %d\n", rc);
+
+	pthread_setcancelstate(oldstate, NULL);
+	return rc;
+}
+
+static void req_setup(struct cblk_req *req,
+		uint32_t action_code,
+		uint64_t dst,
+		uint64_t src,
+		uint32_t size)
+{
+	req->action = action_code | (req->slot << 8);
+	req->dst = dst;
+	req->src = src;
+	req->size = size;
+	req->tries = 0;
+}
+
+/*
+ * NVMe: For NVMe transfers n is representing a NVME_LB_SIZE (512)
+ *       byte block.
+ */
+static void req_start(struct cblk_req *req, struct cblk_dev *c)
+{
+	uint8_t action_code = req->action & 0x00ff;
+	int slot = req->slot;
+
+	req->tries++;
+	block_trace("    [%s] HW %s memcpy_%x(slot=%u dest=0x%llx, "
+		"src=0x%llx n=%lld bytes) LBA=%ld attempts=%d\n",
+		__func__, action_name[action_code % ACTION_CONFIG_MAX],
+		req->action, slot, (long long)req->dst, (long long)req->src,
+		(long long)req->size, req->lba, req->tries);
+
+	pthread_mutex_lock(&c->dev_lock);
+
+	__cblk_write(c, ACTION_CONFIG,    req->action);
+	__cblk_write(c, ACTION_DEST_LOW,  (uint32_t)(req->dst & 0xffffffff));
+	__cblk_write(c, ACTION_DEST_HIGH, (uint32_t)(req->dst >> 32));
+	__cblk_write(c, ACTION_SRC_LOW,   (uint32_t)(req->src & 0xffffffff));
+	__cblk_write(c, ACTION_SRC_HIGH,  (uint32_t)(req->src >> 32));
+	__cblk_write(c, ACTION_CNT,       req->size);
+
+	/* Wait for Action to go back to Idle */
+	snap_action_start(c->act);
+	gettimeofday(&req->stime, NULL);
+	gettimeofday(&req->h_stime, NULL);
+
+	/*
+	 * Update statistics under device lock.
+	 * Otherwise it might be off a little bit.
+	 */
+	req->tries++;
+	if (action_code == ACTION_CONFIG_COPY_HN) {
+		c->hw_block_writes++;
+		c->wbytes_total += req->size;
+	} else {
+		c->hw_block_reads++;
+		c->rbytes_total += req->size;
+	}
+
+	pthread_mutex_unlock(&c->dev_lock);
+}
+
+int cblk_init(void *arg __attribute__((unused)),
+		uint64_t flags __attribute__((unused)))
+{
+	block_trace("[%s] arg=%p flags=%llx\n", __func__, arg,
+		(long long)flags);
+	return 0;
+}
+
+int cblk_term(void *arg __attribute__((unused)),
+		uint64_t flags __attribute__((unused)))
+{
+	block_trace("[%s] arg=%p flags=%llx\n", __func__, arg,
+		(long long)flags);
+	return 0;
+}
+
+static void cblk_req_dump(struct cblk_dev *c)
+{
+	unsigned int i;
+	struct timeval now;
+	time_t usecs;
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
+		struct cblk_req *req = &c->req[i];
+
+		switch (req->status) {
+		case CBLK_IDLE:
+			usecs = 0;
+			break;
+		case CBLK_READY:
+			usecs = timediff_usec(&req->etime, &req->stime);
+			break;
+		default:
+			usecs = timediff_usec(&now, &req->stime);
+			break;
+		}
+		fprintf(stderr, "  req[%2d]: %s LBA=%ld %ld usec err_total=%d\n",
+			i, cblk_status_str[req->status], req->lba,
+			usecs, req->err_total);
+	}
+}
+
+static void stat_req_dump(struct cblk_dev *c)
+{
+	unsigned int i;
+	struct timeval now;
+	time_t usecs;
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
+		struct cblk_req *req = &c->req[i];
+
+		switch (req->status) {
+		case CBLK_IDLE:
+			usecs = 0;
+			break;
+		case CBLK_READY:
+			usecs = timediff_usec(&req->etime, &req->stime);
+			break;
+		default:
+			usecs = timediff_usec(&now, &req->stime);
+			break;
+		}
+		stat_trace("  req[%2d]: %s LBA=%ld %ld usec err_total=%d\n",
+			i, cblk_status_str[req->status], req->lba,
+			usecs, req->err_total);
+	}
+}
+
+/**
+ * Allocate a free slot for reading. Numbers will go from 0..depth-1.
+ * Updates work_in_flight and sets the request status to CBLK_READING/WRITING.
+ * Returns NULL if no free request is available. Assumes that
+ * requests can be completed out of order. Free slots are bits in
+ * c->free_slots, taken with compare and swap, such that threads do not
+ * serialize on dev_lock here. Each thread continues behind the slot it
+ * got last time, which spreads the slots like the former round robin
+ * search and keeps threads from competing for the same bit.
+ */
+/* Pick an IDLE slot, the caller got busy_sem already */
+static struct cblk_req *__get_req_slot(struct cblk_dev *c,
+				int use_wait_sem,
+				off_t lba, size_t nblocks,
+				int is_write)
+{
+	static __thread unsigned int hint = 0;
+	uint32_t free, above;
+	int slot;
+	struct cblk_req *req;
+
+	free = __atomic_load_n(&c->free_slots, __ATOMIC_RELAXED);
+	do {
+		if (free == 0)
+			return NULL;
+		above = free & ~((1u << (hint % c->depth)) - 1);
+		slot = __builtin_ctz(above ? above : free);
+	} while (!__atomic_compare_exchange_n(&c->free_slots, &free,
+			free & ~(1u << slot), 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	hint = slot + 1;
+
+	req = &c->req[slot];
+	block_trace("[%s] GIVE OUT WRITE slot %u LBA=%ld\n",
+		__func__, slot, lba);
+
+	gettimeofday(&req->stime, NULL);
+	req->use_wait_sem = use_wait_sem;
+	req->apiece = NULL;
+	req->lba = lba;
+	req->nblocks = nblocks;
+	req->is_write = is_write;
+	/* check_req_timeouts() must not see the status before stime */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	cblk_set_status(req, is_write ? CBLK_WRITING : CBLK_READING);
+
+	inc_work_in_flight(c);
+	return req;
+}
+
+static struct cblk_req *get_req(struct cblk_dev *c,
+				int use_wait_sem,
+				off_t lba, size_t nblocks,
+				int is_write)
+{
+	struct cblk_req *req;
+
+	while (c->status == CBLK_READY) {
+		int rc;
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += cblk_busytimeout;
+	retry:
+		rc = sem_timedwait(&c->busy_sem, &ts);
+		if (rc == -1) {
+			if (errno == EINTR)
+				goto retry;
+			if (errno == ETIMEDOUT) {
+				fprintf(stderr, "[%s] warn: %s\n",
+					__func__, strerror(errno));
+				//goto retry;
+				return NULL;
+			}
+			fprintf(stderr, "[%s] warn: sem_timedwait returned rc=%d %s\n",
+				__func__, rc, strerror(errno));
+		}
+
+		/* Check if device is still healthy after waiting */
+		if (c->status != CBLK_READY) {
+			block_trace("[%s] err: Device not READY, no "
+				"write req LBA=%ld given out!\n",
+				__func__, lba);
+			errno = ENOENT;
+			return NULL;
+		}
+
+		req = __get_req_slot(c, use_wait_sem, lba, nblocks, is_write);
+		if (req != NULL)
+			return req;
+
+		fprintf(stderr, "[%s] warn: No IDLE write req for LBA=%ld found!\n",
+			__func__, lba);
+		cblk_req_dump(c);
+	}
+	errno = EIO;
+	return NULL;
+}
+
+/* Like get_req(), but returns NULL instead of waiting for a slot */
+static struct cblk_req *get_req_nowait(struct cblk_dev *c,
+				off_t lba, size_t nblocks,
+				int is_write)
+{
+	struct cblk_req *req;
+
+	if (c->status != CBLK_READY)
+		return NULL;
+	if (sem_trywait(&c->busy_sem) != 0)
+		return NULL;
+
+	req = __get_req_slot(c, 0, lba, nblocks, is_write);
+	if (req == NULL)
+		sem_post(&c->busy_sem);
+	return req;
+}
+
+static void put_req(struct cblk_dev *c, struct cblk_req *req)
+{
+	unsigned int i;
+	time_t usecs;
+
+	pthread_mutex_lock(&c->dev_lock);
+	gettimeofday(&req->etime, NULL);
+	usecs = timediff_usec(&req->etime, &req->stime);
+
+	if (cblk_is_write(req)) {
+		if (usecs > c->max_write_usecs)
+			c->max_write_usecs = usecs;
+		if ((c->min_write_usecs == 0) || (usecs < c->min_write_usecs))
+			c->min_write_usecs = usecs;
+		c->avg_write_usecs += usecs;
+	} else {
+		if (usecs > c->max_read_usecs)
+			c->max_read_usecs = usecs;
+		if ((c->min_read_usecs == 0) || (usecs < c->min_read_usecs))
+			c->min_read_usecs = usecs;
+		c->avg_read_usecs += usecs;
+
+		if (cblk_caching) {
+			for (i = 0; i < ARRAY_SIZE(req->pblock); i++) {
+				cache_unreserve(req->pblock[i],
+						dev_key(c, req->lba + i));
+				req->pblock[i] = NULL;
+			}
+		}
+		if (req->dma_buf) {	/* not adopted by the cache */
+			cache_buf_put(req->dma_buf);
+			req->dma_buf = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&c->dev_lock);
+
+	/* Slots in error are not given out again */
+	if (req->status != CBLK_ERROR) {
+		cblk_set_status(req, CBLK_IDLE);
+		__atomic_fetch_or(&c->free_slots, 1u << req->slot,
+				  __ATOMIC_RELEASE);
+	}
+
+	dec_work_in_flight(c);
+	sem_post(&c->busy_sem);
+
+	async_dispatch(c);	/* queued async requests can have the slot */
+}
+
+/**
+ * Check action results and kick potential waiting threads.
+ */
+static int completion_status(struct cblk_dev *c, int timeout __attribute__((unused)))
+{
+	int rc = ETIME;
+	uint32_t status = 0x0;
+	uint32_t errbits = 0x0;
+	int slot = -1;
+	struct cblk_req *req;
 	time_t usecs;
+	static int count = 0;
+
+#ifdef CONFIG_WAIT_FOR_IRQ
+	rc = snap_action_completed(c->act, NULL, timeout);
+	if (rc == 0) {
+		fprintf(stderr, "err: Timeout while Waiting for Idle %d\n", rc);
+		return -1;
+	}
+#endif
+
+	rc = __cblk_read(c, ACTION_STATUS, &status);
+	if (rc != 0) {
+		fprintf(stderr, "err: MMIO32 read ACTION_STATUS %d\n", rc);
+		dev_set_status(c, CBLK_ERROR);
+		return -2;
+	}
+
+	if (((status & ACTION_STATUS_ERROR_MASK) != 0x0) && (count++ < 2)) {
+		__cblk_read(c, ACTION_ERROR_BITS, &errbits);
+
+		block_trace("[%s] warn: ACTION_STATUS=%08x ERROR_MASK not 0 "
+			"ACTION_ERROR_BITS=%08x\n",
+			__func__, status, errbits);
+		/* FIXME */
+		/* dev_set_status(c, CBLK_ERROR);
+		return -4; */
+	}
+
+	if ((status & ACTION_STATUS_COMPLETED) != ACTION_STATUS_COMPLETED) {
+		/* FIXME Very verbose when doing polling */
+		/* block_trace("  NO COMPLETION %02x\n", status); */
+		return -3;
+	}
+
+	slot = status & ACTION_STATUS_COMPLETION_MASK;
+	req = &c->req[slot];
+
+	if (status == ACTION_STATUS_WRITE_COMPLETED) {
+		block_trace("    [%s] HW WRITE_COMPLETED %08x slot: %d LBA=%ld\n",
+			__func__, status, slot, req->lba);
+	} else {
+		block_trace("    [%s] HW READ_COMPLETED %08x slot: %d LBA=%ld\n",
+			__func__, status, slot, req->lba);
+	}
+
+	/* statistics: figure out hardware completion time ... */
+	gettimeofday(&req->h_etime, NULL);
+	usecs = timediff_usec(&req->h_etime, &req->h_stime);
+	if (cblk_is_write(req))
+		c->avg_hw_write_usecs += usecs;
+	else
+		c->avg_hw_read_usecs += usecs;
+
+	return slot;
+}
+
+/*
+ * We are checking status in struct cblk_req and we saw req->stime to
+ * be all 0s during testing. Therefore we try to aquire the c->dev_lock
+ * to avoid any possible inconsistencies here.
+ */
+static int check_req_timeouts(struct cblk_dev *c, long int timeout_sec)
+{
+	unsigned int i, nfailed = 0;
+	long int diff_sec = 0;
+	int err = 0;
+	struct timeval etime;
+	struct cblk_req *failed[CBLK_IDX_MAX];
+
+	gettimeofday(&etime, NULL);
+	pthread_mutex_lock(&c->dev_lock);
+
+	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
+		struct cblk_req *req = &c->req[i];
+
+		if ((req->status != CBLK_READING) && (req->status != CBLK_WRITING))
+			continue;
+
+		diff_sec = timediff_sec(&etime, &req->stime);
+		if (diff_sec > timeout_sec) {
+			err++;
+			
+			fprintf(stderr, "[%s] err: req[%2d]: "
+				"%s %lu/%lu sec LBA=%ld TIMEOUT\n",
+				__func__, i, cblk_status_str[req->status],
+				timeout_sec, diff_sec, req->lba);
+
+			if (req->tries >= cblk_maxretries) {
+				uint32_t errbits;
+
+				errno = ETIME;
+				cblk_set_status(req, CBLK_ERROR);
+				dev_set_status(c, CBLK_ERROR);
+				__cblk_read(c, ACTION_ERROR_BITS, &errbits);
+
+				if (errbits != 0)
+					fprintf(stderr, "[%s] err: req[%2d]: "
+						"ACTION_ERROR_BITS=%08x\n",
+						__func__, i, errbits);
+
+				if (req->use_wait_sem)
+					sem_post(&req->wait_sem);
+				else if (req->apiece)
+					failed[nfailed++] = req;
+			} else {
+				/* FIXME Helps but is not optimal ... */
+				req->err_total++;
+
+				/* req_start() will use the lock too */
+				pthread_mutex_unlock(&c->dev_lock);
+				req_start(req, c);
+				pthread_mutex_lock(&c->dev_lock);
+			}
+		}
+	}
+	pthread_mutex_unlock(&c->dev_lock);
+
+	/* Needs dev_lock itself */
+	for (i = 0; i < nfailed; i++)
+		async_complete(c, failed[i]);
+
+	return err;
+}
+
+static void completion_thread_cleanup(void *arg)
+{
+	struct cblk_dev *c = (struct cblk_dev *)arg;
+
+	block_trace("[%s] tid=%d tidy up ...\n", __func__, __gettid());
+	pthread_mutex_unlock(&c->idle_m);
+}
+
+/**
+ * Reserve cache ways for the blocks of a read request. Single block
+ * reads go straight into a cache buffer which __read_complete() hands
+ * over to the reserved way, larger ones are copied from req->buf.
+ * Returns where the hardware should put the data.
+ */
+static uint8_t *req_cache_setup(struct cblk_dev *c, struct cblk_req *req)
+{
+	unsigned int i;
+
+	if (!cblk_caching)
+		return req->buf;
+
+	for (i = 0; i < req->nblocks; i++)
+		req->pblock[i] = cache_reserve(dev_key(c, req->lba + i), 0);
+
+	if ((req->nblocks == 1) && (req->pblock[0] != NULL))
+		req->dma_buf = cache_buf_get();
+
+	return req->dma_buf ? req->dma_buf : req->buf;
+}
+
+static inline uint8_t *req_data(struct cblk_req *req)
+{
+	return req->dma_buf ? req->dma_buf : req->buf;
+}
+
+/**
+ * Trigger read prefetch operations starting from lba which should
+ * already be in flight. Do not wait for completion via semaphore.
+ * Only prefetch if there are read slots free. Use cache reserve
+ * and buffers in cache such that completion is just a markup task.
+ */
+static int __prefetch_read_start(struct cblk_chunk *ch, off_t lba,
+			unsigned int nblocks)
+{
+	unsigned int i, n;
+	struct cblk_dev *c;
+	struct cblk_req *req;
+	struct cblk_range r[CBLK_DEVS_MAX];
+	enum cache_block_status status;
+	uint32_t mem_size;
+
+	/* Check if we can really prefetch this lba */
+	if ((lba < 0) || ((size_t)lba + nblocks > ch->nblocks))
+		return -1;
+
+	/* Check if the block is already in cache or requested */
+	status = cache_info(chunk_key(ch, lba));
+	if ((status == CACHE_BLOCK_VALID) || (status == CACHE_BLOCK_READING)) {
+		block_trace("[%s] skip prefetch LBA=%lu %d KiB status=%s\n",
+			__func__, lba, nblocks * __CBLK_BLOCK_SIZE/1024,
+			block_status_str[status]);
+		chunk_dev(ch, lba)->prefetch_collisions++;
+		return -2;
+	}
+
+	block_trace("[%s] do prefetch LBA=%lu %d KiB status=%s\n",
+		__func__, lba, nblocks * __CBLK_BLOCK_SIZE/1024,
+		block_status_str[status]);
+
+	/*
+	 * Get a free read slot, we can read CBLK_NBLOCKS_MAX blocks,
+	 * pysically request the block. Prefetching is speculative, it
+	 * must not wait for a slot a real request could use.
+	 */
+	n = chunk_split(ch, lba, nblocks, r);
+	for (i = 0; i < n; i++) {
+		c = r[i].dev;
+		req = get_req_nowait(c, r[i].lba, r[i].nblocks, 0);
+		if (req == NULL)
+			return -2;
+
+		mem_size = r[i].nblocks * __CBLK_BLOCK_SIZE;
+		c->prefetches++;
+		req_setup(req, ACTION_CONFIG_COPY_NH,		/* NVMe to Host DDR */
+			(uint64_t)req_cache_setup(c, req),	/* dst */
+			r[i].lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* src */
+			mem_size);				/* size */
+		req_start(req, c);
+	}
+	return 0;
+}
+
+static int __prefetch_blocks(struct cblk_chunk *ch, off_t lba,
+			unsigned int nblocks)
+{
+	int rc = 0;
+	unsigned int k, n = 0;
+
+	if (!cblk_prefetch)
+		return -1;
+
+	/* pp_get_offslist(prefetch_offs, cblk_prefetch, nblocks); */
+
+	for (k = 0; k < prefetch_n; k++) {
+		struct cblk_dev *c = chunk_dev(ch, lba);
+
+		if (work_in_flight(c) >=
+		    MIN((unsigned int)cblk_prefetch_threshold, c->depth))
+			continue;
+
+		block_trace("[%s] LBA=%ld+(%d)\n",
+			__func__, lba, prefetch_offs[k]);
+		rc = __prefetch_read_start(ch, lba + prefetch_offs[k],
+					nblocks);
+		if (rc >= 0)
+			n++;
+	}
+
+	return n;
+}
+
+static int __read_complete(struct cblk_dev *c,
+				struct cblk_req *req, int _used)
+{
+	unsigned int i;
+
+	if ((c->status == CBLK_ERROR) || (req->status == CBLK_ERROR)) {
+		errno = ETIME;
+		put_req(c, req);
+		return -1;
+	}
+
+	if (cblk_caching) {
+		/* ... push blocks to cache for later use */
+		for (i = 0; i < req->nblocks; i++) {
+			cache_write_reserved(&req->pblock[i],
+					dev_key(c, req->lba + i),
+					req->buf + i * __CBLK_BLOCK_SIZE,
+					&req->dma_buf, _used);
+		}
+	}
+
+	put_req(c, req);
+	return 0;
+}
+
+/**
+ * Try to pin the calling thread to a specific CPU, the one it is
+ * currently running on if cpu is negative. Returns the CPU.
+ */
+static inline int __pin_cpu(int cpu)
+{
+	cpu_set_t *cpusetp;
+	size_t size;
+	int num_cpus, run_cpu = (cpu < 0) ? sched_getcpu() : cpu;
+
+	num_cpus = CPU_SETSIZE; /* take default, currently 1024 */
+	cpusetp = CPU_ALLOC(num_cpus);
+	if (cpusetp == NULL)
+		return -1;
+
+	size = CPU_ALLOC_SIZE(num_cpus);
+	CPU_ZERO_S(size, cpusetp);
+	CPU_SET_S(run_cpu, size, cpusetp);
+
+	if (sched_setaffinity(0, size, cpusetp) < 0) {
+		CPU_FREE(cpusetp);
+		return -2;
+	}
+
+	CPU_FREE(cpusetp);
+	return run_cpu;
+}
+
+static unsigned long no_result_counter = 0;
+
+/* The hardware is done with slot, wake up whoever waits for it */
+static void complete_slot(struct cblk_dev *c, int slot)
+{
+	struct cblk_req *req = &c->req[slot];
+
+	if ((req->status == CBLK_READING) ||
+	    (req->status == CBLK_WRITING)) {
+		block_trace("  [%s] waking up slot %d LBA=%ld\n",
+			__func__, slot, req->lba);
+
+		cblk_set_status(req, CBLK_READY);
+		if (req->use_wait_sem) {
+			sem_post(&req->wait_sem);
+		} else if (req->apiece) {
+			async_complete(c, req);
+		} else {
+			__read_complete(c, req, 0);
+		}
+	} else {
+		block_trace("  [%s] err: slot %d status is %s "
+			"ILLEGAL STATUS (%lu) LBA=%ld\n", __func__,
+			slot, cblk_status_str[req->status],
+			no_result_counter,
+			req->lba);
+	}
+}
+
+/**
+ * This thread contains performane critical code which is supposed
+ * to identify request/slot completion and inform  the waiting threads
+ * as quick as possible. Rescheduling or any other delay will have
+ * direct influence on performance.
+ *
+ * ACTION_STATUS gives one completion per read. Up to
+ * cblk_completion_batch of them are harvested before their requests
+ * are completed, such that the MMIO reads are not interleaved with
+ * the copying and waking up. Stuck requests are looked for every
+ * CONFIG_TIMEOUT_CHECK_USEC instead of after each poll. If a poll
+ * finds nothing, the thread sleeps cblk_completion_usec to coalesce
+ * completions, 0 keeps it spinning.
+ */
+static void *completion_thread(void *arg)
+{
+	struct cblk_dev *c = (struct cblk_dev *)arg;
+	unsigned int n, i, id = __atomic_fetch_add(&c->done_started, 1,
+						     __ATOMIC_RELAXED);
+	int slot, slots[CBLK_IDX_MAX];
+	unsigned long long now_usec, last;
+	struct timeval now;
+	struct timespec timeout, nap;
+
+	block_trace("[%s] arg=%p enter\n", __func__, arg);
+	if (cblk_completion_cpu >= 0)
+		__pin_cpu(cblk_completion_cpu + id);
+	pthread_cleanup_push(completion_thread_cleanup, c);
+
+	while (1) {
+		pthread_mutex_lock(&c->idle_m);
+		while (__atomic_load_n(&c->work_in_flight,
+				       __ATOMIC_SEQ_CST) == 0) {
+			/* 5 sec delay should be noticable ... */
+			gettimeofday(&now, NULL);
+			timeout.tv_sec = now.tv_sec + 5;
+			timeout.tv_nsec = now.tv_usec;
+
+			/* int rc =  */
+			pthread_cond_timedwait(&c->idle_c, &c->idle_m, &timeout);
+			/* if (rc == ETIMEDOUT)
+				fprintf(stderr, "[%s] info: timedwait returned ETIMEDOUT\n",
+					__func__); */
+
+			c->idle_wakeups++;
+		}
+		pthread_mutex_unlock(&c->idle_m);
+
+		for (n = 0; n < (unsigned int)cblk_completion_batch; n++) {
+			slot = completion_status(c, c->timeout);
+			if ((slot < 0) || (slot >= (int)c->depth))
+				break;
+			slots[n] = slot;
+		}
+		for (i = 0; i < n; i++)
+			complete_slot(c, slots[i]);
+
+		if (n != 0)
+			c->harvests++;
+		else
+			no_result_counter++;
+		if ((n == 0) && cblk_completion_usec) {
+			nap.tv_sec = cblk_completion_usec / 1000000;
+			nap.tv_nsec = (cblk_completion_usec % 1000000) * 1000;
+			nanosleep(&nap, NULL);
+		}
+
+		gettimeofday(&now, NULL);
+		now_usec = now.tv_sec * 1000000ull + now.tv_usec;
+		last = __atomic_load_n(&c->tcheck, __ATOMIC_RELAXED);
+		if ((now_usec - last >= CONFIG_TIMEOUT_CHECK_USEC) &&
+		    __atomic_compare_exchange_n(&c->tcheck, &last, now_usec,
+				0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			check_req_timeouts(c, cblk_reqtimeout); /* sec */
+
+		pthread_testcancel();	/* go home if requested */
+	}
+
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+static int put_offslist(void *put_data __attribute__((unused)),
+			int *offslist, unsigned int n,
+			size_t nblocks __attribute__((unused)))
+{
+	if (offslist == NULL) {
+		block_trace("[%s] warn: no offset list provided!\n", __func__);
+		return -1;
+	}
+
+	n = MIN(n, (unsigned int)ARRAY_SIZE(prefetch_offs));
+	pthread_mutex_lock(&prefetch_lock);
+	memcpy(prefetch_offs, offslist, n * sizeof(int));
+	prefetch_n = n;
+	pthread_mutex_unlock(&prefetch_lock);
+	return 0;
+}
+
+static void dev_stats(struct cblk_dev *c)
+{
+	struct timeval end_time;
+	time_t usec;
+
+	gettimeofday(&end_time, NULL);
+	usec = timediff_usec(&end_time, &c->start_time);
+
+	stat_trace("Statistics %s\n"
+		"  prefetches:          %ld\n"
+		"  prefetch_collis_4k:  %ld\n"
+		"  cache_hits:          %ld\n"
+		"    cache_hits_4k:     %ld\n"
+		"  hw_block_reads:      %ld\n"
+		"  hw_block_writes:     %ld\n"
+		"  block_reads:         %ld\n"
+		"    block_reads_4k:    %ld\n"
+		"  block_writes:        %ld\n"
+		"    block_writes_4k:   %ld\n"
+		"  idle_wakeups:        %ld\n"
+		"  harvests:            %ld\n"
+		"  cache_trashing_4k:   %ld\n"
+		"  running:             %ld usec\n"
+		"  reading:             %ld usec\n"
+		"  writing:             %ld usec\n"
+		"  rbytes_total:        %lld %.3f MiB/sec\n"
+		"  wbytes_total:        %lld %.3f MiB/sec\n"
+		"  max_read_usecs:      %ld usec\n"
+		"  max_write_usecs:     %ld usec\n"
+		"  avg_read_usecs:      %ld usec\n"
+		"  avg_write_usecs:     %ld usec\n"
+		"  min_read_usecs:      %ld usec\n"
+		"  min_write_usecs:     %ld usec\n"
+		"  avg_hw_read_usecs:   %ld usec\n"
+		"  avg_hw_write_usecs:  %ld usec\n",
+		c->path,
+		c->prefetches,
+		c->prefetch_collisions,
+		c->cache_hits,
+		c->cache_hits_4k,
+		c->hw_block_reads,
+		c->hw_block_writes,
+		c->block_reads,
+		c->block_reads_4k,
+		c->block_writes,
+		c->block_writes_4k,
+		c->idle_wakeups,
+		c->harvests,
+		cache_trashing,
+		(long int)usec,
+		c->avg_read_usecs,
+		c->avg_write_usecs,
+		c->rbytes_total, usec ? (double)c->rbytes_total / usec : 0.0,
+		c->wbytes_total, usec ? (double)c->wbytes_total / usec : 0.0,
+		c->max_read_usecs,
+		c->max_write_usecs,
+		c->hw_block_reads ? c->avg_read_usecs/c->hw_block_reads : 0,
+		c->hw_block_writes ? c->avg_write_usecs/c->hw_block_writes : 0,
+		c->min_read_usecs,
+		c->min_write_usecs,
+		c->hw_block_reads ? c->avg_hw_read_usecs/c->hw_block_reads : 0,
+		c->hw_block_writes ? c->avg_hw_write_usecs/c->hw_block_writes : 0);
+
+	stat_req_dump(c);
+}
+
+/**
+ * Returns the device context for path. The first user sets it up,
+ * attaches the action and starts the completion threads, later ones
+ * just share it. Called with cblk_lock held.
+ */
+static struct cblk_dev *dev_open(const char *path)
+{
+	int rc;
+	unsigned int i, j;
+	int timeout = ACTION_WAIT_TIME;
+	unsigned long have_nvme = 0;
+	snap_action_flag_t attach_flags = 0;
+	struct cblk_dev *c = NULL;
+
+	for (i = 0; i < ARRAY_SIZE(devs); i++) {
+		if (devs[i].users && (strcmp(devs[i].path, path) == 0)) {
+			devs[i].users++;
+			return &devs[i];
+		}
+		if ((c == NULL) && (devs[i].users == 0))
+			c = &devs[i];
+	}
+	if (c == NULL) {
+		fprintf(stderr, "err: No more than %d devices supported\n",
+			CBLK_DEVS_MAX);
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	block_trace("[%s] opening (%s)\n", __func__, path);
+
+	memset(c, 0, sizeof(*c));
+	c->devno = c - devs;
+	strncpy(c->path, path, sizeof(c->path) - 1);
+	pthread_mutex_init(&c->dev_lock, NULL);
+	pthread_mutex_init(&c->aq_lock, NULL);
+
+#ifdef CONFIG_WAIT_FOR_IRQ
+	attach_flags |= (SNAP_ACTION_DONE_IRQ | SNAP_ATTACH_IRQ);
+#endif
+	/* path must match the following scheme: "/dev/cxl/afu%d.0m" */
+	c->card = snap_card_alloc_dev(path, SNAP_VENDOR_ID_IBM,
+					 SNAP_DEVICE_ID_SNAP);
+	if (NULL == c->card) {
+		fprintf(stderr, "err: Cannot open SNAP device %s\n", path);
+		goto out_err0;
+	}
+
+	/* Check if i do have NVME on this card */
+	snap_card_ioctl(c->card, GET_NVME_ENABLED, (unsigned long)&have_nvme);
+	if (0 == have_nvme) {
+		fprintf(stderr, "err: SNAP NVMe is not enabled on card %s!\n",
+			path);
+		goto out_err1;
+	}
+
+	c->act = snap_attach_action(c->card, ACTION_TYPE_NVME_EXAMPLE,
+					attach_flags, timeout);
+	if (NULL == c->act) {
+		fprintf(stderr, "err: Cannot Attach Action: %x\n",
+			ACTION_TYPE_NVME_EXAMPLE);
+		goto out_err1;
+	}
+
+	c->buf = snap_malloc(CBLK_IDX_MAX * __CBLK_BLOCK_SIZE * CBLK_NBLOCKS_MAX);
+	if (c->buf == NULL) {
+		fprintf(stderr, "err: Cannot alloc temporary buffer\n");
+		goto out_err2;
+	}
+
+	c->status = CBLK_READY;
+	c->req_status = CBLK_IDLE;
+	c->drive = 0;
+	c->nblocks = cblk_dev_nblocks;
+	c->timeout = timeout;
+	gettimeofday(&c->start_time, NULL);
+
+	c->depth = cblk_queue_depth;
+	c->free_slots = (1u << c->depth) - 1;
+	sem_init(&c->busy_sem, 0, c->depth);
+	pthread_mutex_init(&c->idle_m, NULL);
+	pthread_cond_init(&c->idle_c, NULL);
 
-	gettimeofday(&now, NULL);
 	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
 		struct cblk_req *req = &c->req[i];
 
-		switch (req->status) {
-		case CBLK_IDLE:
-			usecs = 0;
-			break;
-		case CBLK_READY:
-			usecs = timediff_usec(&req->etime, &req->stime);
-			break;
-		default:
-			usecs = timediff_usec(&now, &req->stime);
-			break;
+		req->slot = i;
+		req->buf = c->buf + i * CBLK_NBLOCKS_MAX * __CBLK_BLOCK_SIZE;
+		cblk_set_status(req, CBLK_IDLE);
+		sem_init(&req->wait_sem, 0, 0);
+
+		for (j = 0; j < ARRAY_SIZE(req->pblock); j++) {
+			req->pblock[j] = NULL;
 		}
-		stat_trace("  req[%2d]: %s LBA=%ld %ld usec err_total=%d\n",
-			i, cblk_status_str[req->status], req->lba,
-			usecs, req->err_total);
 	}
+
+	for (i = 0; i < (unsigned int)cblk_completion_threads; i++) {
+		rc = pthread_create(&c->done_tid[i], NULL,
+				&completion_thread, c);
+		if (rc != 0) {
+			c->done_tid[i] = 0;
+			goto out_err3;
+		}
+	}
+
+	c->users = 1;
+	return c;
+
+ out_err3:
+	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++) {
+		if (c->done_tid[i] == 0)
+			continue;
+		pthread_cancel(c->done_tid[i]);
+		pthread_join(c->done_tid[i], NULL);
+		c->done_tid[i] = 0;
+	}
+ 	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
+		c->req[i].status = CBLK_IDLE;
+		sem_destroy(&c->req[i].wait_sem);
+	}
+	__free(c->buf);
+	c->buf = NULL;
+ out_err2:
+	snap_detach_action(c->act);
+	c->act = NULL;
+ out_err1:
+	snap_card_free(c->card);
+	c->card = NULL;
+ out_err0:
+	errno = ENODEV;
+	return NULL;
+}
+
+/* The last user tears the device down. Called with cblk_lock held. */
+static void dev_close(struct cblk_dev *c)
+{
+	int rc;
+	unsigned int i;
+	struct timeval etime;
+
+	if (--c->users != 0)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++) {
+		if (c->done_tid[i] == 0)
+			continue;
+		rc = pthread_cancel(c->done_tid[i]);
+		if (rc != 0)
+			fprintf(stderr, "  [%s] canceling tid %u rc=%d\n",
+				__func__, (unsigned int)c->done_tid[i], rc);
+		
+		rc = pthread_join(c->done_tid[i], NULL);
+		if (rc != 0)
+			fprintf(stderr, "  [%s] joining tid %u rc=%d\n",
+				__func__, (unsigned int)c->done_tid[i], rc);
+
+		c->done_tid[i] = 0;
+	}
+
+	gettimeofday(&etime, NULL);
+	block_trace("[%s] %s req_status=%s work_in_flight=%d "
+		"now: %lu sec %lu usec ...\n",
+		__func__, c->path, cblk_status_str[c->req_status],
+		work_in_flight(c),
+		(long)etime.tv_sec, (long)etime.tv_usec);
+
+	dev_stats(c);
+
+	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
+		/* c->req[i].status = CBLK_IDLE; */
+		sem_destroy(&c->req[i].wait_sem);
+	}
+
+        pthread_cond_destroy(&c->idle_c);
+	snap_detach_action(c->act);
+	snap_card_free(c->card);
+	__free(c->buf);
+
+	c->act = NULL;
+	c->card = NULL;
+	c->buf = NULL;
+	c->nblocks = 0;
+	c->timeout = 0;
+	c->drive = -1;
+}
+
+static struct cblk_chunk *chunk_get(chunk_id_t id)
+{
+	if ((id < 0) || (id >= (chunk_id_t)ARRAY_SIZE(chunks)) ||
+	    !chunks[id].used) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return &chunks[id];
 }
 
 /**
- * Allocate a free slot for reading. Numbers will go from 0..15.
- * Updates work_in_flight and sets the request status to CBLK_READING/WRITING.
- * Returns NULL if no free request is available. Assumes that
- * requests can be completed out of order, so it searches all available
- * blocks. Holds the device lock temporarily to sync updating the
- * internal device status. Sets c->idx to enable round robin searching
- * for a free slot.
+ * Opens a chunk on the card given by path. With CBLK_OPN_VIRT_LUN the
+ * chunk is an empty slice of the card, cblk_set_size() gives it room.
+ * With CBLK_GROUP_RAID0, path is a ':' separated list of cards and the
+ * blocks of the chunk are striped over them.
  */
-static struct cblk_req *get_req(struct cblk_dev *c,
-				int use_wait_sem,
-				off_t lba, size_t nblocks,
-				int is_write)
+chunk_id_t cblk_open(const char *path,
+		int max_num_requests __attribute__((unused)),
+		int mode, uint64_t ext_arg __attribute__((unused)),
+		int flags)
 {
-	int i, slot;
-	struct cblk_req *req;
+	int rc;
+	unsigned int i;
+	char *paths = NULL, *p, *save = NULL;
+	struct cblk_dev *c;
+	struct cblk_chunk *ch = NULL;
+	size_t nblocks;
 
-	while (c->status == CBLK_READY) {
-		int rc;
-		struct timespec ts;
+	block_trace("[%s] opening (%s) flags=%x\n", __func__, path, flags);
+
+	if (mode != O_RDWR) {
+		fprintf(stderr, "err: Only O_RDWR file mode is supported in capi stub\n");
+		errno = EINVAL;
+		return (chunk_id_t)(-1);
+	}
+	if ((path == NULL) ||
+	    ((flags & CBLK_OPN_VIRT_LUN) && (flags & CBLK_GROUP_RAID0))) {
+		errno = EINVAL;
+		return (chunk_id_t)(-1);
+	}
+	paths = strdup(path);
+	if (paths == NULL)
+		return (chunk_id_t)(-1);
+
+	pthread_mutex_lock(&cblk_lock);
+
+	for (i = 0; i < ARRAY_SIZE(chunks); i++) {
+		if (!chunks[i].used) {
+			ch = &chunks[i];
+			break;
+		}
+	}
+	if (ch == NULL) {
+		fprintf(stderr, "err: No more than %d chunks supported\n",
+			CBLK_CHUNKS_MAX);
+		errno = ENOSPC;
+		goto out_err0;
+	}
 
-		clock_gettime(CLOCK_REALTIME, &ts);
-		ts.tv_sec += cblk_busytimeout;
-	retry:
-		rc = sem_timedwait(&c->busy_sem, &ts);
-		if (rc == -1) {
-			if (errno == EINTR)
-				goto retry;
-			if (errno == ETIMEDOUT) {
-				fprintf(stderr, "[%s] warn: %s\n",
-					__func__, strerror(errno));
-				//goto retry;
-				return NULL;
-			}
-			fprintf(stderr, "[%s] warn: sem_timedwait returned rc=%d %s\n",
-				__func__, rc, strerror(errno));
+	ch->flags = flags;
+	ch->start = 0;
+	ch->stripe = MAX(cblk_raid0_stripe, 1u);
+	ch->ndevs = 0;
+
+	/* Only RAID0 splits the path into its members */
+	for (p = strtok_r(paths, (flags & CBLK_GROUP_RAID0) ? ":" : "", &save);
+	     p != NULL; p = strtok_r(NULL, ":", &save)) {
+		if (ch->ndevs == CBLK_DEVS_MAX) {
+			errno = EINVAL;
+			goto out_err1;
+		}
+		c = dev_open(p);
+		if (c == NULL)
+			goto out_err1;
+		for (i = 0; i < ch->ndevs; i++)
+			if (ch->dev[i] == c)
+				break;
+		ch->dev[ch->ndevs++] = c;
+		if (i != ch->ndevs - 1) {	/* a member twice */
+			errno = EINVAL;
+			goto out_err1;
 		}
+	}
+	if (ch->ndevs == 0) {
+		errno = EINVAL;
+		goto out_err1;
+	}
 
-		/* Check if device is still healthy after waiting */
-		if (c->status != CBLK_READY) {
-			block_trace("[%s] err: Device not READY, no "
-				"write req LBA=%ld given out!\n",
-				__func__, lba);
-			errno = ENOENT;
-			return NULL;
+	if (flags & CBLK_OPN_VIRT_LUN)
+		nblocks = 0;		/* cblk_set_size() makes room */
+	else {
+		nblocks = ch->dev[0]->nblocks;
+		for (i = 1; i < ch->ndevs; i++)
+			nblocks = MIN(nblocks, ch->dev[i]->nblocks);
+		if (ch->ndevs > 1)
+			nblocks = nblocks / ch->stripe * ch->stripe * ch->ndevs;
+	}
+	ch->nblocks = nblocks;
+
+	if (cblk_chunks_open == 0) {
+		rc = cache_init();
+		if (rc != 0) {
+			errno = rc;
+			goto out_err1;
 		}
+		rc = pp_init(cblk_prefetch, put_offslist, cblk_nblocks, NULL);
+		if (rc != 0) {
+			cache_done();
+			goto out_err1;
+		}
+		rc = wb_start();
+		if (rc != 0) {
+			pp_done();
+			cache_done();
+			errno = rc;
+			goto out_err1;
+		}
+		rc = pp_get_offslist(prefetch_offs, cblk_prefetch, cblk_nblocks);
+		prefetch_n = MIN(MAX(rc, 0), cblk_prefetch);
+	}
+	cblk_chunks_open++;
 
-		pthread_mutex_lock(&c->dev_lock);
+	async_init(ch);
+	ch->used = 1;
+	pthread_mutex_unlock(&cblk_lock);
+	free(paths);
+	return (chunk_id_t)(ch - chunks);
 
-		for (i = 0; i < CBLK_IDX_MAX; i++) {
-			slot = c->idx;			/* try next slot */
+ out_err1:
+	for (i = 0; i < ch->ndevs; i++)
+		dev_close(ch->dev[i]);
+	ch->ndevs = 0;
+ out_err0:
+	pthread_mutex_unlock(&cblk_lock);
+	free(paths);
+	return (chunk_id_t)(-1);
+}
 
-			req = &c->req[slot];
-			if (req->status == CBLK_IDLE) {	/* nice it is free */
-				block_trace("[%s] GIVE OUT WRITE slot %u LBA=%ld\n",
-					__func__, slot, lba);
+int cblk_close(chunk_id_t id, int flags __attribute__((unused)))
+{
+	unsigned int i;
+	struct cblk_chunk *ch = chunk_get(id);
 
-				gettimeofday(&req->stime, NULL);
-				req->use_wait_sem = use_wait_sem;
-				req->lba = lba;
-				req->nblocks = nblocks;
-				req->is_write = is_write;
-				cblk_set_status(req, is_write ? CBLK_WRITING : CBLK_READING);
+	if (ch == NULL)
+		return -1;
 
-				inc_work_in_flight(c);
-				pthread_mutex_unlock(&c->dev_lock);
-				return req;
-			}
-			c->idx = (c->idx + 1) % CBLK_IDX_MAX;	/* pick next idx */
-		}
-		pthread_mutex_unlock(&c->dev_lock);
-		fprintf(stderr, "[%s] warn: No IDLE write req for LBA=%ld found!\n",
-			__func__, lba);
-		cblk_req_dump(c);
+	block_trace("[%s] id=%d\n", __func__, (int)id);
+	async_done(ch);		/* while the devices still complete */
+	if (cache_flush() != 0)
+		fprintf(stderr, "err: write-back of chunk %d failed: %s\n",
+			(int)id, strerror(errno));
+
+	pthread_mutex_lock(&cblk_lock);
+	if (cblk_chunks_open == 1)
+		wb_stop();	/* before the devices go */
+	ch->used = 0;
+	for (i = 0; i < ch->ndevs; i++)
+		dev_close(ch->dev[i]);
+	ch->ndevs = 0;
+	ch->nblocks = 0;
+
+	if (--cblk_chunks_open == 0) {
+		cache_done();
+		pp_done();
 	}
-	errno = EIO;
-	return NULL;
+	pthread_mutex_unlock(&cblk_lock);
+	return 0;
 }
 
-static void put_req(struct cblk_dev *c, struct cblk_req *req)
+int cblk_get_lun_size(chunk_id_t id, size_t *size,
+		      int flags __attribute__((unused)))
 {
-	unsigned int i;
-	time_t usecs;
+	struct cblk_chunk *ch = chunk_get(id);
 
-	pthread_mutex_lock(&c->dev_lock);
-	gettimeofday(&req->etime, NULL);
-	usecs = timediff_usec(&req->etime, &req->stime);
+	if (ch == NULL)
+		return -1;
 
-	if (cblk_is_write(req)) {
-		if (usecs > c->max_write_usecs)
-			c->max_write_usecs = usecs;
-		if ((c->min_write_usecs == 0) || (usecs < c->min_write_usecs))
-			c->min_write_usecs = usecs;
-		c->avg_write_usecs += usecs;
-	} else {
-		if (usecs > c->max_read_usecs)
-			c->max_read_usecs = usecs;
-		if ((c->min_read_usecs == 0) || (usecs < c->min_read_usecs))
-			c->min_read_usecs = usecs;
-		c->avg_read_usecs += usecs;
+	/* The LUN of a virtual one is the whole device */
+	if (size)
+		*size = (ch->flags & CBLK_OPN_VIRT_LUN) ?
+			ch->dev[0]->nblocks : ch->nblocks;
+	block_trace("[%s] lun_size=%zu block of %d bytes ...\n",
+		__func__, size ? *size : 0, __CBLK_BLOCK_SIZE);
+	return 0;
+}
 
-		if (cblk_caching) {
-			for (i = 0; i < ARRAY_SIZE(req->pblock); i++) {
-				cache_unreserve(req->pblock[i], req->lba + i);
-				req->pblock[i] = NULL;
-			}
-		}
-	}
+int cblk_get_size(chunk_id_t id, size_t *size,
+		  int flags __attribute__((unused)))
+{
+	struct cblk_chunk *ch = chunk_get(id);
 
-	if (req->status != CBLK_ERROR)
-		cblk_set_status(req, CBLK_IDLE);
+	if (ch == NULL)
+		return -1;
+	if (size)
+		*size = ch->nblocks;
+	return 0;
+}
 
-	dec_work_in_flight(c);
-	sem_post(&c->busy_sem);
+/*
+ * Virtual LUNs are consecutive slices of their device. With cblk_lock
+ * held: returns 1 if ch can use nblocks from start without overlapping
+ * another slice.
+ */
+static int vlun_fits(struct cblk_chunk *ch, off_t start, size_t nblocks)
+{
+	unsigned int i;
+	struct cblk_chunk *o;
+	struct cblk_dev *c = ch->dev[0];
 
-	/* FIXME Should we do the sem_post(&c->busy_sem); here? */
-	pthread_mutex_unlock(&c->dev_lock);
+	if (start + nblocks > c->nblocks)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(chunks); i++) {
+		o = &chunks[i];
+		if ((o == ch) || !o->used || !(o->flags & CBLK_OPN_VIRT_LUN) ||
+		    (o->dev[0] != c) || (o->nblocks == 0))
+			continue;
+		if ((start < o->start + (off_t)o->nblocks) &&
+		    (o->start < start + (off_t)nblocks))
+			return 0;
+	}
+	return 1;
 }
 
-/**
- * Check action results and kick potential waiting threads.
+/*
+ * A slice can grow only if the blocks behind it are free, its data
+ * does not move. An empty one goes to the first gap large enough.
  */
-static int completion_status(struct cblk_dev *c, int timeout __attribute__((unused)))
+int cblk_set_size(chunk_id_t id, size_t nblocks,
+		  int flags __attribute__((unused)))
 {
-	int rc = ETIME;
-	uint32_t status = 0x0;
-	uint32_t errbits = 0x0;
-	int slot = -1;
-	struct cblk_req *req;
-	time_t usecs;
-	static int count = 0;
+	int rc = 0;
+	unsigned int i;
+	struct cblk_chunk *o, *ch = chunk_get(id);
 
-#ifdef CONFIG_WAIT_FOR_IRQ
-	rc = snap_action_completed(c->act, NULL, timeout);
-	if (rc == 0) {
-		fprintf(stderr, "err: Timeout while Waiting for Idle %d\n", rc);
+	if (ch == NULL)
+		return -1;
+	if (!(ch->flags & CBLK_OPN_VIRT_LUN)) {
+		fprintf(stderr, "err: Cannot change size of physical luns\n");
+		errno = EINVAL;
 		return -1;
 	}
-#endif
 
-	rc = __cblk_read(c, ACTION_STATUS, &status);
-	if (rc != 0) {
-		fprintf(stderr, "err: MMIO32 read ACTION_STATUS %d\n", rc);
-		dev_set_status(c, CBLK_ERROR);
-		return -2;
+	pthread_mutex_lock(&cblk_lock);
+	if ((nblocks <= ch->nblocks) ||
+	    ((ch->nblocks != 0) && vlun_fits(ch, ch->start, nblocks))) {
+		ch->nblocks = nblocks;
+		goto out;
+	}
+	if ((ch->nblocks == 0) && vlun_fits(ch, 0, nblocks)) {
+		ch->start = 0;
+		ch->nblocks = nblocks;
+		goto out;
+	}
+	for (i = 0; (ch->nblocks == 0) && (i < ARRAY_SIZE(chunks)); i++) {
+		o = &chunks[i];
+		if ((o == ch) || !o->used || !(o->flags & CBLK_OPN_VIRT_LUN) ||
+		    (o->dev[0] != ch->dev[0]) || (o->nblocks == 0))
+			continue;
+		if (vlun_fits(ch, o->start + o->nblocks, nblocks)) {
+			ch->start = o->start + o->nblocks;
+			ch->nblocks = nblocks;
+			goto out;
+		}
 	}
+	errno = ENOSPC;
+	rc = -1;
+ out:
+	block_trace("[%s] id=%d start=%ld nblocks=%zu rc=%d\n", __func__,
+		(int)id, (long)ch->start, ch->nblocks, rc);
+	pthread_mutex_unlock(&cblk_lock);
+	return rc;
+}
 
-	if (((status & ACTION_STATUS_ERROR_MASK) != 0x0) && (count++ < 2)) {
-		__cblk_read(c, ACTION_ERROR_BITS, &errbits);
+/* Get a slot and start reading, returns NULL if that failed */
+static struct cblk_req *block_read_start(struct cblk_dev *c, off_t lba,
+					 size_t nblocks)
+{
+	struct cblk_req *req;
+	uint32_t mem_size = __CBLK_BLOCK_SIZE * nblocks;
 
-		block_trace("[%s] warn: ACTION_STATUS=%08x ERROR_MASK not 0 "
-			"ACTION_ERROR_BITS=%08x\n",
-			__func__, status, errbits);
-		/* FIXME */
-		/* dev_set_status(c, CBLK_ERROR);
-		return -4; */
+	req = get_req(c, 1, lba, nblocks, 0);
+	if (req == NULL)
+		return NULL;
+
+	if (c->status != CBLK_READY) {	/* device in fatal error */
+		put_req(c, req);
+		errno = EBADFD;
+		return NULL;
 	}
 
-	if ((status & ACTION_STATUS_COMPLETED) != ACTION_STATUS_COMPLETED) {
-		/* FIXME Very verbose when doing polling */
-		/* block_trace("  NO COMPLETION %02x\n", status); */
-		return -3;
+	req_setup(req, ACTION_CONFIG_COPY_NH,		/* NVMe to Host DDR */
+		(uint64_t)req_cache_setup(c, req),	/* dst */
+		lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* src */
+		mem_size);				/* size */
+	req_start(req, c);
+	return req;
+}
+
+static int block_wait(struct cblk_dev *c, struct cblk_req *req)
+{
+	while ((req->status == CBLK_READING) ||
+	       (req->status == CBLK_WRITING)) {
+		/* block_trace("  [%s] sleeping slot %d status: %s\n",
+			__func__, req->slot, cblk_status_str[req->status]); */
+		sem_wait(&req->wait_sem);
+		/* block_trace("  [%s] continuing slot %d\n",
+			__func__, req->slot); */
 	}
 
-	slot = status & ACTION_STATUS_COMPLETION_MASK;
-	req = &c->req[slot];
+	if ((c->status == CBLK_ERROR) || (req->status == CBLK_ERROR)) {
+		errno = ETIME;
+		return -1;
+	}
+	return 0;
+}
 
-	if (status == ACTION_STATUS_WRITE_COMPLETED) {
-		block_trace("    [%s] HW WRITE_COMPLETED %08x slot: %d LBA=%ld\n",
-			__func__, status, slot, req->lba);
-	} else {
-		block_trace("    [%s] HW READ_COMPLETED %08x slot: %d LBA=%ld\n",
-			__func__, status, slot, req->lba);
+/*
+ * Reads the blocks of a chunk with one request per device. All of
+ * them are started before we wait for the first one.
+ */
+static int chunk_read(struct cblk_chunk *ch, void *buf, off_t lba,
+		size_t nblocks)
+{
+	int rc = nblocks;
+	unsigned int i, n, started;
+	struct cblk_range r[CBLK_DEVS_MAX];
+	struct cblk_req *req[CBLK_DEVS_MAX];
+
+	block_trace("[%s] reading (%p LBA=%zu nblocks=%zu) ...\n",
+		__func__, buf, lba, nblocks);
+
+	if ((lba < 0) || (lba + nblocks > ch->nblocks)) {	/* no valid LBA */
+		fprintf(stderr, "[%s] err: LBA=%ld out of range (max=%ld)!\n",
+			__func__, lba, ch->nblocks);
+		errno = EFAULT;
+		return 0;
+	}
+	if (nblocks > CBLK_NBLOCKS_MAX) {
+		fprintf(stderr, "err: temp buffer too small!\n");
+		errno = EFAULT;
+		return -1;
 	}
 
-	/* statistics: figure out hardware completion time ... */
-	gettimeofday(&req->h_etime, NULL);
-	usecs = timediff_usec(&req->h_etime, &req->h_stime);
-	if (cblk_is_write(req))
-		c->avg_hw_write_usecs += usecs;
+	n = chunk_split(ch, lba, nblocks, r);
+	for (started = 0; started < n; started++) {
+		if (r[started].dev->status != CBLK_READY) {
+			errno = EBADFD;	/* device in fatal error */
+			break;
+		}
+		req[started] = block_read_start(r[started].dev,
+					r[started].lba, r[started].nblocks);
+		if (req[started] == NULL)
+			break;
+	}
+	if (started != n)
+		rc = -1;
 	else
-		c->avg_hw_read_usecs += usecs;
+		__prefetch_blocks(ch, lba, nblocks);
+
+	for (i = 0; i < started; i++) {
+		if (block_wait(r[i].dev, req[i]) != 0) {
+			if (rc > 0)
+				rc = 0;
+		} else if (buf) {	/* NULL: just fill the cache */
+			chunk_copy(ch, lba, nblocks, buf, &r[i],
+				   req_data(req[i]), 1);
+			cache_overlay_dirty(ch, lba, nblocks, buf, &r[i]);
+		}
 
-	return slot;
+		__read_complete(r[i].dev, req[i], 1);	/* mark as used one time */
+	}
+	return rc;
 }
 
 /*
- * We are checking status in struct cblk_req and we saw req->stime to
- * be all 0s during testing. Therefore we try to aquire the c->dev_lock
- * to avoid any possible inconsistencies here.
+ * Blocks which are READING already are not requested again, we sleep
+ * until the request in flight fills them. That way concurrent readers
+ * of the same blocks share one hardware request.
  */
-static int check_req_timeouts(struct cblk_dev *c, long int timeout_sec)
+static int __cache_try_read(struct cblk_chunk *ch,
+			off_t lba, void *buf, void **pin, size_t nblocks,
+			unsigned int timeout_usec)
 {
-	unsigned int i;
-	long int diff_sec = 0;
-	int err = 0;
-	struct timeval etime;
+	int rc;
+	unsigned long usecs;
+	struct timeval s, e;
+	struct timespec deadline;
+	size_t i;
+	size_t from_cache = 0;
+	int prefetch_requested = 0;
 
-	gettimeofday(&etime, NULL);
-	pthread_mutex_lock(&c->dev_lock);
+	gettimeofday(&s, NULL);
+	deadline.tv_sec = s.tv_sec + (s.tv_usec + timeout_usec) / 1000000;
+	deadline.tv_nsec = ((s.tv_usec + timeout_usec) % 1000000) * 1000;
 
-	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
-		struct cblk_req *req = &c->req[i];
+	/* Trying to get data from CACHE if we got all blocks ... */
+	for (i = 0; i < nblocks; i++) {
+		rc = cache_read(chunk_key(ch, lba + i),
+				buf ? buf + i * __CBLK_BLOCK_SIZE : NULL,
+				pin ? &pin[i] : NULL);
+		if (rc == 1) {		/* READING LBA was requested */
+			if (!prefetch_requested) {
+				__prefetch_blocks(ch, lba, nblocks);
+				prefetch_requested = 1;
+			}
+			rc = cache_read_wait(chunk_key(ch, lba + i),
+					buf ? buf + i * __CBLK_BLOCK_SIZE : NULL,
+					pin ? &pin[i] : NULL, &deadline);
+			gettimeofday(&e, NULL);
+			usecs = timediff_usec(&e, &s);
+			if (rc == 0)
+				block_trace("    [%s] got LBA=%ld after %ld usecs\n",
+					__func__, lba + i, usecs);
+			else if (rc == 1)
+				dfprintf(stderr, "[%s] LBA=%ld did not arrive "
+					"n time %ld usecs\n", __func__, lba + i,
+					usecs);
+		}
+		if (rc != 0)		/* Not in cache or too late */
+			goto out;
+		from_cache++;
+	}
 
-		if ((req->status != CBLK_READING) && (req->status != CBLK_WRITING))
-			continue;
+ out:
+	if (!prefetch_requested && (nblocks == from_cache)) {
+		block_trace("    [%s] trigger prefetching for LBA=%ld "
+			"nblocks=%ld from_cache=%ld\n",
+			__func__, lba, nblocks, from_cache);
+		__prefetch_blocks(ch, lba, nblocks);
+		prefetch_requested = 1;
+	}
+	return from_cache;
+}
 
-		diff_sec = timediff_sec(&etime, &req->stime);
-		if (diff_sec > timeout_sec) {
-			err++;
-			
-			fprintf(stderr, "[%s] err: req[%2d]: "
-				"%s %lu/%lu sec LBA=%ld TIMEOUT\n",
-				__func__, i, cblk_status_str[req->status],
-				timeout_sec, diff_sec, req->lba);
+int cblk_read(chunk_id_t id, void *buf, off_t lba, size_t nblocks,
+		int flags __attribute__((unused)))
+{
+	int rc;
+	struct cblk_dev *c;
+	struct cblk_chunk *ch = chunk_get(id);
+	struct timeval start_time, end_time;
+	unsigned long usecs = 0;
 
-			if (req->tries >= cblk_maxretries) {
-				uint32_t errbits;
+	if (ch == NULL)
+		return -1;
 
-				errno = ETIME;
-				cblk_set_status(req, CBLK_ERROR);
-				dev_set_status(c, CBLK_ERROR);
-				__cblk_read(c, ACTION_ERROR_BITS, &errbits);
+	gettimeofday(&start_time, NULL);
 
-				if (errbits != 0)
-					fprintf(stderr, "[%s] err: req[%2d]: "
-						"ACTION_ERROR_BITS=%08x\n",
-						__func__, i, errbits);
+	c = chunk_dev(ch, lba);		/* statistics go there */
+	c->block_reads++;
+	if (nblocks == 1)
+		c->block_reads_4k++;
 
-				if (req->use_wait_sem)
-					sem_post(&req->wait_sem);
-			} else {
-				/* FIXME Helps but is not optimal ... */
-				req->err_total++;
+	if (cblk_caching) {
+		/* Trying to get data from CACHE if we got all blocks ... */
+		rc = __cache_try_read(ch, lba, buf, NULL, nblocks,
+				CONFIG_REQ_DURATION_USEC);
 
-				/* req_start() will use the lock too */
-				pthread_mutex_unlock(&c->dev_lock);
-				req_start(req, c);
-				pthread_mutex_lock(&c->dev_lock);
-			}
+		/* ... we don't need to ask the NVMe hardware */
+		if (rc == (int)nblocks) {
+			block_trace("    [%s] Got %ld..%ld, nice\n", __func__,
+				lba, lba + nblocks - 1);
+
+			c->cache_hits++;
+			if (nblocks == 1)
+				c->cache_hits_4k++;
+			goto out;
 		}
 	}
-	pthread_mutex_unlock(&c->dev_lock);
 
-	return err;
+	/* Else read them all for simplicity at this point in time ... */
+	rc = chunk_read(ch, buf, lba, nblocks);
+out:
+	gettimeofday(&end_time, NULL);
+	usecs = timediff_usec(&end_time, &start_time);
+	pp_add_lba(lba, nblocks, usecs, 1);
+
+	return rc;
 }
 
-static void completion_thread_cleanup(void *arg)
+static void cache_unpin(void **pin, size_t nblocks)
 {
-	struct cblk_dev *c = (struct cblk_dev *)arg;
+	size_t i;
 
-	block_trace("[%s] tid=%d tidy up ...\n", __func__, __gettid());
-	pthread_mutex_unlock(&c->idle_m);
+	for (i = 0; i < nblocks; i++) {
+		if (pin[i] == NULL)
+			continue;
+		cache_buf_put(pin[i]);
+		pin[i] = NULL;
+	}
 }
 
 /**
- * Trigger read prefetch operations starting from lba which should
- * already be in flight. Do not wait for completion via semaphore.
- * Only prefetch if there are read slots free. Use cache reserve
- * and buffers in cache such that completion is just a markup task.
+ * Zero-copy read. Instead of copying the blocks, bufs receives
+ * pointers to the cache buffers holding them. The data does not
+ * change until each block was handed back with cblk_release(), even
+ * if the LBA is written or thrown out of the cache meanwhile. Missing
+ * blocks are read into the cache first.
  */
-static int __prefetch_read_start(struct cblk_dev *c, off_t lba, 
-			unsigned int nblocks)
+int cblk_read_ref(chunk_id_t id, const void *bufs[], off_t lba,
+		size_t nblocks, int flags __attribute__((unused)))
 {
-	struct cblk_req *req;
-	enum cache_block_status status;
-	uint32_t mem_size = nblocks * __CBLK_BLOCK_SIZE;
+	int rc = -1;
+	unsigned int tries;
+	struct cblk_dev *c;
+	struct cblk_chunk *ch = chunk_get(id);
+	struct timeval start_time, end_time;
+	unsigned long usecs = 0;
+	void **pin = (void **)bufs;
 
-	/* Check if we can really prefetch this lba */
-	if ((lba < 0) || (lba >= (off_t)c->nblocks))
+	if (ch == NULL)
+		return -1;
+	if (!cblk_caching || (cache_entries == NULL)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if ((bufs == NULL) || (nblocks == 0) || (nblocks > CBLK_NBLOCKS_MAX)) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* Bound the buffers held by callers, see cache_init() */
+	if (__atomic_add_fetch(&cache_pins, nblocks, __ATOMIC_RELAXED) >
+	    cache_pins_max) {
+		__atomic_sub_fetch(&cache_pins, nblocks, __ATOMIC_RELAXED);
+		errno = ENOBUFS;
 		return -1;
+	}
 
-	/* Check if the block is already in cache or requested */
-	status = cache_info(lba);
-	if ((status == CACHE_BLOCK_VALID) || (status == CACHE_BLOCK_READING)) {
-		block_trace("[%s] skip prefetch LBA=%lu %d KiB status=%s\n",
-			__func__, lba, mem_size/1024, block_status_str[status]);
-		c->prefetch_collisions++;
-		return -2;
+	gettimeofday(&start_time, NULL);
+
+	c = chunk_dev(ch, lba);
+	c->block_reads++;
+	if (nblocks == 1)
+		c->block_reads_4k++;
+
+	memset(pin, 0, nblocks * sizeof(*pin));
+	for (tries = 0; ; tries++) {
+		rc = __cache_try_read(ch, lba, NULL, pin, nblocks,
+				CONFIG_REQ_DURATION_USEC);
+		if (rc == (int)nblocks)
+			break;
+		cache_unpin(pin, nblocks);
+
+		if (tries == CACHE_READ_RETRIES) {
+			errno = EAGAIN;	/* kept being thrown out */
+			rc = -1;
+			break;
+		}
+		/* Read them all into the cache and try again */
+		rc = chunk_read(ch, NULL, lba, nblocks);
+		if (rc != (int)nblocks) {
+			rc = -1;
+			break;
+		}
+	}
+	if (rc < 0) {
+		__atomic_sub_fetch(&cache_pins, nblocks, __ATOMIC_RELAXED);
+		goto out;
 	}
 
-	block_trace("[%s] do prefetch LBA=%lu %d KiB status=%s\n",
-		__func__, lba, mem_size/1024, block_status_str[status]);
+	if (tries == 0) {
+		block_trace("    [%s] Got %ld..%ld, nice\n", __func__,
+			lba, lba + nblocks - 1);
+		c->cache_hits++;
+		if (nblocks == 1)
+			c->cache_hits_4k++;
+	}
+out:
+	gettimeofday(&end_time, NULL);
+	usecs = timediff_usec(&end_time, &start_time);
+	pp_add_lba(lba, nblocks, usecs, 1);
 
-	/*
-	 * Get a free read slot, we can read CBLK_NBLOCKS_MAX blocks,
-	 * pysically request the block.
-	 */
-	req = get_req(c, 0, lba, nblocks, 0);
-	if (req == NULL)
-		return -2;
+	return rc;
+}
 
-	c->prefetches++;
-	req_setup(req, ACTION_CONFIG_COPY_NH,		/* NVMe to Host DDR */
-		(uint64_t)req->buf,			/* dst */
-		lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* src */
-		mem_size);				/* size */
-	req_start(req, c);
+int cblk_release(chunk_id_t id __attribute__((unused)),
+		const void *buf, int flags __attribute__((unused)))
+{
+	if (!cache_buf_valid(buf) ||
+	    (__atomic_load_n(&cache_buf_of(buf)->refs, __ATOMIC_RELAXED) == 0)) {
+		errno = EINVAL;
+		return -1;
+	}
 
+	cache_buf_put((void *)buf);
+	__atomic_sub_fetch(&cache_pins, 1, __ATOMIC_RELAXED);
 	return 0;
 }
 
-static int __prefetch_blocks(struct cblk_dev *c, off_t lba, unsigned int nblocks)
+static int chunk_write(struct cblk_chunk *ch, void *buf, off_t lba,
+		size_t nblocks)
 {
-	int rc = 0;
-	unsigned int k, n = 0;
+	unsigned int i, n, started;
+	struct cblk_dev *c;
+	struct cblk_range r[CBLK_DEVS_MAX];
+	struct cblk_req *req[CBLK_DEVS_MAX];
 
-	if (!cblk_prefetch)
-		return -1;
+	block_trace("[%s] writing (%p LBA=%zu nblocks=%zu) ...\n",
+		__func__, buf, lba, nblocks);
+
+	if ((lba < 0) || (lba + nblocks > ch->nblocks)) {	/* no valid LBA */
+		fprintf(stderr, "[%s] err: LBA=%ld out of range (max=%ld)!\n",
+			__func__, lba, ch->nblocks);
+		errno = EFAULT;
+		return 0;
+	}
+	if (nblocks > CBLK_NBLOCKS_WRITE_MAX) {
+		fprintf(stderr, "err: at most %u blocks per request!\n",
+			CBLK_NBLOCKS_WRITE_MAX);
+		errno = EFAULT;
+		return 0;
+	}
 
-	/* pp_get_offslist(c->prefetch_offs, cblk_prefetch, nblocks); */
+	n = chunk_split(ch, lba, nblocks, r);
+	for (started = 0; started < n; started++) {
+		c = r[started].dev;
+		if (c->status != CBLK_READY) {	/* device in fatal error */
+			errno = EBADFD;
+			break;
+		}
+		req[started] = get_req(c, 1, r[started].lba,
+				       r[started].nblocks, 1);
+		if (req[started] == NULL)
+			break;
 
-	for (k = 0; (k < (unsigned int)cblk_prefetch); k++) {
-		if (work_in_flight(c) >= CBLK_PREFETCH_THRESHOLD)
-			continue;
+		chunk_copy(ch, lba, nblocks, buf, &r[started],
+			   req[started]->buf, 0);
+		req_setup(req[started], ACTION_CONFIG_COPY_HN,	/* Host DDR to NVMe */
+			r[started].lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE, /* dst */
+			(uint64_t)req[started]->buf,		/* src */
+			r[started].nblocks * __CBLK_BLOCK_SIZE);	/* size */
+		req_start(req[started], c);
+	}
+	if (started != n)
+		nblocks = 0;
 
-		block_trace("[%s] LBA=%ld+(%d)\n",
-			__func__, lba, c->prefetch_offs[k]);
-		rc = __prefetch_read_start(c, lba + c->prefetch_offs[k],
-					nblocks);
-		if (rc >= 0)
-			n++;
+	for (i = 0; i < started; i++) {
+		c = r[i].dev;
+		if (block_wait(c, req[i]) != 0)
+			nblocks = 0;
+		put_req(c, req[i]);
 	}
+	/* block_trace("[%s] exit LBA=%zu nblocks=%zu\n", __func__, lba, nblocks); */
+	return nblocks;
+}
 
-	return n;
+/*
+ * Write-back
+ *
+ * With CBLK_WRITEBACK set, writes only go into the cache, marked
+ * dirty. Dirty blocks are not replaced. A background thread writes
+ * them every cblk_writeback_usec, or earlier once half of the cache
+ * is dirty: it sorts their keys, such that consecutive blocks of a
+ * device become one request of up to CBLK_NBLOCKS_WRITE_MAX blocks.
+ * A block stays dirty if it was written again while it was flushed.
+ * cblk_flush() and cblk_close() flush synchronously. wb_lock keeps
+ * flushes, and the writes which bypass the cache, in order.
+ */
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wb_m = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_c = PTHREAD_COND_INITIALIZER;
+static pthread_t wb_tid;
+static int wb_running = 0;
+static int wb_kicked = 0;
+static int wb_stopping = 0;
+
+static int key_cmp(const void *a, const void *b)
+{
+	off_t x = *(const off_t *)a, y = *(const off_t *)b;
+
+	return (x > y) - (x < y);
 }
 
-static int __read_complete(struct cblk_dev *c,
-				struct cblk_req *req, int _used)
+/* Write keys[0..n-1], consecutive blocks of one device */
+static int wb_write_run(const off_t *keys, unsigned int n)
 {
-	unsigned int i;
+	unsigned int i, wgen[CBLK_NBLOCKS_WRITE_MAX];
+	off_t lba = keys[0] & ((1ull << CBLK_DEV_SHIFT) - 1);
+	struct cblk_dev *c = &devs[keys[0] >> CBLK_DEV_SHIFT];
+	struct cblk_req *req;
 
-	if ((c->status == CBLK_ERROR) || (req->status == CBLK_ERROR)) {
-		errno = ETIME;
-		put_req(c, req);
+	if ((c->users == 0) || (c->status != CBLK_READY)) {
+		errno = EBADFD;
 		return -1;
 	}
+	req = get_req(c, 1, lba, n, 1);
+	if (req == NULL)
+		return -1;
 
-	if (cblk_caching) {
-		/* ... push blocks to cache for later use */
-		for (i = 0; i < req->nblocks; i++) {
-			cache_write_reserved(&req->pblock[i], req->lba + i,
-					req->buf + i * __CBLK_BLOCK_SIZE,
-					_used);
-		}
+	/* A block which is not in the cache anymore ends the run */
+	for (i = 0; i < n; i++)
+		if (cache_copy_dirty(keys[i], req->buf + i * __CBLK_BLOCK_SIZE,
+				     &wgen[i]) != 0)
+			break;
+	n = i;
+	if (n == 0) {
+		put_req(c, req);
+		return 0;
 	}
 
+	req->nblocks = n;
+	req_setup(req, ACTION_CONFIG_COPY_HN,		/* Host DDR to NVMe */
+		lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* dst */
+		(uint64_t)req->buf,			/* src */
+		n * __CBLK_BLOCK_SIZE);			/* size */
+	req_start(req, c);
+	if (block_wait(c, req) != 0) {
+		put_req(c, req);
+		return -1;
+	}
 	put_req(c, req);
+
+	for (i = 0; i < n; i++)
+		cache_clean(keys[i], wgen[i]);
+	__atomic_fetch_add(&cache_flushed, n, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&cache_flushes, 1, __ATOMIC_RELAXED);
 	return 0;
 }
 
-/**
- * Try to ping process to a specific CPU. Returns the CPU we are
- * currently running on.
- */
-static inline int __pin_cpu(void)
+/* Write all blocks which are dirty now to their devices */
+static int cache_flush(void)
 {
-	cpu_set_t *cpusetp;
-	size_t size;
-	int num_cpus, run_cpu = sched_getcpu();
-
-	num_cpus = CPU_SETSIZE; /* take default, currently 1024 */
-	cpusetp = CPU_ALLOC(num_cpus);
-	if (cpusetp == NULL)
-		return -1;
+	int rc = 0, err = 0;
+	unsigned int i, j, n = 0, nways;
+	struct cache_way *e;
 
-	size = CPU_ALLOC_SIZE(num_cpus);
-	CPU_ZERO_S(size, cpusetp);
-	CPU_SET_S(run_cpu, size, cpusetp);
+	if (!cblk_writeback || (cache_wb_keys == NULL))
+		return 0;
 
-	if (sched_setaffinity(0, size, cpusetp) < 0) {
-		CPU_FREE(cpusetp);
-		return -2;
+	pthread_mutex_lock(&wb_lock);
+	nways = cache_sets * cache_ways;
+	for (i = 0; i < nways; i++) {
+		e = &cache_way_tab[i];
+		if ((__atomic_load_n(&e->status, __ATOMIC_RELAXED) ==
+		     CACHE_BLOCK_VALID) &&
+		    __atomic_load_n(&e->dirty, __ATOMIC_RELAXED))
+			cache_wb_keys[n++] = __atomic_load_n(&e->lba,
+							     __ATOMIC_RELAXED);
+	}
+	qsort(cache_wb_keys, n, sizeof(*cache_wb_keys), key_cmp);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; (j < n) && (j - i < CBLK_NBLOCKS_WRITE_MAX) &&
+			     (cache_wb_keys[j] == cache_wb_keys[j - 1] + 1); j++)
+			;
+		if (wb_write_run(&cache_wb_keys[i], j - i) != 0) {
+			err = errno;
+			rc = -1;
+		}
 	}
+	pthread_mutex_unlock(&wb_lock);
 
-	CPU_FREE(cpusetp);
-	return run_cpu;
+	block_trace("[%s] %u dirty blocks rc=%d\n", __func__, n, rc);
+	if (rc != 0)
+		errno = err ? err : EIO;
+	return rc;
 }
 
-/**
- * This thread contains performane critical code which is supposed
- * to identify request/slot completion and inform  the waiting threads
- * as quick as possible. Rescheduling or any other delay will have
- * direct influence on performance.
- */
-static void *completion_thread(void *arg)
+static void wb_kick(void)
 {
-	static unsigned long no_result_counter = 0;
-	struct cblk_dev *c = (struct cblk_dev *)arg;
+	pthread_mutex_lock(&wb_m);
+	wb_kicked = 1;
+	pthread_cond_signal(&wb_c);
+	pthread_mutex_unlock(&wb_m);
+}
 
-	block_trace("[%s] arg=%p enter\n", __func__, arg);
-	pthread_cleanup_push(completion_thread_cleanup, c);
+static void *wb_thread(void *arg __attribute__((unused)))
+{
+	struct timeval now;
+	struct timespec ts;
+	unsigned long long usec;
 
+	block_trace("[%s] enter\n", __func__);
 	while (1) {
-		int slot;
-		struct timeval now;
-		struct timespec timeout;
-
-		pthread_mutex_lock(&c->idle_m);
-		while (c->work_in_flight == 0) {
-			/* 5 sec delay should be noticable ... */
+		pthread_mutex_lock(&wb_m);
+		if (!wb_kicked && !wb_stopping) {
 			gettimeofday(&now, NULL);
-			timeout.tv_sec = now.tv_sec + 5;
-			timeout.tv_nsec = now.tv_usec;
+			usec = now.tv_usec + cblk_writeback_usec;
+			ts.tv_sec = now.tv_sec + usec / 1000000;
+			ts.tv_nsec = (usec % 1000000) * 1000;
+			pthread_cond_timedwait(&wb_c, &wb_m, &ts);
+		}
+		wb_kicked = 0;
+		if (wb_stopping) {
+			pthread_mutex_unlock(&wb_m);
+			break;
+		}
+		pthread_mutex_unlock(&wb_m);
 
-			/* int rc =  */
-			pthread_cond_timedwait(&c->idle_c, &c->idle_m, &timeout);
-			/* if (rc == ETIMEDOUT)
-				fprintf(stderr, "[%s] info: timedwait returned ETIMEDOUT\n",
-					__func__); */
+		if (__atomic_load_n(&cache_ndirty, __ATOMIC_RELAXED))
+			cache_flush();
+	}
+	return NULL;
+}
 
-			c->idle_wakeups++;
-		}
-		pthread_mutex_unlock(&c->idle_m);
+/* Called with cblk_lock held */
+static int wb_start(void)
+{
+	int rc;
 
-		slot = completion_status(c, c->timeout);
-		if ((slot >= 0) && (slot < CBLK_IDX_MAX)) {
-			struct cblk_req *req = &c->req[slot];
-			if ((req->status == CBLK_READING) ||
-			    (req->status == CBLK_WRITING)) {
-				block_trace("  [%s] waking up slot %d LBA=%ld\n",
-					__func__, slot, req->lba);
+	if (!cblk_writeback || wb_running)
+		return 0;
 
-				cblk_set_status(req, CBLK_READY);
-				if (req->use_wait_sem) {
-					sem_post(&req->wait_sem);
-				} else {
-					__read_complete(c, req, 0);
-				}
-			} else {
-				block_trace("  [%s] err: slot %d status is %s "
-					"ILLEGAL STATUS (%lu) LBA=%ld\n", __func__,
-					slot, cblk_status_str[req->status],
-					no_result_counter,
-					req->lba);
-			}
-		} else no_result_counter++;
+	wb_stopping = 0;
+	rc = pthread_create(&wb_tid, NULL, &wb_thread, NULL);
+	if (rc != 0)
+		return rc;
+	wb_running = 1;
+	return 0;
+}
 
-		check_req_timeouts(c, cblk_reqtimeout); /* sec */
-		pthread_testcancel();	/* go home if requested */
-	}
+/* Called with cblk_lock held, not canceled since it might be flushing */
+static void wb_stop(void)
+{
+	if (!wb_running)
+		return;
 
-	pthread_cleanup_pop(1);
-	return NULL;
+	pthread_mutex_lock(&wb_m);
+	wb_stopping = 1;
+	pthread_cond_signal(&wb_c);
+	pthread_mutex_unlock(&wb_m);
+	pthread_join(wb_tid, NULL);
+	wb_running = 0;
 }
 
-static int put_offslist(void *put_data, int *offslist, unsigned int n,
-			size_t nblocks __attribute__((unused)))
+/*
+ * Put the blocks into the cache as dirty ones. If a set is full of
+ * dirty blocks, flush and try again, else write the block through.
+ * Returns the number of blocks written.
+ */
+static size_t wb_write(struct cblk_chunk *ch, const uint8_t *buf,
+		       off_t lba, size_t nblocks)
 {
-	struct cblk_dev *c = (struct cblk_dev *)put_data;
+	size_t i;
+	off_t key;
+	const uint8_t *data;
 
-	if (offslist == NULL) {
-		block_trace("[%s] warn: no offset list provided!\n", __func__);
-		return -1;
+	for (i = 0; i < nblocks; i++) {
+		key = chunk_key(ch, lba + i);
+		data = buf + i * __CBLK_BLOCK_SIZE;
+		if (cache_write(key, data, 0, 1) == 0)
+			continue;
+
+		cache_flush();
+		if (cache_write(key, data, 0, 1) == 0)
+			continue;
+
+		pthread_mutex_lock(&wb_lock);	/* not behind older data */
+		if (chunk_write(ch, (void *)data, lba + i, 1) != 1) {
+			pthread_mutex_unlock(&wb_lock);
+			break;
+		}
+		pthread_mutex_unlock(&wb_lock);
 	}
 
-	pthread_mutex_lock(&c->dev_lock);
-	memcpy(c->prefetch_offs, offslist, n * sizeof(int));
-	pthread_mutex_unlock(&c->dev_lock);
-	return 0;
+	if (__atomic_load_n(&cache_ndirty, __ATOMIC_RELAXED) >
+	    cache_sets * cache_ways / 2)
+		wb_kick();
+	return i;
 }
 
-chunk_id_t cblk_open(const char *path,
-		int max_num_requests __attribute__((unused)),
-		int mode, uint64_t ext_arg __attribute__((unused)),
-		int flags)
+/**
+ * Writes without write-back go to the device first, in requests of
+ * up to CBLK_NBLOCKS_WRITE_MAX blocks, and then into the cache.
+ */
+int cblk_write(chunk_id_t id, void *buf, off_t lba, size_t nblocks,
+		int flags __attribute__((unused)))
 {
 	int rc;
-	unsigned int i, j;
-	int timeout = ACTION_WAIT_TIME;
-	unsigned long have_nvme = 0;
-	snap_action_flag_t attach_flags = 0;
-	struct cblk_dev *c = &chunk;
-
-	block_trace("[%s] opening (%s)\n", __func__, path);
+	size_t i, n, done;
+	struct cblk_dev *c;
+	struct cblk_chunk *ch = chunk_get(id);
+	struct timeval start_time, end_time;
+	time_t usecs;
 
-	pthread_mutex_lock(&c->dev_lock);
+	if (ch == NULL)
+		return -1;
 
-#ifdef CONFIG_WAIT_FOR_IRQ
-	attach_flags |= (SNAP_ACTION_DONE_IRQ | SNAP_ATTACH_IRQ);
-#endif
-	if (flags & CBLK_OPN_VIRT_LUN) {
-		fprintf(stderr, "err: Virtual luns not supported in capi stub\n");
-		goto out_err0;
-	}
+	gettimeofday(&start_time, NULL);
 
-	if (mode != O_RDWR) {
-		fprintf(stderr, "err: Only O_RDWR file mode is supported in capi stub\n");
-		goto out_err0;
-	}
+	c = chunk_dev(ch, lba);
+	c->block_writes++;
+	if (nblocks == 1)
+		c->block_writes_4k++;
 
-	if (c->card != NULL) { /* already initialized */
-		pthread_mutex_unlock(&c->dev_lock);
+	if ((lba < 0) || ((size_t)lba + nblocks > ch->nblocks)) {
+		fprintf(stderr, "[%s] err: LBA=%ld out of range (max=%ld)!\n",
+			__func__, lba, ch->nblocks);
+		errno = EFAULT;
 		return 0;
 	}
 
-	/* path must match the following scheme: "/dev/cxl/afu%d.0m" */
-	c->card = snap_card_alloc_dev(path, SNAP_VENDOR_ID_IBM,
-					 SNAP_DEVICE_ID_SNAP);
-	if (NULL == c->card) {
-		fprintf(stderr, "err: Cannot open SNAP device %s\n", path);
-		goto out_err0;
+	if (cblk_writeback) {
+		done = wb_write(ch, buf, lba, nblocks);
+		goto out;
 	}
 
-	/* Check if i do have NVME on this card */
-	snap_card_ioctl(c->card, GET_NVME_ENABLED, (unsigned long)&have_nvme);
-	if (0 == have_nvme) {
-		fprintf(stderr, "err: SNAP NVMe is not enabled on card %s!\n",
-			path);
-		goto out_err1;
+	for (done = 0; done < nblocks; done += n) {
+		n = MIN(nblocks - done, (size_t)CBLK_NBLOCKS_WRITE_MAX);
+		if (chunk_write(ch, buf + done * __CBLK_BLOCK_SIZE,
+				lba + done, n) != (int)n)
+			break;
 	}
 
-	c->act = snap_attach_action(c->card, ACTION_TYPE_NVME_EXAMPLE,
-					attach_flags, timeout);
-	if (NULL == c->act) {
-		fprintf(stderr, "err: Cannot Attach Action: %x\n",
-			ACTION_TYPE_NVME_EXAMPLE);
-		goto out_err1;
+	if (cblk_caching) {
+		for (i = 0; i < done; i++) {
+			rc = cache_write(chunk_key(ch, lba + i),
+					buf + i * __CBLK_BLOCK_SIZE, 0, 0);
+			if (rc != 0) {
+				dfprintf(stderr, "err: cache_write LBA=%ld "
+					"failed rc=%d!\n", (long int)lba, rc);
+				return 0;
+			}
+		}
 	}
+ out:
+	gettimeofday(&end_time, NULL);
+	usecs = timediff_usec(&end_time, &start_time);
+	pp_add_lba(lba, done, usecs, 0);
 
-	c->buf = snap_malloc(CBLK_IDX_MAX * __CBLK_BLOCK_SIZE * CBLK_NBLOCKS_MAX);
-	if (c->buf == NULL) {
-		fprintf(stderr, "err: Cannot alloc temporary buffer\n");
-		goto out_err2;
-	}
+	return done;
+}
 
-	c->status = CBLK_READY;
-	c->req_status = CBLK_IDLE;
-	c->drive = 0;
-	c->nblocks = SNAP_N250S_NVME_SIZE / __CBLK_BLOCK_SIZE;
-	c->timeout = timeout;
-	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++)
-		c->done_tid[i] = 0;
-	c->idx = 0;
-	c->status_read_count = 0;
-	c->cache_hits = 0;
-	c->cache_hits_4k = 0;
-	c->prefetch_collisions = 0;
-	c->hw_block_reads = 0;
-	c->hw_block_writes = 0;
-	c->block_reads = 0;
-	c->block_writes = 0;
-	c->block_reads_4k = 0;
-	c->block_writes_4k = 0;
-	c->max_read_usecs = 0;
-	c->max_write_usecs = 0;
-	c->avg_read_usecs = 0;
-	c->avg_write_usecs = 0;
-	c->min_read_usecs = 0;
-	c->min_write_usecs = 0;
-	c->avg_hw_read_usecs = 0;
-	c->avg_hw_write_usecs = 0;
-	c->wbytes_total = 0;
-	c->rbytes_total = 0;
-	c->idle_wakeups = 0;
-
-	c->wtime_total.tv_sec = 0;
-	c->wtime_total.tv_usec = 0;
-	c->rtime_total.tv_sec = 0;
-	c->rtime_total.tv_usec = 0;
-	gettimeofday(&c->start_time, NULL);
+/**
+ * Write-back: returns once the blocks written before are on the
+ * devices. Flushes the blocks of all chunks.
+ */
+int cblk_flush(chunk_id_t id, int flags __attribute__((unused)))
+{
+	if (chunk_get(id) == NULL)
+		return -1;
+	return cache_flush();
+}
 
-	sem_init(&c->busy_sem, 0, CBLK_IDX_MAX);
-	pthread_mutex_init(&c->idle_m, NULL);
-	pthread_cond_init(&c->idle_c, NULL);
+/*
+ * Asynchronous requests
+ *
+ * cblk_aread() and cblk_awrite() take a tag of the chunk and queue
+ * one part per device the blocks are on. Queued parts get a request
+ * slot of their device as soon as one is free, either right away or
+ * when put_req() hands back a slot. The completion thread finishes
+ * them, i.e. copies read data to the caller and fills the cache like
+ * the synchronous calls do. Once all parts are done, the tag waits on
+ * a list for cblk_aresult(), unless the caller asked for its status to
+ * be posted (CBLK_ARW_USER_STATUS_FLAG); those are freed right away.
+ * Priority requests from cblk_listio() are queued in front of the
+ * others.
+ */
+static void async_init(struct cblk_chunk *ch)
+{
+	unsigned int i;
 
-	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
-		struct cblk_req *req = &c->req[i];
+	pthread_mutex_init(&ch->async_lock, NULL);
+	pthread_cond_init(&ch->async_c, NULL);
+	memset(ch->atag, 0, sizeof(ch->atag));
+	ch->atag_free = NULL;
+	for (i = ARRAY_SIZE(ch->atag); i > 0; i--) {
+		ch->atag[i - 1].next = ch->atag_free;
+		ch->atag_free = &ch->atag[i - 1];
+	}
+	ch->adone_head = ch->adone_tail = NULL;
+	ch->aresults = 0;
+	ch->ainflight = 0;
+}
 
-		req->slot = i;
-		req->lba = 0;
-		req->nblocks = 0;
-		req->buf = c->buf + i * CBLK_NBLOCKS_MAX * __CBLK_BLOCK_SIZE;
-		req->action = 0;
-		req->dst = 0;
-		req->src = 0;
-		req->size = 0;
-		req->tries = 0;
-		req->err_total = 0;
-		cblk_set_status(req, CBLK_IDLE);
-		sem_init(&req->wait_sem, 0, 0);
+/* With async_lock held */
+static struct cblk_atag *atag_find(struct cblk_chunk *ch, int tag,
+				   int user_tag)
+{
+	unsigned int i;
+	struct cblk_atag *at;
 
-		for (j = 0; j < ARRAY_SIZE(req->pblock); j++) {
-			req->pblock[j] = NULL;
-		}
+	if (!user_tag) {
+		if ((tag < 0) || (tag >= (int)ARRAY_SIZE(ch->atag)))
+			return NULL;
+		at = &ch->atag[tag];
+		return ((at->state == CBLK_ATAG_FREE) || at->user_tag) ?
+			NULL : at;
 	}
 
-	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++) {
-		rc = pthread_create(&c->done_tid[i], NULL,
-				&completion_thread, &chunk);
-		if (rc != 0)
-			goto out_err3;
+	for (i = 0; i < ARRAY_SIZE(ch->atag); i++) {
+		at = &ch->atag[i];
+		if ((at->state != CBLK_ATAG_FREE) && at->user_tag &&
+		    (at->tag == tag))
+			return at;
 	}
+	return NULL;
+}
 
-	rc = cache_init();
-	if (rc != 0)
-		goto out_err4;
-
-	rc = pp_init(cblk_prefetch, put_offslist, cblk_nblocks, c);
-	if (rc != 0)
-		goto out_err5;
-
-	pp_get_offslist(c->prefetch_offs, cblk_prefetch, cblk_nblocks);
-
-	pthread_mutex_unlock(&c->dev_lock);
-	return 0;
-
- out_err5:
-	cache_done();
- out_err4:
-	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++) {
-		if (c->done_tid[i] == 0)
-			continue;
-		pthread_cancel(c->done_tid[i]);
-		pthread_join(c->done_tid[i], NULL);
-		c->done_tid[i] = 0;
-	}
- out_err3:
-	__free(c->buf);
-	c->buf = NULL;
- out_err2:
-	snap_detach_action(c->act);
-	c->act = NULL;
- out_err1:
-	snap_card_free(c->card);
-	c->card = NULL;
- out_err0:
- 	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
-		c->req[i].status = CBLK_IDLE;
-		sem_destroy(&c->req[i].wait_sem);
-	}
-	pthread_mutex_unlock(&c->dev_lock);
-	return (chunk_id_t)(-1);
+/* With async_lock held */
+static void atag_put(struct cblk_chunk *ch, struct cblk_atag *at)
+{
+	at->state = CBLK_ATAG_FREE;
+	at->next = ch->atag_free;
+	ch->atag_free = at;
+	pthread_cond_broadcast(&ch->async_c);
 }
 
-int cblk_close(chunk_id_t id __attribute__((unused)),
-		int flags __attribute__((unused)))
+/* With async_lock held */
+static void __async_finish(struct cblk_chunk *ch, struct cblk_atag *at,
+			   int rc, int err)
 {
-	int rc;
-	unsigned int i;
-	struct cblk_dev *c = &chunk;
-	struct timeval etime;
+	at->rc = rc;
+	at->err = err;
+
+	if (at->status) {
+		at->status->blocks_transferred = (rc > 0) ? rc : 0;
+		at->status->fail_errno = err;
+		/* Last, callers may poll it without lock */
+		__atomic_store_n(&at->status->status, (rc < 0) ?
+				 CBLK_ARW_STATUS_FAIL : CBLK_ARW_STATUS_SUCCESS,
+				 __ATOMIC_RELEASE);
+	}
 
-	if (c->card == NULL) {
-		errno = EINVAL;
-		return -1;
+	if (at->flags & CBLK_ARW_USER_STATUS_FLAG) {
+		atag_put(ch, at);	/* nobody will ask for it */
+		return;
 	}
 
-	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++) {
-		if (c->done_tid[i] == 0)
-			continue;
-		rc = pthread_cancel(c->done_tid[i]);
-		if (rc != 0)
-			fprintf(stderr, "  [%s] canceling tid %u rc=%d\n",
-				__func__, (unsigned int)c->done_tid[i], rc);
-		
-		rc = pthread_join(c->done_tid[i], NULL);
-		if (rc != 0)
-			fprintf(stderr, "  [%s] joining tid %u rc=%d\n",
-				__func__, (unsigned int)c->done_tid[i], rc);
+	at->state = CBLK_ATAG_DONE;
+	at->next = NULL;
+	if (ch->adone_tail)
+		ch->adone_tail->next = at;
+	else
+		ch->adone_head = at;
+	ch->adone_tail = at;
+	pthread_cond_broadcast(&ch->async_c);
+}
 
-		c->done_tid[i] = 0;
+/*
+ * One part of at is done, the last one finishes the tag. inflight is
+ * set if the part had a request slot.
+ */
+static void async_piece_done(struct cblk_atag *at, int err, int inflight)
+{
+	int rc, is_write;
+	off_t lba = at->lba;
+	size_t nblocks = at->nblocks;
+	struct timeval etime, stime = at->stime;
+	struct cblk_chunk *ch = at->ch;
+
+	pthread_mutex_lock(&ch->async_lock);
+	if (inflight) {
+		__atomic_sub_fetch(&ch->ainflight, 1, __ATOMIC_RELAXED);
+		pthread_cond_broadcast(&ch->async_c);
 	}
+	if (err)
+		at->err = err;
+	if (--at->pieces != 0) {
+		pthread_mutex_unlock(&ch->async_lock);
+		return;
+	}
+	is_write = at->is_write;
+	rc = at->err ? -1 : (int)at->nblocks;
+	__async_finish(ch, at, rc, at->err);	/* at may be reused now */
+	pthread_mutex_unlock(&ch->async_lock);
 
 	gettimeofday(&etime, NULL);
-	block_trace("[%s] id=%d req_status=%s work_in_flight=%d "
-		"now: %lu sec %lu usec ...\n",
-		__func__, (int)id, cblk_status_str[c->req_status],
-		work_in_flight(c),
-		(long)etime.tv_sec, (long)etime.tv_usec);
+	pp_add_lba(lba, nblocks, timediff_usec(&etime, &stime), !is_write);
+}
 
-	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
-		/* c->req[i].status = CBLK_IDLE; */
-		sem_destroy(&c->req[i].wait_sem);
+static void async_start(struct cblk_dev *c, struct cblk_req *req,
+			struct cblk_apiece *p)
+{
+	struct cblk_atag *at = p->at;
+	struct cblk_range r = { .dev = c, .lba = p->lba, .nblocks = p->nblocks };
+	uint32_t mem_size = __CBLK_BLOCK_SIZE * p->nblocks;
+
+	req->apiece = p;
+	if (at->is_write) {
+		chunk_copy(at->ch, at->lba, at->nblocks, at->buf, &r,
+			   req->buf, 0);
+		req_setup(req, ACTION_CONFIG_COPY_HN,		/* Host DDR to NVMe */
+			p->lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* dst */
+			(uint64_t)req->buf,			/* src */
+			mem_size);				/* size */
+	} else {
+		req_setup(req, ACTION_CONFIG_COPY_NH,		/* NVMe to Host DDR */
+			(uint64_t)req_cache_setup(c, req),	/* dst */
+			p->lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* src */
+			mem_size);				/* size */
 	}
+	req_start(req, c);
+}
 
-        pthread_cond_destroy(&c->idle_c);
-	snap_detach_action(c->act);
-	snap_card_free(c->card);
-	__free(c->buf);
+/* Give free request slots of c to queued parts */
+static void async_dispatch(struct cblk_dev *c)
+{
+	struct cblk_apiece *p;
+	struct cblk_req *req;
 
-	c->act = NULL;
-	c->card = NULL;
-	c->nblocks = 0;
-	c->timeout = 0;
-	c->drive = -1;
+	while (1) {
+		pthread_mutex_lock(&c->aq_lock);
+		p = c->aq_head;
+		if (p == NULL) {
+			pthread_mutex_unlock(&c->aq_lock);
+			return;
+		}
+		req = get_req_nowait(c, p->lba, p->nblocks, p->at->is_write);
+		if (req == NULL) {	/* put_req() will call us again */
+			pthread_mutex_unlock(&c->aq_lock);
+			return;
+		}
 
-	cache_done();
-	pp_done();
-	return 0;
+		c->aq_head = p->next;
+		if (c->aq_head == NULL)
+			c->aq_tail = NULL;
+		if (c->aq_prio == p)
+			c->aq_prio = NULL;
+		p->at->state = CBLK_ATAG_ISSUED;
+		__atomic_fetch_add(&p->at->ch->ainflight, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&c->aq_lock);
+
+		async_start(c, req, p);
+	}
 }
 
-int cblk_get_lun_size(chunk_id_t id __attribute__((unused)),
-		      size_t *size, int flags __attribute__((unused)))
+static void async_enqueue(struct cblk_dev *c, struct cblk_apiece *p,
+			  int prio)
 {
-	struct cblk_dev *c = &chunk;
-
-	block_trace("[%s] lun_size=%zu block of %d bytes ...\n",
-		__func__, c->nblocks, __CBLK_BLOCK_SIZE);
-	if (size)
-		*size = c->nblocks;
-	return 0;
+	pthread_mutex_lock(&c->aq_lock);
+	p->next = NULL;
+	if (prio) {			/* behind the other priority ones */
+		if (c->aq_prio) {
+			p->next = c->aq_prio->next;
+			c->aq_prio->next = p;
+		} else {
+			p->next = c->aq_head;
+			c->aq_head = p;
+		}
+		if (p->next == NULL)
+			c->aq_tail = p;
+		c->aq_prio = p;
+	} else {
+		if (c->aq_tail)
+			c->aq_tail->next = p;
+		else
+			c->aq_head = p;
+		c->aq_tail = p;
+	}
+	pthread_mutex_unlock(&c->aq_lock);
 }
 
-int cblk_get_size(chunk_id_t id, size_t *size, int flags)
+/* Called by the completion thread once the hardware is done */
+static void async_complete(struct cblk_dev *c, struct cblk_req *req)
 {
-	cblk_get_lun_size(id, size, flags);
-	return 0;
+	int err = 0;
+	size_t i;
+	struct cblk_apiece *p = req->apiece;
+	struct cblk_atag *at = p->at;
+	struct cblk_chunk *ch = at->ch;
+	struct cblk_range r = { .dev = c, .lba = p->lba, .nblocks = p->nblocks };
+
+	req->apiece = NULL;
+	if ((c->status == CBLK_ERROR) || (req->status == CBLK_ERROR))
+		err = ETIME;
+
+	if (at->is_write) {
+		for (i = 0; !err && cblk_caching && (i < p->nblocks); i++)
+			cache_write(dev_key(c, p->lba + i),
+				req->buf + i * __CBLK_BLOCK_SIZE, 0, 0);
+		put_req(c, req);
+	} else {
+		if (!err) {
+			chunk_copy(ch, at->lba, at->nblocks, at->buf, &r,
+				   req_data(req), 1);
+			cache_overlay_dirty(ch, at->lba, at->nblocks,
+					    at->buf, &r);
+		}
+		__read_complete(c, req, 1);	/* mark as used one time */
+	}
+
+	async_piece_done(at, err, 1);
 }
 
-int cblk_set_size(chunk_id_t id __attribute__((unused)),
-		  size_t size __attribute__((unused)),
-		  int flags __attribute__((unused)))
+/* Reads which are completely in the cache finish right away */
+static int async_cache_read(struct cblk_chunk *ch, off_t lba, void *buf,
+			    size_t nblocks)
 {
-	fprintf(stderr, "err: Cannot change size of physical luns\n");
-	return -1;
+	size_t i;
+	struct cblk_dev *c = chunk_dev(ch, lba);
+
+	if (!cblk_caching)
+		return 0;
+	for (i = 0; i < nblocks; i++)
+		if (cache_read(chunk_key(ch, lba + i),
+			       (uint8_t *)buf + i * __CBLK_BLOCK_SIZE, NULL) != 0)
+			return 0;
+
+	c->cache_hits++;
+	if (nblocks == 1)
+		c->cache_hits_4k++;
+	return 1;
 }
 
-static int block_read(struct cblk_dev *c, void *buf, off_t lba,
-		size_t nblocks)
+static void async_dispatch_chunk(struct cblk_chunk *ch)
 {
-	struct cblk_req *req;
-	uint32_t mem_size = __CBLK_BLOCK_SIZE * nblocks;
+	unsigned int i;
 
-	block_trace("[%s] reading (%p LBA=%zu nblocks=%zu) ...\n",
-		__func__, buf, lba, nblocks);
+	for (i = 0; i < ch->ndevs; i++)
+		async_dispatch(ch->dev[i]);
+}
 
-	if (c->status != CBLK_READY) {	/* device in fatal error */
-		errno = EBADFD;
+/*
+ * Queue a request. Does not start it if batch is set, the caller will
+ * call async_dispatch_chunk() once it queued all of them.
+ */
+static int async_submit(struct cblk_chunk *ch, void *buf, off_t lba,
+			size_t nblocks, int *tag, cblk_arw_status_t *status,
+			int flags, int is_write, int prio, int batch)
+{
+	unsigned int i, n;
+	struct cblk_atag *at;
+	struct cblk_dev *c;
+	struct cblk_range r[CBLK_DEVS_MAX];
+	int user_tag = !!(flags & CBLK_ARW_USER_TAG_FLAG);
+	int hit = 0;
+	size_t done;
+
+	if ((buf == NULL) || (tag == NULL) || (nblocks == 0) ||
+	    (nblocks > (is_write ? CBLK_NBLOCKS_WRITE_MAX : CBLK_NBLOCKS_MAX)) ||
+	    ((flags & CBLK_ARW_USER_STATUS_FLAG) && (status == NULL))) {
+		errno = EINVAL;
 		return -1;
 	}
-	if ((lba < 0) || (lba >= (off_t)c->nblocks)) {	/* no valid LBA */
-		fprintf(stderr, "[%s] err: LBA=%ld out of range (max=%ld)!\n",
-			__func__, lba, c->nblocks);
-		errno = EFAULT;
-		return 0;
-	}
-	if (nblocks > CBLK_NBLOCKS_MAX) {
-		fprintf(stderr, "err: temp buffer too small!\n");
+	if ((lba < 0) || (lba + nblocks > ch->nblocks)) {
 		errno = EFAULT;
 		return -1;
 	}
-	req = get_req(c, 1, lba, nblocks, 0);
-	if (req == NULL)
-		return -1;
+	n = chunk_split(ch, lba, nblocks, r);
+	for (i = 0; i < n; i++) {
+		if (r[i].dev->status != CBLK_READY) {
+			errno = EBADFD;
+			return -1;
+		}
+	}
 
-	if (c->status != CBLK_READY) {	/* device in fatal error */
-		errno = EBADFD;
+	c = chunk_dev(ch, lba);
+	if (is_write) {
+		c->block_writes++;
+		if (nblocks == 1)
+			c->block_writes_4k++;
+	} else {
+		c->block_reads++;
+		if (nblocks == 1)
+			c->block_reads_4k++;
+		hit = async_cache_read(ch, lba, buf, nblocks);
+	}
+
+	pthread_mutex_lock(&ch->async_lock);
+	if (user_tag && atag_find(ch, *tag, 1)) {
+		pthread_mutex_unlock(&ch->async_lock);
+		errno = EEXIST;
 		return -1;
 	}
+	while (ch->atag_free == NULL) {
+		if (!(flags & CBLK_ARW_WAIT_CMD_FLAGS)) {
+			pthread_mutex_unlock(&ch->async_lock);
+			errno = EBUSY;
+			return -1;
+		}
+		pthread_cond_wait(&ch->async_c, &ch->async_lock);
+	}
+	at = ch->atag_free;
+	ch->atag_free = at->next;
+
+	at->next = NULL;
+	at->ch = ch;
+	at->user_tag = user_tag;
+	at->tag = user_tag ? *tag : (int)(at - ch->atag);
+	at->flags = flags;
+	at->is_write = is_write;
+	at->buf = buf;
+	at->lba = lba;
+	at->nblocks = nblocks;
+	at->status = status;
+	at->rc = 0;
+	at->err = 0;
+	gettimeofday(&at->stime, NULL);
+	*tag = at->tag;
+	if (status) {
+		status->blocks_transferred = 0;
+		status->fail_errno = 0;
+		status->status = CBLK_ARW_STATUS_PENDING;
+	}
+	if (!(flags & CBLK_ARW_USER_STATUS_FLAG))
+		ch->aresults++;
+
+	if (hit) {
+		__async_finish(ch, at, nblocks, 0);
+		pthread_mutex_unlock(&ch->async_lock);
+		pp_add_lba(lba, nblocks, 0, 1);
+		goto out;
+	}
+	if (is_write && cblk_writeback) {	/* done once in the cache */
+		at->state = CBLK_ATAG_ISSUED;
+		pthread_mutex_unlock(&ch->async_lock);
+		done = wb_write(ch, buf, lba, nblocks);
+		pthread_mutex_lock(&ch->async_lock);
+		if (done == nblocks)
+			__async_finish(ch, at, nblocks, 0);
+		else
+			__async_finish(ch, at, -1, errno ? errno : EIO);
+		pthread_mutex_unlock(&ch->async_lock);
+		pp_add_lba(lba, nblocks, 0, 0);
+		return 0;
+	}
+
+	at->state = CBLK_ATAG_QUEUED;
+	at->pieces = n;
+	for (i = 0; i < n; i++) {
+		at->piece[i].at = at;
+		at->piece[i].dev = r[i].dev;
+		at->piece[i].lba = r[i].lba;
+		at->piece[i].nblocks = r[i].nblocks;
+		async_enqueue(r[i].dev, &at->piece[i], prio);
+	}
+	pthread_mutex_unlock(&ch->async_lock);
 
-	req_setup(req, ACTION_CONFIG_COPY_NH,		/* NVMe to Host DDR */
-		(uint64_t)req->buf,			/* dst */
-		lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* src */
-		mem_size);				/* size */
-	req_start(req, c);
+	if (batch)
+		return 0;
+	async_dispatch_chunk(ch);
+ out:
+	if (!is_write)
+		__prefetch_blocks(ch, lba, nblocks);
+	return 0;
+}
 
-	__prefetch_blocks(c, lba, nblocks);
+int cblk_aread(chunk_id_t id, void *buf, off_t lba, size_t nblocks,
+		int *tag, cblk_arw_status_t *status, int flags)
+{
+	struct cblk_chunk *ch = chunk_get(id);
 
-	while (req->status == CBLK_READING) {
-		/* block_trace("  [%s] sleeping slot %d status: %s\n",
-			__func__, req->slot, cblk_status_str[req->status]); */
-		sem_wait(&req->wait_sem);
-		/* block_trace("  [%s] continuing slot %d\n",
-			__func__, req->slot); */
-	}
+	if (ch == NULL)
+		return -1;
+	return async_submit(ch, buf, lba, nblocks, tag, status, flags,
+			    0, 0, 0);
+}
 
-	if ((c->status == CBLK_ERROR) || (req->status == CBLK_ERROR)) {
-		errno = ETIME;
-		nblocks = 0;
-	} else
-		memcpy(buf, req->buf, nblocks * __CBLK_BLOCK_SIZE);
+int cblk_awrite(chunk_id_t id, void *buf, off_t lba, size_t nblocks,
+		int *tag, cblk_arw_status_t *status, int flags)
+{
+	struct cblk_chunk *ch = chunk_get(id);
 
-	__read_complete(c, req, 1);	/* mark as used one time */
-	return nblocks;
+	if (ch == NULL)
+		return -1;
+	return async_submit(ch, buf, lba, nblocks, tag, status, flags,
+			    1, 0, 0);
 }
 
-/*
- * Consider using pthread_cond_wait() and pthread_cond_broadcast()
- * once the data is ready to be absorbed.
+/**
+ * Returns the number of blocks transferred if the request completed,
+ * 0 if it did not complete yet and CBLK_ARESULT_BLOCKING was not given,
+ * -1 on failure. With CBLK_ARESULT_NEXT_TAG, *tag receives the tag of
+ * the request which completed first.
  */
-static int __cache_try_read(struct cblk_dev *c __attribute__((unused)),
-			off_t lba, void *buf, size_t nblocks,
-			unsigned int timeout_usec)
+int cblk_aresult(chunk_id_t id, int *tag, uint64_t *status, int flags)
 {
 	int rc;
-	unsigned long usecs = 0;
-	struct timeval s, e;
-	size_t i;
-	size_t from_cache = 0;
-	int prefetch_requested = 0;
+	struct cblk_chunk *ch = chunk_get(id);
+	struct cblk_atag *at, *p, *prev;
 
-	/* Trying to get data from CACHE if we got all blocks ... */
-	for (i = 0; i < nblocks; i++) {
-		gettimeofday(&s, NULL);
-		while (usecs < timeout_usec) {
-			rc = cache_read(lba + i, buf + i * __CBLK_BLOCK_SIZE);
-			if (rc == 1) {		/* READING LBA was requested */
-				if (!prefetch_requested) {
-					__prefetch_blocks(c, lba, nblocks);
-					prefetch_requested = 1;
-				}
-				gettimeofday(&e, NULL);
-				usecs = timediff_usec(&e, &s);
-				continue;	/* Try again */
+	if (ch == NULL)
+		return -1;
+	if ((tag == NULL) || (status == NULL)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&ch->async_lock);
+	while (1) {
+		if (flags & CBLK_ARESULT_NEXT_TAG) {
+			at = ch->adone_head;
+			if ((at == NULL) && (ch->aresults == 0)) {
+				errno = ENOENT;	/* would wait forever */
+				rc = -1;
+				break;
 			}
-			if (rc == 0) {		/* Success */
-				block_trace("    [%s] got LBA=%ld after %ld usecs\n",
-					__func__, lba + i, usecs);
-				from_cache++;
+		} else {
+			at = atag_find(ch, *tag, !!(flags & CBLK_ARESULT_USER_TAG));
+			if ((at == NULL) ||
+			    (at->flags & CBLK_ARW_USER_STATUS_FLAG)) {
+				errno = EINVAL;
+				rc = -1;
 				break;
 			}
-			if (rc < 0)		/* Not in cache, not requested */
-				goto out;
+			if (at->state != CBLK_ATAG_DONE)
+				at = NULL;
 		}
-		if (usecs >= timeout_usec)
-			dfprintf(stderr, "[%s] LBA=%ld did not arrive "
-				"n time %ld usecs\n", __func__, lba + i, usecs);
-	}
 
- out:
-	if (!prefetch_requested && (nblocks == from_cache)) {
-		block_trace("    [%s] trigger prefetching for LBA=%ld "
-			"nblocks=%ld from_cache=%ld\n",
-			__func__, lba, nblocks, from_cache);
-		__prefetch_blocks(c, lba, nblocks);
-		prefetch_requested = 1;
+		if (at != NULL) {
+			for (prev = NULL, p = ch->adone_head; p != at; p = p->next)
+				prev = p;
+			if (prev)
+				prev->next = at->next;
+			else
+				ch->adone_head = at->next;
+			if (ch->adone_tail == at)
+				ch->adone_tail = prev;
+			ch->aresults--;
+
+			*tag = at->tag;
+			*status = (at->rc > 0) ? at->rc : 0;
+			rc = at->rc;
+			if (rc < 0)
+				errno = at->err;
+			atag_put(ch, at);
+			break;
+		}
+
+		if (!(flags & CBLK_ARESULT_BLOCKING)) {
+			rc = 0;
+			break;
+		}
+		pthread_cond_wait(&ch->async_c, &ch->async_lock);
 	}
-	return from_cache;
+	pthread_mutex_unlock(&ch->async_lock);
+	return rc;
 }
 
-int cblk_read(chunk_id_t id __attribute__((unused)),
-		void *buf, off_t lba, size_t nblocks,
-		int flags __attribute__((unused)))
+/* With async_lock held */
+static unsigned int listio_done(cblk_io_t *list[], int items,
+				cblk_io_t *done[], unsigned int ndone,
+				unsigned int max)
 {
-	int rc;
-	struct cblk_dev *c = &chunk;
-	struct timeval start_time, end_time;
-	unsigned long usecs = 0;
-
-	gettimeofday(&start_time, NULL);
-
-	c->block_reads++;
-	if (nblocks == 1)
-		c->block_reads_4k++;
-
-	if (cblk_caching) {
-		/* Trying to get data from CACHE if we got all blocks ... */
-		rc = __cache_try_read(c, lba, buf, nblocks, CONFIG_REQ_DURATION_USEC);
-
-		/* ... we don't need to ask the NVMe hardware */
-		if (rc == (int)nblocks) {
-			block_trace("    [%s] Got %ld..%ld, nice\n", __func__,
-				lba, lba + nblocks - 1);
+	int i;
+	unsigned int j;
 
-			c->cache_hits++;
-			if (nblocks == 1)
-				c->cache_hits_4k++;
-			goto out;
-		}
+	for (i = 0; i < items; i++) {
+		if ((list[i] == NULL) ||
+		    (list[i]->stat.status == CBLK_ARW_STATUS_PENDING))
+			continue;
+		for (j = 0; j < ndone; j++)
+			if (done[j] == list[i])
+				break;
+		if ((j == ndone) && (ndone < max))
+			done[ndone++] = list[i];
 	}
+	return ndone;
+}
 
-	/* Else read them all for simplicity at this point in time ... */
-	rc = block_read(c, buf, lba, nblocks);
-out:
-	gettimeofday(&end_time, NULL);
-	usecs = timediff_usec(&end_time, &start_time);
-	pp_add_lba(lba, nblocks, usecs, 1);
+/* With async_lock held */
+static int listio_pending(cblk_io_t *list[], int items)
+{
+	int i;
 
-	return rc;
+	for (i = 0; i < items; i++)
+		if (list[i] &&
+		    (list[i]->stat.status == CBLK_ARW_STATUS_PENDING))
+			return 1;
+	return 0;
 }
 
-static int block_write(struct cblk_dev *c, void *buf, off_t lba,
-		size_t nblocks)
+/**
+ * Queue all requests of issue_io_list, then start as many as there
+ * are free slots. Waits up to timeout usecs (0: no limit) for the
+ * requests in wait_io_list. completion_io_list receives the requests
+ * of all lists which are complete, *completion_items gives its size
+ * and returns how many were filled in.
+ */
+int cblk_listio(chunk_id_t id,
+		cblk_io_t *issue_io_list[], int issue_items,
+		cblk_io_t *pending_io_list[], int pending_items,
+		cblk_io_t *wait_io_list[], int wait_items,
+		cblk_io_t *completion_io_list[], int *completion_items,
+		uint64_t timeout, int flags)
 {
-	uint32_t mem_size = __CBLK_BLOCK_SIZE * nblocks;
-	struct cblk_req *req;
+	int i, rc = 0, err = 0, arw_flags, is_write;
+	unsigned int ndone = 0, max = 0;
+	struct cblk_chunk *ch = chunk_get(id);
+	struct timespec ts;
+	cblk_io_t *io;
 
-	block_trace("[%s] writing (%p LBA=%zu nblocks=%zu) ...\n",
-		__func__, buf, lba, nblocks);
+	if (ch == NULL)
+		return -1;
+	if (completion_io_list && completion_items)
+		max = MAX(*completion_items, 0);
 
-	if (c->status != CBLK_READY) {	/* device in fatal error */
-		errno = EBADFD;
-		return 0;
-	}
-	if ((lba < 0) || (lba >= (off_t)c->nblocks)) {	/* no valid LBA */
-		fprintf(stderr, "[%s] err: LBA=%ld out of range (max=%ld)!\n",
-			__func__, lba, c->nblocks);
-		errno = EFAULT;
-		return 0;
-	}
-	if (nblocks > CBLK_NBLOCKS_WRITE_MAX) {
-		fprintf(stderr, "err: just 1 and %u supported for NBLOCKS!\n",
-			CBLK_NBLOCKS_WRITE_MAX);
-		errno = EFAULT;
-		return 0;
+	for (i = 0; i < issue_items; i++) {
+		io = issue_io_list[i];
+		if (io == NULL)
+			continue;
+
+		arw_flags = CBLK_ARW_USER_STATUS_FLAG;
+		if (io->flags & CBLK_IO_USER_TAG)
+			arw_flags |= CBLK_ARW_USER_TAG_FLAG;
+		if (flags & CBLK_LISTIO_WAIT_ISSUE_CMD)
+			arw_flags |= CBLK_ARW_WAIT_CMD_FLAGS;
+		is_write = (io->request_type == CBLK_IO_TYPE_WRITE);
+
+		if (((io->request_type != CBLK_IO_TYPE_READ) && !is_write) ||
+		    async_submit(ch, io->buf, io->lba, io->nblocks, &io->tag,
+				 &io->stat, arw_flags, is_write,
+				 !!(io->flags & CBLK_IO_PRIORITY_REQ), 1) < 0) {
+			io->stat.status = CBLK_ARW_STATUS_INVALID;
+			io->stat.fail_errno = err = errno ? errno : EINVAL;
+			rc = -1;
+		}
 	}
-	req = get_req(c, 1, lba, nblocks, 1);
-	if (req == NULL)
-		return 0;
+	async_dispatch_chunk(ch);	/* one go for the whole batch */
 
-	if (c->status != CBLK_READY) {	/* device in fatal error */
-		errno = EBADFD;
-		return 0;
+	for (i = 0; i < issue_items; i++) {
+		io = issue_io_list[i];
+		if (io && (io->request_type == CBLK_IO_TYPE_READ) &&
+		    (io->stat.status != CBLK_ARW_STATUS_INVALID))
+			__prefetch_blocks(ch, io->lba, io->nblocks);
 	}
 
-	memcpy(req->buf, buf, nblocks * __CBLK_BLOCK_SIZE);
-	req_setup(req, ACTION_CONFIG_COPY_HN,		/* NVMe to Host DDR */
-		lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* dst */
-		(uint64_t)req->buf,			/* src */
-		mem_size);				/* size */
-	req_start(req, c);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000000;
+	ts.tv_nsec += (timeout % 1000000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
 
-	while (req->status == CBLK_WRITING) {
-		/* block_trace("  [%s] sleeping slot %d\n",
-			__func__, req->slot); */
-		sem_wait(&req->wait_sem);
-		/* block_trace("  [%s] continuing slot %d\n",
-			__func__, req->slot); */
+	pthread_mutex_lock(&ch->async_lock);
+	while (listio_pending(wait_io_list, wait_items)) {
+		if (timeout == 0)
+			pthread_cond_wait(&ch->async_c, &ch->async_lock);
+		else if (pthread_cond_timedwait(&ch->async_c, &ch->async_lock,
+						&ts) == ETIMEDOUT) {
+			err = ETIMEDOUT;
+			rc = -1;
+			break;
+		}
 	}
 
-	if ((c->status == CBLK_ERROR) || (req->status == CBLK_ERROR)) {
-		errno = ETIME;
-		nblocks = 0;
+	if (max) {
+		ndone = listio_done(issue_io_list, issue_items,
+				    completion_io_list, ndone, max);
+		ndone = listio_done(pending_io_list, pending_items,
+				    completion_io_list, ndone, max);
+		ndone = listio_done(wait_io_list, wait_items,
+				    completion_io_list, ndone, max);
 	}
+	pthread_mutex_unlock(&ch->async_lock);
 
-	put_req(c, req);
-	/* block_trace("[%s] exit LBA=%zu nblocks=%zu\n", __func__, lba, nblocks); */
-	return nblocks;
+	if (completion_items)
+		*completion_items = ndone;
+	if (rc < 0)
+		errno = err;
+	return rc;
 }
 
-int cblk_write(chunk_id_t id __attribute__((unused)),
-		void *buf, off_t lba, size_t nblocks,
-		int flags __attribute__((unused)))
+/*
+ * Closing: parts still queued fail with ENODEV, parts on the hardware
+ * are waited for since their device may stay in use by other chunks.
+ */
+static void async_done(struct cblk_chunk *ch)
 {
-	int rc;
-	unsigned  int i;
-	struct cblk_dev *c = &chunk;
-	struct timeval start_time, end_time;
-	time_t usecs;
-
-	gettimeofday(&start_time, NULL);
-
-	c->block_writes++;
-	if (nblocks == 1)
-		c->block_writes_4k++;
-
-	nblocks = block_write(&chunk, buf, lba, nblocks);
-
-	if (cblk_caching) {
-		for (i = 0; i < nblocks; i++) {
-			rc = cache_write(lba + i, buf + i * __CBLK_BLOCK_SIZE, 0);
-			if (rc != 0) {
-				dfprintf(stderr, "err: cache_write LBA=%ld "
-					"failed rc=%d!\n", (long int)lba, rc);
-				return 0;
+	unsigned int i;
+	int in_prio;
+	struct cblk_dev *c;
+	struct cblk_apiece *p, **pp, *prio, *failed = NULL;
+
+	pthread_mutex_lock(&ch->async_lock);
+	for (i = 0; i < ch->ndevs; i++) {
+		c = ch->dev[i];
+		pthread_mutex_lock(&c->aq_lock);
+		prio = c->aq_prio;
+		c->aq_tail = c->aq_prio = NULL;
+		for (pp = &c->aq_head; *pp != NULL; ) {
+			p = *pp;
+			in_prio = (prio != NULL);
+			if (p == prio)
+				prio = NULL;	/* last priority one */
+			if (p->at->ch != ch) {
+				if (in_prio)
+					c->aq_prio = p;
+				c->aq_tail = p;
+				pp = &p->next;
+				continue;
 			}
+			*pp = p->next;
+			p->next = failed;
+			failed = p;
 		}
+		pthread_mutex_unlock(&c->aq_lock);
 	}
+	pthread_mutex_unlock(&ch->async_lock);
 
-	gettimeofday(&end_time, NULL);
-	usecs = timediff_usec(&end_time, &start_time);
-	pp_add_lba(lba, nblocks, usecs, 0);
+	for (p = failed; p != NULL; p = failed) {
+		failed = p->next;
+		async_piece_done(p->at, ENODEV, 0);
+	}
 
-	return nblocks;
+	pthread_mutex_lock(&ch->async_lock);
+	while (ch->ainflight != 0)
+		pthread_cond_wait(&ch->async_c, &ch->async_lock);
+	pthread_mutex_unlock(&ch->async_lock);
+
+	pthread_mutex_destroy(&ch->async_lock);
+	pthread_cond_destroy(&ch->async_c);
 }
 
 static void _init(void) __attribute__((constructor));
@@ -1899,6 +4381,42 @@ static void _init(void)
 	if (env != NULL)
 		cblk_caching = strtol(env, (char **)NULL, 0);
 
+	env = getenv("CBLK_QUEUE_DEPTH");
+	if (env != NULL)
+		cblk_queue_depth = MIN(MAX(strtol(env, (char **)NULL, 0), 1),
+				       CBLK_IDX_MAX);
+
+	env = getenv("CBLK_COMPLETION_THREADS");
+	if (env != NULL)
+		cblk_completion_threads = MIN(MAX(strtol(env, (char **)NULL, 0), 1),
+					      CONFIG_COMPLETION_THREADS_MAX);
+
+	env = getenv("CBLK_COMPLETION_BATCH");
+	if (env != NULL)
+		cblk_completion_batch = MIN(MAX(strtol(env, (char **)NULL, 0), 1),
+					    CBLK_IDX_MAX);
+
+	env = getenv("CBLK_COMPLETION_USEC");
+	if (env != NULL)
+		cblk_completion_usec = MAX(strtol(env, (char **)NULL, 0), 0);
+
+	env = getenv("CBLK_COMPLETION_CPU");
+	if (env != NULL)
+		cblk_completion_cpu = strtol(env, (char **)NULL, 0);
+
+	env = getenv("CBLK_WRITEBACK");
+	if (env != NULL) {
+		cblk_writeback = strtol(env, (char **)NULL, 0);
+
+		/* NOTE: write-back implies caching */
+		if (cblk_writeback)
+			cblk_caching = 1;
+	}
+
+	env = getenv("CBLK_WRITEBACK_USEC");
+	if (env != NULL)
+		cblk_writeback_usec = MAX(strtol(env, (char **)NULL, 0), 1);
+
 	env = getenv("CBLK_NBLOCKS");
 	if (env != NULL)
 		cblk_nblocks = strtol(env, (char **)NULL, 0);
@@ -1917,84 +4435,83 @@ static void _init(void)
 	if (env != NULL)
 		cblk_prefetch_threshold = strtol(env, (char **)NULL, 0);
 
+	env = getenv("CBLK_CACHE_SETS");
+	if (env != NULL)
+		cache_sets = strtoul(env, (char **)NULL, 0);
+
+	env = getenv("CBLK_CACHE_WAYS");
+	if (env != NULL)
+		cache_ways = strtoul(env, (char **)NULL, 0);
+
+	env = getenv("CBLK_CACHE_PINS");
+	if (env != NULL)
+		cache_pins_max = strtoul(env, (char **)NULL, 0);
+
+	env = getenv("CBLK_CACHE_POLICY");
+	if (env != NULL) {
+		int i;
+
+		for (i = 0; i < CACHE_POLICY_MAX; i++)
+			if (strcasecmp(env, cache_policy_str[i]) == 0)
+				break;
+		if (i == CACHE_POLICY_MAX)
+			i = strtol(env, (char **)NULL, 0);
+		if ((i >= 0) && (i < CACHE_POLICY_MAX))
+			cache_policy = i;
+	}
+
+	/* Size of each NVMe drive in GiB, libsnap cannot tell */
+	env = getenv("CBLK_NVME_SIZE");
+	if (env != NULL)
+		cblk_dev_nblocks = strtoull(env, (char **)NULL, 0) *
+			(1024 * 1024 * 1024 / __CBLK_BLOCK_SIZE);
+
+	env = getenv("CBLK_RAID0_STRIPE");
+	if (env != NULL)
+		cblk_raid0_stripe = MAX(strtoul(env, (char **)NULL, 0), 1ul);
+
 	block_trace("[%s] CBLK_MAXRETRIES=%d CBLK_REQTIMEOUT=%d CBLK_PREFETCH=%d "
-		"CBLK_PREFETCH_THRESHOLD=%d CBLK_CACHING=%d\n",
+		"CBLK_PREFETCH_THRESHOLD=%d CBLK_CACHING=%d "
+		"CBLK_CACHE_SETS=%d CBLK_CACHE_WAYS=%d CBLK_CACHE_POLICY=%s "
+		"CBLK_NVME_SIZE=%lld blocks CBLK_RAID0_STRIPE=%d\n",
 		    __func__, cblk_maxretries, cblk_reqtimeout, cblk_prefetch,
-		cblk_prefetch_threshold, cblk_caching);
+		cblk_prefetch_threshold, cblk_caching, cache_sets, cache_ways,
+		cache_policy_str[cache_policy], (long long)cblk_dev_nblocks,
+		(int)cblk_raid0_stripe);
+	block_trace("[%s] CBLK_QUEUE_DEPTH=%d CBLK_COMPLETION_THREADS=%d "
+		"CBLK_COMPLETION_BATCH=%d CBLK_COMPLETION_USEC=%d "
+		"CBLK_COMPLETION_CPU=%d CBLK_WRITEBACK=%d "
+		"CBLK_WRITEBACK_USEC=%d\n",
+		__func__, cblk_queue_depth, cblk_completion_threads,
+		cblk_completion_batch, cblk_completion_usec,
+		cblk_completion_cpu, cblk_writeback, cblk_writeback_usec);
 }
 
 static void _done(void) __attribute__((destructor));
 
 static void _done(void)
 {
-	struct cblk_dev *c = &chunk;
-	struct timeval end_time;
-	time_t usec;
-
-	gettimeofday(&end_time, NULL);
-	usec = timediff_usec(&end_time, &c->start_time);
+	int i;
 
 	block_trace("[%s] exit\n", __func__);
 
-	stat_trace("Statistics\n"
-		"  prefetches:          %ld\n"
-		"  prefetch_collis_4k:  %ld\n"
-		"  cache_hits:          %ld\n"
-		"    cache_hits_4k:     %ld\n"
-		"  hw_block_reads:      %ld\n"
-		"  hw_block_writes:     %ld\n"
-		"  block_reads:         %ld\n"
-		"    block_reads_4k:    %ld\n"
-		"  block_writes:        %ld\n"
-		"    block_writes_4k:   %ld\n"
-		"  idle_wakeups:        %ld\n"
-		"  cache_trashing_4k:   %ld\n"
-		"  running:             %ld usec\n"
-		"  reading:             %ld usec\n"
-		"  writing:             %ld usec\n"
-		"  rbytes_total:        %lld %.3f MiB/sec\n"
-		"  wbytes_total:        %lld %.3f MiB/sec\n"
-		"  max_read_usecs:      %ld usec\n"
-		"  max_write_usecs:     %ld usec\n"
-		"  avg_read_usecs:      %ld usec\n"
-		"  avg_write_usecs:     %ld usec\n"
-		"  min_read_usecs:      %ld usec\n"
-		"  min_write_usecs:     %ld usec\n"
-		"  avg_hw_read_usecs:   %ld usec\n"
-		"  avg_hw_write_usecs:  %ld usec\n",
-		c->prefetches,
-		c->prefetch_collisions,
-		c->cache_hits,
-		c->cache_hits_4k,
-		c->hw_block_reads,
-		c->hw_block_writes,
-		c->block_reads,
-		c->block_reads_4k,
-		c->block_writes,
-		c->block_writes_4k,
-		c->idle_wakeups,
-		cache_trashing,
-		(long int)usec,
-		c->avg_read_usecs,
-		c->avg_write_usecs,
-		c->rbytes_total, usec ? (double)c->rbytes_total / usec : 0.0,
-		c->wbytes_total, usec ? (double)c->wbytes_total / usec : 0.0,
-		c->max_read_usecs,
-		c->max_write_usecs,
-		c->hw_block_reads ? c->avg_read_usecs/c->hw_block_reads : 0,
-		c->hw_block_writes ? c->avg_write_usecs/c->hw_block_writes : 0,
-		c->min_read_usecs,
-		c->min_write_usecs,
-		c->hw_block_reads ? c->avg_hw_read_usecs/c->hw_block_reads : 0,
-		c->hw_block_writes ? c->avg_hw_write_usecs/c->hw_block_writes : 0);
-
-	stat_req_dump(c);
-
 	cache_trace("Cache Info\n"
-		"  entries/ways:        %d/%d per block %d KiB\n"
-		"  total_size:          %d MiB\n",
-		CACHE_ENTRIES, CACHE_WAYS, __CBLK_BLOCK_SIZE / 1024,
-		CACHE_ENTRIES * CACHE_WAYS * __CBLK_BLOCK_SIZE / (1024*1024));
-
-	cblk_close(0, 0);
+		"  sets/ways:           %d/%d per block %d KiB\n"
+		"  policy:              %s\n"
+		"  total_size:          %d MiB\n"
+		"  locked_lookups:      %ld\n"
+		"  adopted_dma_buffers: %ld\n"
+		"  read_waits:          %ld\n"
+		"  write_back:          %s, %u dirty\n"
+		"  written_back:        %ld blocks in %ld requests\n",
+		cache_sets, cache_ways, __CBLK_BLOCK_SIZE / 1024,
+		cache_policy_str[cache_policy],
+		cache_sets * cache_ways * __CBLK_BLOCK_SIZE / (1024*1024),
+		cache_lock_reads, cache_adopted, cache_read_waits,
+		cblk_writeback ? "on" : "off", cache_ndirty,
+		cache_flushed, cache_flushes);
+
+	for (i = 0; i < CBLK_CHUNKS_MAX; i++)
+		if (chunks[i].used)
+			cblk_close(i, 0);
 }
@@ -0,0 +1,315 @@
+/*
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Software version of the NVMe action used by snapblock.c, for
+ * SNAP_CONFIG=CPU together with SNAP_NVME_SIM.
+ *
+ * It takes the same register protocol as the hardware: ACTION_CONFIG
+ * holds the transfer type and the slot in bits 8 to 11, source,
+ * destination and size follow, starting the action queues the transfer
+ * on the emulated drive. Each read of ACTION_STATUS returns one
+ * completion, 0x10 | slot, or 0 if there is none. Unlike the hardware
+ * any mix of reads and writes can use the 16 slots.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <libsnap.h>
+
+#include <snap_tools.h>
+#include <snap_internal.h>
+#include <snap_hls_if.h>
+
+#define ACTION_TYPE_NVME_EXAMPLE	0x10140001	/* Action Type */
+
+#define ACTION_CONFIG		0x30
+#define  ACTION_CONFIG_COPY_HN	0x03	/* Memcopy Host DRAM to NVMe */
+#define  ACTION_CONFIG_COPY_NH	0x04	/* Memcopy NVMe to Host DRAM */
+#define  NVME_DRIVE1		0x10	/* Select Drive 1 */
+#define ACTION_SRC_LOW		0x34	/* LBA for 03, 04 */
+#define ACTION_SRC_HIGH		0x38
+#define ACTION_DEST_LOW		0x3c	/* LBA for 03, 04 */
+#define ACTION_DEST_HIGH	0x40
+#define ACTION_CNT		0x44	/* Bytes */
+#define ACTION_ERROR_BITS	0x48
+#define ACTION_STATUS		0x4c
+#define  ACTION_STATUS_COMPLETED	0x10
+#define  ACTION_STATUS_ERROR		0x20
+
+#define NVME_SLOTS		16
+
+/* Error bits, cleared when read */
+#define NVME_ERR_CONFIG		0x01	/* Unknown transfer type */
+#define NVME_ERR_SLOT_BUSY	0x02	/* Slot started twice */
+#define NVME_ERR_RANGE		0x04	/* Transfer not on the drive */
+#define NVME_ERR_IO		0x08	/* Emulated drive failed */
+#define NVME_ERR_NO_DRIVE	0x10	/* SNAP_NVME_SIM has no drive */
+
+struct nvme_action;
+
+struct nvme_slot {
+	struct snap_nvme_sim_req req;
+	struct nvme_action *na;
+	unsigned int slot;
+	int busy;
+};
+
+struct nvme_action {
+	pthread_mutex_t lock;
+	pthread_cond_t idle_c;
+	struct snap_nvme_sim *sim;
+	uint32_t regs[(ACTION_STATUS - ACTION_CONFIG) / sizeof(uint32_t)];
+	uint32_t errbits;
+	unsigned int inflight;
+
+	/* Completed slots, each slot is at most once in here */
+	uint32_t done[NVME_SLOTS];
+	unsigned int done_head;
+	unsigned int done_tail;
+
+	struct nvme_slot slots[NVME_SLOTS];
+};
+
+#define reg(na, offs)	((na)->regs[((offs) - ACTION_CONFIG) / sizeof(uint32_t)])
+
+static struct nvme_action *nvme_action_get(struct snap_card *card)
+{
+	unsigned int i;
+	struct snap_sim_action *a = snap_card_to_sim_action(card);
+	struct nvme_action *na, *old = NULL;
+
+	na = __atomic_load_n((struct nvme_action **)&a->priv_data,
+			     __ATOMIC_ACQUIRE);
+	if (na)
+		return na;
+
+	na = calloc(1, sizeof(*na));
+	if (na == NULL)
+		return NULL;
+
+	pthread_mutex_init(&na->lock, NULL);
+	pthread_cond_init(&na->idle_c, NULL);
+	na->sim = snap_card_to_nvme_sim(card);
+	for (i = 0; i < NVME_SLOTS; i++) {
+		na->slots[i].na = na;
+		na->slots[i].slot = i;
+		na->slots[i].req.priv = &na->slots[i];
+	}
+
+	/* The completion thread may poll while the first request starts */
+	if (!__atomic_compare_exchange_n((struct nvme_action **)&a->priv_data,
+			&old, na, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		pthread_cond_destroy(&na->idle_c);
+		pthread_mutex_destroy(&na->lock);
+		free(na);
+		na = old;
+	}
+	return na;
+}
+
+/* Must hold na->lock */
+static void nvme_complete(struct nvme_action *na, unsigned int slot,
+			  uint32_t errbits)
+{
+	uint32_t status = ACTION_STATUS_COMPLETED | slot;
+
+	if (errbits) {
+		na->errbits |= errbits;
+		status |= ACTION_STATUS_ERROR;
+	}
+	if (na->done_tail - na->done_head < NVME_SLOTS)
+		na->done[na->done_tail++ % NVME_SLOTS] = status;
+}
+
+static void nvme_done(struct snap_nvme_sim_req *req)
+{
+	struct nvme_slot *s = req->priv;
+	struct nvme_action *na = s->na;
+
+	act_trace("  %s: slot %u LBA=%lld rc=%d\n", __func__, s->slot,
+		  (long long)req->lba, req->rc);
+
+	pthread_mutex_lock(&na->lock);
+	s->busy = 0;
+	nvme_complete(na, s->slot, req->rc ? NVME_ERR_IO : 0);
+	if (--na->inflight == 0)
+		pthread_cond_broadcast(&na->idle_c);
+	pthread_mutex_unlock(&na->lock);
+}
+
+static int action_start(struct snap_card *card)
+{
+	uint32_t config;
+	uint64_t src, dst;
+	unsigned int slot;
+	struct nvme_slot *s;
+	struct snap_nvme_sim_req *req;
+	struct nvme_action *na = nvme_action_get(card);
+
+	if (na == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pthread_mutex_lock(&na->lock);
+	config = reg(na, ACTION_CONFIG);
+	src = (uint64_t)reg(na, ACTION_SRC_HIGH) << 32 |
+		reg(na, ACTION_SRC_LOW);
+	dst = (uint64_t)reg(na, ACTION_DEST_HIGH) << 32 |
+		reg(na, ACTION_DEST_LOW);
+	slot = (config >> 8) & (NVME_SLOTS - 1);
+	s = &na->slots[slot];
+	req = &s->req;
+
+	act_trace("  %s: config=%x src=%llx dst=%llx size=%u\n", __func__,
+		  config, (long long)src, (long long)dst,
+		  reg(na, ACTION_CNT));
+
+	if (s->busy) {
+		/* Cannot report the slot twice, the first one wins */
+		na->errbits |= NVME_ERR_SLOT_BUSY;
+		goto out;
+	}
+	if (na->sim == NULL) {
+		nvme_complete(na, slot, NVME_ERR_NO_DRIVE);
+		goto out;
+	}
+
+	switch (config & 0x0f) {
+	case ACTION_CONFIG_COPY_HN:
+		req->write = 1;
+		req->buf = (void *)(unsigned long)src;
+		req->lba = dst;
+		break;
+	case ACTION_CONFIG_COPY_NH:
+		req->write = 0;
+		req->buf = (void *)(unsigned long)dst;
+		req->lba = src;
+		break;
+	default:
+		nvme_complete(na, slot, NVME_ERR_CONFIG);
+		goto out;
+	}
+	req->drive = (config & NVME_DRIVE1) ? 1 : 0;
+	req->size = reg(na, ACTION_CNT);
+	req->done = nvme_done;
+
+	if (snap_nvme_sim_submit(na->sim, req) < 0) {
+		nvme_complete(na, slot, NVME_ERR_RANGE);
+		goto out;
+	}
+	s->busy = 1;
+	na->inflight++;
+ out:
+	pthread_mutex_unlock(&na->lock);
+	return 0;
+}
+
+static int mmio_write32(struct snap_card *card,
+			uint64_t offs, uint32_t data)
+{
+	struct nvme_action *na;
+
+	if ((offs < ACTION_CONFIG) || (offs >= ACTION_STATUS) ||
+	    (offs == ACTION_ERROR_BITS))
+		return 0;	/* IRQ setup, nothing to do */
+
+	na = nvme_action_get(card);
+	if (na == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	pthread_mutex_lock(&na->lock);
+	reg(na, offs) = data;
+	pthread_mutex_unlock(&na->lock);
+	return 0;
+}
+
+static int mmio_read32(struct snap_card *card,
+		       uint64_t offs, uint32_t *data)
+{
+	struct nvme_action *na = nvme_action_get(card);
+
+	*data = 0;
+	if (na == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	pthread_mutex_lock(&na->lock);
+	switch (offs) {
+	case ACTION_STATUS:
+		if (na->done_head != na->done_tail)
+			*data = na->done[na->done_head++ % NVME_SLOTS];
+		break;
+	case ACTION_ERROR_BITS:
+		*data = na->errbits;
+		na->errbits = 0;
+		break;
+	default:
+		if ((offs >= ACTION_CONFIG) && (offs < ACTION_STATUS))
+			*data = reg(na, offs);
+		break;
+	}
+	pthread_mutex_unlock(&na->lock);
+	return 0;
+}
+
+/* Transfers still on the drive write into the request slots */
+static void action_release(struct snap_sim_action *action)
+{
+	struct nvme_action *na = action->priv_data;
+
+	if (na == NULL)
+		return;
+
+	pthread_mutex_lock(&na->lock);
+	while (na->inflight)
+		pthread_cond_wait(&na->idle_c, &na->lock);
+	pthread_mutex_unlock(&na->lock);
+
+	pthread_cond_destroy(&na->idle_c);
+	pthread_mutex_destroy(&na->lock);
+	free(na);
+	action->priv_data = NULL;
+}
+
+static struct snap_sim_action action = {
+	.vendor_id = SNAP_VENDOR_ID_ANY,
+	.device_id = SNAP_DEVICE_ID_ANY,
+	.action_type = ACTION_TYPE_NVME_EXAMPLE,
+
+	.job = { .retc = SNAP_RETC_FAILURE, },
+	.state = ACTION_IDLE,
+	.main = NULL,		/* Started via action_start */
+	.priv_data = NULL,	/* struct nvme_action, per card */
+	.mmio_write32 = mmio_write32,
+	.mmio_read32 = mmio_read32,
+	.start = action_start,
+	.release = action_release,
+};
+
+static void _init(void) __attribute__((constructor));
+
+static void _init(void)
+{
+	snap_action_register(&action);
+}
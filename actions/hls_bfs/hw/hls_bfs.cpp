@@ -39,6 +39,7 @@
 
 /* Version
  * 2017/5/18    1.3   fixed address bits lost when reading one 512b word
+ * 2018         1.5   reject jobs in CSR format, only the CPU action has it
  */
 
 #include <string.h>
@@ -47,7 +48,8 @@
 #include "action_bfs.H"
 
 // Level 14: refine some coding on data type casting. Avoid using bit range.
-#define HW_RELEASE_LEVEL       0x00000014
+// Level 15: check the graph format of the job.
+#define HW_RELEASE_LEVEL       0x00000015
 
 void write_out_buf (snap_membus_t  * tgt_mem, snapu64_t address, snapu32_t buf_out[32])
 {
@@ -152,6 +154,12 @@ static int process_action(snap_membus_t *din_gmem,
     vex_num        = act_reg->Data.vex_num;
     root           = act_reg->Data.start_root;
 
+    // Only adjacency lists here, CSR graphs are for the CPU action
+    if (act_reg->Data.format != BFS_FORMAT_ADJLIST)
+    {
+        act_reg->Control.Retc = (snapu32_t) SNAP_RETC_FAILURE;
+        return 0;
+    }
 
 
 
@@ -27,7 +27,10 @@ extern "C" {
 #ifndef CACHELINE_BYTES
 #define CACHELINE_BYTES 128
 #endif
-unsigned int * g_out_ptr;
+
+// Graph formats of the job
+#define BFS_FORMAT_ADJLIST  0   /* input_adjtable is a VexNode array */
+#define BFS_FORMAT_CSR      1   /* input_adjtable is a bfs_csr_t, CPU only */
 
 // BFS Configuration PATTERN.
 // This must match with DATA structure in hls_bfs/kernel.cpp
@@ -38,6 +41,8 @@ typedef struct bfs_job {
     uint32_t start_root;
     uint32_t status_pos;
     uint32_t status_vex;
+    uint32_t format;
+    uint32_t status_level;  /* CSR: number of BFS levels */
 } bfs_job_t;
 
 /* Example structure for Vex and Edge*/
@@ -84,25 +89,43 @@ typedef struct EdgeEntry {
     EdgeData data;
 } EdgeEntry;
 
-//-----------------------------------------
-//   Queue
-//-----------------------------------------
-
-typedef unsigned int ElementType;
-typedef struct QNode{
-    ElementType    data;
-    struct QNode   *next;
-} QNode;
-
-typedef struct {
-    QNode * front;
-    QNode * rear;
-}Queue;
+/*
+ * Compressed sparse row: the edges of vertex v go to
+ * col[row[v]] ... col[row[v + 1] - 1]. in_row/in_col hold the same
+ * graph transposed, the edges coming into v. They are optional, the
+ * BFS only runs bottom-up steps with them.
+ */
+typedef struct bfs_csr {
+    uint64_t vex_num;
+    uint64_t edge_num;
+    uint64_t *row;          /* vex_num + 1 offsets into col */
+    uint32_t *col;
+    uint64_t *in_row;       /* Transposed or NULL */
+    uint32_t *in_col;
+} bfs_csr_t;
 
 //int bfs_all(VexNode *, unsigned int vex_num );
 void bfs(VexNode *, unsigned int vex_num, unsigned int root);
 void output_vex(unsigned int, int);
 
+/*
+ * CSR graphs, see bfs_csr.c. The builders keep the edge order of each
+ * vertex and return 0, or -1 with errno set.
+ */
+int bfs_csr_from_adjlist(bfs_csr_t *csr, const AdjList *adj);
+int bfs_csr_from_edges(bfs_csr_t *csr, uint32_t vex_num, uint64_t edge_num,
+        const uint32_t *s_vex, const uint32_t *d_vex);
+int bfs_csr_transpose(bfs_csr_t *csr);
+void bfs_csr_free(bfs_csr_t *csr);
+
+/*
+ * Direction-optimizing BFS from root. Puts the reached vertices into
+ * out level by level, each level in ascending order, and returns how
+ * many. levels gets the number of levels. -1 with errno set on errors.
+ */
+int64_t bfs_csr_run(const bfs_csr_t *csr, uint32_t root, uint32_t *out,
+        unsigned int threads, uint32_t *levels);
+
 #ifdef __cplusplus
 }
 #endif
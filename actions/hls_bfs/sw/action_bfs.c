@@ -7,7 +7,7 @@
  * Use Adjacency list to describe a graph:
  *        https://en.wikipedia.org/wiki/Adjacency_list
  *
- * And takes Queue structure:
+ * The output list doubles as the queue:
  *        https://en.wikipedia.org/wiki/Queue_%28abstract_data_type%29
  *
  * Wikipedia's pages are based on "CC BY-SA 3.0"
@@ -85,111 +85,14 @@ static int mmio_read32(struct snap_card *card,
     return 0;
 }
 //-------------------------------------
-//   Queue functions
+//    breadth first search
 //-------------------------------------
-static Queue * InitQueue()
-{
-    Queue *q= (Queue*)malloc (sizeof(Queue));
-    if (!q)
-    {
-        printf("ERROR: failed to malloc queue.\n");
-        return NULL;
-    }
-    q -> front = NULL;
-    q -> rear  = NULL;
-    return q;
-}
-
-static void DestoryQueue( Queue *q)
-{
-    free (q);
-}
-
-static int QueueEmpty(Queue * q)
-{
-    return (q->front == NULL);
-}
-
-/*
-   static void PrintQueue(Queue *q)
-   {
-   printf("Queue is ");
-   if (QueueEmpty(q))
-   {
-   printf ("empty.\n");
-   return;
-   }
-
-   QNode * node = q->front;
-   while (node != NULL)
-   {
-   printf ("%d, ", node->data);
-   node = node->next;
-   }
-   printf("\n");
-   }
-   */
-static void EnQueue (Queue *q, ElementType element)
-{
-    QNode * node_ptr = (QNode*) malloc (sizeof(QNode));
-    if (!node_ptr)
-    {
-        printf("ERROR: failed to malloc a queue node.\n");
-        return;
-    }
-
-    node_ptr->data = element;
-    node_ptr->next = NULL;
 
-    //Append to the tail
+// Where output_vex() puts the next vertex
+static unsigned int * g_out_ptr;
 
-    if (q->front == NULL)
-        q->front = node_ptr;
-
-    if (q->rear == NULL)
-    {
-        q->rear = node_ptr;
-    }
-    else
-    {
-        q->rear->next = node_ptr;
-        q->rear = node_ptr;
-    }
-
-
-    //PrintQueue(q);
-}
-
-
-
-static void DeQueue (Queue *q, ElementType *ep)
-{
-    // printf("Dequeue\n");
-    if (QueueEmpty (q))
-    {
-        printf ("ERROR: DeQueue: queue is empty.\n");
-        return;
-    }
-
-    QNode *temp = q->front;
-    if(q->front == q->rear) //only one element
-    {
-        q->front = NULL;
-        q->rear = NULL;
-    }
-    else
-    {
-        q->front = q->front->next;
-    }
-
-    *ep = temp->data;
-    free(temp);
-}
-
-
-//-------------------------------------
-//    breadth first search
-//-------------------------------------
+// Threads of the CSR search, SNAP_BFS_THREADS or one per CPU
+static unsigned int bfs_threads = 1;
 
 // put one visited vertex to the place of g_out_ptr.
 // Last vertex (is_tail=1) will follow an END sign (FFxxxxxx)
@@ -223,29 +126,21 @@ int bfs_all (VexNode * vex_list, unsigned int vex_num)
 }
 */
 //Breadth-first-search from a perticular vertex.
+//The vertices output so far and not dequeued yet are the queue.
 void bfs (VexNode * vex_list, unsigned int vex_num, unsigned int root)
 {
     EdgeNode *p;
-    Queue *Q;
-    unsigned int current, i;
-    int * visited;
-    visited = (int *) malloc (vex_num * sizeof(int));
+    unsigned int *head = g_out_ptr;
+    unsigned int current;
+    uint8_t * visited;
+    visited = (uint8_t *) calloc (vex_num, sizeof(uint8_t));
     unsigned int cnt = 0;
-    current = 0;
-
-    //initilize to all zero.
-    for (i = 0; i < vex_num; i++)
-        visited[i] = 0;
-
-    Q = InitQueue();
 
     visited[root] = 1;
     output_vex( root,0);
     cnt++;
 
-    EnQueue(Q, root);
-
-    while (! QueueEmpty(Q))
+    while (head < g_out_ptr)
     {
 
         /*
@@ -257,7 +152,7 @@ void bfs (VexNode * vex_list, unsigned int vex_num, unsigned int root)
            printf("\n");
            */
 
-        DeQueue(Q, &current);
+        current = *head++;
         p = vex_list[current].edgelink;
 
         // printf("current = %d\n", current);
@@ -268,8 +163,6 @@ void bfs (VexNode * vex_list, unsigned int vex_num, unsigned int root)
                 visited[p->adjvex] = 1;
                 output_vex(p->adjvex, 0);
                 cnt++;
-
-                EnQueue(Q, p->adjvex);
             }
             p = p->next;
         } //till to NULL of the edge list
@@ -277,7 +170,6 @@ void bfs (VexNode * vex_list, unsigned int vex_num, unsigned int root)
     output_vex(cnt, 1); //Indicate a tail
 
     free(visited);
-    DestoryQueue(Q);
 }
 
 //------------------------------------
@@ -292,11 +184,30 @@ static int action_main(struct snap_sim_action *action,
 
     VexNode * vex_list = (VexNode *) js->input_adjtable.addr;
     unsigned int vex_num = js->vex_num;
+    int64_t cnt;
 
 
     g_out_ptr = (unsigned int *)js->output_traverse.addr;
 
-    bfs(vex_list, vex_num, js->start_root);
+    if (js->format == BFS_FORMAT_CSR)
+    {
+        bfs_csr_t *csr = (bfs_csr_t *)js->input_adjtable.addr;
+
+        cnt = bfs_csr_run(csr, js->start_root, g_out_ptr, bfs_threads,
+                &js->status_level);
+        if (cnt < 0)
+        {
+            fprintf(stderr, "ERROR: CSR BFS from %u: %s\n",
+                    js->start_root, strerror(errno));
+            goto out_err;
+        }
+        g_out_ptr += cnt;
+        output_vex(cnt, 1);
+    }
+    else if (js->format == BFS_FORMAT_ADJLIST)
+        bfs(vex_list, vex_num, js->start_root);
+    else
+        goto out_err;
     js->status_vex = vex_num;
     js->status_pos = (unsigned int)((unsigned long long) g_out_ptr & 0xFFFFFFFFull);
     if (rc == 0)
@@ -325,13 +236,21 @@ static struct snap_sim_action action = {
     .priv_data = NULL,	/* this is passed back as void *card */
     .mmio_write32 = mmio_write32,
     .mmio_read32 = mmio_read32,
-
-    .next = NULL,
 };
 
 static void _init(void) __attribute__((constructor));
 
 static void _init(void)
 {
+    const char *env = getenv("SNAP_BFS_THREADS");
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (env != NULL)
+        bfs_threads = strtoul(env, (char **)NULL, 0);
+    else if (cpus > 0)
+        bfs_threads = cpus;
+    if (bfs_threads == 0)
+        bfs_threads = 1;
+
     snap_action_register(&action);
 }
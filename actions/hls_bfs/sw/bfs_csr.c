@@ -0,0 +1,445 @@
+/*
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * CSR graphs and the breadth-first-search of the software action on
+ * them.
+ *
+ * The search goes level by level, a level is a bitmap of its vertices
+ * and the list of them in the output, which is also the queue. A
+ * top-down step hands out chunks of the frontier list to the threads,
+ * they claim the unvisited targets of its edges with an atomic or on
+ * the visited bitmap. A bottom-up step hands out chunks of the bitmap
+ * words instead, each unvisited vertex looks at the sources of its
+ * incoming edges and stops at the first one in the frontier bitmap.
+ * That is cheaper once the frontier holds a good part of the graph,
+ * see "Direction-Optimizing Breadth-First Search", Beamer et al.:
+ * bottom-up when the frontier has more than 1/BFS_ALPHA of the edges
+ * not looked at yet, top-down again when it shrinks below 1/BFS_BETA
+ * of the vertices.
+ *
+ * After a step each thread collects the new level from its share of
+ * the words, counts first, then writes its vertices behind those of
+ * the threads before it. So a level comes out in ascending order, the
+ * same for any number of threads and directions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <libsnap.h>
+#include <snap_tools.h>
+#include <action_bfs.h>
+
+#define BFS_ALPHA           14
+#define BFS_BETA            24
+#define BFS_CHUNK_VEX       64      /* Top-down: frontier vertices at a time */
+#define BFS_CHUNK_WORDS     16      /* Bottom-up: bitmap words at a time */
+#define BFS_PARALLEL_MIN    16384   /* Vertices per thread at least */
+#define BFS_THREADS_MAX     64
+
+/*---------------------------------------------------
+ *       Building
+ *---------------------------------------------------*/
+
+/* Turn the counts in row[1 ... n] into the starts of each vertex */
+static void csr_starts(uint64_t *row, uint64_t vex_num)
+{
+    uint64_t v;
+
+    row[0] = 0;
+    for (v = 0; v < vex_num; v++)
+        row[v + 1] += row[v];
+}
+
+/* Filling row[v]++ moved each start to the next one, move them back */
+static void csr_unshift(uint64_t *row, uint64_t vex_num)
+{
+    uint64_t v;
+
+    for (v = vex_num; v > 0; v--)
+        row[v] = row[v - 1];
+    row[0] = 0;
+}
+
+static int csr_alloc(uint64_t **row, uint32_t **col, uint64_t vex_num,
+        uint64_t edge_num)
+{
+    *row = calloc(vex_num + 1, sizeof(**row));
+    *col = malloc(MAX(edge_num, 1ull) * sizeof(**col));
+    if (*row == NULL || *col == NULL) {
+        free(*row);
+        free(*col);
+        *row = NULL;
+        *col = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+int bfs_csr_from_adjlist(bfs_csr_t *csr, const AdjList *adj)
+{
+    const EdgeNode *en;
+    uint64_t v, e = 0;
+
+    memset(csr, 0, sizeof(*csr));
+    for (v = 0; v < adj->vex_num; v++)
+        for (en = adj->vex_list[v].edgelink; en != NULL; en = en->next) {
+            if (en->adjvex >= adj->vex_num) {
+                errno = EINVAL;
+                return -1;
+            }
+            e++;
+        }
+
+    if (csr_alloc(&csr->row, &csr->col, adj->vex_num, e) < 0)
+        return -1;
+    csr->vex_num = adj->vex_num;
+    csr->edge_num = e;
+
+    e = 0;
+    for (v = 0; v < adj->vex_num; v++) {
+        csr->row[v] = e;
+        for (en = adj->vex_list[v].edgelink; en != NULL; en = en->next)
+            csr->col[e++] = en->adjvex;
+    }
+    csr->row[v] = e;
+    return 0;
+}
+
+int bfs_csr_from_edges(bfs_csr_t *csr, uint32_t vex_num, uint64_t edge_num,
+        const uint32_t *s_vex, const uint32_t *d_vex)
+{
+    uint64_t e;
+
+    memset(csr, 0, sizeof(*csr));
+    for (e = 0; e < edge_num; e++)
+        if (s_vex[e] >= vex_num || d_vex[e] >= vex_num) {
+            errno = EINVAL;
+            return -1;
+        }
+
+    if (csr_alloc(&csr->row, &csr->col, vex_num, edge_num) < 0)
+        return -1;
+    csr->vex_num = vex_num;
+    csr->edge_num = edge_num;
+
+    for (e = 0; e < edge_num; e++)
+        csr->row[s_vex[e] + 1]++;
+    csr_starts(csr->row, vex_num);
+    for (e = 0; e < edge_num; e++)
+        csr->col[csr->row[s_vex[e]]++] = d_vex[e];
+    csr_unshift(csr->row, vex_num);
+    return 0;
+}
+
+int bfs_csr_transpose(bfs_csr_t *csr)
+{
+    uint64_t v, e;
+
+    free(csr->in_row);
+    free(csr->in_col);
+    if (csr_alloc(&csr->in_row, &csr->in_col, csr->vex_num,
+                csr->edge_num) < 0)
+        return -1;
+
+    for (e = 0; e < csr->edge_num; e++)
+        csr->in_row[csr->col[e] + 1]++;
+    csr_starts(csr->in_row, csr->vex_num);
+    for (v = 0; v < csr->vex_num; v++)
+        for (e = csr->row[v]; e < csr->row[v + 1]; e++)
+            csr->in_col[csr->in_row[csr->col[e]]++] = v;
+    csr_unshift(csr->in_row, csr->vex_num);
+    return 0;
+}
+
+void bfs_csr_free(bfs_csr_t *csr)
+{
+    free(csr->row);
+    free(csr->col);
+    free(csr->in_row);
+    free(csr->in_col);
+    memset(csr, 0, sizeof(*csr));
+}
+
+/*---------------------------------------------------
+ *       Search
+ *---------------------------------------------------*/
+
+/* What a thread found of the new level, a cache line each */
+struct bfs_count {
+    uint64_t vex;
+    uint64_t edges;         /* Out edges of those vertices */
+    uint64_t pad[6];
+};
+
+struct bfs_search {
+    const bfs_csr_t *g;
+    uint32_t *out;
+    uint64_t *visited;
+    uint64_t *front;        /* Current level */
+    uint64_t *next;         /* Level being found */
+    uint64_t words;
+    uint64_t cursor;        /* Next chunk of the step */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_barrier_t barrier;
+    unsigned int threads;   /* 0 until all are started */
+
+    uint64_t reached;
+    uint32_t levels;
+    struct bfs_count count[BFS_THREADS_MAX];
+};
+
+struct bfs_thread {
+    pthread_t tid;
+    struct bfs_search *s;
+    unsigned int no;
+};
+
+static inline uint64_t bfs_degree(const uint64_t *row, uint32_t v)
+{
+    return row[v + 1] - row[v];
+}
+
+static void bfs_top_down(struct bfs_search *s, uint64_t lo, uint64_t hi)
+{
+    const uint64_t *row = s->g->row;
+    const uint32_t *col = s->g->col;
+    uint64_t i, end, e, bit, *word;
+    uint32_t u;
+
+    for (;;) {
+        i = lo + __atomic_fetch_add(&s->cursor, BFS_CHUNK_VEX,
+                __ATOMIC_RELAXED);
+        if (i >= hi)
+            break;
+        end = MIN(i + BFS_CHUNK_VEX, hi);
+        for (; i < end; i++) {
+            uint32_t v = s->out[i];
+
+            for (e = row[v]; e < row[v + 1]; e++) {
+                u = col[e];
+                word = &s->visited[u / 64];
+                bit = 1ull << (u % 64);
+                if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+                    continue;
+                if (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit)
+                    continue;   /* Another thread was first */
+                __atomic_fetch_or(&s->next[u / 64], bit, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+static void bfs_bottom_up(struct bfs_search *s)
+{
+    const uint64_t *in_row = s->g->in_row;
+    const uint32_t *in_col = s->g->in_col;
+    uint64_t w, end, e, todo, found;
+    uint32_t u, v;
+
+    for (;;) {
+        w = __atomic_fetch_add(&s->cursor, BFS_CHUNK_WORDS,
+                __ATOMIC_RELAXED);
+        if (w >= s->words)
+            break;
+        end = MIN(w + BFS_CHUNK_WORDS, s->words);
+        for (; w < end; w++) {
+            todo = ~s->visited[w];
+            found = 0;
+            while (todo) {
+                v = w * 64 + __builtin_ctzll(todo);
+                for (e = in_row[v]; e < in_row[v + 1]; e++) {
+                    u = in_col[e];
+                    if (s->front[u / 64] & (1ull << (u % 64))) {
+                        found |= 1ull << (v % 64);
+                        break;
+                    }
+                }
+                todo &= todo - 1;
+            }
+            s->next[w] = found;
+            s->visited[w] |= found;
+        }
+    }
+}
+
+static void bfs_worker(struct bfs_search *s, unsigned int no)
+{
+    const bfs_csr_t *g = s->g;
+    uint64_t lo = 0, hi = 1, w, w0, w1, bits, vex, edges, pos;
+    uint64_t unexplored = g->edge_num - bfs_degree(g->row, s->out[0]);
+    uint64_t front_vex = 1;
+    unsigned int i, threads;
+    int bottom_up = 0;
+
+    pthread_mutex_lock(&s->lock);
+    while (s->threads == 0)
+        pthread_cond_wait(&s->cond, &s->lock);
+    threads = s->threads;
+    pthread_mutex_unlock(&s->lock);
+
+    w0 = s->words * no / threads;
+    w1 = s->words * (no + 1) / threads;
+
+    for (;;) {
+        if (bottom_up)
+            bfs_bottom_up(s);
+        else
+            bfs_top_down(s, lo, hi);
+        pthread_barrier_wait(&s->barrier);
+
+        /* Count the new level in the own words */
+        if (no == 0)
+            s->cursor = 0;
+        vex = edges = 0;
+        for (w = w0; w < w1; w++) {
+            for (bits = s->next[w]; bits; bits &= bits - 1)
+                edges += bfs_degree(g->row,
+                        w * 64 + __builtin_ctzll(bits));
+            vex += __builtin_popcountll(s->next[w]);
+        }
+        s->count[no].vex = vex;
+        s->count[no].edges = edges;
+        pthread_barrier_wait(&s->barrier);
+
+        /* Write it out behind the vertices of the threads before */
+        pos = hi;
+        vex = edges = 0;
+        for (i = 0; i < threads; i++) {
+            if (i == no)
+                pos = hi + vex;
+            vex += s->count[i].vex;
+            edges += s->count[i].edges;
+        }
+        for (w = w0; w < w1; w++) {
+            for (bits = s->next[w]; bits; bits &= bits - 1)
+                s->out[pos++] = w * 64 + __builtin_ctzll(bits);
+            s->front[w] = s->next[w];
+            s->next[w] = 0;
+        }
+        pthread_barrier_wait(&s->barrier);
+
+        /* Each thread comes to the same decisions */
+        if (vex == 0)
+            break;
+        lo = hi;
+        hi += vex;
+        unexplored -= edges;
+        if (!bottom_up && g->in_row != NULL &&
+                edges > unexplored / BFS_ALPHA)
+            bottom_up = 1;
+        else if (bottom_up && vex < front_vex &&
+                vex < g->vex_num / BFS_BETA)
+            bottom_up = 0;
+        front_vex = vex;
+        if (no == 0)
+            s->levels++;
+    }
+    if (no == 0)
+        s->reached = hi;
+}
+
+static void *bfs_thread_main(void *data)
+{
+    struct bfs_thread *t = data;
+
+    bfs_worker(t->s, t->no);
+    return NULL;
+}
+
+int64_t bfs_csr_run(const bfs_csr_t *csr, uint32_t root, uint32_t *out,
+        unsigned int threads, uint32_t *levels)
+{
+    struct bfs_search *s;
+    struct bfs_thread t[BFS_THREADS_MAX];
+    uint64_t tail;
+    unsigned int i;
+    int64_t reached = -1;
+
+    if (root >= csr->vex_num) {
+        errno = EINVAL;
+        return -1;
+    }
+    threads = MIN(MAX(threads, 1u), (unsigned int)BFS_THREADS_MAX);
+    threads = MIN(threads, csr->vex_num / BFS_PARALLEL_MIN + 1);
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return -1;
+    s->g = csr;
+    s->out = out;
+    s->words = (csr->vex_num + 63) / 64;
+    s->visited = calloc(s->words, sizeof(uint64_t));
+    s->front = calloc(s->words, sizeof(uint64_t));
+    s->next = calloc(s->words, sizeof(uint64_t));
+    if (s->visited == NULL || s->front == NULL || s->next == NULL) {
+        errno = ENOMEM;
+        goto out_free;
+    }
+
+    /* Vertices past the end count as visited */
+    tail = csr->vex_num % 64;
+    if (tail)
+        s->visited[s->words - 1] = ~0ull << tail;
+    s->visited[root / 64] |= 1ull << (root % 64);
+    s->front[root / 64] |= 1ull << (root % 64);
+    out[0] = root;
+    s->levels = 1;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    /* Those that start make the team */
+    pthread_mutex_lock(&s->lock);
+    for (i = 1; i < threads; i++) {
+        t[i].s = s;
+        t[i].no = i;
+        if (pthread_create(&t[i].tid, NULL, bfs_thread_main, &t[i]) != 0)
+            break;
+    }
+    threads = i;
+    pthread_barrier_init(&s->barrier, NULL, threads);
+    s->threads = threads;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    bfs_worker(s, 0);
+    for (i = 1; i < threads; i++)
+        pthread_join(t[i].tid, NULL);
+
+    pthread_barrier_destroy(&s->barrier);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+
+    reached = s->reached;
+    if (levels != NULL)
+        *levels = s->levels;
+
+ out_free:
+    free(s->visited);
+    free(s->front);
+    free(s->next);
+    free(s);
+    return reached;
+}
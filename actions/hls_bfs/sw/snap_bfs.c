@@ -81,6 +81,9 @@ static void usage(const char *prog)
             "  -o, --output_file <traverse.bin>   Output traverse result file.\n"
             "  -t, --timeout <seconds>       When graph is large, need to enlarge it.\n"
             "  -r, --rand_nodes <N>          Generate a random graph with the number\n"
+            "  -e, --edges <M>               Edges of the random graph, default N*(N-1)/8\n"
+            "  -c, --csr                     Traverse the graph in CSR format, CPU only.\n"
+            "                                Each level comes out in ascending order.\n"
             "  -s, --start_root <num>        Traverse starting node index [0...N-1], default 0\n"
             "  -v, --verbose                 Show more information on screen.\n"
             "                                Automatically turned off when vex number > 20\n"
@@ -91,6 +94,8 @@ static void usage(const char *prog)
             "  snap_bfs   (Traverse a small sample graph and show result on screen)\n"
             "  snap_bfs -r 50 -s 9 -o traverse.bin \n"
             "             (Generate a 50 nodes graph, traverse from node 9) \n"
+            "  SNAP_CONFIG=CPU snap_bfs -c -r 10000000 -e 100000000 \n"
+            "             (Search a random graph of 10^8 edges in CSR format) \n"
             "\n",
             prog);
 }
@@ -198,6 +203,47 @@ static int create_random_graph( AdjList * adj, uint32_t vex_num, uint32_t edge_n
     return rc;
 }
 
+/*
+ * The random graph of create_random_graph() straight in CSR format,
+ * without edge nodes.
+ */
+static int create_random_csr(bfs_csr_t * csr, uint32_t vex_num, uint64_t edge_num)
+{
+    int rc = 0;
+    uint64_t i;
+    uint32_t * s_vex = malloc (MAX(edge_num, 1ull) * sizeof(uint32_t));
+    uint32_t * d_vex = malloc (MAX(edge_num, 1ull) * sizeof(uint32_t));
+
+    if (s_vex == NULL || d_vex == NULL)
+    {
+        printf("ERROR: Fail to malloc edge list\n");
+        rc = -1;
+        goto out;
+    }
+
+    for (i = 0; i < edge_num; i++)
+    {
+        s_vex[i] = rand()%vex_num;
+
+        do {
+            d_vex[i] = rand()%vex_num;
+        }while (d_vex[i]==s_vex[i]); //An arc to itself is not allowed.
+
+        if(verbose_flag && i <50)
+            printf("edge %d:   %d -> %d\n", (int)i, s_vex[i], d_vex[i]);
+    }
+
+    rc = bfs_csr_from_edges(csr, vex_num, edge_num, s_vex, d_vex);
+    if (rc < 0)
+        printf("ERROR: Fail to build CSR: %s\n", strerror(errno));
+    else
+        printf("construct CSR done.\n");
+out:
+    free(s_vex);
+    free(d_vex);
+    return rc;
+}
+
 static int create_sample_graph( AdjList * adj, uint32_t vex_num, uint32_t edge_num, VexData * v_table, EdgeEntry * e_table, uint32_t page_size )
 {
     int rc = 0;
@@ -299,11 +345,13 @@ static void snap_prepare_bfs(struct snap_job *job,
         uint16_t type_in,
 
         void *addr_out,
-        uint16_t type_out)
+        uint16_t type_out,
+        uint32_t format)
 {
 
     fprintf(stdout, "----------------  Config Space ----------- \n");
-    fprintf(stdout, "input_adjtable_address = %p\n",addr_in);
+    fprintf(stdout, "input_adjtable_address = %p (%s)\n", addr_in,
+            format == BFS_FORMAT_CSR ? "CSR" : "adjacency list");
     fprintf(stdout, "output_address = %p\n", addr_out);
     fprintf(stdout, "graph nodes number = %d\n", vex_num_in);
     fprintf(stdout, "start BFS traversing at %d\n", root_in);
@@ -322,6 +370,8 @@ static void snap_prepare_bfs(struct snap_job *job,
     bjob_in->start_root = root_in;
     bjob_in->status_pos = 0;
     bjob_in->status_vex = 0xbeefbeef;
+    bjob_in->format = format;
+    bjob_in->status_level = 0;
 
     // Here sets the 108byte MMIO settings input.
     // We have input parameters.
@@ -351,7 +401,9 @@ int main(int argc, char *argv[])
     const char *input_file = NULL;
     const char *output_file = NULL;
     int random_graph = 0;
+    int csr_graph = 0;
     uint32_t vex_n, edge_n, root_in;
+    uint64_t rand_edges = 0;
     snap_action_flag_t action_irq = 0;
 
     vex_n  = ARRAY_SIZE(v_table);
@@ -365,6 +417,8 @@ int main(int argc, char *argv[])
             { "input_file",	 required_argument, NULL, 'i' },
             { "output_file", required_argument, NULL, 'o' },
             { "rand_nodes",	 required_argument, NULL, 'r' },
+            { "edges",	 required_argument, NULL, 'e' },
+            { "csr",	 no_argument,	    NULL, 'c' },
             { "start_root",	 required_argument, NULL, 's' },
             { "timeout",	 required_argument, NULL, 't' },
             { "version",	 no_argument,	    NULL, 'V' },
@@ -375,7 +429,7 @@ int main(int argc, char *argv[])
         };
 
         ch = getopt_long(argc, argv,
-                "C:i:o:t:r:s:VvhI",
+                "C:i:o:t:r:e:s:cVvhI",
                 long_options, &option_index);
         if (ch == -1)	/* all params processed ? */
             break;
@@ -404,9 +458,15 @@ int main(int argc, char *argv[])
                 random_graph=1;
                 vex_n = strtol(optarg, (char **)NULL, 0);
                 break;
+            case 'e':
+                rand_edges = strtoull(optarg, (char **)NULL, 0);
+                break;
             case 's':
                 root_in = strtol(optarg, (char **)NULL, 0);
                 break;
+            case 'c':
+                csr_graph = 1;
+                break;
             case 'h':
                 usage(argv[0]);
                 exit(EXIT_SUCCESS);
@@ -433,7 +493,7 @@ int main(int argc, char *argv[])
 
     //Input buffer
     uint8_t type_in = SNAP_ADDRTYPE_HOST_DRAM;
-    VexNode * ibuf = 0x0ull;
+    void * ibuf = 0x0ull;
 
     //Output buffer
     uint8_t type_out = SNAP_ADDRTYPE_HOST_DRAM;
@@ -445,7 +505,8 @@ int main(int argc, char *argv[])
 
     //////////////////////////////////////////////////////////////////////
     // Construct the graph, and set to ibuf.
-    AdjList adj;
+    AdjList adj = { NULL, 0, 0 };
+    bfs_csr_t csr;
 
     fprintf(stdout, "DEBUG: page_size is %d\n", page_size);
     fprintf(stdout, "DEBUG: timeout is %ld\n",timeout);
@@ -454,19 +515,57 @@ int main(int argc, char *argv[])
     //if(input_file != NULL)
     //    rc = create_file_graph (/*&adj, input_file*/); // TODO dummy function
     //else
+    memset(&csr, 0, sizeof(csr));
     if (random_graph && vex_n > 0)
     {
-        edge_n = vex_n * (vex_n - 1) / 8;  // 1/8 of a full connection
-        rc = create_random_graph(&adj, vex_n, edge_n, page_size);
+        if (rand_edges == 0)
+            rand_edges = (uint64_t)vex_n * (vex_n - 1) / 8;  // 1/8 of a full connection
+        if (vex_n < 2 || rand_edges > UINT32_MAX)
+        {
+            fprintf(stderr, "err: cannot make %llu edges for %u nodes\n",
+                    (long long)rand_edges, vex_n);
+            goto out_error;
+        }
+        edge_n = rand_edges;
+        if (csr_graph)
+            rc = create_random_csr(&csr, vex_n, edge_n);
+        else
+            rc = create_random_graph(&adj, vex_n, edge_n, page_size);
     }
     else
+    {
         rc = create_sample_graph(&adj, vex_n, edge_n, v_table, e_table, page_size);
+        if (rc == 0 && csr_graph)
+        {
+            rc = bfs_csr_from_adjlist(&csr, &adj);
+            if (rc < 0)
+                fprintf(stderr, "err: CSR conversion: %s\n", strerror(errno));
+        }
+    }
 
     print_graph(&adj);
     if(rc < 0)
         goto out_error;
 
-    ibuf = adj.vex_list;
+    if (root_in >= vex_n)
+    {
+        fprintf(stderr, "err: start root %u is not below %u\n", root_in, vex_n);
+        goto out_error;
+    }
+
+    if (csr_graph)
+    {
+        // The transpose lets the search go bottom-up
+        rc = bfs_csr_transpose(&csr);
+        if (rc < 0)
+        {
+            fprintf(stderr, "err: CSR transpose: %s\n", strerror(errno));
+            goto out_error;
+        }
+        ibuf = &csr;
+    }
+    else
+        ibuf = adj.vex_list;
 
 
 
@@ -510,7 +609,8 @@ int main(int argc, char *argv[])
     snap_prepare_bfs(&job, &bjob_in, &bjob_out,
             vex_n, root_in,
             (void *)ibuf, type_in,
-            (void *)obuf, type_out);
+            (void *)obuf, type_out,
+            csr_graph ? BFS_FORMAT_CSR : BFS_FORMAT_ADJLIST);
 
     fprintf(stdout, "INFO: Timer starts...\n");
     gettimeofday(&stime, NULL);
@@ -528,6 +628,8 @@ int main(int argc, char *argv[])
     fprintf(stdout, "------------------------------------------ \n");
 
     fprintf(stdout, "Write out position to 0x%x, vex = %d\n", bjob_out.status_pos, bjob_out.status_vex);
+    if (csr_graph)
+        fprintf(stdout, "BFS levels = %d\n", bjob_out.status_level);
     //print obuf
 
     if(output_file == NULL )
@@ -584,6 +686,7 @@ int main(int argc, char *argv[])
     snap_card_free(card);
     free(obuf);
     destroy_graph(adj);
+    bfs_csr_free(&csr);
     exit(exit_code);
 
 out_error2:
@@ -592,6 +695,7 @@ out_error1:
     snap_card_free(card);
 out_error:
     destroy_graph(adj);
+    bfs_csr_free(&csr);
     free(obuf);
     exit(EXIT_FAILURE);
 }
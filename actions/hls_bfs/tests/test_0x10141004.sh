@@ -100,6 +100,41 @@ for num in 10 25 37 64 128 256 512 1024 2048 4096 8192 16383 ; do
     echo "==============================================================================" >> snap_bfs.log
     eval ${cmd}
 
+    if [ $? -ne 0 ]; then
+	cat snap_bfs.log
+	echo
+	echo "cmd: ${cmd}"
+	echo "failed"
+	exit 1
+    fi
+
+    echo "ok"
+done
+
+# CSR search on the CPU, the same levels with any number of threads. It
+# takes 16384 vertices per thread at least, so 65536 vertices get 4. The
+# sparse graphs need many top-down levels, the dense ones go bottom-up.
+for edges in 100000 300000 1000000 4000000 ; do
+    echo -n "... CSR graph of 65536 nodes and ${edges} edges, 1 and 4 threads ... "
+    rm -f out.csr1
+    rm -f out.csr4
+    s=$(( $RANDOM % 65536 ))
+
+    cmd="SNAP_CONFIG=1 SNAP_BFS_THREADS=1 snap_bfs -C${snap_card} -c -r 65536 -e ${edges} \
+			-s $s -o out.csr1 >> snap_bfs.log 2>&1"
+    echo "$cmd" >> snap_bfs.log
+    eval ${cmd}
+
+    cmd="SNAP_CONFIG=1 SNAP_BFS_THREADS=4 snap_bfs -C${snap_card} -c -r 65536 -e ${edges} \
+			-s $s -o out.csr4 >> snap_bfs.log 2>&1"
+    echo "$cmd" >> snap_bfs.log
+    eval ${cmd}
+
+    cmd="bfs_diff out.csr1 out.csr4"
+    echo "$cmd" >> snap_bfs.log
+    echo "==============================================================================" >> snap_bfs.log
+    eval ${cmd}
+
     if [ $? -ne 0 ]; then
 	cat snap_bfs.log
 	echo
@@ -97,8 +97,6 @@ static struct snap_sim_action action = {
 	.priv_data = NULL,	/* this is passed back as void *card */
 	.mmio_write32 = mmio_write32,
 	.mmio_read32 = mmio_read32,
-
-	.next = NULL,
 };
 
 static void _init(void) __attribute__((constructor));
@@ -74,7 +74,7 @@ typedef struct hashjoin_job {
 	uint64_t t1_processed; /* #entries cached, repeat if not all */
 	uint64_t t2_processed; /* #entries processed, repeat if not all */
 	uint64_t t3_produced;  /* #entries produced store them away */
-	uint64_t checkpoint;
+	uint64_t checkpoint;   /* #entries of row t2_processed produced */
 } hashjoin_job_t;
 
 #ifdef __cplusplus
@@ -52,18 +52,12 @@ static const char *version = GIT_VERSION;
  *           ("Alan", "Ghosts"),
  *           ("Alan", "Zombies"),
  *           ("Glory", "Buffy")]
+ *
+ * The tables are allocated for the sizes given, the hashtable to hold
+ * all of table1 in the software action. The hardware action takes
+ * TABLE1_SIZE, TABLE2_SIZE and TABLE3_SIZE entries at most, which is
+ * why table2 is sent in chunks.
  */
-static table1_t t1[TABLE1_SIZE] __attribute__((aligned(HASHJOIN_ALIGN)));
-
-/*
- * Decouple the entries to maintain the multihash table from the data
- * in table1, since we do not want to transfer empty entries over the
- * PCIe bus to the card.
- */
-static table2_t t2[TABLE2_SIZE] __attribute__((aligned(HASHJOIN_ALIGN)));
-static table3_t t3[TABLE3_SIZE] __attribute__((aligned(64))); /* large++ */
-static hashtable_t hashtable __attribute__((aligned(64)));
-
 static const char *get_name(void)
 {
 	const char *names[] = { "Jonah", "Alan", "Allen", "Glory", "Frank", "Bruno",
@@ -152,23 +146,113 @@ file_read(const char *fname, uint8_t *buff, size_t len)
 	return rc;
 }
 
+/* Columnar batch of rows rows, NULL if it does not fit */
+static struct snap_batch *batch_alloc(const struct snap_col_spec *spec,
+				      unsigned int ncols, uint32_t rows)
+{
+	uint64_t size = snap_batch_layout(spec, ncols, rows, NULL);
+	void *buf;
+
+	if (size == 0)
+		return NULL;
+	buf = memalign(SNAP_BATCH_ALIGN, size);
+	if (buf == NULL)
+		return NULL;
+	return snap_batch_init(buf, spec, ncols, rows);
+}
+
+/* The tables as batches: the strings take what they are long */
+static struct snap_batch *table1_batch(const table1_t *t1, unsigned int n)
+{
+	struct snap_col_spec spec[] = { { SNAP_COL_UTF8, 0, 0 },
+					{ SNAP_COL_INT32, 0, 0 } };
+	struct snap_batch *b;
+	uint32_t *age;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		spec[0].heap_size += strnlen(t1[i].name, sizeof(hashkey_t));
+	b = batch_alloc(spec, ARRAY_SIZE(spec), n);
+	if (b == NULL)
+		return NULL;
+
+	age = snap_col_values(b, 1);
+	for (i = 0; i < n; i++) {
+		snap_col_put_str(b, 0, i, t1[i].name,
+				 strnlen(t1[i].name, sizeof(hashkey_t)));
+		age[i] = t1[i].age;
+	}
+	b->rows = n;
+	return b;
+}
+
+static struct snap_batch *table2_batch(const table2_t *t2, unsigned int n)
+{
+	struct snap_col_spec spec[] = { { SNAP_COL_UTF8, 0, 0 },
+					{ SNAP_COL_UTF8, 0, 0 } };
+	struct snap_batch *b;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		spec[0].heap_size += strnlen(t2[i].name, sizeof(hashkey_t));
+		spec[1].heap_size += strnlen(t2[i].animal, sizeof(hashkey_t));
+	}
+	b = batch_alloc(spec, ARRAY_SIZE(spec), n);
+	if (b == NULL)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		snap_col_put_str(b, 0, i, t2[i].name,
+				 strnlen(t2[i].name, sizeof(hashkey_t)));
+		snap_col_put_str(b, 1, i, t2[i].animal,
+				 strnlen(t2[i].animal, sizeof(hashkey_t)));
+	}
+	b->rows = n;
+	return b;
+}
+
+/* For t3_entries rows of the longest name and animal of table2 */
+static struct snap_batch *table3_batch(const table2_t *t2, unsigned int n,
+				       unsigned int t3_entries)
+{
+	struct snap_col_spec spec[] = { { SNAP_COL_UTF8, 0, 0 },
+					{ SNAP_COL_UTF8, 0, 0 },
+					{ SNAP_COL_INT32, 0, 0 } };
+	uint64_t name = 0, animal = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		name = MAX(name, (uint64_t)strnlen(t2[i].name,
+						   sizeof(hashkey_t)));
+		animal = MAX(animal, (uint64_t)strnlen(t2[i].animal,
+						       sizeof(hashkey_t)));
+	}
+	if ((name * t3_entries > UINT32_MAX) ||
+	    (animal * t3_entries > UINT32_MAX))
+		return NULL;
+	spec[0].heap_size = name * t3_entries;
+	spec[1].heap_size = animal * t3_entries;
+	return batch_alloc(spec, ARRAY_SIZE(spec), t3_entries);
+}
+
 static void snap_prepare_hashjoin(struct snap_job *cjob,
 				  struct hashjoin_job *jin,
 				  struct hashjoin_job *jout,
-				  const table1_t *t1, ssize_t t1_size,
-				  const table2_t *t2, size_t t2_size,
-				  table3_t *t3, size_t t3_size,
-				  hashtable_t *h, size_t h_size)
+				  snap_addrflag_t batch,
+				  const void *t1, ssize_t t1_size,
+				  const void *t2, size_t t2_size,
+				  void *t3, size_t t3_size,
+				  void *h, size_t h_size)
 {
 	snap_addr_set(&jin->t1, t1, t1_size,
 		      SNAP_ADDRTYPE_HOST_DRAM,
-		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC | batch);
 	snap_addr_set(&jin->t2, t2, t2_size,
 		      SNAP_ADDRTYPE_HOST_DRAM,
-		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC | batch);
 	snap_addr_set(&jin->t3, t3, t3_size,
 		      SNAP_ADDRTYPE_HOST_DRAM,
-		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST);
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | batch);
 
 	/* FIXME Assumptions where there is free DRAM on the card ... */
 	snap_addr_set(&jin->hashtable, h, h_size,
@@ -179,6 +263,7 @@ static void snap_prepare_hashjoin(struct snap_job *cjob,
 	jin->t1_processed = 0;
 	jin->t2_processed = 0;
 	jin->t3_produced = 0;
+	jin->checkpoint = 0;
 
 	snap_job_set(cjob, jin, sizeof(*jin), jout, sizeof(*jout));
 }
@@ -195,6 +280,10 @@ static void usage(const char *prog)
 	       "  -t, --timeout <timeout>  Timefor for job completion. (default 10 sec)\n"
 	       "  -Q, --t1-entries <items> Entries in table1.\n"
 	       "  -T, --t2-entries <items> Entries in table2.\n"
+	       "  -c, --chunk <items>      Entries of table2 per job (default %d).\n"
+	       "  -R, --t3-entries <items> Entries in table3 (default %d).\n"
+	       "  -H, --ht-size <bytes>    Hashtable size, 0: all of table1 (default 0).\n"
+	       "  -F, --columnar           Pass the tables as columnar batches, CPU mode only.\n"
 	       "  -s, --seed <seed>        Random seed to enable recreation.\n"
 	       "  -N, --no irq             Disable Interrupts (polling)\n"
 	       "\n"
@@ -203,6 +292,12 @@ static void usage(const char *prog)
 	       " - T is the Table 2 containing name and animals\n"
 	       " - The result will be stored in Table 3 containing name, animal and age \n"
 	       " The table 2 is limited to 32 on purpose and results will be given at each action call\n"
+	       " - In CPU mode, tables have no size limits. A job stops when table3 is full\n"
+	       "   and the next one continues where it stopped. A table1 larger than the\n"
+	       "   hashtable is joined in several passes over table2.\n"
+	       "   SNAP_HASHJOIN_THREADS=<n> sets the threads, default is one per CPU\n"
+	       " - With -F, strings take what they are long instead of 64 bytes, and\n"
+	       "   all of table2 goes with each job, -c does not apply.\n"
 	       "\n"
                "Useful parameters :\n"
                "-------------------\n"
@@ -234,8 +329,12 @@ static void usage(const char *prog)
 	       "echo Random generation of 2 tables with 30 entries for Table1/Q and 60 for Table2/T"
 	       "=> this will induce 2 calls of the action since Table2 is limited to 32 on purpose\n"
 	       "snap_hashjoin -vv -t2500 -Q 30 -T 60 -C0\n"
+	       "\n"
+	       "Example in CPU mode\n"
+	       "-------------------\n"
+	       "SNAP_CONFIG=CPU snap_hashjoin -Q 1000 -T 1000000 -c 1000000 -R 1000000\n"
 	       "\n",
-	       prog);
+	       prog, TABLE2_SIZE, TABLE3_SIZE);
 }
 
 /**
@@ -257,6 +356,17 @@ int main(int argc, char *argv[])
 	unsigned int t1_entries = 25;
 	unsigned int t2_entries = 23;
 	unsigned int t2_tocopy = 0;
+	unsigned int t2_chunk = TABLE2_SIZE;
+	unsigned int t3_entries = TABLE3_SIZE;
+	unsigned long long ht_size = 0;
+	uint64_t t1_first, t1_next = 0, t2_first, t3_total = 0;
+	table1_t *t1 = NULL;
+	table2_t *t2 = NULL;
+	table3_t *t3 = NULL;
+	void *ht = NULL;
+	int columnar = 0;
+	struct snap_batch *t1b = NULL, *t2b = NULL, *t3b = NULL;
+	uint64_t key_bytes;
 	unsigned int seed = 1974;
 	snap_action_flag_t action_irq = (SNAP_ACTION_DONE_IRQ | SNAP_ATTACH_IRQ);
 
@@ -267,6 +377,10 @@ int main(int argc, char *argv[])
 			{ "timeout",	 required_argument, NULL, 't' },
 			{ "t1-entries",	 required_argument, NULL, 'Q' },
 			{ "t2-entries",	 required_argument, NULL, 'T' },
+			{ "chunk",	 required_argument, NULL, 'c' },
+			{ "t3-entries",	 required_argument, NULL, 'R' },
+			{ "ht-size",	 required_argument, NULL, 'H' },
+			{ "columnar",	 no_argument,	    NULL, 'F' },
 			{ "seed",	 required_argument, NULL, 's' },
 			{ "version",	 no_argument,	    NULL, 'V' },
 			{ "verbose",	 no_argument,	    NULL, 'v' },
@@ -276,7 +390,7 @@ int main(int argc, char *argv[])
 		};
 
 		ch = getopt_long(argc, argv,
-				 "s:Q:T:C:t:VvhN",
+				 "s:Q:T:c:R:H:FC:t:VvhN",
 				 long_options, &option_index);
 		if (ch == -1)	/* all params processed ? */
 			break;
@@ -295,6 +409,18 @@ int main(int argc, char *argv[])
 		case 'T':
 			t2_entries = strtol(optarg, (char **)NULL, 0);
 			break;
+		case 'c':
+			t2_chunk = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'R':
+			t3_entries = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'H':
+			ht_size = strtoull(optarg, (char **)NULL, 0);
+			break;
+		case 'F':
+			columnar = 1;
+			break;
 		case 's':
 			seed = strtol(optarg, (char **)NULL, 0);
 			break;
@@ -352,67 +478,163 @@ int main(int argc, char *argv[])
 		goto out_error1;
 	}
 
-	if (t1_entries > ARRAY_SIZE(t1)) {
-		fprintf(stderr, "err: t1 too large %d\n", t1_entries);
-		goto out_error;
+	if (t1_entries == 0 || t2_chunk == 0 || t3_entries == 0) {
+		fprintf(stderr, "err: t1 %d, chunk %d and t3 %d entries must "
+			"not be 0\n", t1_entries, t2_chunk, t3_entries);
+		goto out_error2;
+	}
+	t1 = memalign(HASHJOIN_ALIGN, t1_entries * sizeof(table1_t));
+	t2 = memalign(HASHJOIN_ALIGN, MAX(t2_entries, 1u) * sizeof(table2_t));
+	if (!t1 || !t2) {
+		fprintf(stderr, "err: cannot allocate tables\n");
+		goto out_error3;
 	}
 
 	table1_fill(t1, t1_entries);
 	if (verbose_flag)
 		table1_dump(t1, t1_entries);
-
-	gettimeofday(&stime, NULL);
-	while (t2_entries != 0) {
-		t2_tocopy = MIN(ARRAY_SIZE(t2), t2_entries);
-
-		table2_fill(t2, t2_tocopy);
-		snap_prepare_hashjoin(&cjob, &jin, &jout,
-				      t1, t1_entries * sizeof(table1_t),
-				      t2, t2_tocopy * sizeof(table2_t),
-				      t3, sizeof(t3),
-				      &hashtable, sizeof(hashtable));
-		if (verbose_flag) {
-			pr_info("Job Input:\n");
-			__hexdump(stderr, &jin, sizeof(jin));
-			table2_dump(t2, t2_tocopy);
-		}
-
-		rc = snap_action_sync_execute_job(action, &cjob, timeout);
-		if (rc != 0) {
-			fprintf(stderr, "err: job execution %d: %s!\n", rc,
-				strerror(errno));
-			goto out_error2;
-		}
-		if (cjob.retc != SNAP_RETC_SUCCESS)  {
-			fprintf(stderr, "err: job retc %x!\n", cjob.retc);
-			goto out_error2;
+	table2_fill(t2, t2_entries);
+
+	if (columnar) {
+		t1b = table1_batch(t1, t1_entries);
+		t2b = table2_batch(t2, t2_entries);
+		t3b = table3_batch(t2, t2_entries, t3_entries);
+		if (!t1b || !t2b || !t3b) {
+			fprintf(stderr, "err: cannot allocate batches\n");
+			goto out_error3;
 		}
-
-		if (verbose_flag) {
-			pr_info("Table 3 is the resulting table:\n");
-			table3_dump(t3, jout.t3_produced);
+		/* All of table2 in each job, they continue by t2_processed */
+		t2_chunk = MAX(t2_entries, 1u);
+		key_bytes = t1b->col[0].heap_size;
+		if (verbose_flag)
+			fprintf(stderr, "Batches: t1 %u t2 %u t3 %u bytes, "
+				"as rows %llu %llu %llu bytes\n",
+				t1b->size, t2b->size, t3b->size,
+				(unsigned long long)t1_entries * sizeof(table1_t),
+				(unsigned long long)t2_entries * sizeof(table2_t),
+				(unsigned long long)t3_entries * sizeof(table3_t));
+	} else {
+		t3 = memalign(64, t3_entries * sizeof(table3_t));
+		if (!t3) {
+			fprintf(stderr, "err: cannot allocate tables\n");
+			goto out_error3;
 		}
+		key_bytes = (uint64_t)t1_entries * sizeof(hashkey_t);
+	}
 
-		t1_entries = 0; /* no need to process this twice,
-				   ht stores the values */
-		t2_entries -= t2_tocopy;
+	if (ht_size == 0)
+		ht_size = MAX(hashjoin_ht_size(t1_entries, key_bytes),
+			      (uint64_t)sizeof(hashtable_t));
+	if (ht_size > UINT32_MAX) {
+		fprintf(stderr, "err: hashtable too large %lld\n",
+			(long long)ht_size);
+		goto out_error3;
+	}
+	ht = memalign(64, ht_size);
+	if (!ht) {
+		fprintf(stderr, "err: cannot allocate hashtable\n");
+		goto out_error3;
 	}
+
+	cjob.retc = SNAP_RETC_SUCCESS;
+	gettimeofday(&stime, NULL);
+	do {	/* Once for each part of table1 fitting the hashtable */
+		t1_first = t1_next;
+		for (t2_first = 0; t2_first < t2_entries; t2_first += t2_tocopy) {
+			t2_tocopy = MIN(t2_chunk, t2_entries - t2_first);
+
+			/* table1 goes with the first job, ht stores the values */
+			if (columnar)
+				snap_prepare_hashjoin(&cjob, &jin, &jout,
+						      SNAP_ADDRFLAG_BATCH,
+						      t1b, t1b->size,
+						      t2b, t2b->size,
+						      t3b, t3b->size,
+						      ht, ht_size);
+			else
+				snap_prepare_hashjoin(&cjob, &jin, &jout, 0,
+						      t1, t2_first ? 0 :
+						      t1_entries * sizeof(table1_t),
+						      t2 + t2_first,
+						      t2_tocopy * sizeof(table2_t),
+						      t3, t3_entries * sizeof(table3_t),
+						      ht, ht_size);
+			jin.t1_processed = t1_first;
+			if (verbose_flag) {
+				pr_info("Job Input:\n");
+				__hexdump(stderr, &jin, sizeof(jin));
+				table2_dump(t2 + t2_first, t2_tocopy);
+			}
+
+			do {	/* Until table3 took all of the chunk */
+				rc = snap_action_sync_execute_job(action, &cjob,
+								  timeout);
+				if (rc != 0) {
+					fprintf(stderr, "err: job execution %d: %s!\n",
+						rc, strerror(errno));
+					goto out_error3;
+				}
+				if (cjob.retc != SNAP_RETC_SUCCESS)  {
+					fprintf(stderr, "err: job retc %x!\n",
+						cjob.retc);
+					goto out_error3;
+				}
+
+				if (verbose_flag) {
+					pr_info("Table 3 is the resulting table:\n");
+					if (columnar)
+						table3_batch_dump(t3b);
+					else
+						table3_dump(t3, jout.t3_produced);
+				}
+				t3_total += jout.t3_produced;
+
+				if (t2_first == 0 && jin.t2_processed == 0) {
+					/* The hardware caches all, reports 0 */
+					t1_next = jout.t1_processed;
+					if (t1_next <= t1_first)
+						t1_next = t1_entries;
+				}
+
+				/* The hardware does all, reports no progress */
+				if (jout.t2_processed == 0 && jout.checkpoint == 0)
+					break;
+				jin.t2_processed = jout.t2_processed;
+				jin.checkpoint = jout.checkpoint;
+			} while (jin.t2_processed < t2_tocopy);
+		}
+	} while (t1_next < t1_entries && t2_entries != 0);
 	gettimeofday(&etime, NULL);
 
 	(cjob.retc == SNAP_RETC_SUCCESS) ? fprintf(stdout, "SUCCESS\n") : fprintf(stdout, "FAILED\n");
         if (cjob.retc != SNAP_RETC_SUCCESS) {
                 fprintf(stderr, "err: Unexpected RETC=%x!\n", cjob.retc);
-                goto out_error2;
+                goto out_error3;
         }
 
-	fprintf(stderr, "HashJoin took %lld usec\n", 
-		(long long)timediff_usec(&etime, &stime));
+	fprintf(stderr, "HashJoin took %lld usec, %lld entries in table3\n",
+		(long long)timediff_usec(&etime, &stime), (long long)t3_total);
        fprintf(stdout, "This time represents the register transfer time + hashjoin action time\n");
 
+	free(t1);
+	free(t2);
+	free(t3);
+	free(t1b);
+	free(t2b);
+	free(t3b);
+	free(ht);
 	snap_detach_action(action);
 	snap_card_free(card);
 	exit(exit_code);
 
+ out_error3:
+	free(t1);
+	free(t2);
+	free(t3);
+	free(t1b);
+	free(t2b);
+	free(t3b);
+	free(ht);
  out_error2:
 	snap_detach_action(action);
  out_error1:
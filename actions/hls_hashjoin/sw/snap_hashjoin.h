@@ -20,8 +20,56 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <libsnap.h>
+#include <snap_columnar.h>
 #include <action_hashjoin.h>
 
+/*
+ * sw_hashjoin_radix.c: the join of the software action. hashjoin_build
+ * caches table1 from t1_processed on in the hashtable memory, as many
+ * rows as fit, and moves t1_processed behind them. hashjoin_probe
+ * joins table2 from t2_processed and checkpoint on until table3 is
+ * full, and updates t2_processed, checkpoint and t3_produced.
+ *
+ * Tables are table1_t/table2_t rows or struct snap_batch with the
+ * columns name, age (table1) and name, animal (table2). A table3
+ * batch has name, animal and age.
+ */
+struct hashjoin_col {
+	const char *base;	/* Row 0, batch strings: the heap */
+	uint64_t stride;	/* Bytes from row to row */
+	const uint32_t *offs;	/* Batch strings: offsets, else NULL */
+	const uint8_t *valid;	/* Batch: validity bitmap or NULL */
+};
+
+struct hashjoin_table {
+	uint64_t rows;
+	struct hashjoin_col name;
+	struct hashjoin_col val;	/* table1: age, table2: animal */
+};
+
+struct hashjoin_out {
+	table3_t *t3;			/* Rows, or */
+	struct snap_batch *batch;	/* columns */
+	uint64_t capacity;		/* Rows */
+};
+
+#define HASHJOIN_T1_COLS { SNAP_COL_UTF8, SNAP_COL_INT32 }
+#define HASHJOIN_T2_COLS { SNAP_COL_UTF8, SNAP_COL_UTF8 }
+#define HASHJOIN_T3_COLS { SNAP_COL_UTF8, SNAP_COL_UTF8, SNAP_COL_INT32 }
+
+/* Bytes to cache t1_rows with key_bytes of names all */
+uint64_t hashjoin_ht_size(uint64_t t1_rows, uint64_t key_bytes);
+void hashjoin_t1_rows(struct hashjoin_table *t, const table1_t *t1,
+		      uint64_t rows);
+void hashjoin_t2_rows(struct hashjoin_table *t, const table2_t *t2,
+		      uint64_t rows);
+void hashjoin_batch(struct hashjoin_table *t, const struct snap_batch *b);
+int hashjoin_build(void *ht, struct hashjoin_job *hj,
+		   const struct hashjoin_table *t1, unsigned int threads);
+int hashjoin_probe(const void *ht, struct hashjoin_job *hj,
+		   const struct hashjoin_table *t2, struct hashjoin_out *t3,
+		   unsigned int threads);
+
 static inline void print_hex(void *buf, size_t len)
 {
 	unsigned int x;
@@ -101,4 +149,22 @@ static inline void table3_dump(table3_t *table3, unsigned int table3_idx)
 	fprintf(stderr, "}; /* table3_idx=%d\n", table3_idx);
 }
 
+static inline void table3_batch_dump(const struct snap_batch *b)
+{
+	unsigned int i;
+	uint32_t name_len, animal_len;
+	const char *name, *animal;
+	const uint32_t *age = (const uint32_t *)snap_col_values(b, 2);
+
+	fprintf(stderr, "table3_t table3[] = {\n");
+	for (i = 0; i < b->rows; i++) {
+		name = snap_col_str(b, 0, i, &name_len);
+		animal = snap_col_str(b, 1, i, &animal_len);
+		fprintf(stderr, "  { .name = \"%.*s\", .animal = \"%.*s\", "
+			".age=%d } /* %d. */\n", (int)name_len, name ? name : "",
+			(int)animal_len, animal ? animal : "", age[i], i);
+	}
+	fprintf(stderr, "}; /* table3_idx=%d\n", b->rows);
+}
+
 #endif	/* __SNAP_HASHJOIN_H__ */
@@ -0,0 +1,815 @@
+/*
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Radix hash join for the software flow of the hashjoin action.
+ *
+ * Build: the table1 rows are hashed and scattered into 2^bits
+ * partitions of about HJ_PART_ROWS rows by the low hash bits, then each
+ * partition gets its own open addressing table, small enough to stay
+ * in the L2 cache while it is built or probed. A slot holds 32 bits of
+ * the hash as fingerprint, so only equal fingerprints compare keys.
+ * Each distinct key is stored once, the ages of its rows follow each
+ * other in table1 order, which is all a table3 row needs of table1.
+ *
+ * Everything lives in the job's hashtable memory, with offsets instead
+ * of pointers, such that later jobs can probe it without table1. When
+ * table1 does not fit, the first rows which do are cached and
+ * t1_processed tells where the next pass starts.
+ *
+ * Probe: table2 is done in batches. The rows of a batch are grouped
+ * by partition before they are looked up, then the matches are
+ * counted, the rows cut where table3 is full, and written in table2
+ * order. t2_processed is the next row to probe and checkpoint the
+ * number of its matches already written, a job continues there.
+ *
+ * Hashing, scattering, building, probing and writing run on threads,
+ * each on its own rows or partitions.
+ *
+ * The tables are rows of table1_t ... table3_t or columnar batches,
+ * read through struct hashjoin_col. Keys are kept with their length,
+ * so short keys cost what they are long, not sizeof(hashkey_t).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libsnap.h>
+#include <snap_tools.h>
+#include <snap_internal.h>
+#include <snap_parallel.h>
+#include <snap_hashjoin.h>
+
+#define HJ_MAGIC		0x484153484a4f494eull	/* HASHJOIN */
+#define HJ_PART_ROWS		4096	/* table1 rows per partition */
+#define HJ_RADIX_BITS_MAX	12
+#define HJ_ALIGN		64
+#define HJ_PROBE_BATCH		(256 * 1024)	/* table2 rows */
+
+struct hj_slot {
+	uint32_t fp;		/* Upper 32 hash bits */
+	uint32_t key;		/* 1 + offset of the key, 0: free */
+	uint32_t start;		/* First age of the key */
+	uint32_t count;		/* Rows of the key */
+};
+
+struct hj_part {
+	uint64_t slots;		/* Offsets from the start of the table */
+	uint64_t keys;		/* Length, then bytes, 4 byte aligned */
+	uint64_t ages;
+	uint32_t mask;		/* Slots - 1 */
+	uint32_t nrows;
+};
+
+struct hj_table {
+	uint64_t magic;
+	uint64_t size;		/* Bytes used */
+	uint64_t t1_first;	/* Cached table1 rows */
+	uint64_t t1_rows;
+	uint32_t bits;		/* Radix bits */
+	uint32_t reserved;
+	struct hj_part part[];
+};
+
+struct hj_tuple {
+	uint64_t hash;
+	uint32_t row;		/* From t1_first */
+	uint32_t slot;
+};
+
+#define HJ_PTR(ht, offs, type)	((type)((uint8_t *)(ht) + (offs)))
+
+static inline uint64_t hj_align(uint64_t offs)
+{
+	return (offs + HJ_ALIGN - 1) & ~(uint64_t)(HJ_ALIGN - 1);
+}
+
+/* Bytes a key takes in a partition */
+static inline uint64_t hj_key_size(uint32_t len)
+{
+	return sizeof(uint32_t) + ((len + 3) & ~3u);
+}
+
+/* String of row i, NULL if not there */
+static inline const char *hj_str(const struct hashjoin_col *c, uint64_t i,
+				 uint32_t *len)
+{
+	const char *s;
+
+	if (c->offs) {
+		if (!snap_bitmap_get(c->valid, i)) {
+			*len = 0;
+			return NULL;
+		}
+		*len = c->offs[i + 1] - c->offs[i];
+		return c->base + c->offs[i];
+	}
+	s = c->base + i * c->stride;
+	*len = strnlen(s, sizeof(hashkey_t));
+	return s;
+}
+
+/* Key of row i, NULL for rows not to join: empty names in table rows */
+static inline const char *hj_key(const struct hashjoin_col *c, uint64_t i,
+				 uint32_t *len)
+{
+	const char *s = hj_str(c, i, len);
+
+	if ((c->offs == NULL) && (*len == 0))
+		return NULL;
+	return s;
+}
+
+static inline uint32_t hj_u32(const struct hashjoin_col *c, uint64_t i)
+{
+	uint32_t v;
+
+	memcpy(&v, c->base + i * c->stride, sizeof(v));
+	return v;
+}
+
+/* Key bytes of rows [first, first + n) */
+static uint64_t hj_key_bytes(const struct hashjoin_table *t, uint64_t first,
+			     uint64_t n)
+{
+	if (t->name.offs)
+		return t->name.offs[first + n] - t->name.offs[first];
+	return n * sizeof(hashkey_t);
+}
+
+static inline int hj_key_eq(const uint8_t *keys, uint32_t key,
+			    const char *s, uint32_t len)
+{
+	uint32_t klen;
+
+	memcpy(&klen, keys + key - 1, sizeof(klen));
+	return (klen == len) &&
+		(memcmp(keys + key - 1 + sizeof(klen), s, len) == 0);
+}
+
+static unsigned int hj_radix_bits(uint64_t rows)
+{
+	unsigned int bits = 0;
+
+	while ((bits < HJ_RADIX_BITS_MAX) && ((rows >> bits) > HJ_PART_ROWS))
+		bits++;
+	return bits;
+}
+
+/* Load at most 1/2 */
+static uint64_t hj_part_slots(uint64_t rows)
+{
+	uint64_t slots = 16;
+
+	if (rows == 0)
+		return 0;
+	while (slots < 2 * rows)
+		slots <<= 1;
+	return slots;
+}
+
+uint64_t hashjoin_ht_size(uint64_t t1_rows, uint64_t key_bytes)
+{
+	uint64_t parts = 1ull << hj_radix_bits(t1_rows);
+
+	/* Each partition has at most 16 + 4 * rows slots */
+	return hj_align(sizeof(struct hj_table) +
+			parts * sizeof(struct hj_part)) +
+		(16 * parts + 4 * t1_rows) * sizeof(struct hj_slot) +
+		key_bytes + t1_rows * (hj_key_size(0) + 3) +
+		t1_rows * sizeof(uint32_t) +
+		parts * 3 * HJ_ALIGN;
+}
+
+void hashjoin_t1_rows(struct hashjoin_table *t, const table1_t *t1,
+		      uint64_t rows)
+{
+	memset(t, 0, sizeof(*t));
+	t->rows = rows;
+	t->name.base = t1 ? t1->name : NULL;
+	t->name.stride = sizeof(*t1);
+	t->val.base = t1 ? (const char *)&t1->age : NULL;
+	t->val.stride = sizeof(*t1);
+}
+
+void hashjoin_t2_rows(struct hashjoin_table *t, const table2_t *t2,
+		      uint64_t rows)
+{
+	memset(t, 0, sizeof(*t));
+	t->rows = rows;
+	t->name.base = t2 ? t2->name : NULL;
+	t->name.stride = sizeof(*t2);
+	t->val.base = t2 ? t2->animal : NULL;
+	t->val.stride = sizeof(*t2);
+}
+
+static void hj_batch_col(struct hashjoin_col *c, const struct snap_batch *b,
+			 unsigned int col)
+{
+	if (b->col[col].type == SNAP_COL_UTF8) {
+		c->base = snap_col_heap(b, col);
+		c->offs = snap_col_offs(b, col);
+	} else {
+		c->base = snap_col_values(b, col);
+		c->stride = b->col[col].width;
+	}
+	c->valid = snap_col_bitmap(b, col);
+}
+
+void hashjoin_batch(struct hashjoin_table *t, const struct snap_batch *b)
+{
+	memset(t, 0, sizeof(*t));
+	t->rows = b->rows;
+	hj_batch_col(&t->name, b, 0);
+	hj_batch_col(&t->val, b, 1);
+}
+
+/*
+ * Build
+ */
+struct hj_build {
+	struct hj_table *ht;
+	const struct hashjoin_table *t1;
+	uint64_t first;		/* Row t1_first */
+	uint64_t nrows;
+	unsigned int threads;
+	unsigned int nparts;
+
+	uint64_t *hist;		/* [threads][nparts], then offsets */
+	uint64_t *key_bytes;	/* [threads][nparts] */
+	uint64_t *part_first;	/* [nparts + 1] tuples of each partition */
+	struct hj_tuple *tuples;
+	unsigned int next_part;
+};
+
+/* Key of a row to cache, NULL if the row is not joined */
+static inline const char *hj_build_key(const struct hj_build *b, uint64_t i,
+				       uint32_t *len)
+{
+	const char *s = hj_key(&b->t1->name, b->first + i, len);
+
+	if (!snap_bitmap_get(b->t1->val.valid, b->first + i))
+		return NULL;	/* No age */
+	return s;
+}
+
+static void hj_build_hist(void *arg, unsigned int no)
+{
+	struct hj_build *b = arg;
+	uint64_t *hist = &b->hist[(uint64_t)no * b->nparts];
+	uint64_t *bytes = &b->key_bytes[(uint64_t)no * b->nparts];
+	uint64_t i, end = snap_parallel_share(b->nrows, b->threads, no + 1);
+	const char *s;
+	uint32_t len, p;
+
+	for (i = snap_parallel_share(b->nrows, b->threads, no); i < end; i++) {
+		s = hj_build_key(b, i, &len);
+		if (s == NULL)
+			continue;
+		p = snap_hash_bytes(s, len) & (b->nparts - 1);
+		hist[p]++;
+		bytes[p] += hj_key_size(len);
+	}
+}
+
+static void hj_build_scatter(void *arg, unsigned int no)
+{
+	struct hj_build *b = arg;
+	uint64_t *offs = &b->hist[(uint64_t)no * b->nparts];
+	uint64_t i, h, end = snap_parallel_share(b->nrows, b->threads, no + 1);
+	struct hj_tuple *t;
+	const char *s;
+	uint32_t len;
+
+	for (i = snap_parallel_share(b->nrows, b->threads, no); i < end; i++) {
+		s = hj_build_key(b, i, &len);
+		if (s == NULL)
+			continue;
+		h = snap_hash_bytes(s, len);
+		t = &b->tuples[offs[h & (b->nparts - 1)]++];
+		t->hash = h;
+		t->row = i;
+	}
+}
+
+static void hj_build_part(struct hj_build *b, unsigned int p)
+{
+	struct hj_part *part = &b->ht->part[p];
+	struct hj_slot *slots = HJ_PTR(b->ht, part->slots, struct hj_slot *);
+	uint8_t *keys = HJ_PTR(b->ht, part->keys, uint8_t *);
+	uint32_t *ages = HJ_PTR(b->ht, part->ages, uint32_t *);
+	struct hj_tuple *t;
+	struct hj_slot *s;
+	const char *name;
+	uint32_t idx, fp, len, kpos = 0, run = 0;
+	uint64_t i;
+
+	if (part->nrows == 0)
+		return;
+	memset(slots, 0, ((uint64_t)part->mask + 1) * sizeof(*slots));
+
+	/* Distinct keys, rows per key */
+	for (i = b->part_first[p]; i < b->part_first[p + 1]; i++) {
+		t = &b->tuples[i];
+		name = hj_key(&b->t1->name, b->first + t->row, &len);
+		fp = t->hash >> 32;
+		idx = (t->hash >> b->ht->bits) & part->mask;
+		for (;; idx = (idx + 1) & part->mask) {
+			s = &slots[idx];
+			if (s->key == 0) {
+				memcpy(keys + kpos, &len, sizeof(len));
+				memcpy(keys + kpos + sizeof(len), name, len);
+				s->fp = fp;
+				s->key = kpos + 1;
+				s->count = 1;
+				kpos += hj_key_size(len);
+				break;
+			}
+			if ((s->fp == fp) &&
+			    hj_key_eq(keys, s->key, name, len)) {
+				s->count++;
+				break;
+			}
+		}
+		t->slot = idx;
+	}
+
+	for (idx = 0; idx <= part->mask; idx++) {
+		s = &slots[idx];
+		if (s->key == 0)
+			continue;
+		s->start = run;
+		run += s->count;
+		s->count = 0;
+	}
+
+	/* Tuples are in table1 order, so are the ages of a key */
+	for (i = b->part_first[p]; i < b->part_first[p + 1]; i++) {
+		t = &b->tuples[i];
+		s = &slots[t->slot];
+		ages[s->start + s->count++] = hj_u32(&b->t1->val,
+						     b->first + t->row);
+	}
+}
+
+static void hj_build_parts(void *arg, unsigned int no __attribute__((unused)))
+{
+	struct hj_build *b = arg;
+	unsigned int p;
+
+	while ((p = __atomic_fetch_add(&b->next_part, 1, __ATOMIC_RELAXED)) <
+	       b->nparts)
+		hj_build_part(b, p);
+}
+
+/* Largest number of rows from first on, which fits into ht_size */
+static uint64_t hj_fit(const struct hashjoin_table *t1, uint64_t first,
+		       uint64_t ht_size)
+{
+	uint64_t lo = 0, hi = t1->rows - first, mid;
+
+	if (hashjoin_ht_size(hi, hj_key_bytes(t1, first, hi)) <= ht_size)
+		return hi;
+	while (lo < hi) {
+		mid = hi - (hi - lo) / 2;
+		if (hashjoin_ht_size(mid, hj_key_bytes(t1, first, mid)) <=
+		    ht_size)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+int hashjoin_build(void *ht, struct hashjoin_job *hj,
+		   const struct hashjoin_table *t1, unsigned int threads)
+{
+	struct hj_build b;
+	struct hj_table *t = ht;
+	uint64_t offs, sum, n, bytes;
+	unsigned int i, p;
+	int rc = -1;
+
+	memset(&b, 0, sizeof(b));
+	b.first = hj->t1_processed;
+	b.nrows = hj_fit(t1, b.first, hj->hashtable.size);
+	if (b.nrows == 0) {
+		fprintf(stderr, "err: hashtable of %u bytes too small\n",
+			hj->hashtable.size);
+		errno = ENOSPC;
+		return -1;
+	}
+
+	b.ht = t;
+	b.t1 = t1;
+	b.threads = snap_parallel_threads(threads, b.nrows);
+	t->bits = hj_radix_bits(b.nrows);
+	b.nparts = 1u << t->bits;
+
+	b.hist = calloc((uint64_t)b.threads * b.nparts, sizeof(*b.hist));
+	b.key_bytes = calloc((uint64_t)b.threads * b.nparts,
+			     sizeof(*b.key_bytes));
+	b.part_first = calloc(b.nparts + 1, sizeof(*b.part_first));
+	b.tuples = malloc(b.nrows * sizeof(*b.tuples));
+	if (!b.hist || !b.key_bytes || !b.part_first || !b.tuples)
+		goto out;
+
+	snap_parallel(b.threads, hj_build_hist, &b);
+
+	/* Histograms to scatter offsets, partition by partition */
+	for (p = 0, sum = 0; p < b.nparts; p++) {
+		b.part_first[p] = sum;
+		for (i = 0; i < b.threads; i++) {
+			n = b.hist[(uint64_t)i * b.nparts + p];
+			b.hist[(uint64_t)i * b.nparts + p] = sum;
+			sum += n;
+		}
+	}
+	b.part_first[b.nparts] = sum;
+
+	offs = hj_align(sizeof(*t) + b.nparts * sizeof(struct hj_part));
+	for (p = 0; p < b.nparts; p++) {
+		struct hj_part *part = &t->part[p];
+		uint64_t slots;
+
+		for (i = 0, bytes = 0; i < b.threads; i++)
+			bytes += b.key_bytes[(uint64_t)i * b.nparts + p];
+		part->nrows = b.part_first[p + 1] - b.part_first[p];
+		slots = hj_part_slots(part->nrows);
+		part->mask = slots ? slots - 1 : 0;
+		part->slots = offs;
+		offs = hj_align(offs + slots * sizeof(struct hj_slot));
+		part->keys = offs;
+		offs = hj_align(offs + bytes);
+		part->ages = offs;
+		offs = hj_align(offs + part->nrows * sizeof(uint32_t));
+	}
+
+	snap_parallel(b.threads, hj_build_scatter, &b);
+	snap_parallel(b.threads, hj_build_parts, &b);
+
+	t->magic = HJ_MAGIC;
+	t->size = offs;
+	t->t1_first = b.first;
+	t->t1_rows = b.nrows;
+	hj->t1_processed = b.first + b.nrows;
+
+	act_trace("  %s: rows %lld..%lld %d partitions %lld bytes "
+		  "%d threads\n", __func__, (long long)b.first,
+		  (long long)(b.first + b.nrows), b.nparts, (long long)offs,
+		  b.threads);
+	rc = 0;
+ out:
+	free(b.hist);
+	free(b.key_bytes);
+	free(b.part_first);
+	free(b.tuples);
+	return rc;
+}
+
+/*
+ * Probe
+ */
+struct hj_probe {
+	const struct hj_table *ht;
+	const struct hashjoin_table *t2;
+	uint64_t first;		/* First row of the batch */
+	uint32_t nrows;
+	unsigned int threads;
+	unsigned int nparts;
+
+	uint64_t *hash;		/* [nrows] */
+	uint32_t *order;	/* Batch rows by partition */
+	uint64_t *hist;		/* [threads][nparts], then offsets */
+	uint64_t *part_first;	/* [nparts + 1] */
+	const uint32_t **ages;	/* [nrows] first age of a match */
+	uint32_t *count;	/* [nrows] matches */
+	unsigned int next_part;
+
+	/* Output of the cut batch */
+	struct hashjoin_out *t3;
+	unsigned int emit_threads;
+	uint32_t emit_rows;	/* Rows with output */
+	uint32_t skip;		/* Matches of row 0 done before */
+	uint64_t *out;		/* [nrows + 1] first table3 row */
+	uint64_t *out_name;	/* [nrows + 1] batch: heap offsets */
+	uint64_t *out_animal;
+};
+
+static void hj_probe_hist(void *arg, unsigned int no)
+{
+	struct hj_probe *pr = arg;
+	uint64_t *hist = &pr->hist[(uint64_t)no * pr->nparts];
+	uint32_t i, len;
+	uint32_t end = snap_parallel_share(pr->nrows, pr->threads, no + 1);
+	const char *s;
+
+	i = snap_parallel_share(pr->nrows, pr->threads, no);
+	for (; i < end; i++) {
+		pr->count[i] = 0;
+		s = hj_key(&pr->t2->name, pr->first + i, &len);
+		if (s == NULL)
+			continue;
+		pr->hash[i] = snap_hash_bytes(s, len);
+		hist[pr->hash[i] & (pr->nparts - 1)]++;
+	}
+}
+
+static void hj_probe_scatter(void *arg, unsigned int no)
+{
+	struct hj_probe *pr = arg;
+	uint64_t *offs = &pr->hist[(uint64_t)no * pr->nparts];
+	uint32_t i, len;
+	uint32_t end = snap_parallel_share(pr->nrows, pr->threads, no + 1);
+
+	i = snap_parallel_share(pr->nrows, pr->threads, no);
+	for (; i < end; i++) {
+		if (hj_key(&pr->t2->name, pr->first + i, &len) == NULL)
+			continue;
+		pr->order[offs[pr->hash[i] & (pr->nparts - 1)]++] = i;
+	}
+}
+
+static void hj_probe_parts(void *arg, unsigned int no __attribute__((unused)))
+{
+	struct hj_probe *pr = arg;
+	const struct hj_table *ht = pr->ht;
+	const struct hj_part *part;
+	const struct hj_slot *slots, *s;
+	const uint8_t *keys;
+	const char *name;
+	uint32_t idx, fp, row, len;
+	unsigned int p;
+	uint64_t i, h;
+
+	while ((p = __atomic_fetch_add(&pr->next_part, 1, __ATOMIC_RELAXED)) <
+	       pr->nparts) {
+		part = &ht->part[p];
+		if (part->nrows == 0)
+			continue;
+		slots = HJ_PTR(ht, part->slots, const struct hj_slot *);
+		keys = HJ_PTR(ht, part->keys, const uint8_t *);
+
+		for (i = pr->part_first[p]; i < pr->part_first[p + 1]; i++) {
+			row = pr->order[i];
+			name = hj_key(&pr->t2->name, pr->first + row, &len);
+			h = pr->hash[row];
+			fp = h >> 32;
+			for (idx = (h >> ht->bits) & part->mask;;
+			     idx = (idx + 1) & part->mask) {
+				s = &slots[idx];
+				if (s->key == 0)
+					break;
+				if ((s->fp == fp) &&
+				    hj_key_eq(keys, s->key, name, len)) {
+					pr->ages[row] = HJ_PTR(ht,
+						part->ages, const uint32_t *) +
+						s->start;
+					pr->count[row] = s->count;
+					break;
+				}
+			}
+		}
+	}
+}
+
+static void hj_put_key(hashkey_t dst, const char *s, uint32_t len)
+{
+	len = MIN(len, (uint32_t)sizeof(hashkey_t));
+	memcpy(dst, s, len);
+	memset(dst + len, 0, sizeof(hashkey_t) - len);
+}
+
+static void hj_probe_emit(void *arg, unsigned int no)
+{
+	struct hj_probe *pr = arg;
+	struct snap_batch *b = pr->t3->batch;
+	uint32_t i, j, n, from, nlen, alen;
+	uint32_t end = snap_parallel_share(pr->emit_rows, pr->emit_threads,
+					   no + 1);
+	uint32_t *noffs = NULL, *aoffs = NULL, *age = NULL;
+	char *nheap = NULL, *aheap = NULL;
+	const char *name, *animal;
+	uint64_t r;
+	table3_t *t3;
+
+	if (b) {
+		noffs = snap_col_offs(b, 0);
+		aoffs = snap_col_offs(b, 1);
+		nheap = snap_col_heap(b, 0);
+		aheap = snap_col_heap(b, 1);
+		age = snap_col_values(b, 2);
+	}
+
+	i = snap_parallel_share(pr->emit_rows, pr->emit_threads, no);
+	for (; i < end; i++) {
+		from = (i == 0) ? pr->skip : 0;
+		n = pr->out[i + 1] - pr->out[i];
+		if (n == 0)
+			continue;
+		name = hj_str(&pr->t2->name, pr->first + i, &nlen);
+		animal = hj_str(&pr->t2->val, pr->first + i, &alen);
+
+		for (j = 0; j < n; j++) {
+			r = pr->out[i] + j;
+			if (b == NULL) {
+				t3 = &pr->t3->t3[r];
+				hj_put_key(t3->name, name, nlen);
+				hj_put_key(t3->animal, animal, alen);
+				t3->age = pr->ages[i][from + j];
+				continue;
+			}
+			memcpy(nheap + pr->out_name[i] + j * nlen, name, nlen);
+			noffs[r + 1] = pr->out_name[i] + (j + 1) * nlen;
+			memcpy(aheap + pr->out_animal[i] + j * alen, animal,
+			       alen);
+			aoffs[r + 1] = pr->out_animal[i] + (j + 1) * alen;
+			age[r] = pr->ages[i][from + j];
+		}
+	}
+}
+
+/* Validity bits of the table3 batch, one thread, bits share bytes */
+static void hj_probe_valid(struct hj_probe *pr)
+{
+	struct snap_batch *b = pr->t3->batch;
+	uint32_t i;
+	uint64_t r;
+	int valid;
+
+	for (i = 0; i < pr->emit_rows; i++) {
+		valid = snap_bitmap_get(pr->t2->val.valid, pr->first + i);
+		for (r = pr->out[i]; r < pr->out[i + 1]; r++) {
+			snap_col_set_valid(b, 0, r, 1);
+			snap_col_set_valid(b, 1, r, valid);
+			snap_col_set_valid(b, 2, r, 1);
+		}
+	}
+}
+
+/* Matches of row i fitting into table3 after the rows before */
+static uint64_t hj_probe_fit(struct hj_probe *pr, uint32_t i, uint64_t n)
+{
+	struct snap_batch *b = pr->t3->batch;
+	uint32_t nlen, alen;
+
+	n = MIN(n, pr->t3->capacity - pr->out[i]);
+	if (b == NULL)
+		return n;
+
+	hj_str(&pr->t2->name, pr->first + i, &nlen);
+	hj_str(&pr->t2->val, pr->first + i, &alen);
+	if (nlen)
+		n = MIN(n, (b->col[0].heap_size - pr->out_name[i]) / nlen);
+	if (alen)
+		n = MIN(n, (b->col[1].heap_size - pr->out_animal[i]) / alen);
+	pr->out_name[i + 1] = pr->out_name[i] + n * nlen;
+	pr->out_animal[i + 1] = pr->out_animal[i] + n * alen;
+	return n;
+}
+
+int hashjoin_probe(const void *ht, struct hashjoin_job *hj,
+		   const struct hashjoin_table *t2, struct hashjoin_out *t3,
+		   unsigned int threads)
+{
+	struct hj_probe pr;
+	const struct hj_table *t = ht;
+	uint64_t row = hj->t2_processed, produced = 0, sum, n, fit;
+	uint32_t batch, i, skip = hj->checkpoint, cut;
+	unsigned int p, k;
+	int rc = -1;
+
+	if ((t == NULL) || (t->magic != HJ_MAGIC) || (row > t2->rows) ||
+	    (t3->capacity == 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&pr, 0, sizeof(pr));
+	pr.ht = t;
+	pr.t2 = t2;
+	pr.t3 = t3;
+	pr.nparts = 1u << t->bits;
+	/* About one match a row, no need to look up far more than fits */
+	batch = MIN(MIN(t2->rows - row, (uint64_t)HJ_PROBE_BATCH),
+		    MAX(t3->capacity, (uint64_t)1024));
+	pr.threads = snap_parallel_threads(threads, batch);
+
+	pr.hash = malloc((uint64_t)batch * sizeof(*pr.hash));
+	pr.order = malloc((uint64_t)batch * sizeof(*pr.order));
+	pr.ages = malloc((uint64_t)batch * sizeof(*pr.ages));
+	pr.count = malloc((uint64_t)batch * sizeof(*pr.count));
+	pr.out = malloc(((uint64_t)batch + 1) * sizeof(*pr.out));
+	pr.out_name = malloc(((uint64_t)batch + 1) * sizeof(*pr.out_name));
+	pr.out_animal = malloc(((uint64_t)batch + 1) * sizeof(*pr.out_animal));
+	pr.hist = malloc((uint64_t)pr.threads * pr.nparts * sizeof(*pr.hist));
+	pr.part_first = malloc((pr.nparts + 1) * sizeof(*pr.part_first));
+	if (!pr.hash || !pr.order || !pr.ages || !pr.count || !pr.out ||
+	    !pr.out_name || !pr.out_animal || !pr.hist || !pr.part_first)
+		goto out;
+
+	pr.out_name[0] = 0;
+	pr.out_animal[0] = 0;
+	if (t3->batch) {
+		snap_col_offs(t3->batch, 0)[0] = 0;
+		snap_col_offs(t3->batch, 1)[0] = 0;
+	}
+
+	while ((row < t2->rows) && (produced < t3->capacity)) {
+		pr.first = row;
+		pr.nrows = MIN(t2->rows - row, (uint64_t)batch);
+		pr.next_part = 0;
+		memset(pr.hist, 0,
+		       (uint64_t)pr.threads * pr.nparts * sizeof(*pr.hist));
+
+		snap_parallel(pr.threads, hj_probe_hist, &pr);
+		for (p = 0, sum = 0; p < pr.nparts; p++) {
+			pr.part_first[p] = sum;
+			for (k = 0; k < pr.threads; k++) {
+				n = pr.hist[(uint64_t)k * pr.nparts + p];
+				pr.hist[(uint64_t)k * pr.nparts + p] = sum;
+				sum += n;
+			}
+		}
+		pr.part_first[pr.nparts] = sum;
+		snap_parallel(pr.threads, hj_probe_scatter, &pr);
+		snap_parallel(pr.threads, hj_probe_parts, &pr);
+
+		/* Cut where table3 is full, in table2 order */
+		pr.skip = skip;
+		pr.out[0] = produced;
+		for (i = 0, cut = 0; i < pr.nrows; i++) {
+			n = pr.count[i] - ((i == 0) ? MIN(skip, pr.count[0]) : 0);
+			fit = hj_probe_fit(&pr, i, n);
+			pr.out[i + 1] = pr.out[i] + fit;
+			if (fit < n) {		/* Partly, continue later */
+				if (pr.out[i + 1] == 0) {
+					/* Not even one match fits */
+					errno = ENOSPC;
+					goto out;
+				}
+				skip = ((i == 0) ? skip : 0) + fit;
+				cut = 1;
+				i++;
+				break;
+			}
+		}
+		pr.emit_rows = i;
+		pr.emit_threads = snap_parallel_threads(pr.threads,
+							pr.out[i] - produced);
+		snap_parallel(pr.emit_threads, hj_probe_emit, &pr);
+		if (t3->batch)
+			hj_probe_valid(&pr);
+
+		produced = pr.out[i];
+		if (t3->batch) {
+			pr.out_name[0] = pr.out_name[i];
+			pr.out_animal[0] = pr.out_animal[i];
+		}
+		if (cut) {
+			row += i - 1;	/* The row cut stays the next one */
+			break;
+		}
+		row += i;
+		skip = 0;
+	}
+
+	if (t3->batch)
+		t3->batch->rows = produced;
+	hj->t2_processed = row;
+	hj->checkpoint = skip;
+	hj->t3_produced = produced;
+	act_trace("  %s: t2_processed=%lld checkpoint=%lld t3_produced=%lld\n",
+		  __func__, (long long)row, (long long)skip,
+		  (long long)produced);
+	rc = 0;
+ out:
+	free(pr.hash);
+	free(pr.order);
+	free(pr.ages);
+	free(pr.count);
+	free(pr.out);
+	free(pr.out_name);
+	free(pr.out_animal);
+	free(pr.hist);
+	free(pr.part_first);
+	return rc;
+}
@@ -49,8 +49,9 @@ using namespace std;
 // V1.6 : 06/21/2017 : USE ARRAY_PARITION to provide parallel sorting. 
 //                     Use #ifdef to compile hash method and sort method.
 // V1.7 : 07/12/2017 : Split hash method and sort method to two directories.                    
+// V1.8 : 10/18/2026 : Pipelined step 6, tables streamed from Host, result to Host.
 //--------------------------------------------------------------------------------------------
-#define HW_RELEASE_LEVEL       0x00000017
+#define HW_RELEASE_LEVEL       0x00000018
 
 snapu32_t read_bulk ( snap_membus_t *src_mem,
         snapu64_t      byte_address,
@@ -226,104 +227,141 @@ snap_bool_t  read_update_ram (ap_uint <HT_ENTRY_NUM_EXP> index, snap_bool_t with
 }
 
 
-short make_hashtable(snap_membus_t  *d_ddrmem,
-        action_reg *Action_Register)
+//Hash Table arrangement:
+// Starting from HASH_TABLE_ADDR
+// Only stores the address of input
+// Still 64bytes:
+// Byte0-3: Count
+// Byte4-7: offset0  (offset to src_tables_ddr0.addr)
+// Byte8-11: offset1
+// ....
+// Byte60-63: offset14
+
+// Add num elements of Table1 at offset to the hash table
+void hash_keys(snap_membus_t  *d_ddrmem,
+        ele_t           *keybuf,
+        short            num,
+        snapu32_t        offset,
+        short           *rc)
 {
-    // int type can represent -2G~+2G
-    // Input table size is designed to be <=1GB
     ap_uint<HT_ENTRY_NUM_EXP> index;
-
-    short ijk;
-    snapu32_t read_bytes;
-    snapu64_t addr = Action_Register->Data.src_tables_ddr0.addr;
-    int left_bytes = Action_Register->Data.src_tables_ddr0.size;
-    snapu32_t offset = 0;
-
-    ele_t keybuf[MAX_NB_OF_BYTES_READ/ELE_BYTES];
     ele_t hash_entry, new_entry;
-
     ap_uint<5> count;
     snap_bool_t used = 0;
+    short ijk;
 
+    *rc = 0;
+    for (ijk = 0; ijk < num; ijk++)
+    {
+        index = ht_hash(keybuf[ijk]);
 
-    //Hash Table arrangement:
-    // Starting from HASH_TABLE_ADDR
-    // Only stores the address of input
-    // Still 64bytes:
-    // Byte0-3: Count
-    // Byte4-7: offset0  (offset to src_tables_ddr0.addr)
-    // Byte8-11: offset1
-    // ....
-    // Byte60-63: offset14
+        used = read_update_ram(index, 1);
 
-    while (left_bytes > 0)
-    {
-        read_bytes = read_bulk (d_ddrmem, addr,  left_bytes, keybuf);
 
-        for (ijk = 0; ijk < read_bytes/ELE_BYTES; ijk++)
+        new_entry = 0;
+        if(used == 0)
         {
-            index = ht_hash(keybuf[ijk]);
-
-            used = read_update_ram(index, 1);
+            new_entry(31,0) = 1;
+            new_entry(63,32) = offset;
+            write_single(d_ddrmem, HASH_TABLE_ADDR + index * ELE_BYTES, new_entry);
 
+        }
+        else
+        {
+            read_single(d_ddrmem, HASH_TABLE_ADDR + index * ELE_BYTES, &hash_entry);
+            count = hash_entry(31,0);
 
-            new_entry = 0;
-            if(used == 0)
+            if (count >= 15)
             {
-                new_entry(31,0) = 1;
-                new_entry(63,32) = offset;
-                write_single(d_ddrmem, HASH_TABLE_ADDR + index * ELE_BYTES, new_entry);
-
+                *rc = -1; //Hash Table is full.
+                return;
             }
             else
             {
-                read_single(d_ddrmem, HASH_TABLE_ADDR + index * ELE_BYTES, &hash_entry);
-                count = hash_entry(31,0);
-
-                if (count >= 15)
-                    return -1; //Hash Table is full.
-                else
-                {
-                    new_entry = hash_entry;
-                    new_entry(31,0) = count + 1;
-                    new_entry((count+1)*32+31, (count+1)*32) = offset;
-                    write_single(d_ddrmem, HASH_TABLE_ADDR + index * ELE_BYTES, new_entry);
-                }
+                new_entry = hash_entry;
+                new_entry(31,0) = count + 1;
+                new_entry((count+1)*32+31, (count+1)*32) = offset;
+                write_single(d_ddrmem, HASH_TABLE_ADDR + index * ELE_BYTES, new_entry);
             }
+        }
 
-            offset += ELE_BYTES;
+        offset += ELE_BYTES;
+    }
+}
 
+short make_hashtable(snap_membus_t  *d_ddrmem,
+        action_reg *Action_Register)
+{
+    // int type can represent -2G~+2G
+    // Input table size is designed to be <=1GB
+    short rc;
+    snapu32_t read_bytes;
+    snapu64_t addr = Action_Register->Data.src_tables_ddr0.addr;
+    int left_bytes = Action_Register->Data.src_tables_ddr0.size;
+    snapu32_t offset = 0;
 
-        }
+    ele_t keybuf[MAX_NB_OF_BYTES_READ/ELE_BYTES];
+
+    while (left_bytes > 0)
+    {
+        read_bytes = read_bulk (d_ddrmem, addr,  left_bytes, keybuf);
+        hash_keys(d_ddrmem, keybuf, read_bytes/ELE_BYTES, offset, &rc);
+        if (rc != 0)
+            return -1;
+
+        offset     += MAX_NB_OF_BYTES_READ;
         left_bytes -= MAX_NB_OF_BYTES_READ;
         addr       += MAX_NB_OF_BYTES_READ;
     }
     return 0;
 }
 
-snapu32_t check_table2(snap_membus_t  *d_ddrmem,
-        action_reg      *Action_Register)
+// Look for key in Table1, 1 with it in *node_a if there
+snap_bool_t hash_lookup(snap_membus_t  *d_ddrmem,
+        snapu64_t        table1_addr,
+        ele_t            key,
+        ele_t           *node_a)
 {
     ap_uint<HT_ENTRY_NUM_EXP> index;
+    ele_t hash_entry;
+    snapu32_t count;
+    snapu32_t offset;
+    short j;
+
+    index = ht_hash(key);
+    if (read_update_ram(index, 0) == 0) //just read
+        return 0;
 
+    read_single(d_ddrmem, HASH_TABLE_ADDR + index * ELE_BYTES, &hash_entry);
+    count = hash_entry(31,0); //How many elements are in the same hash table entry
+    //If count == 0, this element in Table2 doesn't exist in Table1.
+    for (j = 0; j < count; j++)
+    {
+        //Go to read Table1
+        offset = hash_entry(32*(j+1)+31, 32*(j+1));
+
+        read_single(d_ddrmem, table1_addr + offset, node_a);
+
+        if (compare_eq(*node_a, key) == 1)
+            return 1; //match!
+    }
+    return 0;
+}
+
+snapu32_t check_table2(snap_membus_t  *d_ddrmem,
+        action_reg      *Action_Register)
+{
     short iii;
-    short j;
     snapu32_t read_bytes;
     snapu64_t addr = Action_Register->Data.src_tables_ddr1.addr;
     int left_bytes = Action_Register->Data.src_tables_ddr1.size;
-    snapu32_t offset = 0;
 
     ele_t keybuf[MAX_NB_OF_BYTES_READ/ELE_BYTES];
-    ele_t hash_entry;
     ele_t node_a;
 
-    snapu32_t count;
     snapu32_t res_size = 0;
     snapu64_t write_addr = Action_Register->Data.result_table.addr;
 
-    snap_bool_t used = 0;
-    ap_uint<BRAM_WIDTH> ram_q;
-
     while (left_bytes > 0)
     {
         read_bytes = read_bulk (d_ddrmem, addr,  left_bytes, keybuf);
@@ -331,30 +369,12 @@ snapu32_t check_table2(snap_membus_t  *d_ddrmem,
         for (iii = 0; iii < read_bytes/ELE_BYTES; iii++)
         {
             //Current element in Table2 is keybuf[i]
-            index = ht_hash(keybuf[iii]);
-            used = read_update_ram(index, 0); //just read
-
-            if(used == 1)
+            if (hash_lookup(d_ddrmem, Action_Register->Data.src_tables_ddr0.addr,
+                        keybuf[iii], &node_a) == 1)
             {
-                read_single(d_ddrmem, HASH_TABLE_ADDR + index * ELE_BYTES, &hash_entry);
-                count = hash_entry(31,0); //How many elements are in the same hash table entry
-                //If count == 0, this element in Table2 doesn't exist in Table1.
-                for (j = 0; j < count; j++)
-                {
-                    //Go to read Table1
-                    offset = hash_entry(32*(j+1)+31, 32*(j+1));
-
-                    read_single(d_ddrmem, Action_Register->Data.src_tables_ddr0.addr + offset, &node_a);
-
-                    if (compare_eq(node_a, keybuf[iii] ) == 1)
-                    {
-                        //match!
-                        write_single(d_ddrmem, write_addr, node_a);
-                        res_size += ELE_BYTES;
-                        write_addr += ELE_BYTES;
-                        break;
-                    }
-                }
+                write_single(d_ddrmem, write_addr, node_a);
+                res_size += ELE_BYTES;
+                write_addr += ELE_BYTES;
             }
         }
         left_bytes -= MAX_NB_OF_BYTES_READ;
@@ -363,6 +383,200 @@ snapu32_t check_table2(snap_membus_t  *d_ddrmem,
     return res_size;
 }
 
+/////////////////////////////////////////////////////
+//   Pipelined step: 1, 3 and 5 in one job
+/////////////////////////////////////////////////////
+// The chunks come from the host into two buffers in turn, DATAFLOW
+// reads the next one while the current one is worked on. Each process
+// of a DATAFLOW region has the m_axi bundles it uses to itself and each
+// buffer has one producer and one consumer, else HLS does not overlap
+// them.
+
+// Table1: the current chunk goes to DDR and into the hash table
+static void store_hash_keys(snap_membus_t  *d_ddrmem,
+        snapu64_t       ddr_addr,
+        snapu32_t       offset,
+        snapu32_t       bytes,
+        ele_t          *buf,
+        short          *rc)
+{
+    write_bulk(d_ddrmem, ddr_addr, bytes, buf);
+    hash_keys(d_ddrmem, buf, bytes/ELE_BYTES, offset, rc);
+}
+
+static void hash_stage(snap_membus_t  *din_gmem,
+        snap_membus_t  *d_ddrmem,
+        snapu64_t       next_addr,
+        snapu32_t       next_bytes,
+        ele_t          *next_buf,
+        snapu64_t       ddr_addr,
+        snapu32_t       offset,
+        snapu32_t       bytes,
+        ele_t          *buf,
+        short          *rc)
+{
+#pragma HLS DATAFLOW
+    read_bulk(din_gmem, next_addr, next_bytes, next_buf);
+    store_hash_keys(d_ddrmem, ddr_addr, offset, bytes, buf, rc);
+}
+
+short pipe_hashtable(snap_membus_t  *din_gmem,
+        snap_membus_t  *d_ddrmem,
+        action_reg      *Action_Register)
+{
+    ele_t keybuf0[MAX_NB_OF_BYTES_READ/ELE_BYTES];
+    ele_t keybuf1[MAX_NB_OF_BYTES_READ/ELE_BYTES];
+    snapu64_t src = Action_Register->Data.src_tables_host0.addr;
+    snapu64_t dst = Action_Register->Data.src_tables_ddr0.addr;
+    snapu32_t left_bytes = Action_Register->Data.src_tables_host0.size;
+    snapu32_t bytes, next_bytes;
+    snapu32_t offset = 0;
+    ap_uint<1> cur = 0;
+    short rc = 0;
+
+    bytes = read_bulk(din_gmem, src, left_bytes, keybuf0);
+    while (left_bytes > 0)
+    {
+        next_bytes = left_bytes - bytes;
+        if (next_bytes > MAX_NB_OF_BYTES_READ)
+            next_bytes = MAX_NB_OF_BYTES_READ;
+        if (cur == 0)
+            hash_stage(din_gmem, d_ddrmem, src + MAX_NB_OF_BYTES_READ, next_bytes, keybuf1,
+                    dst, offset, bytes, keybuf0, &rc);
+        else
+            hash_stage(din_gmem, d_ddrmem, src + MAX_NB_OF_BYTES_READ, next_bytes, keybuf0,
+                    dst, offset, bytes, keybuf1, &rc);
+        if (rc != 0)
+            return -1;
+
+        left_bytes -= bytes;
+        bytes       = next_bytes;
+        offset     += MAX_NB_OF_BYTES_READ;
+        src        += MAX_NB_OF_BYTES_READ;
+        dst        += MAX_NB_OF_BYTES_READ;
+        cur         = cur ^ 1;
+    }
+    return 0;
+}
+
+// Table2: the current chunk is looked up, the matches of the one
+// before go to the host
+static void probe_keys(snap_membus_t  *d_ddrmem,
+        snapu64_t        table1_addr,
+        snapu32_t        bytes,
+        ele_t           *buf,
+        ele_t           *resbuf,
+        snapu32_t       *res_bytes)
+{
+    ele_t node_a;
+    snapu32_t n = 0;
+    short iii;
+
+    for (iii = 0; iii < bytes/ELE_BYTES; iii++)
+    {
+        if (hash_lookup(d_ddrmem, table1_addr, buf[iii], &node_a) == 1)
+        {
+            resbuf[n] = node_a;
+            n++;
+        }
+    }
+    *res_bytes = n * ELE_BYTES;
+}
+
+// din_gmem and dout_gmem are both the host_mem bundle, one process
+// writes the matches of the chunk before and reads the next chunk
+static void probe_host_io(snap_membus_t  *din_gmem,
+        snap_membus_t  *dout_gmem,
+        snapu64_t       next_addr,
+        snapu32_t       next_bytes,
+        ele_t          *next_buf,
+        snapu64_t       prev_addr,
+        snapu32_t       prev_bytes,
+        ele_t          *prev_resbuf)
+{
+    write_bulk(dout_gmem, prev_addr, prev_bytes, prev_resbuf);
+    read_bulk(din_gmem, next_addr, next_bytes, next_buf);
+}
+
+static void probe_stage(snap_membus_t  *din_gmem,
+        snap_membus_t  *dout_gmem,
+        snap_membus_t  *d_ddrmem,
+        snapu64_t       next_addr,
+        snapu32_t       next_bytes,
+        ele_t          *next_buf,
+        snapu64_t       table1_addr,
+        snapu32_t       bytes,
+        ele_t          *buf,
+        ele_t          *resbuf,
+        snapu32_t      *res_bytes,
+        snapu64_t       prev_addr,
+        snapu32_t       prev_bytes,
+        ele_t          *prev_resbuf)
+{
+#pragma HLS DATAFLOW
+    probe_host_io(din_gmem, dout_gmem, next_addr, next_bytes, next_buf,
+            prev_addr, prev_bytes, prev_resbuf);
+    probe_keys(d_ddrmem, table1_addr, bytes, buf, resbuf, res_bytes);
+}
+
+snapu32_t pipe_check_table2(snap_membus_t  *din_gmem,
+        snap_membus_t  *dout_gmem,
+        snap_membus_t  *d_ddrmem,
+        action_reg      *Action_Register)
+{
+    ele_t keybuf0[MAX_NB_OF_BYTES_READ/ELE_BYTES];
+    ele_t keybuf1[MAX_NB_OF_BYTES_READ/ELE_BYTES];
+    ele_t resbuf0[MAX_NB_OF_BYTES_READ/ELE_BYTES];
+    ele_t resbuf1[MAX_NB_OF_BYTES_READ/ELE_BYTES];
+    snapu64_t src = Action_Register->Data.src_tables_host1.addr;
+    snapu64_t table1_addr = Action_Register->Data.src_tables_ddr0.addr;
+    snapu32_t left_bytes = Action_Register->Data.src_tables_host1.size;
+    snapu32_t bytes, next_bytes;
+    snapu32_t res_bytes = 0, prev_bytes = 0;
+    snapu32_t res_size = 0;
+    snapu64_t write_addr = Action_Register->Data.result_table.addr;
+    ap_uint<1> cur = 0;
+
+    bytes = read_bulk(din_gmem, src, left_bytes, keybuf0);
+    while (left_bytes > 0)
+    {
+        next_bytes = left_bytes - bytes;
+        if (next_bytes > MAX_NB_OF_BYTES_READ)
+            next_bytes = MAX_NB_OF_BYTES_READ;
+        if (cur == 0)
+            probe_stage(din_gmem, dout_gmem, d_ddrmem,
+                    src + MAX_NB_OF_BYTES_READ, next_bytes, keybuf1,
+                    table1_addr, bytes, keybuf0, resbuf0, &res_bytes,
+                    write_addr, prev_bytes, resbuf1);
+        else
+            probe_stage(din_gmem, dout_gmem, d_ddrmem,
+                    src + MAX_NB_OF_BYTES_READ, next_bytes, keybuf0,
+                    table1_addr, bytes, keybuf1, resbuf1, &res_bytes,
+                    write_addr, prev_bytes, resbuf0);
+
+        write_addr += prev_bytes;
+        res_size   += res_bytes;
+        prev_bytes  = res_bytes;
+        left_bytes -= bytes;
+        bytes       = next_bytes;
+        src        += MAX_NB_OF_BYTES_READ;
+        cur         = cur ^ 1;
+    }
+    // Matches of the last chunk
+    if (cur == 0)
+        write_bulk(dout_gmem, write_addr, prev_bytes, resbuf1);
+    else
+        write_bulk(dout_gmem, write_addr, prev_bytes, resbuf0);
+    return res_size;
+}
+
+
+void clear_hash_used()
+{
+    snapu32_t i;
+    for(i = 0; i < (HW_HT_ENTRY_NUM >> WIDTH_EXP); i++)
+        hash_used[i]=0;
+}
 
 //--------------------------------------------------------------------------------------------
 //--- MAIN PROGRAM ---------------------------------------------------------------------------
@@ -420,11 +634,7 @@ void hls_action(snap_membus_t  *din_gmem,
                 Action_Register->Data.src_tables_host1.size, HOST2DDR);
         // Clear the content of hash_used RAM
         if(Action_Register->Data.method == HASH_METHOD)
-        {
-            snapu32_t i;
-            for(i = 0; i < (HW_HT_ENTRY_NUM >> WIDTH_EXP); i++)
-                hash_used[i]=0;
-        }
+            clear_hash_used();
     }
     else if(Action_Register->Data.step == 2)
     {
@@ -456,9 +666,25 @@ void hls_action(snap_membus_t  *din_gmem,
                 Action_Register->Data.src_tables_ddr0.addr, Action_Register->Data.result_table.addr,
                 Action_Register->Data.result_table.size, DDR2HOST);
     }
+    else if (Action_Register->Data.step == PIPELINE_STEP)
+    {
+        //Table1 from Host to DDR and hash table, Table2 from Host
+        //looked up, result to Host. No timer for the stages.
+        clear_hash_used();
+        rc = pipe_hashtable(din_gmem, d_ddrmem, Action_Register);
+        if(rc != 0)
+        {
+            Action_Register->Control.Retc = SNAP_RETC_FAILURE;
+            return;
+        }
+        result_size = pipe_check_table2(din_gmem, dout_gmem, d_ddrmem, Action_Register);
+    }
 
     Action_Register->Control.Retc = SNAP_RETC_SUCCESS;
     Action_Register->Data.result_table.size = result_size;
+    Action_Register->Data.load_usec = 0;
+    Action_Register->Data.compute_usec = 0;
+    Action_Register->Data.store_usec = 0;
     return;
 }
 
@@ -48,8 +48,10 @@ using namespace std;
 // V1.6 : 06/21/2017 : USE ARRAY_PARITION to provide parallel sorting. 
 //                     Use #ifdef to compile hash method and sort method.
 // V1.7 : 07/12/2017 : Split sort and hash methods to two directories
+// V1.8 : 10/18/2026 : Pipelined step 6, tables sorted on their way from Host,
+//                     result to Host.
 //--------------------------------------------------------------------------------------------
-#define HW_RELEASE_LEVEL       0x00000017
+#define HW_RELEASE_LEVEL       0x00000018
 
 snapu32_t read_bulk ( snap_membus_t *src_mem,
         snapu64_t      byte_address,
@@ -278,56 +280,96 @@ bm_loop: for (k = low; k < end; k++) {
 	}
 }
 
-void init_paddings (snap_membus_t * ddr_mem,snapu64_t ddr_addr, snapu32_t offset_w, snapu32_t table_size)
+// Block group of the table into bufs, zeros past the table's end
+static void ls_read (snap_membus_t * src_mem, snapu64_t src_addr, snapu32_t table_size,
+        snapu32_t group, ele_t bufs[NUM_ENGINES][NUM_SORT])
 {
-    ele_t init_value = 0;
-    snapu32_t iii;
-    //Initialize the paddings of last block_group
-    //Address from table_size to the boundry of a block_group
-ip_loop: for ( iii = table_size; iii < offset_w + NUM_ENGINES * ONE_BUF_SIZE; iii += ELE_BYTES)
+    snapu32_t offset, bytes;
+    short kkk, iii;
+
+lsr_loop: for (kkk = 0; kkk < NUM_ENGINES; kkk ++)
+    {
+        offset = group * NUM_ENGINES * ONE_BUF_SIZE + kkk * ONE_BUF_SIZE;
+        bytes = 0;
+        if (offset < table_size)
+            bytes = table_size - offset;
+        if (bytes > ONE_BUF_SIZE)
+            bytes = ONE_BUF_SIZE;
+        read_bulk(src_mem, (src_addr + offset), bytes, bufs[kkk]);
+
+        //Initialize the paddings of last block_group
+ip_loop: for (iii = bytes/ELE_BYTES; iii < NUM_SORT; iii++)
 #pragma HLS PIPELINE
-        write_single(ddr_mem, ddr_addr + iii, init_value);
+            bufs[kkk][iii] = 0;
+    }
 }
 
-void local_sort (snap_membus_t * ddr_mem, snapu64_t ddr_addr, snapu32_t table_size )
+static void ls_sort (snap_membus_t * ddr_mem, snapu32_t group, ele_t bufs[NUM_ENGINES][NUM_SORT])
 {
-    snapu32_t offset = 0;
-    snapu32_t offset_w = 0;
-    snapu32_t num = table_size/ELE_BYTES;
+    snapu32_t offset;
+    short kkk;
 
-    snapu32_t block_groups = num/(NUM_SORT * NUM_ENGINES);
-    offset_w = block_groups * NUM_ENGINES * ONE_BUF_SIZE;
-    snapu32_t jjj, kkk; 
-    
+    for (kkk = 0; kkk < NUM_ENGINES; kkk ++)
+    {
+        #pragma HLS UNROLL
+        bubble_sort(bufs[kkk]);
+    }
 
-    if (offset_w < table_size)
+lsw_loop: for (kkk = 0; kkk < NUM_ENGINES; kkk ++)
     {
-        block_groups ++;
-        init_paddings(ddr_mem, ddr_addr, offset_w, table_size);
+        offset = group * NUM_ENGINES * ONE_BUF_SIZE + kkk * ONE_BUF_SIZE;
+        write_bulk(ddr_mem, (DDR_SORT_SPACE + offset), ONE_BUF_SIZE, bufs[kkk]);
     }
+}
 
+// The next block group is read while this one is sorted. Only for a
+// src_mem other than ddr_mem, each process of a DATAFLOW region needs its
+// m_axi bundle to itself.
+static void ls_stage (snap_membus_t * src_mem, snap_membus_t * ddr_mem,
+        snapu64_t src_addr, snapu32_t table_size,
+        snapu32_t next, ele_t next_bufs[NUM_ENGINES][NUM_SORT],
+        snapu32_t group, ele_t bufs[NUM_ENGINES][NUM_SORT])
+{
+#pragma HLS DATAFLOW
+    ls_read(src_mem, src_addr, table_size, next, next_bufs);
+    ls_sort(ddr_mem, group, bufs);
+}
 
-    ele_t local_bufs[NUM_ENGINES][NUM_SORT];
-#pragma HLS ARRAY_PARTITION variable=local_bufs complete dim=1
-    for (jjj = 0; jjj < block_groups; jjj++) {
+// Table from src_mem (DDR, or Host in the pipelined step), sorted blocks
+// to DDR_SORT_SPACE. from_host overlaps reading and sorting.
+void local_sort (snap_membus_t * src_mem, snapu64_t src_addr,
+        snap_membus_t * ddr_mem, snapu32_t table_size, snap_bool_t from_host)
+{
+    snapu32_t num = table_size/ELE_BYTES;
 
-lsr_loop: for (kkk = 0; kkk < NUM_ENGINES; kkk ++)
-        {
-            offset = jjj * NUM_ENGINES * ONE_BUF_SIZE + kkk * ONE_BUF_SIZE;
-            read_bulk(ddr_mem, (ddr_addr + offset), ONE_BUF_SIZE, local_bufs[kkk]);
-        }
+    snapu32_t block_groups = num/(NUM_SORT * NUM_ENGINES);
+    snapu32_t jjj;
+    ap_uint<1> cur = 0;
 
-        for (kkk = 0; kkk < NUM_ENGINES; kkk ++)
-        {
-            #pragma HLS UNROLL
-            bubble_sort(local_bufs[kkk]);
-        }
+    if (block_groups * NUM_ENGINES * ONE_BUF_SIZE < table_size)
+        block_groups ++;
 
-lsw_loop: for (kkk = 0; kkk < NUM_ENGINES; kkk ++)
-        {
-            offset = jjj * NUM_ENGINES * ONE_BUF_SIZE + kkk * ONE_BUF_SIZE;
-            write_bulk(ddr_mem, (DDR_SORT_SPACE + offset), ONE_BUF_SIZE, local_bufs[kkk]);
+
+    ele_t local_bufs0[NUM_ENGINES][NUM_SORT];
+    ele_t local_bufs1[NUM_ENGINES][NUM_SORT];
+#pragma HLS ARRAY_PARTITION variable=local_bufs0 complete dim=1
+#pragma HLS ARRAY_PARTITION variable=local_bufs1 complete dim=1
+    if (!from_host) {
+        for (jjj = 0; jjj < block_groups; jjj++) {
+            ls_read(src_mem, src_addr, table_size, jjj, local_bufs0);
+            ls_sort(ddr_mem, jjj, local_bufs0);
         }
+        return;
+    }
+
+    if (block_groups > 0)
+        ls_read(src_mem, src_addr, table_size, 0, local_bufs0);
+    for (jjj = 0; jjj < block_groups; jjj++) {
+        if (cur == 0)
+            ls_stage(src_mem, ddr_mem, src_addr, table_size, jjj + 1, local_bufs1, jjj, local_bufs0);
+        else
+            ls_stage(src_mem, ddr_mem, src_addr, table_size, jjj + 1, local_bufs0, jjj, local_bufs1);
+        cur = cur ^ 1;
     }
 }
 
@@ -358,10 +400,13 @@ void merge_sort (snap_membus_t * ddr_mem, snapu64_t ddr_addr, snapu32_t table_si
         memcopy_table_DDR2DDR(ddr_mem, DDR_SORT_SPACE, ddr_addr, table_size);
 }
 
-snapu32_t merge_intersection(snap_membus_t * ddr_mem, action_reg *Action_Register)
+// Result to out_mem, DDR or Host in the pipelined step
+snapu32_t merge_intersection(snap_membus_t * ddr_mem, snap_membus_t * out_mem, action_reg *Action_Register)
 {
     snapu32_t i, j, res_size;
     ele_t val_i, val_j;
+    ele_t resbuf[MAX_NB_OF_BYTES_READ/ELE_BYTES];
+    snapu32_t n = 0;
 
     snapu64_t res_address = Action_Register->Data.result_table.addr;
     i = 0;
@@ -374,12 +419,18 @@ snapu32_t merge_intersection(snap_membus_t * ddr_mem, action_reg *Action_Registe
 
         if(compare_eq(val_i, val_j) == 1)
         {
-            //OUTPUT to result table
-            write_single(ddr_mem, res_address, val_i);
+            //OUTPUT to result table, a buffer at a time
+            resbuf[n] = val_i;
+            n++;
+            if (n == MAX_NB_OF_BYTES_READ/ELE_BYTES)
+            {
+                write_bulk(out_mem, res_address, MAX_NB_OF_BYTES_READ, resbuf);
+                res_address += MAX_NB_OF_BYTES_READ;
+                n = 0;
+            }
             i += ELE_BYTES;
             j += ELE_BYTES;
             res_size += ELE_BYTES;
-            res_address += ELE_BYTES;
         }
         else if (compare_gt (val_i, val_j) == 1)
         {
@@ -390,6 +441,7 @@ snapu32_t merge_intersection(snap_membus_t * ddr_mem, action_reg *Action_Registe
             j += ELE_BYTES;
         }
     }
+    write_bulk(out_mem, res_address, n * ELE_BYTES, resbuf);
     return res_size;
 }
 
@@ -463,17 +515,17 @@ void hls_action(snap_membus_t  *din_gmem,
     else if(Action_Register->Data.step == 3)
     {
         //Table1
-        local_sort(d_ddrmem, Action_Register->Data.src_tables_ddr0.addr, 
-                Action_Register->Data.src_tables_ddr0.size);
+        local_sort(d_ddrmem, Action_Register->Data.src_tables_ddr0.addr, d_ddrmem,
+                Action_Register->Data.src_tables_ddr0.size, 0);
         merge_sort(d_ddrmem, Action_Register->Data.src_tables_ddr0.addr, 
                 Action_Register->Data.src_tables_ddr0.size);
 
         //Table2
-        local_sort(d_ddrmem, Action_Register->Data.src_tables_ddr1.addr, 
-                Action_Register->Data.src_tables_ddr1.size);
+        local_sort(d_ddrmem, Action_Register->Data.src_tables_ddr1.addr, d_ddrmem,
+                Action_Register->Data.src_tables_ddr1.size, 0);
         merge_sort(d_ddrmem, Action_Register->Data.src_tables_ddr1.addr, 
                 Action_Register->Data.src_tables_ddr1.size);
-        result_size = merge_intersection(d_ddrmem, Action_Register);
+        result_size = merge_intersection(d_ddrmem, d_ddrmem, Action_Register);
     }
     else if (Action_Register->Data.step == 5)
     {
@@ -482,9 +534,27 @@ void hls_action(snap_membus_t  *din_gmem,
                 Action_Register->Data.src_tables_ddr0.addr, Action_Register->Data.result_table.addr,
                 Action_Register->Data.result_table.size);
     }
+    else if (Action_Register->Data.step == PIPELINE_STEP)
+    {
+        //Tables sorted on their way from Host, result to Host.
+        //No timer for the stages.
+        local_sort(din_gmem, Action_Register->Data.src_tables_host0.addr, d_ddrmem,
+                Action_Register->Data.src_tables_ddr0.size, 1);
+        merge_sort(d_ddrmem, Action_Register->Data.src_tables_ddr0.addr,
+                Action_Register->Data.src_tables_ddr0.size);
+
+        local_sort(din_gmem, Action_Register->Data.src_tables_host1.addr, d_ddrmem,
+                Action_Register->Data.src_tables_ddr1.size, 1);
+        merge_sort(d_ddrmem, Action_Register->Data.src_tables_ddr1.addr,
+                Action_Register->Data.src_tables_ddr1.size);
+        result_size = merge_intersection(d_ddrmem, dout_gmem, Action_Register);
+    }
 
     Action_Register->Control.Retc = SNAP_RETC_SUCCESS;
     Action_Register->Data.result_table.size = result_size;
+    Action_Register->Data.load_usec = 0;
+    Action_Register->Data.compute_usec = 0;
+    Action_Register->Data.store_usec = 0;
     return;
 }
 
@@ -17,6 +17,7 @@
  * limitations under the License.
  */
 #include <snap_types.h>
+#include <snap_columnar.h>
 #include "action_intersect_common.h"
 
 #ifdef __cplusplus
@@ -32,12 +33,60 @@ void copyvalue(value_t dst, value_t src);
 int cmpvalue(const value_t src1, const value_t src2);
 uint32_t run_sw_intersection(uint32_t method, value_t * table1, uint32_t n1, value_t* table2, uint32_t n2, value_t * result_array);
 
-struct entry_t
-{
-    value_t data;
-    struct entry_t * next;
-}entry_t;
+/*
+ * Tables as columnar batches (snap_columnar.h), column 0 the values.
+ * The result gets each value as often as it is in both tables. It
+ * needs MIN(rows) and the smaller heap.
+ */
+uint64_t intersect_batch_size(const struct snap_batch *table1,
+        const struct snap_batch *table2);
+struct snap_batch *intersect_batch_init(void *buf,
+        const struct snap_batch *table1, const struct snap_batch *table2);
+int run_sw_intersection_batch(uint32_t method,
+        const struct snap_batch *table1, const struct snap_batch *table2,
+        struct snap_batch *result);
+
+/*
+ * Engine of the software action, see sw_intersect.c. A table is
+ * value_t rows or column 0 of a batch, the result has room for
+ * capacity rows. Returns the result rows, -1 with errno set.
+ */
+struct intersect_table {
+    uint64_t rows;
+    const char *base;
+    const uint32_t *offs;       /* Batches: rows + 1 offsets into base */
+    const uint8_t *valid;       /* Batches: validity bitmap or NULL */
+};
+
+struct intersect_out {
+    value_t *rows;              /* Rows, or */
+    struct snap_batch *batch;   /* a batch */
+    uint64_t capacity;
+};
+
+void intersect_table_rows(struct intersect_table *t, const value_t *table,
+        uint64_t rows);
+void intersect_table_batch(struct intersect_table *t,
+        const struct snap_batch *b);
+int64_t intersect_run(uint32_t method, const struct intersect_table *t1,
+        const struct intersect_table *t2, struct intersect_out *out,
+        unsigned int threads);
+
+/*
+ * Streamed hash intersection, for tables that arrive in chunks. Rows
+ * of table1 below end go into the hash table, which must be there by
+ * then. All of table1 is in before the probes. A probe puts the rows
+ * of t2 in [first, end) that match into list, in order, and returns
+ * how many. Row numbers are 32 bits.
+ */
+struct intersect_stream;
 
+struct intersect_stream *intersect_stream_alloc(const struct intersect_table *t1);
+void intersect_stream_build(struct intersect_stream *st, uint64_t end);
+uint64_t intersect_stream_probe(struct intersect_stream *st,
+        const struct intersect_table *t2, uint64_t first, uint64_t end,
+        uint32_t *list);
+void intersect_stream_free(struct intersect_stream *st);
 
 #ifdef __cplusplus
 }
@@ -38,12 +38,20 @@ extern "C" {
 #define HASH_METHOD 1
 #define SORT_METHOD 2
 
+// Steps 1, 3 and 5 in one job: both tables stream in from the host,
+// a chunk is worked on while the next one arrives and the result goes
+// to the host at result_table as it is found.
+#define PIPELINE_STEP 6
+
 typedef struct intersect_job {
 	struct snap_addr src_tables_host[NUM_TABLES];	 /* input tables */
 	struct snap_addr src_tables_ddr[NUM_TABLES];	 /* input tables */
 	struct snap_addr result_table;             /* output table */
-    uint32_t step;
-    uint32_t method;
+    uint16_t step;              /* Both 16 bits, the job stays at */
+    uint16_t method;            /* 96 bytes to go in the registers */
+    uint32_t load_usec;         /* PIPELINE_STEP: busy time of each */
+    uint32_t compute_usec;      /* stage, 0 if not measured */
+    uint32_t store_usec;
 } intersect_job_t;
 
 
@@ -9,7 +9,8 @@
  *        https://en.wikipedia.org/wiki/hash_table
  *
  * 2) Sort both source tables, and then do intersection
- *  Use C build in library qsort  (quick sort)
+ *
+ * The software action does both on threads, see sw_intersect.c.
  *
  * Wikipedia's pages are based on "CC BY-SA 3.0"
  * Creative Commons Attribution-ShareAlike License 3.0
@@ -44,6 +45,8 @@
 #include <errno.h>
 #include <string.h>
 #include <endian.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <libsnap.h>
@@ -104,216 +107,372 @@ int cmpvalue(const value_t s1, const value_t s2)
         s1 += 1;
         s2 += 1;
     }
+    if (i == sizeof(value_t))
+        return 0;   // Equal and not terminated
     return *s2 - *s1;
 }
-static int qs_cmp(const void *a, const void *b)
-{
-    return cmpvalue((char*) a, (char*) b);
-}
-
 //////////////////////////////////////////////////////////////////
-//   Intersect Method: Two loops direct
+//   Intersect Overall, the methods see sw_intersect.c
 //////////////////////////////////////////////////////////////////
-static uint32_t intersect_direct(value_t table1[], uint32_t n1,
-        value_t table2[], uint32_t n2,
-        value_t result_array[] )
-{
-    // a straight forward way to do intersection.
-    // we can compare the speed with following intersect() function.
-    uint32_t i,j;
-    uint32_t n3;
 
-    n3 = 0; //number of result_array entries
+// Threads of the engine, SNAP_INTERSECT_THREADS or one per CPU
+static unsigned int intersect_threads = 1;
 
-    for ( i = 0; i < n1; i++)
-    {
-        for (j = 0; j < n2; j++)
-        {
-            if(cmpvalue(table1[i], table2[j]) == 0)
-            {
-                copyvalue(result_array[n3], table2[j]);
-                n3++;
-                break;
-            }
-        }
+uint32_t run_sw_intersection(uint32_t method, value_t *table1, uint32_t n1, value_t * table2, uint32_t n2, value_t *result_array)
+{
+    struct intersect_table t1, t2;
+    struct intersect_out out = { result_array, NULL, MIN(n1, n2) };
+    int64_t n3;
+
+    printf("SW intersection, method = %d, table1 (%p) num is %d, table2 (%p) num is %d, out (%p) \n",
+            method, table1, n1, table2, n2, result_array);
+    intersect_table_rows(&t1, table1, n1);
+    intersect_table_rows(&t2, table2, n2);
+    n3 = intersect_run(method, &t1, &t2, &out, intersect_threads);
+    if (n3 < 0) {
+        fprintf(stderr, "ERROR: intersection method %d: %s\n", method,
+                strerror(errno));
+        return 0;
     }
     return n3;
 }
 
 //////////////////////////////////////////////////////////////////
-//   Intersect Method: Hash
+//   Columnar batches, the values without padding
 //////////////////////////////////////////////////////////////////
-static uint32_t ht_hash(value_t key)
+static const uint16_t batch_types[] = { SNAP_COL_UTF8 };
+
+static void batch_spec(const struct snap_batch *table1,
+        const struct snap_batch *table2, struct snap_col_spec *spec)
 {
-    uint64_t hashval = 0;
-    uint32_t i = 0;
-    int k = HT_ENTRY_NUM_EXP/8; //For example, 24/8 = 3.
+    spec->type = SNAP_COL_UTF8;
+    spec->nullable = 0;
+    spec->heap_size = MIN(table1->col[0].heap_size, table2->col[0].heap_size);
+}
 
-    while (i < sizeof(value_t))
-    {
-        hashval = hashval + (key[i]<<((k-1-(i%k))*8));
-        i++;
-        // accumluate every k chars.
-    }
+uint64_t intersect_batch_size(const struct snap_batch *table1,
+        const struct snap_batch *table2)
+{
+    struct snap_col_spec spec;
 
-    return (hashval % HT_ENTRY_NUM);
+    batch_spec(table1, table2, &spec);
+    return snap_batch_layout(&spec, 1, MIN(table1->rows, table2->rows), NULL);
 }
 
-// hash_ptr_table example.
-// Note: The implementation is different to HW HLS
-//   [0]->entry{data, ptr}->entry{data, ptr}-> ... -> entry{data, NULL}
-//   [1]->entry{data, NULL}
-//   [2]->NULL
-//   ......
-//
-// When there are many entries having the same key, they will link in a list.
+struct snap_batch *intersect_batch_init(void *buf,
+        const struct snap_batch *table1, const struct snap_batch *table2)
+{
+    struct snap_col_spec spec;
 
+    batch_spec(table1, table2, &spec);
+    return snap_batch_init(buf, &spec, 1, MIN(table1->rows, table2->rows));
+}
 
-static uint32_t intersect_hash(value_t table1[], uint32_t n1,
-        value_t table2[], uint32_t n2,
-        value_t result_array[] )
+int run_sw_intersection_batch(uint32_t method,
+        const struct snap_batch *table1, const struct snap_batch *table2,
+        struct snap_batch *result)
 {
+    struct intersect_table t1, t2;
+    struct intersect_out out = { NULL, result, 0 };
+
+    if (snap_batch_check(table1, table1->size, batch_types, 1) ||
+        snap_batch_check(table2, table2->size, batch_types, 1) ||
+        (result->ncols < 1) || (result->col[0].type != SNAP_COL_UTF8)) {
+        errno = EINVAL;
+        return -1;
+    }
+    intersect_table_batch(&t1, table1);
+    intersect_table_batch(&t2, table2);
+    out.capacity = result->capacity;
+    return intersect_run(method, &t1, &t2, &out, intersect_threads);
+}
 
-    uint32_t i, index;
-    struct entry_t **hash_ptr_table;
-    struct entry_t *ptr;
-    struct entry_t *entry;
+//////////////////////////////////////////////
+//     SNAP SW Action wrapper, same steps as the hardware.
+//     Card DRAM see SNAP_DRAM_SIM.
+//////////////////////////////////////////////
 
-    uint32_t n3 = 0;
-    hash_ptr_table = malloc(HT_ENTRY_NUM * 8); //just allocate the pointers (8bytes each)
-    if(!hash_ptr_table)
-    {
-        fprintf(stderr, "ERROR: hash table malloc failed.\n");
-        return 0;
+static int intersect_in_ddr(struct snap_sim_action *action,
+        struct intersect_job *js)
+{
+    struct intersect_table t1, t2;
+    struct intersect_out out;
+    value_t *table1, *table2;
+    uint32_t n1, n2;
+    int64_t n3;
+    struct snap_addr result = js->result_table;
+
+    n1 = js->src_tables_ddr[0].size / sizeof(value_t);
+    n2 = js->src_tables_ddr[1].size / sizeof(value_t);
+    table1 = snap_sim_addr(action, &js->src_tables_ddr[0]);
+    table2 = snap_sim_addr(action, &js->src_tables_ddr[1]);
+
+    // The job only gives the start, at most the smaller table matches.
+    result.size = MIN(n1, n2) * sizeof(value_t);
+    out.rows = snap_sim_addr(action, &result);
+    out.batch = NULL;
+    out.capacity = MIN(n1, n2);
+    if (table1 == NULL || table2 == NULL || out.rows == NULL)
+        return -1;
+
+    intersect_table_rows(&t1, table1, n1);
+    intersect_table_rows(&t2, table2, n2);
+    n3 = intersect_run(js->method, &t1, &t2, &out, intersect_threads);
+    if (n3 < 0)
+        return -1;
+    js->result_table.size = n3 * sizeof(value_t);
+    return 0;
+}
+
+// Batches: the result batch is laid out at the result address.
+static int intersect_batch_in_ddr(struct snap_sim_action *action,
+        struct intersect_job *js)
+{
+    struct snap_batch *table1, *table2, *result_batch;
+    struct snap_addr result = js->result_table;
+    int i;
+
+    for (i = 0; i < NUM_TABLES; i++) {
+        if (js->src_tables_ddr[i].size < sizeof(struct snap_batch)) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    table1 = snap_sim_addr(action, &js->src_tables_ddr[0]);
+    table2 = snap_sim_addr(action, &js->src_tables_ddr[1]);
+    if (table1 == NULL || table2 == NULL)
+        return -1;
+    if (snap_batch_check(table1, js->src_tables_ddr[0].size, batch_types, 1) ||
+        snap_batch_check(table2, js->src_tables_ddr[1].size, batch_types, 1)) {
+        errno = EINVAL;
+        return -1;
     }
 
+    result.size = intersect_batch_size(table1, table2);
+    result_batch = snap_sim_addr(action, &result);
+    if (result.size == 0 || result_batch == NULL)
+        return -1;
+    intersect_batch_init(result_batch, table1, table2);
 
-    for (i = 0; i < HT_ENTRY_NUM; i++)
-        hash_ptr_table[i] = NULL;
+    if (run_sw_intersection_batch(js->method, table1, table2,
+                result_batch) < 0)
+        return -1;
+    js->result_table.size = result_batch->size;
+    return 0;
+}
 
-    for (i = 0; i < n1; i++)
-    {
-        index = ht_hash(table1[i]);
+//////////////////////////////////////////////
+//     Pipelined step: a thread copies both tables to DDR chunk by
+//     chunk, this one hashes table1 and looks up table2 as the chunks
+//     arrive and stores the matches of a chunk to the host. This is
+//     the streamed hash whatever the method, the result in table2 order.
+//////////////////////////////////////////////
+#define PIPELINE_CHUNK_ROWS 16384ull/* 1 MiB of value_t */
+
+struct intersect_pipe {
+    struct snap_sim_action *action;
+    const struct intersect_job *js;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t rows[NUM_TABLES];      /* Rows of each table in DDR */
+    uint64_t total[NUM_TABLES];
+    uint64_t load_usec;
+    int err;
+};
 
-        //    printf("build hash: %s, index = %d,",table1[i], index);
-        entry = malloc(sizeof(entry_t));
-        copyvalue(entry->data, table1[i]);
-        entry->next = hash_ptr_table[index];
-        hash_ptr_table[index] = entry; //hook in the front.
-    }
+static uint64_t pipe_usec(const struct timespec *end,
+        const struct timespec *start)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000ull +
+        end->tv_nsec / 1000 - start->tv_nsec / 1000;
+}
 
-    for (i = 0; i < n2; i++)
-    {
-        index = ht_hash(table2[i]);
-        ptr = hash_ptr_table[index];
-        entry = ptr;
-        // printf("index = %d, ptr = %p\n", index, ptr);
-
-        while (ptr != NULL)
-        {
-            //printf("   cmp: %s . %s \n", table2[i], ptr->data);
-            if(cmpvalue(table2[i], ptr->data) == 0)
-            {
-                //printf("match %d, %s\n", i, table2[i]);
-                copyvalue(result_array[n3], table2[i]);
-                n3++;
-                //delete the node aready matches.
-                //this a optional step and it reduces the traversing times.
-                entry->next = ptr->next;
-                break;
-            }
+static void *pipe_load(void *arg)
+{
+    struct intersect_pipe *p = arg;
+    struct snap_addr src, dst;
+    struct timespec start, end;
+    uint64_t done, n;
+    int i, rc = 0;
+
+    for (i = 0; i < NUM_TABLES && rc == 0; i++) {
+        src = p->js->src_tables_host[i];
+        dst = p->js->src_tables_ddr[i];
+        for (done = 0; done < p->total[i] && rc == 0; done += n) {
+            n = MIN(p->total[i] - done, PIPELINE_CHUNK_ROWS);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            rc = snap_sim_memcpy(p->action, &dst, &src, n * sizeof(value_t));
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            p->load_usec += pipe_usec(&end, &start);
+            src.addr += n * sizeof(value_t);
+            dst.addr += n * sizeof(value_t);
+
+            pthread_mutex_lock(&p->lock);
+            if (rc == 0)
+                p->rows[i] = done + n;
             else
-                entry = ptr;
-            ptr = ptr -> next;
+                p->err = errno ? errno : EIO;
+            pthread_cond_signal(&p->cond);
+            pthread_mutex_unlock(&p->lock);
         }
     }
-    __free(hash_ptr_table);
-    return n3;
+    return NULL;
 }
 
-//////////////////////////////////////////////////////////////////
-//   Intersect Method: Sort
-//////////////////////////////////////////////////////////////////
-static uint32_t intersect_sort( value_t table1[], uint32_t n1,
-        value_t table2[], uint32_t n2,
-        value_t result_array[] )
+/* Rows of table i in DDR, more than have, 0 with errno set on error */
+static uint64_t pipe_wait(struct intersect_pipe *p, int i, uint64_t have)
 {
-
-    uint32_t n3 = 0;
-    uint32_t i, j;
-
-    i = 0;
-    j = 0;
-    //Buildin Quicksort, qs_cmp is the function pointer.
-    qsort(table1, n1, sizeof(value_t), qs_cmp);
-    qsort(table2, n2, sizeof(value_t), qs_cmp);
-
-    while (i < n1 && j < n2)
-    {
-        if(cmpvalue(table1[i], table2[j]) == 0)
-        {
-            copyvalue(result_array[n3], table2[j]);
-            n3++;
-            i++;
-            j++;
-        }
-        else if (cmpvalue(table1[i], table2[j]) < 0)
-            i++;
-        else
-            j++;
-    }
-    return n3;
+    uint64_t rows;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->rows[i] == have && p->err == 0)
+        pthread_cond_wait(&p->cond, &p->lock);
+    rows = p->err ? 0 : p->rows[i];
+    errno = p->err;
+    pthread_mutex_unlock(&p->lock);
+    return rows;
 }
 
-//////////////////////////////////////////////////////////////////
-//   Intersect Overall
-//////////////////////////////////////////////////////////////////
-
-uint32_t run_sw_intersection(uint32_t method, value_t *table1, uint32_t n1, value_t * table2, uint32_t n2, value_t *result_array)
+static int intersect_pipelined(struct snap_sim_action *action,
+        struct intersect_job *js)
 {
-    printf("SW intersection, method = %d, table1 (%p) num is %d, table2 (%p) num is %d, out (%p) \n",
-            method, table1, n1, table2, n2, result_array);
-    if(method == DIRECT_METHOD)
-        return intersect_direct(table1, n1, table2, n2, result_array);
-    else if (method == HASH_METHOD) {
-        if (n1 <= n2)
-            return intersect_hash (table1, n1, table2, n2, result_array);
-        else
-            return intersect_hash (table2, n2, table1, n1, result_array);
+    struct intersect_pipe p;
+    struct intersect_table t1, t2;
+    struct intersect_stream *st = NULL;
+    struct snap_addr result = js->result_table;
+    struct timespec start, mid, end;
+    value_t *table1, *table2, *out;
+    uint32_t *list = NULL;
+    uint64_t have, rows, n, k, n3 = 0, compute = 0, store = 0;
+    pthread_t loader;
+    int i, rc = -1;
+
+    // Rows only, a batch is not of any use before it is all there
+    if (js->src_tables_host[0].flags & SNAP_ADDRFLAG_BATCH) {
+        errno = EINVAL;
+        return -1;
     }
-    else if (method == SORT_METHOD)
-        return intersect_sort (table1, n1, table2, n2, result_array);
-    else
-        return 0;
-}
-
 
-//////////////////////////////////////////////
-//     SNAP SW Action wrapper. Do nothing.
-//////////////////////////////////////////////
+    memset(&p, 0, sizeof(p));
+    p.action = action;
+    p.js = js;
+    for (i = 0; i < NUM_TABLES; i++)
+        p.total[i] = js->src_tables_host[i].size / sizeof(value_t);
+
+    table1 = snap_sim_addr(action, &js->src_tables_ddr[0]);
+    table2 = snap_sim_addr(action, &js->src_tables_ddr[1]);
+    result.size = MIN(p.total[0], p.total[1]) * sizeof(value_t);
+    out = snap_sim_addr(action, &result);
+    if (table1 == NULL || table2 == NULL || out == NULL)
+        return -1;
+    intersect_table_rows(&t1, table1, p.total[0]);
+    intersect_table_rows(&t2, table2, p.total[1]);
+
+    st = intersect_stream_alloc(&t1);
+    list = malloc(PIPELINE_CHUNK_ROWS * sizeof(*list));
+    if (st == NULL || list == NULL)
+        goto out_free;
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    errno = pthread_create(&loader, NULL, pipe_load, &p);
+    if (errno != 0)
+        goto out_destroy;
+
+    for (have = 0; have < p.total[0]; have = rows) {
+        rows = pipe_wait(&p, 0, have);
+        if (rows == 0)
+            goto out_join;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        intersect_stream_build(st, rows);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        compute += pipe_usec(&end, &start);
+    }
+    for (have = 0; have < p.total[1]; have = rows) {
+        rows = pipe_wait(&p, 1, have);
+        if (rows == 0)
+            goto out_join;
+        rows = MIN(rows, have + PIPELINE_CHUNK_ROWS);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        n = intersect_stream_probe(st, &t2, have, rows, list);
+        clock_gettime(CLOCK_MONOTONIC, &mid);
+        for (k = 0; k < n; k++)
+            memcpy(out[n3 + k], table2[list[k]], sizeof(value_t));
+        n3 += n;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        compute += pipe_usec(&mid, &start);
+        store += pipe_usec(&end, &mid);
+    }
+    rc = 0;
+
+ out_join:
+    pthread_join(loader, NULL);
+    js->load_usec = MIN(p.load_usec, (uint64_t)UINT32_MAX);
+    js->compute_usec = MIN(compute, (uint64_t)UINT32_MAX);
+    js->store_usec = MIN(store, (uint64_t)UINT32_MAX);
+    js->result_table.size = n3 * sizeof(value_t);
+ out_destroy:
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+ out_free:
+    intersect_stream_free(st);
+    free(list);
+    return rc;
+}
 
 static int action_main(struct snap_sim_action *action,
         void *job, uint32_t job_len)
 {
     struct intersect_job *js = (struct intersect_job *)job;
-    act_trace("%s(%p, %p, %d) table1_size = %d, table2_size = %d\n",
-            __func__, action, job, job_len, js->src_tables_host[0].size,  js->src_tables_host[1].size);
-
-    //Do Nothing.
+    int i, rc = 0;
+
+    act_trace("%s(%p, %p, %d) step = %d, table1_size = %d, table2_size = %d\n",
+            __func__, action, job, job_len, js->step,
+            js->src_tables_host[0].size,  js->src_tables_host[1].size);
+
+    switch (js->step) {
+    case 1: // Host to DDR
+        for (i = 0; i < NUM_TABLES && rc == 0; i++)
+            rc = snap_sim_memcpy(action, &js->src_tables_ddr[i],
+                    &js->src_tables_host[i], js->src_tables_host[i].size);
+        break;
+    case 2: // DDR to Host
+        for (i = 0; i < NUM_TABLES && rc == 0; i++)
+            rc = snap_sim_memcpy(action, &js->src_tables_host[i],
+                    &js->src_tables_ddr[i], js->src_tables_ddr[i].size);
+        break;
+    case 3: // Intersection in DDR
+        if (js->src_tables_ddr[0].flags & SNAP_ADDRFLAG_BATCH)
+            rc = intersect_batch_in_ddr(action, js);
+        else
+            rc = intersect_in_ddr(action, js);
+        break;
+    case 5: // Result from DDR to Host, in src_tables_ddr[0]
+        rc = snap_sim_memcpy(action, &js->result_table,
+                &js->src_tables_ddr[0], js->result_table.size);
+        break;
+    case PIPELINE_STEP: // 1, 3 and 5, the result straight to the Host
+        rc = intersect_pipelined(action, js);
+        break;
+    default:
+        break;
+    }
 
-    action->job.retc = SNAP_RETC_SUCCESS;
+    if (rc < 0) {
+        act_trace("  err: step %d: %s\n", js->step, strerror(errno));
+        action->job.retc = SNAP_RETC_FAILURE;
+    } else
+        action->job.retc = SNAP_RETC_SUCCESS;
     return 0;
-
 }
 
 
+// The hardware has an action type for each method, both are this one.
 static struct snap_sim_action action = {
     .vendor_id = SNAP_VENDOR_ID_ANY,
     .device_id = SNAP_DEVICE_ID_ANY,
 
     .action_type = INTERSECT_H_ACTION_TYPE,
-    // CONFIG=0 HW Action doesn't look at this. 
-    // CONFIG=1 SW Action just make a match. So pickup one TYPE.
 
     .job = { .retc = SNAP_RETC_FAILURE, },
     .state = ACTION_IDLE,
@@ -321,13 +480,36 @@ static struct snap_sim_action action = {
     .priv_data = NULL,	/* this is passed back as void *card */
     .mmio_write32 = mmio_write32,
     .mmio_read32 = mmio_read32,
+};
 
-    .next = NULL,
+static struct snap_sim_action action_s = {
+    .vendor_id = SNAP_VENDOR_ID_ANY,
+    .device_id = SNAP_DEVICE_ID_ANY,
+
+    .action_type = INTERSECT_S_ACTION_TYPE,
+
+    .job = { .retc = SNAP_RETC_FAILURE, },
+    .state = ACTION_IDLE,
+    .main = action_main,
+    .priv_data = NULL,
+    .mmio_write32 = mmio_write32,
+    .mmio_read32 = mmio_read32,
 };
 
 static void _init(void) __attribute__((constructor));
 
 static void _init(void)
 {
+    const char *env = getenv("SNAP_INTERSECT_THREADS");
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (env != NULL)
+        intersect_threads = strtoul(env, (char **)NULL, 0);
+    else if (cpus > 0)
+        intersect_threads = cpus;
+    if (intersect_threads == 0)
+        intersect_threads = 1;
+
     snap_action_register(&action);
+    snap_action_register(&action_s);
 }
@@ -30,6 +30,11 @@
  * 4) Do intersection in CPU. Results stored in Host memory.
  *
  * Count the time elapsed at step2 + step4.
+ *
+ * Function: One step (6) doing 1, 3 and 5 at once, -P:
+ * The tables stream from Host to FPGA DDR in chunks, a chunk is worked
+ * on while the next one comes in and the result goes to Host as it is
+ * found. The job tells how long each stage was busy.
  */
 
 #include <fcntl.h>
@@ -74,12 +79,17 @@ static void usage(const char *prog)
             "  -m, --method   <0/1/2>    0: compare one by one (only available  software approach.in software action).\n"
             "                            1: Use Hash table\n"
             "                            2: Use Sort and merge\n"
+            "  -F, --columnar            Pass the tables as columnar batches, software action only.\n"
+            "                            Values take their length without the padding.\n"
+            "  -P, --pipeline            One job streaming the tables and the result (Step 6).\n"
             "  -I, --irq                 Enable Interrupts\n"
             "\n"
             "Example:\n"
             "HW Action:  sudo ./snap_intersect        (Step1-3-5)\n"
             "HW Action:  sudo ./snap_intersect -s     (Step1-2-4)\n"
-            "SW Action:  SNAP_CONFIG=1 ./snap_intersect -s ... (must with -s, only Step4)\n"
+            "SW Action:  SNAP_CONFIG=1 ./snap_intersect    (Step1-3-5, card DRAM see SNAP_DRAM_SIM)\n"
+            "SW Action:  SNAP_CONFIG=1 ./snap_intersect -s (Step1-2-4)\n"
+            "SW Action:  SNAP_CONFIG=1 ./snap_intersect -P (Step6)\n"
             "\n",
             prog);
 }
@@ -89,10 +99,11 @@ static void snap_prepare_intersect(struct snap_job *cjob,
         intersect_job_t *ijob_o,
         uint32_t step,
         uint32_t method,
+        snap_addrflag_t batch,
 
-        value_t * input_addrs_host[],
+        void * input_addrs_host[],
         uint32_t input_sizes[],
-        value_t * output_addr_host,
+        void * output_addr_host,
         uint32_t actual_output_size)
 {
     uint64_t ddr_addr = 0x0ull;
@@ -100,18 +111,18 @@ static void snap_prepare_intersect(struct snap_job *cjob,
     if (step == 1) {
         //Memcopy, source
         snap_addr_set( &ijob_i->src_tables_host[0], input_addrs_host[0], input_sizes[0],SNAP_ADDRTYPE_HOST_DRAM ,
-                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC | batch);
         snap_addr_set( &ijob_i->src_tables_host[1], input_addrs_host[1], input_sizes[1],SNAP_ADDRTYPE_HOST_DRAM ,
-                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC | batch);
 
         //Memcopy, target
         ddr_addr = 0;
         snap_addr_set( &ijob_i->src_tables_ddr[0], (void *)ddr_addr, input_sizes[0], SNAP_ADDRTYPE_CARD_DRAM ,
-                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | SNAP_ADDRFLAG_END);
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | batch | SNAP_ADDRFLAG_END);
 
         ddr_addr = MAX_TABLE_SIZE;
         snap_addr_set( &ijob_i->src_tables_ddr[1], (void *)ddr_addr, input_sizes[1], SNAP_ADDRTYPE_CARD_DRAM ,
-                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | SNAP_ADDRFLAG_END);
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | batch | SNAP_ADDRFLAG_END);
 
         //No relation to result_table
     }
@@ -119,36 +130,36 @@ static void snap_prepare_intersect(struct snap_job *cjob,
         //Memcopy, source
         ddr_addr = 0;
         snap_addr_set( &ijob_i->src_tables_ddr[0], (void *)ddr_addr, input_sizes[0],SNAP_ADDRTYPE_CARD_DRAM ,
-                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC | batch);
 
         ddr_addr = MAX_TABLE_SIZE;
         snap_addr_set( &ijob_i->src_tables_ddr[1], (void *)ddr_addr, input_sizes[1],SNAP_ADDRTYPE_CARD_DRAM ,
-                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC | batch);
 
         //Memcopy, target
         snap_addr_set( &ijob_i->src_tables_host[0], input_addrs_host[0], input_sizes[0],SNAP_ADDRTYPE_HOST_DRAM ,
-                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | SNAP_ADDRFLAG_END);
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | batch | SNAP_ADDRFLAG_END);
         snap_addr_set( &ijob_i->src_tables_host[1], input_addrs_host[1], input_sizes[1],SNAP_ADDRTYPE_HOST_DRAM ,
-                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | SNAP_ADDRFLAG_END);
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | batch | SNAP_ADDRFLAG_END);
 
         //No relation to result_table
     }
     else if (step == 3) {
         ddr_addr = 0;
         snap_addr_set( &ijob_i->src_tables_ddr[0], (void *)ddr_addr, input_sizes[0],SNAP_ADDRTYPE_CARD_DRAM ,
-                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC | batch);
 
         ddr_addr = MAX_TABLE_SIZE;
         snap_addr_set( &ijob_i->src_tables_ddr[1], (void *)ddr_addr,
                 input_sizes[1],SNAP_ADDRTYPE_CARD_DRAM ,
-                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC | batch);
 
         //result_table in DDR
         // 99 is a dummy value. HW will update this field when finished.
         ddr_addr = 2*MAX_TABLE_SIZE;
         snap_addr_set (&ijob_i->result_table, (void *)ddr_addr,
                 99, SNAP_ADDRTYPE_CARD_DRAM ,
-                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST |
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | batch |
                 SNAP_ADDRFLAG_END);
     }
     else if (step == 5) {
@@ -158,17 +169,42 @@ static void snap_prepare_intersect(struct snap_job *cjob,
         snap_addr_set( &ijob_i->src_tables_ddr[0],
                 (void *)ddr_addr, actual_output_size,
                 SNAP_ADDRTYPE_CARD_DRAM ,
-                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC | batch);
 
         //Memcopy, target
         snap_addr_set (&ijob_i->result_table,
                 output_addr_host, actual_output_size,
                 SNAP_ADDRTYPE_HOST_DRAM ,
-                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST |
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | batch |
+                SNAP_ADDRFLAG_END);
+    }
+    else if (step == PIPELINE_STEP) {
+        //Source, streamed to DDR on the way
+        snap_addr_set( &ijob_i->src_tables_host[0], input_addrs_host[0], input_sizes[0],SNAP_ADDRTYPE_HOST_DRAM ,
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC | batch);
+        snap_addr_set( &ijob_i->src_tables_host[1], input_addrs_host[1], input_sizes[1],SNAP_ADDRTYPE_HOST_DRAM ,
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC | batch);
+
+        ddr_addr = 0;
+        snap_addr_set( &ijob_i->src_tables_ddr[0], (void *)ddr_addr, input_sizes[0], SNAP_ADDRTYPE_CARD_DRAM ,
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | batch);
+
+        ddr_addr = MAX_TABLE_SIZE;
+        snap_addr_set( &ijob_i->src_tables_ddr[1], (void *)ddr_addr, input_sizes[1], SNAP_ADDRTYPE_CARD_DRAM ,
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | batch);
+
+        //result_table in Host, the action sets the size.
+        snap_addr_set (&ijob_i->result_table,
+                output_addr_host, actual_output_size,
+                SNAP_ADDRTYPE_HOST_DRAM ,
+                SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | batch |
                 SNAP_ADDRFLAG_END);
     }
     ijob_i->step = step;
     ijob_i->method = method;
+    ijob_i->load_usec = 0;
+    ijob_i->compute_usec = 0;
+    ijob_i->store_usec = 0;
     snap_job_set(cjob, ijob_i, sizeof(*ijob_i),
             ijob_o, sizeof(*ijob_o));
 }
@@ -198,6 +234,38 @@ static int gen_random_table(value_t table[], uint32_t num,uint32_t len)
 
 }
 
+// Column 0 the values, without the padding spaces of the rows
+static struct snap_batch *table_to_batch(value_t table[], uint32_t num)
+{
+    struct snap_col_spec spec = { SNAP_COL_UTF8, 0, 0 };
+    struct snap_batch *b;
+    uint32_t i, *lens;
+    uint64_t size;
+    void *buf;
+
+    lens = malloc(MAX(num, 1u) * sizeof(*lens));
+    if (!lens)
+        return NULL;
+    for (i = 0; i < num; i++) {
+        lens[i] = strnlen(table[i], sizeof(value_t) - 1);
+        while (lens[i] && table[i][lens[i] - 1] == ' ')
+            lens[i]--;
+        spec.heap_size += lens[i];
+    }
+
+    b = NULL;
+    size = snap_batch_layout(&spec, 1, num, NULL);
+    buf = size ? memalign(SNAP_BATCH_ALIGN, size) : NULL;
+    if (buf) {
+        b = snap_batch_init(buf, &spec, 1, num);
+        for (i = 0; i < num; i++)
+            snap_col_put_str(b, 0, i, table[i], lens[i]);
+        b->rows = num;
+    }
+    __free(lens);
+    return b;
+}
+
 static void dump_table(value_t* table, uint32_t num)
 {
     uint32_t i;
@@ -230,6 +298,14 @@ static int run_one_step(struct snap_action *action,
     return rc;
 }
 
+static void print_usec(const char *stage, uint32_t usec)
+{
+    if (usec)
+        fprintf(stdout, "  %-8s %d usec busy\n", stage, usec);
+    else
+        fprintf(stdout, "  %-8s n/a\n", stage);
+}
+
 /**
  * Read accelerator specific registers. Must be called as root!
  */
@@ -268,8 +344,14 @@ int main(int argc, char *argv[])
     const char *config_env;
     static uint32_t snap_config;
     config_env = getenv("SNAP_CONFIG");
-    if (config_env != NULL)
-        snap_config = strtol(config_env, (char **)NULL, 0);
+    if (config_env != NULL) {
+        // Named like libsnap does, CPU and CPU_ASYNC are the sw action
+        if (strncmp(config_env, "CPU", 3) == 0 ||
+            strncmp(config_env, "cpu", 3) == 0)
+            snap_config = 0x1;
+        else
+            snap_config = strtol(config_env, (char **)NULL, 0);
+    }
     uint32_t sw_action = snap_config & 0x1;
 
     //For random generated table....
@@ -277,6 +359,12 @@ int main(int argc, char *argv[])
     uint32_t len = 1;
     uint32_t sw = 0;
     uint32_t method = HASH_METHOD;
+    uint32_t columnar = 0;
+    uint32_t pipeline = 0;
+    struct snap_batch *src_batches[NUM_TABLES] = { NULL, NULL };
+    struct snap_batch *result_batch = NULL;
+    void * src_bufs[NUM_TABLES];
+    snap_addrflag_t batch = 0;
     const char *input[NUM_TABLES];
     for(i = 0; i < NUM_TABLES; i++)
         input[i] = NULL;
@@ -297,12 +385,14 @@ int main(int argc, char *argv[])
             { "version", no_argument,	    NULL, 'V' },
             { "verbose", no_argument,	    NULL, 'v' },
             { "irq",     no_argument,	    NULL, 'I' },
+            { "columnar",no_argument,	    NULL, 'F' },
+            { "pipeline",no_argument,	    NULL, 'P' },
             { "help",	 no_argument,	    NULL, 'h' },
             { 0,		 no_argument,	    NULL, 0   },
         };
 
         ch = getopt_long(argc, argv,
-                "C:i:j:o:m:n:l:t:VIvhs",
+                "C:i:j:o:m:n:l:t:VIvhsFP",
                 long_options, &option_index);
         if (ch == -1)
             break;
@@ -335,6 +425,13 @@ int main(int argc, char *argv[])
             case 's':
                 sw = 1;
                 break;
+            case 'F':
+                columnar = 1;
+                batch = SNAP_ADDRFLAG_BATCH;
+                break;
+            case 'P':
+                pipeline = 1;
+                break;
                 /* service */
             case 'V':
                 printf("%s\n", version);
@@ -359,9 +456,15 @@ int main(int argc, char *argv[])
         usage(argv[0]);
         exit(EXIT_FAILURE);
     }
+    if (pipeline && (sw || columnar)) {
+        fprintf(stderr, "err: -P streams rows to the action, not with -s or -F\n");
+        exit(EXIT_FAILURE);
+    }
 
 
     //Create Input tables
+    for (i = 0; i < NUM_TABLES; i++)
+        src_tables[i] = NULL;
     if (input[0] == NULL || input[1] == NULL) {
         //Randomly generate the Table data
         for (i = 0; i < NUM_TABLES; i++) {
@@ -371,6 +474,7 @@ int main(int argc, char *argv[])
                 goto out_error2;
 
             rc |= gen_random_table(src_tables[i], num, len);
+            min_num = num;
             printf("Source table address is %p\n",src_tables[i]);
 
             if(0)
@@ -422,11 +526,37 @@ int main(int argc, char *argv[])
         }
     }
 
+    for (i = 0; i < NUM_TABLES; i++)
+        src_bufs[i] = src_tables[i];
+
+    // Batches are made from the rows, which are not needed then.
+    if (columnar) {
+        for (i = 0; i < NUM_TABLES; i++) {
+            src_batches[i] = table_to_batch(src_tables[i],
+                    src_sizes[i] / sizeof(value_t));
+            if (!src_batches[i]) {
+                fprintf(stderr, "Err: cannot make batch %d\n", i);
+                goto out_error;
+            }
+            printf("Table %d: %d bytes as batch, %d bytes as rows\n", i,
+                    src_batches[i]->size, src_sizes[i]);
+            src_sizes[i] = src_batches[i]->size;
+            src_bufs[i] = src_batches[i];
+            __free(src_tables[i]);
+            src_tables[i] = NULL;
+        }
+    }
+
     // Apply result_table.
-    init_result_size = min_num * sizeof(value_t);
+    if (columnar)
+        init_result_size = intersect_batch_size(src_batches[0],
+                src_batches[1]);
+    else
+        init_result_size = min_num * sizeof(value_t);
     result_table = memalign(page_size, init_result_size);
     if (!result_table)
-        goto out_error2;
+        goto out_error;
+    result_batch = (struct snap_batch *)result_table;
 
     /////////////////////////////////////////////////////////////////
     //    Open Device ... and start
@@ -459,7 +589,9 @@ int main(int argc, char *argv[])
         }
     }
 
-    if(sw == 0)
+    if (pipeline)
+        fprintf(stdout, "Run in HW step 6\n");
+    else if(sw == 0)
         fprintf(stdout, "Run in HW steps 1-3-5\n");
     else
         fprintf(stdout, "Run in SW steps 1-2-4\n");
@@ -470,10 +602,35 @@ int main(int argc, char *argv[])
                 card_no, strerror(errno));
         goto out_error1;
     }
+    if (pipeline) {
+        //------------------------------------
+        printf("Start Step6 (Stream source data, intersection and result) ......\n");
+        snap_prepare_intersect(&cjob, &ijob_i, &ijob_o,
+                PIPELINE_STEP, method, batch, src_bufs, src_sizes,
+                result_table, init_result_size);
+
+        rc |= run_one_step(action, &cjob, timeout, PIPELINE_STEP);
+        if (rc != 0)
+            goto out_error2;
+        print_usec("load", ijob_o.load_usec);
+        print_usec("compute", ijob_o.compute_usec);
+        print_usec("store", ijob_o.store_usec);
+
+        actual_result_size = ijob_o.result_table.size;  //in bytes
+        if (actual_result_size > init_result_size) {
+            fprintf(stderr, "err: result of %d bytes, room for %d\n",
+                    actual_result_size, init_result_size);
+            goto out_error2;
+        }
+        result_num = actual_result_size/sizeof(value_t);
+        printf("HW: result_num = %d\n", result_num);
+        goto out_result;
+    }
+
     //------------------------------------
     printf("Start Step1 (Copy source data from Host to DDR) ..............\n");
     snap_prepare_intersect(&cjob, &ijob_i, &ijob_o,
-            1, method, src_tables, src_sizes,result_table,99);
+            1, method, batch, src_bufs, src_sizes,result_table,99);
 
     rc |= run_one_step(action, &cjob, timeout, 1);
     if (rc != 0)
@@ -483,7 +640,7 @@ int main(int argc, char *argv[])
         //------------------------------------
         printf("Start Step2 (Copy source data from DDR to Host) ..............\n");
         snap_prepare_intersect(&cjob, &ijob_i, &ijob_o,
-                2, method, src_tables, src_sizes,result_table,99);
+                2, method, batch, src_bufs, src_sizes,result_table,99);
 
         rc |= run_one_step(action, &cjob, timeout, 2);
         if (rc != 0)
@@ -492,8 +649,21 @@ int main(int argc, char *argv[])
         //------------------------------------
         printf("Start Step4 (Do interesction by software) ..............\n");
         gettimeofday(&stime, NULL);
-        result_num = run_sw_intersection (method, src_tables[0], src_sizes[0]/sizeof(value_t),
-                src_tables[1], src_sizes[1]/sizeof(value_t), result_table);
+        if (columnar) {
+            intersect_batch_init(result_batch, src_batches[0],
+                    src_batches[1]);
+            rc = run_sw_intersection_batch(method, src_batches[0], src_batches[1],
+                    result_batch);
+            if (rc < 0) {
+                fprintf(stderr, "err: batch intersection: %s\n",
+                        strerror(errno));
+                goto out_error2;
+            }
+            result_num = rc;
+            rc = 0;
+        } else
+            result_num = run_sw_intersection (method, src_tables[0], src_sizes[0]/sizeof(value_t),
+                    src_tables[1], src_sizes[1]/sizeof(value_t), result_table);
         gettimeofday(&etime, NULL);
         fprintf(stdout, "Step 4 took %lld usec\n", (long long)timediff_usec(&etime, &stime));
         printf("SW: result_num = %d\n", result_num);
@@ -505,28 +675,70 @@ int main(int argc, char *argv[])
         //------------------------------------
         printf("Start Step3 (Do intersection in DDR) ..............\n");
         snap_prepare_intersect(&cjob, &ijob_i, &ijob_o,
-                3, method, src_tables, src_sizes, result_table, 99);
+                3, method, batch, src_bufs, src_sizes, result_table, 99);
 
         rc |= run_one_step(action, &cjob, timeout, 3);
         if (rc != 0)
             goto out_error2;
 
         actual_result_size = ijob_o.result_table.size;  //in bytes
+        if (actual_result_size > init_result_size) {
+            fprintf(stderr, "err: result of %d bytes, room for %d\n",
+                    actual_result_size, init_result_size);
+            goto out_error2;
+        }
         result_num = actual_result_size/sizeof(value_t);
-        printf("HW: result_num = %d\n", result_num);
+        if (!columnar)
+            printf("HW: result_num = %d\n", result_num);
 
 
         //------------------------------------
         printf("Start Step5 (Copy result from DDR to Host) ..............\n");
         snap_prepare_intersect(&cjob, &ijob_i, &ijob_o,
-                5, method, src_tables, src_sizes, result_table, result_num * sizeof(value_t));
+                5, method, batch, src_bufs, src_sizes, result_table,
+                columnar ? actual_result_size : result_num * sizeof(value_t));
 
         rc |= run_one_step(action, &cjob, timeout, 5);
         if (rc != 0)
             goto out_error2;
+
+        if (columnar) {
+            result_num = result_batch->rows;
+            printf("HW: result_num = %d\n", result_num);
+        }
     }
 
-    if(output != NULL) {
+out_result:
+    if(output != NULL && columnar) {
+        printf("Writing intersection result %d lines to %s\n",
+                (int)result_num, output);
+
+        // Padded the way the input files are
+        fp = fopen(output, "w");
+        if (!fp) {
+            fprintf(stderr, "Err: cannot open %s\n", output);
+            goto out_error2;
+        }
+        for (i = 0; i < result_num; i++) {
+            const char *s;
+            uint32_t l;
+
+            s = snap_col_str(result_batch, 0, i, &l);
+            fprintf(fp, "%-*.*s\n", (int)sizeof(value_t) - 1, (int)l, s);
+        }
+        fclose(fp);
+    }
+    else if (columnar) {
+        for (i = 0; (i < result_num && verbose_flag); i++) {
+            const char *s;
+            uint32_t l;
+
+            s = snap_col_str(result_batch, 0, i, &l);
+            printf("%.*s;\n", (int)l, s);
+        }
+        printf("\n");
+    }
+    else if(output != NULL) {
         printf("Writing intersection result %d lines to %s\n",
                 (int)result_num, output);
 
@@ -551,8 +763,10 @@ int main(int argc, char *argv[])
     snap_detach_action(action);
     snap_card_free(card);
 
-    for(i = 0; i < NUM_TABLES; i++)
+    for(i = 0; i < NUM_TABLES; i++) {
         __free(src_tables[i]);
+        __free(src_batches[i]);
+    }
     __free(result_table);
 
     exit(exit_code);
@@ -562,8 +776,10 @@ out_error2:
 out_error1:
     snap_card_free(card);
 out_error:
-    for(i = 0; i < NUM_TABLES; i++)
+    for(i = 0; i < NUM_TABLES; i++) {
         __free(src_tables[i]);
+        __free(src_batches[i]);
+    }
     __free(result_table);
 
     exit(EXIT_FAILURE);
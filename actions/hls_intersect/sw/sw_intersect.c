@@ -0,0 +1,973 @@
+/*
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Set intersection for the software flow of the intersect action.
+ *
+ * All methods give each value as often as it is in both tables, nulls
+ * of batches match nothing. Values compare by length and bytes, value_t
+ * rows up to their first 0.
+ *
+ * Hash: the rows of both tables are hashed and scattered into 2^bits
+ * partitions by the upper hash bits, each thread its own rows, such
+ * that a partition keeps the row order. Then threads take partition
+ * after partition: the smaller table's rows of it go into an open
+ * addressing table small enough for the L2 cache, a slot holds the
+ * lower 32 hash bits as fingerprint and how often the value is there.
+ * The larger table's rows of it are looked up in row order, a match
+ * takes one of the count. The result is in the larger table's order.
+ *
+ * Sort: each table is sorted by an LSD radix sort of its first 8 bytes,
+ * histograms and scatter on threads. Rows with equal first 8 bytes are
+ * sorted by the rest after. The smaller table is then split into a
+ * range per thread, each finds its start in the larger table and merges
+ * from there. The merge gallops, it looks for the next value in steps
+ * doubling each time, so a small table against a large one costs about
+ * small * log(large / small) compares. The result is sorted.
+ *
+ * Direct: each row of table2 against the rows of table1 not matched
+ * yet, on one thread, to check the others. The result is in table2
+ * order.
+ *
+ * Row numbers are 32 bits, which is what a struct snap_addr can hold
+ * of value_t rows or of batches of 4 byte keys.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include <libsnap.h>
+#include <snap_tools.h>
+#include <snap_parallel.h>
+#include <action_intersect.h>
+
+#define IS_PART_ROWS        8192    /* Smaller table rows per partition */
+#define IS_RADIX_BITS_MAX   14
+#define IS_THREADS_MAX      SNAP_PARALLEL_THREADS_MAX
+#define IS_STREAM_GROUP     16      /* Rows hashed ahead of the lookups */
+
+/* Hash method: a row in its partition, slot of a partition table */
+struct is_tuple {
+    uint32_t fp;            /* Lower 32 hash bits */
+    uint32_t row;
+};
+
+struct is_slot {
+    uint32_t fp;
+    uint32_t row;           /* row + 1 of the smaller table, 0: free */
+    uint32_t count;         /* Rows of the value not matched yet */
+};
+
+/* Sort method: a row with its first 8 bytes, big endian */
+struct is_ent {
+    uint64_t key;
+    uint32_t row;
+    uint32_t len;
+};
+
+void intersect_table_rows(struct intersect_table *t, const value_t *table,
+        uint64_t rows)
+{
+    memset(t, 0, sizeof(*t));
+    t->rows = rows;
+    t->base = (const char *)table;
+}
+
+void intersect_table_batch(struct intersect_table *t,
+        const struct snap_batch *b)
+{
+    memset(t, 0, sizeof(*t));
+    t->rows = b->rows;
+    t->base = snap_col_heap(b, 0);
+    t->offs = snap_col_offs(b, 0);
+    t->valid = snap_col_bitmap(b, 0);
+}
+
+/* Value of row i, NULL if not there */
+static inline const char *is_str(const struct intersect_table *t,
+        uint64_t i, uint32_t *len)
+{
+    const char *s;
+
+    if (t->offs) {
+        if (!snap_bitmap_get(t->valid, i)) {
+            *len = 0;
+            return NULL;
+        }
+        *len = t->offs[i + 1] - t->offs[i];
+        return t->base + t->offs[i];
+    }
+    s = t->base + i * sizeof(value_t);
+    *len = strnlen(s, sizeof(value_t));
+    return s;
+}
+
+static inline int is_eq(const char *s1, uint32_t l1,
+        const char *s2, uint32_t l2)
+{
+    return (l1 == l2) && (memcmp(s1, s2, l1) == 0);
+}
+
+/*
+ * Result: each thread has a list of rows of src in result order, they
+ * are written one list after the other.
+ */
+struct is_emit {
+    const struct intersect_table *src;
+    struct intersect_out *out;
+    unsigned int threads;
+    uint32_t *list[IS_THREADS_MAX];
+    uint64_t count[IS_THREADS_MAX];
+    uint64_t first[IS_THREADS_MAX];     /* Result row */
+    uint64_t bytes[IS_THREADS_MAX];     /* Batches: heap bytes, offset */
+};
+
+static void is_emit_bytes(void *arg, unsigned int no)
+{
+    struct is_emit *e = arg;
+    uint64_t i, sum = 0;
+    uint32_t len;
+
+    for (i = 0; i < e->count[no]; i++) {
+        is_str(e->src, e->list[no][i], &len);
+        sum += len;
+    }
+    e->bytes[no] = sum;
+}
+
+static void is_emit_write(void *arg, unsigned int no)
+{
+    struct is_emit *e = arg;
+    struct snap_batch *b = e->out->batch;
+    uint64_t i, row = e->first[no];
+    uint32_t len, *offs, pos;
+    const char *s;
+    char *heap, *v;
+
+    if (b) {
+        offs = snap_col_offs(b, 0);
+        heap = snap_col_heap(b, 0);
+        pos = e->bytes[no];
+        for (i = 0; i < e->count[no]; i++, row++) {
+            s = is_str(e->src, e->list[no][i], &len);
+            memcpy(heap + pos, s, len);
+            pos += len;
+            offs[row + 1] = pos;
+        }
+        return;
+    }
+
+    for (i = 0; i < e->count[no]; i++, row++) {
+        v = e->out->rows[row];
+        if (e->src->offs == NULL) {
+            memcpy(v, e->src->base + e->list[no][i] * sizeof(value_t),
+                    sizeof(value_t));
+            continue;
+        }
+        s = is_str(e->src, e->list[no][i], &len);
+        len = MIN(len, (uint32_t)sizeof(value_t));
+        memcpy(v, s, len);
+        memset(v + len, 0, sizeof(value_t) - len);
+    }
+}
+
+static int64_t is_emit(struct is_emit *e)
+{
+    struct snap_batch *b = e->out->batch;
+    uint64_t total = 0, sum = 0, i;
+    unsigned int no;
+    uint8_t *bitmap;
+
+    for (no = 0; no < e->threads; no++) {
+        e->first[no] = total;
+        total += e->count[no];
+    }
+    if (total > e->out->capacity || (b && total > b->capacity)) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (b) {
+        snap_parallel(e->threads, is_emit_bytes, e);
+        for (no = 0; no < e->threads; no++) {
+            uint64_t n = e->bytes[no];
+
+            e->bytes[no] = sum;
+            sum += n;
+        }
+        if (sum > b->col[0].heap_size) {
+            errno = ENOSPC;
+            return -1;
+        }
+        snap_col_offs(b, 0)[0] = 0;
+    }
+    snap_parallel(e->threads, is_emit_write, e);
+
+    if (b) {
+        bitmap = snap_col_bitmap(b, 0);
+        if (bitmap) {
+            memset(bitmap, 0xff, total / 8);
+            for (i = total & ~7ull; i < total; i++)
+                snap_col_set_valid(b, 0, i, 1);
+        }
+        b->rows = total;
+    }
+    return total;
+}
+
+/*
+ * Hash
+ */
+struct is_hash_job {
+    const struct intersect_table *t[2];     /* Smaller, larger */
+    unsigned int threads;
+    unsigned int bits;
+    uint64_t nparts;
+    uint64_t *hist[2];          /* threads * nparts, then scatter offsets */
+    uint64_t *part_first[2];    /* nparts + 1 */
+    struct is_tuple *tuples[2];
+    uint8_t *matched;           /* Rows of the larger table */
+    uint64_t next_part;
+    uint64_t max_part;          /* Most rows of the smaller in a partition */
+    struct is_emit *e;
+};
+
+static inline uint64_t is_part(const struct is_hash_job *j, uint64_t h)
+{
+    return j->bits ? h >> (64 - j->bits) : 0;
+}
+
+static void is_hash_hist(void *arg, unsigned int no)
+{
+    struct is_hash_job *j = arg;
+    uint64_t *hist, i, end;
+    const char *s;
+    uint32_t len;
+    int k;
+
+    for (k = 0; k < 2; k++) {
+        hist = j->hist[k] + no * j->nparts;
+        memset(hist, 0, j->nparts * sizeof(*hist));
+        end = snap_parallel_share(j->t[k]->rows, j->threads, no + 1);
+        i = snap_parallel_share(j->t[k]->rows, j->threads, no);
+        for (; i < end; i++) {
+            s = is_str(j->t[k], i, &len);
+            if (s)
+                hist[is_part(j, snap_hash_bytes(s, len))]++;
+        }
+    }
+}
+
+static void is_hash_scatter(void *arg, unsigned int no)
+{
+    struct is_hash_job *j = arg;
+    uint64_t *offs, i, end, h;
+    struct is_tuple *t;
+    const char *s;
+    uint32_t len;
+    int k;
+
+    for (k = 0; k < 2; k++) {
+        offs = j->hist[k] + no * j->nparts;
+        end = snap_parallel_share(j->t[k]->rows, j->threads, no + 1);
+        i = snap_parallel_share(j->t[k]->rows, j->threads, no);
+        for (; i < end; i++) {
+            s = is_str(j->t[k], i, &len);
+            if (s == NULL)
+                continue;
+            h = snap_hash_bytes(s, len);
+            t = &j->tuples[k][offs[is_part(j, h)]++];
+            t->fp = h;
+            t->row = i;
+        }
+    }
+}
+
+static void is_hash_parts(void *arg, unsigned int no __attribute__((unused)))
+{
+    struct is_hash_job *j = arg;
+    const struct intersect_table *t1 = j->t[0];
+    struct is_slot *ht, *slot;
+    struct is_tuple *t, *end;
+    uint64_t slots = 16, p, mask;
+    const char *s, *s1;
+    uint32_t len, len1;
+
+    while (slots < 2 * j->max_part)
+        slots <<= 1;
+    ht = malloc(slots * sizeof(*ht));
+    if (ht == NULL)
+        return;         /* The other threads take its partitions */
+
+    while ((p = __atomic_fetch_add(&j->next_part, 1, __ATOMIC_RELAXED)) <
+            j->nparts) {
+        /* Load at most 1/2 */
+        for (mask = 16; mask < 2 * (j->part_first[0][p + 1] -
+                    j->part_first[0][p]); mask <<= 1)
+            ;
+        memset(ht, 0, mask * sizeof(*ht));
+        mask--;
+
+        t = j->tuples[0] + j->part_first[0][p];
+        end = j->tuples[0] + j->part_first[0][p + 1];
+        for (; t < end; t++) {
+            s = is_str(t1, t->row, &len);
+            for (slot = &ht[t->fp & mask]; slot->row;
+                    slot = &ht[(slot - ht + 1) & mask]) {
+                if (slot->fp != t->fp)
+                    continue;
+                s1 = is_str(t1, slot->row - 1, &len1);
+                if (is_eq(s, len, s1, len1))
+                    break;
+            }
+            if (slot->row == 0) {
+                slot->fp = t->fp;
+                slot->row = t->row + 1;
+            }
+            slot->count++;
+        }
+
+        t = j->tuples[1] + j->part_first[1][p];
+        end = j->tuples[1] + j->part_first[1][p + 1];
+        for (; t < end; t++) {
+            s = is_str(j->t[1], t->row, &len);
+            for (slot = &ht[t->fp & mask]; slot->row;
+                    slot = &ht[(slot - ht + 1) & mask]) {
+                if (slot->fp != t->fp)
+                    continue;
+                s1 = is_str(t1, slot->row - 1, &len1);
+                if (is_eq(s, len, s1, len1))
+                    break;
+            }
+            if (slot->row && slot->count) {
+                slot->count--;
+                j->matched[t->row] = 1;
+            }
+        }
+    }
+    free(ht);
+}
+
+/* Matched rows of each thread's share to its list */
+static void is_hash_list(void *arg, unsigned int no)
+{
+    struct is_hash_job *j = arg;
+    uint64_t i, first, end, n = 0;
+    uint32_t *list;
+
+    first = snap_parallel_share(j->t[1]->rows, j->threads, no);
+    end = snap_parallel_share(j->t[1]->rows, j->threads, no + 1);
+    /* The tuples are not needed anymore, they hold twice the rows */
+    list = (uint32_t *)j->tuples[1] + first;
+    for (i = first; i < end; i++)
+        if (j->matched[i])
+            list[n++] = i;
+    j->e->list[no] = list;
+    j->e->count[no] = n;
+}
+
+static int64_t is_hash_run(const struct intersect_table *t1,
+        const struct intersect_table *t2, struct intersect_out *out,
+        unsigned int threads)
+{
+    struct is_hash_job j;
+    struct is_emit e;
+    uint64_t p, sum, n;
+    unsigned int i;
+    int64_t rc = -1;
+    int k;
+
+    memset(&j, 0, sizeof(j));
+    memset(&e, 0, sizeof(e));
+    j.t[0] = t1->rows <= t2->rows ? t1 : t2;
+    j.t[1] = t1->rows <= t2->rows ? t2 : t1;
+    j.threads = snap_parallel_threads(threads, j.t[1]->rows);
+    while ((j.bits < IS_RADIX_BITS_MAX) &&
+            ((j.t[0]->rows >> j.bits) > IS_PART_ROWS))
+        j.bits++;
+    j.nparts = 1ull << j.bits;
+    j.e = &e;
+
+    for (k = 0; k < 2; k++) {
+        j.hist[k] = malloc(j.threads * j.nparts * sizeof(uint64_t));
+        j.part_first[k] = malloc((j.nparts + 1) * sizeof(uint64_t));
+        /* At least 2 tuples, the larger's hold its row list after */
+        j.tuples[k] = malloc(MAX(j.t[k]->rows, 2ull) *
+                sizeof(struct is_tuple));
+        if (!j.hist[k] || !j.part_first[k] || !j.tuples[k])
+            goto out;
+    }
+    j.matched = calloc(MAX(j.t[1]->rows, 1ull), 1);
+    if (j.matched == NULL)
+        goto out;
+
+    snap_parallel(j.threads, is_hash_hist, &j);
+
+    /* Histograms to scatter offsets, partition by partition */
+    for (k = 0; k < 2; k++) {
+        for (p = 0, sum = 0; p < j.nparts; p++) {
+            j.part_first[k][p] = sum;
+            for (i = 0; i < j.threads; i++) {
+                n = j.hist[k][i * j.nparts + p];
+                j.hist[k][i * j.nparts + p] = sum;
+                sum += n;
+            }
+            if (k == 0)
+                j.max_part = MAX(j.max_part, sum - j.part_first[k][p]);
+        }
+        j.part_first[k][j.nparts] = sum;
+    }
+
+    snap_parallel(j.threads, is_hash_scatter, &j);
+    snap_parallel(j.threads, is_hash_parts, &j);
+    if (j.next_part < j.nparts) {
+        errno = ENOMEM;     /* No thread got its partition table */
+        goto out;
+    }
+
+    snap_parallel(j.threads, is_hash_list, &j);
+    e.src = j.t[1];
+    e.out = out;
+    e.threads = j.threads;
+    rc = is_emit(&e);
+
+ out:
+    for (k = 0; k < 2; k++) {
+        free(j.hist[k]);
+        free(j.part_first[k]);
+        free(j.tuples[k]);
+    }
+    free(j.matched);
+    return rc;
+}
+
+/*
+ * Sort
+ */
+struct is_sort_job {
+    const struct intersect_table *t;
+    unsigned int threads;
+    struct is_ent *src, *dst;
+    uint64_t n;                 /* Rows there, without nulls */
+    uint64_t *hist;             /* threads * 256, count of rows there */
+    unsigned int shift;
+    uint64_t runs[IS_THREADS_MAX + 1];
+};
+
+/* Compares a with b, both rows of t */
+static int is_ent_cmp(const struct intersect_table *ta,
+        const struct is_ent *a, const struct intersect_table *tb,
+        const struct is_ent *b)
+{
+    const char *sa, *sb;
+    uint32_t la, lb;
+    int c;
+
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+    if (a->len > 8 && b->len > 8) {
+        sa = is_str(ta, a->row, &la);
+        sb = is_str(tb, b->row, &lb);
+        c = memcmp(sa + 8, sb + 8, MIN(la, lb) - 8);
+        if (c)
+            return c;
+    }
+    return (a->len > b->len) - (a->len < b->len);
+}
+
+static int is_ent_qsort(const void *a, const void *b, void *t)
+{
+    return is_ent_cmp(t, a, t, b);
+}
+
+static void is_sort_fill(void *arg, unsigned int no)
+{
+    struct is_sort_job *j = arg;
+    uint64_t i, end, pos;
+    struct is_ent *ent;
+    const char *s;
+    uint32_t len;
+    uint64_t w;
+
+    end = snap_parallel_share(j->t->rows, j->threads, no + 1);
+    i = snap_parallel_share(j->t->rows, j->threads, no);
+    if (j->t->valid == NULL) {
+        j->hist[no] = i;
+    } else if (j->dst == NULL) {
+        /* First time: only count rows which are there */
+        for (pos = 0; i < end; i++)
+            pos += snap_bitmap_get(j->t->valid, i);
+        j->hist[no] = pos;
+        return;
+    }
+
+    for (pos = j->hist[no]; i < end; i++) {
+        s = is_str(j->t, i, &len);
+        if (s == NULL)
+            continue;
+        ent = &j->src[pos++];
+        w = 0;
+        memcpy(&w, s, MIN(len, 8u));
+        ent->key = be64toh(w);
+        ent->row = i;
+        ent->len = len;
+    }
+}
+
+static void is_sort_hist(void *arg, unsigned int no)
+{
+    struct is_sort_job *j = arg;
+    uint64_t *hist = j->hist + no * 256, i, end;
+
+    memset(hist, 0, 256 * sizeof(*hist));
+    end = snap_parallel_share(j->n, j->threads, no + 1);
+    for (i = snap_parallel_share(j->n, j->threads, no); i < end; i++)
+        hist[(j->src[i].key >> j->shift) & 0xff]++;
+}
+
+static void is_sort_scatter(void *arg, unsigned int no)
+{
+    struct is_sort_job *j = arg;
+    uint64_t *offs = j->hist + no * 256, i, end;
+
+    end = snap_parallel_share(j->n, j->threads, no + 1);
+    for (i = snap_parallel_share(j->n, j->threads, no); i < end; i++)
+        j->dst[offs[(j->src[i].key >> j->shift) & 0xff]++] = j->src[i];
+}
+
+/* First row of a run of equal first 8 bytes from the share on */
+static void is_sort_runs(void *arg, unsigned int no)
+{
+    struct is_sort_job *j = arg;
+    struct is_ent *e = j->src;
+    uint64_t i = snap_parallel_share(j->n, j->threads, no);
+
+    while ((i > 0) && (i < j->n) && (e[i].key == e[i - 1].key))
+        i++;
+    j->runs[no] = i;
+}
+
+/* Rows with equal first 8 bytes by the rest, the runs from runs[no] */
+static void is_sort_ties(void *arg, unsigned int no)
+{
+    struct is_sort_job *j = arg;
+    struct is_ent *e = j->src;
+    uint64_t i = j->runs[no], end = j->runs[no + 1], run;
+
+    while (i < end) {
+        for (run = i + 1; (run < end) && (e[run].key == e[i].key); run++)
+            ;
+        if (run - i > 1)
+            qsort_r(&e[i], run - i, sizeof(*e), is_ent_qsort,
+                    (void *)j->t);
+        i = run;
+    }
+}
+
+/* Sorted rows of t, without nulls, n of them */
+static struct is_ent *is_sort(const struct intersect_table *t,
+        unsigned int threads, struct is_ent **tmp, uint64_t *n)
+{
+    struct is_sort_job j;
+    struct is_ent *swap;
+    uint64_t sum, c, first;
+    unsigned int i, d;
+    int same;
+
+    memset(&j, 0, sizeof(j));
+    j.t = t;
+    j.threads = snap_parallel_threads(threads, t->rows);
+    j.hist = malloc(j.threads * 256 * sizeof(uint64_t));
+    j.src = malloc(MAX(t->rows, 1ull) * sizeof(struct is_ent));
+    *tmp = malloc(MAX(t->rows, 1ull) * sizeof(struct is_ent));
+    if (!j.hist || !j.src || !*tmp) {
+        free(j.hist);
+        free(j.src);
+        free(*tmp);
+        *tmp = NULL;
+        return NULL;
+    }
+
+    /* Nulls: count, then place the rows which are there */
+    if (t->valid) {
+        snap_parallel(j.threads, is_sort_fill, &j);
+        for (i = 0, sum = 0; i < j.threads; i++) {
+            c = j.hist[i];
+            j.hist[i] = sum;
+            sum += c;
+        }
+        j.n = sum;
+        j.dst = *tmp;
+    } else
+        j.n = t->rows;
+    snap_parallel(j.threads, is_sort_fill, &j);
+
+    j.dst = *tmp;
+    for (j.shift = 0; j.shift < 64; j.shift += 8) {
+        snap_parallel(j.threads, is_sort_hist, &j);
+        for (d = 0, sum = 0, same = 0; d < 256; d++) {
+            first = sum;
+            for (i = 0; i < j.threads; i++) {
+                c = j.hist[i * 256 + d];
+                j.hist[i * 256 + d] = sum;
+                sum += c;
+            }
+            same |= (sum - first == j.n);
+        }
+        /* All rows have the same byte there */
+        if (same)
+            continue;
+
+        snap_parallel(j.threads, is_sort_scatter, &j);
+        swap = j.src;
+        j.src = j.dst;
+        j.dst = swap;
+    }
+    snap_parallel(j.threads, is_sort_runs, &j);
+    j.runs[j.threads] = j.n;
+    snap_parallel(j.threads, is_sort_ties, &j);
+
+    free(j.hist);
+    *tmp = j.dst;
+    *n = j.n;
+    return j.src;
+}
+
+struct is_merge_job {
+    const struct intersect_table *t[2];     /* Smaller, larger */
+    struct is_ent *ent[2];
+    uint64_t n[2];
+    uint64_t a[IS_THREADS_MAX + 1];         /* Ranges of the smaller */
+    uint64_t b[IS_THREADS_MAX + 1];         /* Their starts in the larger */
+    uint32_t *lists;
+    struct is_emit *e;
+};
+
+/* First of x[lo, hi) not below v, in doubling steps from lo */
+static uint64_t is_gallop(const struct intersect_table *tx,
+        const struct is_ent *x, uint64_t lo, uint64_t hi,
+        const struct intersect_table *tv, const struct is_ent *v)
+{
+    uint64_t step = 1, end = lo, mid;
+
+    while ((end < hi) && (is_ent_cmp(tx, &x[end], tv, v) < 0)) {
+        lo = end + 1;
+        end += step;
+        step <<= 1;
+    }
+    end = MIN(end, hi);
+    while (lo < end) {
+        mid = lo + (end - lo) / 2;
+        if (is_ent_cmp(tx, &x[mid], tv, v) < 0)
+            lo = mid + 1;
+        else
+            end = mid;
+    }
+    return lo;
+}
+
+static void is_merge(void *arg, unsigned int no)
+{
+    struct is_merge_job *j = arg;
+    const struct intersect_table *ta = j->t[0], *tb = j->t[1];
+    const struct is_ent *a = j->ent[0], *b = j->ent[1];
+    uint64_t i = j->a[no], ai = j->a[no + 1];
+    uint64_t k = j->b[no], bk = j->b[no + 1];
+    uint32_t *list = j->lists + j->a[no];
+    uint64_t n = 0;
+    int c;
+
+    while (i < ai && k < bk) {
+        c = is_ent_cmp(ta, &a[i], tb, &b[k]);
+        if (c == 0) {
+            list[n++] = a[i].row;
+            i++;
+            k++;
+        } else if (c < 0)
+            i = is_gallop(ta, a, i + 1, ai, tb, &b[k]);
+        else
+            k = is_gallop(tb, b, k + 1, bk, ta, &a[i]);
+    }
+    j->e->list[no] = list;
+    j->e->count[no] = n;
+}
+
+static int64_t is_sort_run(const struct intersect_table *t1,
+        const struct intersect_table *t2, struct intersect_out *out,
+        unsigned int threads)
+{
+    struct is_merge_job j;
+    struct is_emit e;
+    struct is_ent *tmp[2] = { NULL, NULL };
+    unsigned int i, nthreads;
+    int64_t rc = -1;
+    int k;
+
+    memset(&j, 0, sizeof(j));
+    memset(&e, 0, sizeof(e));
+    j.t[0] = t1->rows <= t2->rows ? t1 : t2;
+    j.t[1] = t1->rows <= t2->rows ? t2 : t1;
+    for (k = 0; k < 2; k++) {
+        j.ent[k] = is_sort(j.t[k], threads, &tmp[k], &j.n[k]);
+        if (j.ent[k] == NULL) {
+            errno = ENOMEM;
+            goto out;
+        }
+    }
+    /* The smaller's spare buffer holds the row lists */
+    j.lists = (uint32_t *)tmp[0];
+    j.e = &e;
+
+    /* A value is all in one range, so its rows match once */
+    nthreads = snap_parallel_threads(threads, j.n[0]);
+    for (i = 0; i <= nthreads; i++) {
+        j.a[i] = snap_parallel_share(j.n[0], nthreads, i);
+        if (i > 0)
+            j.a[i] = MAX(j.a[i], j.a[i - 1]);
+        while ((j.a[i] > 0) && (j.a[i] < j.n[0]) &&
+                (is_ent_cmp(j.t[0], &j.ent[0][j.a[i] - 1],
+                            j.t[0], &j.ent[0][j.a[i]]) == 0))
+            j.a[i]++;
+        j.b[i] = (j.a[i] < j.n[0]) ?
+            is_gallop(j.t[1], j.ent[1], 0, j.n[1], j.t[0],
+                    &j.ent[0][j.a[i]]) : j.n[1];
+    }
+    snap_parallel(nthreads, is_merge, &j);
+
+    e.src = j.t[0];
+    e.out = out;
+    e.threads = nthreads;
+    rc = is_emit(&e);
+
+ out:
+    for (k = 0; k < 2; k++) {
+        free(j.ent[k]);
+        free(tmp[k]);
+    }
+    return rc;
+}
+
+/*
+ * Direct
+ */
+static int64_t is_direct_run(const struct intersect_table *t1,
+        const struct intersect_table *t2, struct intersect_out *out)
+{
+    struct is_emit e;
+    uint8_t *used;
+    uint64_t i, k;
+    const char *s1, *s2;
+    uint32_t l1, l2;
+    int64_t rc;
+
+    memset(&e, 0, sizeof(e));
+    used = calloc(MAX(t1->rows, 1ull), 1);
+    e.list[0] = malloc(MAX(MIN(t1->rows, t2->rows), 1ull) *
+            sizeof(uint32_t));
+    if (!used || !e.list[0]) {
+        free(used);
+        free(e.list[0]);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (k = 0; k < t2->rows; k++) {
+        s2 = is_str(t2, k, &l2);
+        if (s2 == NULL)
+            continue;
+        for (i = 0; i < t1->rows; i++) {
+            if (used[i])
+                continue;
+            s1 = is_str(t1, i, &l1);
+            if (s1 && is_eq(s1, l1, s2, l2)) {
+                used[i] = 1;
+                e.list[0][e.count[0]++] = k;
+                break;
+            }
+        }
+    }
+
+    e.src = t2;
+    e.out = out;
+    e.threads = 1;
+    rc = is_emit(&e);
+    free(used);
+    free(e.list[0]);
+    return rc;
+}
+
+int64_t intersect_run(uint32_t method, const struct intersect_table *t1,
+        const struct intersect_table *t2, struct intersect_out *out,
+        unsigned int threads)
+{
+    if ((t1->rows > UINT32_MAX) || (t2->rows > UINT32_MAX)) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    switch (method) {
+    case DIRECT_METHOD:
+        return is_direct_run(t1, t2, out);
+    case HASH_METHOD:
+        return is_hash_run(t1, t2, out, threads);
+    case SORT_METHOD:
+        return is_sort_run(t1, t2, out, threads);
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+/*
+ * Stream: rows of table1 go into one hash table as they arrive, then
+ * the rows of table2 are looked up as they arrive, the same slots as
+ * the hash method. The matches are in table2 order.
+ */
+struct intersect_stream {
+    const struct intersect_table *t1;
+    struct is_slot *ht;
+    uint64_t mask;
+    uint64_t built;         /* Rows of t1 in ht */
+};
+
+struct intersect_stream *intersect_stream_alloc(const struct intersect_table *t1)
+{
+    struct intersect_stream *st;
+    uint64_t slots = 16;
+
+    if (t1->rows >= UINT32_MAX) {
+        errno = E2BIG;
+        return NULL;
+    }
+    while (slots < 2 * t1->rows)
+        slots <<= 1;
+    st = calloc(1, sizeof(*st));
+    if (st == NULL)
+        return NULL;
+    st->ht = calloc(slots, sizeof(*st->ht));
+    if (st->ht == NULL) {
+        free(st);
+        return NULL;
+    }
+    st->t1 = t1;
+    st->mask = slots - 1;
+    return st;
+}
+
+void intersect_stream_free(struct intersect_stream *st)
+{
+    if (st == NULL)
+        return;
+    free(st->ht);
+    free(st);
+}
+
+static struct is_slot *is_stream_slot(const struct intersect_stream *st,
+        const char *s, uint32_t len, uint64_t h)
+{
+    struct is_slot *slot;
+    const char *s1;
+    uint32_t len1;
+
+    for (slot = &st->ht[h & st->mask]; slot->row;
+            slot = &st->ht[(slot - st->ht + 1) & st->mask]) {
+        if (slot->fp != (uint32_t)h)
+            continue;
+        s1 = is_str(st->t1, slot->row - 1, &len1);
+        if (is_eq(s, len, s1, len1))
+            break;
+    }
+    return slot;
+}
+
+/*
+ * The table does not fit a cache, rows go in groups: all hashes of a
+ * group first with their slots prefetched, then the lookups.
+ */
+struct is_stream_group {
+    const char *s[IS_STREAM_GROUP];
+    uint32_t len[IS_STREAM_GROUP];
+    uint64_t h[IS_STREAM_GROUP];
+    uint64_t row[IS_STREAM_GROUP];
+    unsigned int n;
+};
+
+static void is_stream_group(const struct intersect_stream *st,
+        const struct intersect_table *t, uint64_t first, uint64_t end,
+        struct is_stream_group *g)
+{
+    uint64_t i;
+
+    for (i = first, g->n = 0; i < end; i++) {
+        g->s[g->n] = is_str(t, i, &g->len[g->n]);
+        if (g->s[g->n] == NULL)
+            continue;
+        g->h[g->n] = snap_hash_bytes(g->s[g->n], g->len[g->n]);
+        g->row[g->n] = i;
+        __builtin_prefetch(&st->ht[g->h[g->n] & st->mask], 1);
+        g->n++;
+    }
+}
+
+void intersect_stream_build(struct intersect_stream *st, uint64_t end)
+{
+    struct is_stream_group g;
+    struct is_slot *slot;
+    unsigned int k;
+
+    end = MIN(end, st->t1->rows);
+    while (st->built < end) {
+        is_stream_group(st, st->t1, st->built,
+                MIN(st->built + IS_STREAM_GROUP, end), &g);
+        st->built = MIN(st->built + IS_STREAM_GROUP, end);
+        for (k = 0; k < g.n; k++) {
+            slot = is_stream_slot(st, g.s[k], g.len[k], g.h[k]);
+            if (slot->row == 0) {
+                slot->fp = g.h[k];
+                slot->row = g.row[k] + 1;
+            }
+            slot->count++;
+        }
+    }
+}
+
+uint64_t intersect_stream_probe(struct intersect_stream *st,
+        const struct intersect_table *t2, uint64_t first, uint64_t end,
+        uint32_t *list)
+{
+    struct is_stream_group g;
+    struct is_slot *slot;
+    uint64_t i, n = 0;
+    unsigned int k;
+
+    end = MIN(end, t2->rows);
+    for (i = first; i < end; i += IS_STREAM_GROUP) {
+        is_stream_group(st, t2, i, MIN(i + IS_STREAM_GROUP, end), &g);
+        for (k = 0; k < g.n; k++) {
+            slot = is_stream_slot(st, g.s[k], g.len[k], g.h[k]);
+            if (slot->row && slot->count) {
+                slot->count--;
+                list[n++] = g.row[k];
+            }
+        }
+    }
+    return n;
+}
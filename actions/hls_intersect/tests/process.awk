@@ -11,10 +11,17 @@ BEGIN {
   if ($0 ~ "HW steps") {
       hw=1
       sw=0
+      pipe=0
+  }
+  if ($0 ~ "HW step 6") {
+      hw=0
+      sw=0
+      pipe=1
   }
   if ($0 ~ "SW steps") {
       hw=0
       sw=1
+      pipe=0
   }
    
   if (hw == 1 && $0 ~ "Step 1 took") {step1_hw[iter]=$4}
@@ -23,18 +30,20 @@ BEGIN {
   if ($0 ~ "Step 3 took") {step3[iter]=$4}
   if ($0 ~ "Step 4 took") {step4[iter]=$4}
   if ($0 ~ "Step 5 took") {step5[iter]=$4}
-  if ($0 ~ "HW: result_num") {hw_num[iter]=$4}
+  if ($0 ~ "Step 6 took") {step6[iter]=$4}
+  if (pipe == 0 && $0 ~ "HW: result_num") {hw_num[iter]=$4}
+  if (pipe == 1 && $0 ~ "HW: result_num") {pipe_num[iter]=$4}
   if ($0 ~ "SW: result_num") {sw_num[iter]=$4}
 }
 END {
   i=1
   error=0
-  printf "%-2s%8s|%8s%8s|%8s%8s\n","#","TableNum", "HW func", "SW func", "HW mcpy", "SW mcpy"
-  printf "%-2s%8s|%8s%8s|%8s%8s\n","","", "Step3", "Step4", "Step5", "Step2"
+  printf "%-2s%8s|%8s%8s|%8s%8s|%8s\n","#","TableNum", "HW func", "SW func", "HW mcpy", "SW mcpy", "HW pipe"
+  printf "%-2s%8s|%8s%8s|%8s%8s|%8s\n","","", "Step3", "Step4", "Step5", "Step2", "Step6"
   while (i <= iter) {
-    printf "%-2s%8s|%8s%8s|%8s%8s\n",i, table_num[i],step3[i], step4[i], step5[i], step2[i]
+    printf "%-2s%8s|%8s%8s|%8s%8s|%8s\n",i, table_num[i],step3[i], step4[i], step5[i], step2[i], step6[i]
    
-    if(hw_num[i] != sw_num[i]) {
+    if(hw_num[i] != sw_num[i] || (i in pipe_num && pipe_num[i] != hw_num[i])) {
       print "Result num MISCOMPARE!"
       print "ERROR and exit."
       error=1
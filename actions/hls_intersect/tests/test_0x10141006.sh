@@ -93,6 +93,18 @@ for table_num in 10 256 512 1024 2048 4096 8192 16384 32768 65536 131072 262144
     echo "$cmd" >> snap_intersect_s.log
     eval ${cmd}
 
+    cmd="snap_intersect -C${snap_card} -i table1.txt -j table2.txt -m2 -P \
+			>> snap_intersect_s.log 2>&1"
+    echo "$cmd" >> snap_intersect_s.log
+    eval ${cmd}
+    if [ $? -ne 0 ]; then
+	cat snap_intersect_s.log
+	echo
+	echo "cmd: ${cmd}"
+	echo "failed"
+	exit 1
+    fi
+
     cmd="snap_intersect -C${snap_card} -i table1.txt -j table2.txt -m2 -s \
 			>> snap_intersect_s.log 2>&1"
     echo "$cmd" >> snap_intersect_s.log
@@ -35,9 +35,6 @@
 #include <snap_tools.h>
 #include <action_memcopy.h>
 
-/* Name is defined by address and size */
-#define MEMORY_FILE "action_memory_%016llx_%016llx.bin"
-
 static int mmio_write32(struct snap_card *card,
 			uint64_t offs, uint32_t data)
 {
@@ -57,14 +54,7 @@ static int mmio_read32(struct snap_card *card,
 static int action_main(struct snap_sim_action *action,
 		       void *job, unsigned int job_len)
 {
-	int rc;
 	struct memcopy_job *js = (struct memcopy_job *)job;
-	void *src, *dst;
-	size_t len;
-	void *ibuf = NULL;
-	void *obuf = NULL;
-	char ifname[128];
-	char ofname[128];
 
 	/* No error checking ... */
 	act_trace("%s(%p, %p, %d) type_in=%d type_out=%d jobsize %ld bytes\n",
@@ -73,52 +63,22 @@ static int action_main(struct snap_sim_action *action,
 
 	__hexdump(stderr, js, sizeof(*js));
 
-	len = js->out.size;
-	dst = (void *)js->out.addr;
 	if (js->in.size != js->out.size) {
 		act_trace("  err: size does not match in %d bytes versus "
 			  "out %d bytes!\n", js->in.size, js->out.size);
 		goto out_err;
 	}
-	/* checking parameters ... */
-	if (js->in.type != SNAP_ADDRTYPE_HOST_DRAM) {
-		snprintf(ifname, sizeof(ifname), MEMORY_FILE,
-			 (long long)js->in.addr, (long long)js->in.size);
-
-		act_trace("  loading input data from %s\n", ifname);
-		ibuf = malloc(len);
-		if (ibuf == NULL)
-			goto out_err;
-
-		rc = __file_read(ifname, ibuf, len);
-		if (rc < 0)
-			goto out_err;
-
-		src = ibuf;
-	} else
-		src = (void *)js->in.addr;
-
-	if (js->out.type != SNAP_ADDRTYPE_HOST_DRAM) {
-		snprintf(ofname, sizeof(ofname), MEMORY_FILE,
-			 (long long)js->out.addr, (long long)js->out.size);
-
-		act_trace("  writing output data to %s\n", ofname);
-		rc = __file_write(ofname, src, len);
-		if (rc < 0)
-			goto out_err;
-
-		goto out_ok;
-	} else {
-		act_trace("   copy %p to %p %ld bytes\n", src, dst, len);
-		memcpy(dst, src, len);
+
+	/* Host and card DRAM, see SNAP_DRAM_SIM */
+	if (snap_sim_memcpy(action, &js->out, &js->in, js->out.size) < 0) {
+		act_trace("  err: cannot copy: %s\n", strerror(errno));
+		goto out_err;
 	}
- out_ok:
+
 	action->job.retc = SNAP_RETC_SUCCESS;
 	return 0;
 
  out_err:
-	__free(ibuf);
-	__free(obuf);
 	action->job.retc = SNAP_RETC_FAILURE;
 	return 0;
 }
@@ -134,8 +94,6 @@ static struct snap_sim_action action = {
 	.priv_data = NULL,	/* this is passed back as void *card */
 	.mmio_write32 = mmio_write32,
 	.mmio_read32 = mmio_read32,
-
-	.next = NULL,
 };
 
 static void _init(void) __attribute__((constructor));
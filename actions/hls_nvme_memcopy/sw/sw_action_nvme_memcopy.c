@@ -38,6 +38,11 @@
 /* Name is defined by address and size */
 #define MEMORY_FILE "action_memory_%016llx_%016llx.bin"
 
+/*
+ * NVMe addresses go to the emulated drives if SNAP_NVME_SIM is set,
+ * else to a file per address and size. Host and card DRAM are accessed
+ * in place, see SNAP_DRAM_SIM.
+ */
 static int mmio_write32(struct snap_card *card,
 			uint64_t offs, uint32_t data)
 {
@@ -54,17 +59,41 @@ static int mmio_read32(struct snap_card *card,
 	return 0;
 }
 
+/* Between NVMe and host or card DRAM, mem is the DRAM side */
+static int nvme_copy(struct snap_sim_action *action,
+		     struct nvme_memcopy_job *js, int write)
+{
+	struct snap_nvme_sim *sim = snap_card_to_nvme_sim(action->card);
+	struct snap_addr *nvme = write ? &js->out : &js->in;
+	void *mem;
+	char fname[128];
+
+	mem = snap_sim_addr(action, write ? &js->in : &js->out);
+	if (mem == NULL)
+		return -1;
+
+	if (sim) {
+		act_trace("  %s NVMe drive %lld\n", write ? "writing" :
+			  "reading", (long long)js->drive_id);
+		return snap_nvme_sim_rw(sim, js->drive_id, write,
+					nvme->addr / SNAP_NVME_SIM_LB_SIZE,
+					mem, nvme->size);
+	}
+
+	snprintf(fname, sizeof(fname), MEMORY_FILE,
+		 (long long)nvme->addr, (long long)nvme->size);
+	act_trace("  %s data %s %s\n", write ? "writing" : "loading",
+		  write ? "to" : "from", fname);
+	if (write)
+		return __file_write(fname, mem, nvme->size);
+	return __file_read(fname, mem, nvme->size);
+}
+
 static int action_main(struct snap_sim_action *action,
 		       void *job, unsigned int job_len)
 {
 	int rc;
 	struct nvme_memcopy_job *js = (struct nvme_memcopy_job *)job;
-	void *src, *dst;
-	size_t len;
-	void *ibuf = NULL;
-	void *obuf = NULL;
-	char ifname[128];
-	char ofname[128];
 
 	/* No error checking ... */
 	act_trace("%s(%p, %p, %d) type_in=%d type_out=%d jobsize %ld bytes\n",
@@ -73,52 +102,31 @@ static int action_main(struct snap_sim_action *action,
 
 	__hexdump(stderr, js, sizeof(*js));
 
-	len = js->out.size;
-	dst = (void *)js->out.addr;
 	if (js->in.size != js->out.size) {
 		act_trace("  err: size does not match in %d bytes versus "
 			  "out %d bytes!\n", js->in.size, js->out.size);
 		goto out_err;
 	}
 	/* checking parameters ... */
-	if (js->in.type != SNAP_ADDRTYPE_HOST_DRAM) {
-		snprintf(ifname, sizeof(ifname), MEMORY_FILE,
-			 (long long)js->in.addr, (long long)js->in.size);
-
-		act_trace("  loading input data from %s\n", ifname);
-		ibuf = malloc(len);
-		if (ibuf == NULL)
-			goto out_err;
-
-		rc = __file_read(ifname, ibuf, len);
-		if (rc < 0)
-			goto out_err;
-
-		src = ibuf;
-	} else
-		src = (void *)js->in.addr;
-
-	if (js->out.type != SNAP_ADDRTYPE_HOST_DRAM) {
-		snprintf(ofname, sizeof(ofname), MEMORY_FILE,
-			 (long long)js->out.addr, (long long)js->out.size);
-
-		act_trace("  writing output data to %s\n", ofname);
-		rc = __file_write(ofname, src, len);
-		if (rc < 0)
-			goto out_err;
-
-		goto out_ok;
-	} else {
-		act_trace("   copy %p to %p %ld bytes\n", src, dst, len);
-		memcpy(dst, src, len);
+	if ((js->in.type == SNAP_ADDRTYPE_NVME) &&
+	    (js->out.type == SNAP_ADDRTYPE_NVME)) {
+		act_trace("  err: NVMe to NVMe not supported\n");
+		goto out_err;
 	}
- out_ok:
+
+	if (js->in.type == SNAP_ADDRTYPE_NVME)
+		rc = nvme_copy(action, js, 0);
+	else if (js->out.type == SNAP_ADDRTYPE_NVME)
+		rc = nvme_copy(action, js, 1);
+	else
+		rc = snap_sim_memcpy(action, &js->out, &js->in, js->out.size);
+	if (rc < 0)
+		goto out_err;
+
 	action->job.retc = SNAP_RETC_SUCCESS;
 	return 0;
 
  out_err:
-	__free(ibuf);
-	__free(obuf);
 	action->job.retc = SNAP_RETC_FAILURE;
 	return 0;
 }
@@ -134,8 +142,6 @@ static struct snap_sim_action action = {
 	.priv_data = NULL,	/* this is passed back as void *card */
 	.mmio_write32 = mmio_write32,
 	.mmio_read32 = mmio_read32,
-
-	.next = NULL,
 };
 
 static void _init(void) __attribute__((constructor));
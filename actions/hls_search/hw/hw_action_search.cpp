@@ -128,6 +128,7 @@ static short read_burst_of_data_from_mem(snap_membus_t *din_gmem,
         	memcpy(buffer, (snap_membus_t  *) (d_ddrmem + input_address), 
 		       size_in_bytes_to_transfer);
 
+       		rc =  0;
 		break;
 	}
 	return rc;
@@ -146,15 +147,6 @@ static void mbus_to_word(snap_membus_t mem, word_t text)
                 tmp = tmp >> 8;
         }
 }
-// Cast multiples word from input port to a char* word
-static void x_mbus_to_word(snap_membus_t *buffer, char *text)
-{
-	loop_x_mbus_to_word:
-	for(unsigned int k=0; k < MAX_NB_OF_WORDS_READ; k++)
-#pragma HLS UNROLL factor=4
-                mbus_to_word(buffer[k], &text[k*BPERDW]);
-}
-
 
 #ifdef STREAMING_METHOD
 /*******************************************************/
@@ -370,13 +362,23 @@ static snapu32_t process_action_strm(snap_membus_t *din_gmem,
 /********* ARRAY  SEARCH *******************************/
 /*******************************************************/
 
+/*
+ * The text is streamed: a reader process bursts MAX_NB_OF_BYTES_READ
+ * blocks into text_stream while the matcher works on the words of the
+ * previous block. The matcher takes the snap_membus_t words as they
+ * are and carries its state from one word to the next, the last
+ * PATTERN_SIZE - 1 bytes for the naive method and the matched prefix
+ * length for KMP. A pattern spanning two words or two blocks is found
+ * like any other.
+ */
+
 /*******************************************************/
 // Knuth Morris Pratt Pattern Searching algorithm
 // based on D. E. Knuth, J. H. Morris, Jr., and V. R. Pratt, i
 // Fast pattern matching in strings", SIAM J. Computing 6 (1977), 323--350
 
 void preprocess_KMP_table(char Pattern[PATTERN_SIZE], int PatternSize,
-	int KMP_table[])
+	int KMP_table[PATTERN_SIZE + 1])
 {
    int i, j;
 
@@ -388,44 +390,37 @@ void preprocess_KMP_table(char Pattern[PATTERN_SIZE], int PatternSize,
          j = KMP_table[j];
       i++;
       j++;
-      if (Pattern[i] == Pattern[j])
+      if (i < PatternSize && Pattern[i] == Pattern[j])
     	  KMP_table[i] = KMP_table[j];
       else
     	  KMP_table[i] = j;
    }
 }
 
-int KMP_search(char Pattern[PATTERN_SIZE], int PatternSize,
-               char Text[MAX_NB_OF_BYTES_READ], int TextSize)
+// One text word, i is the matched pattern prefix, kept between words
+static unsigned int KMP_search_word(const char Pattern[PATTERN_SIZE],
+				    int PatternSize,
+				    const int KMP_table[PATTERN_SIZE + 1],
+				    snap_membus_t word, unsigned int valid,
+				    int &i)
 {
-#pragma HLS INLINE off
-   int i, j;
-   int KMP_table[PATTERN_SIZE];
-   int count;
-
-   preprocess_KMP_table(Pattern, PatternSize, KMP_table);
-
-   i = j = 0;
-   count = 0;
-   //while (j < TextSize) {
-   while (j < MAX_NB_OF_BYTES_READ) {
-//#pragma HLS UNROLL factor=32
-       if (j < TextSize) {
-	  while (i > -1 && Pattern[i] != Text[j])
-		 i = KMP_table[i];
-	  i++;
-	  j++;
-	  if (i >= PatternSize)
-	  {
-		 i = KMP_table[i];
-		 printf("Found pattern at index %d\n", j-i-PatternSize);
-		 count++;
-	  }
-        }
-	else
-		break;
-   }
-   return count;
+	unsigned int count = 0;
+	char c;
+
+ kmp_bytes:
+	for (unsigned int k = 0; k < BPERDW; k++) {
+		if (k < valid) {
+			c = word(8 * k + 7, 8 * k);
+			while (i > -1 && Pattern[i] != c)
+				i = KMP_table[i];
+			i++;
+			if (i >= PatternSize) {
+				i = KMP_table[i];
+				count++;
+			}
+		}
+	}
+	return count;
 }
 
 /*******************************************************/
@@ -433,65 +428,138 @@ int KMP_search(char Pattern[PATTERN_SIZE], int PatternSize,
 // based on D. E. Knuth, J. H. Morris, Jr., and V. R. Pratt, i
 // Fast pattern matching in strings", SIAM J. Computing 6 (1977), 323--350
 
-int Naive_search(char Pattern[PATTERN_SIZE], int PatternSize,
-                 char Text[MAX_NB_OF_BYTES_READ], int TextSize)
+// One text word, carry holds the PATTERN_SIZE - 1 bytes before it
+static unsigned int Naive_search_word(const char Pattern[PATTERN_SIZE],
+				      int PatternSize,
+				      snap_membus_t word, unsigned int valid,
+				      char carry[PATTERN_SIZE - 1],
+				      snapu64_t seen)
 {
-#pragma HLS INLINE off
-   int i, j;
-   int count=0;
-
-
-   //for (j = 0; j <= TextSize - PatternSize; ++j)
-   for (j = 0; j < MAX_NB_OF_BYTES_READ; ++j)
-   {
-//#pragma HLS UNROLL factor=32
-      if (j <= TextSize - PatternSize) 
-      {
-          for (i = 0; i < PatternSize && Pattern[i] == Text[i + j]; ++i)
-	      ;
-          if (i >= PatternSize)
-          {
-              count++;
-              printf("Pattern found at index %d \n", j);
-          }
-      }
-   }
-   return count;
-}
+	char window[PATTERN_SIZE - 1 + BPERDW];
+#pragma HLS ARRAY_PARTITION variable=window complete
+	unsigned int count = 0;
+	bool match;
+	int first;
+
+ naive_carry_in:
+	for (int j = 0; j < PATTERN_SIZE - 1; j++) {
+#pragma HLS UNROLL
+		window[j] = carry[j];
+	}
+ naive_word_in:
+	for (int k = 0; k < BPERDW; k++) {
+#pragma HLS UNROLL
+		window[PATTERN_SIZE - 1 + k] = word(8 * k + 7, 8 * k);
+	}
+
+	// Compare a pattern ending on each byte of the word
+ naive_ends:
+	for (int k = 0; k < BPERDW; k++) {
+#pragma HLS UNROLL
+		first = PATTERN_SIZE + k - PatternSize;
+		match = (k < (int)valid) &&
+			(seen + k + 1 >= (snapu64_t)PatternSize);
+	naive_cmp:
+		for (int j = 0; j < PATTERN_SIZE; j++) {
+#pragma HLS UNROLL
+			if (j < PatternSize)
+				match &= (window[first + j] == Pattern[j]);
+		}
+		count += match;
+	}
 
+ naive_carry_out:
+	for (int j = 0; j < PATTERN_SIZE - 1; j++) {
+#pragma HLS UNROLL
+		carry[j] = window[BPERDW + j];
+	}
+	return count;
+}
 
-unsigned int search(snapu16_t Method,
-           char *Pattern,
-           unsigned int PatternSize,
-           char *Text,
-           unsigned int TextSize)
+// Read the text in bursts, one block ahead of the search
+static void read_text(snap_membus_t *din_gmem,
+		      snap_membus_t *d_ddrmem,
+		      snapu16_t InputType,
+		      snapu64_t InputAddress,
+		      snapu32_t nb_words,
+		      hls::stream<snap_membus_t> &text_stream)
 {
-        int count;
-
-        count = 0;
-        switch (Method) {
-        case(NAIVE_method):    
-		printf("======== Naive method ========\n");
-                count = Naive_search (Pattern, (int)PatternSize, 
-				Text, (int)TextSize);
-                break;
-        case(KMP_method):      
-		printf("========= KMP method =========\n");
-                count = KMP_search(Pattern, (int)PatternSize, 
-				Text, (int)TextSize);
-                break;
-        default:        
-		printf("=== Default Naive method ===\n");;
-                count = Naive_search(Pattern, (int)PatternSize, 
-				Text, (int)TextSize);
-                break;
-        }
+	snap_membus_t TextBuffer[MAX_NB_OF_WORDS_READ];   // 4KB =>64 words of 64B
+	snapu32_t words;
+
+ rd_text_blocks:
+	for (snapu32_t w = 0; w < nb_words; w += MAX_NB_OF_WORDS_READ) {
+		words = MIN(nb_words - w, (snapu32_t)MAX_NB_OF_WORDS_READ);
+		read_burst_of_data_from_mem(din_gmem, d_ddrmem, InputType,
+				(InputAddress >> ADDR_RIGHT_SHIFT) + w,
+				TextBuffer, words * BPERDW);
+	rd_text_words:
+		for (unsigned int k = 0; k < MAX_NB_OF_WORDS_READ; k++) {
+#pragma HLS PIPELINE
+			if (k < words)
+				text_stream.write(TextBuffer[k]);
+		}
+	}
+}
 
-        printf("pattern size %d - text size %d - rc = %d \n", 
-                (int)PatternSize, (int)TextSize, count);
+static void search_text(hls::stream<snap_membus_t> &text_stream,
+			snapu16_t Method,
+			const char Pattern[PATTERN_SIZE],
+			int PatternSize,
+			const int KMP_table[PATTERN_SIZE + 1],
+			snapu32_t TextSize,
+			snapu32_t nb_words,
+			unsigned int &count)
+{
+	char carry[PATTERN_SIZE - 1];
+#pragma HLS ARRAY_PARTITION variable=carry complete
+	int kmp_i = 0;
+	snapu64_t seen = 0;
+	snap_membus_t word;
+	unsigned int valid;
+
+	count = 0;
+ search_carry_init:
+	for (int j = 0; j < PATTERN_SIZE - 1; j++)
+		carry[j] = 0;
+
+ search_words:
+	for (snapu32_t w = 0; w < nb_words; w++) {
+		word = text_stream.read();
+		valid = MIN((snapu64_t)(TextSize - seen), (snapu64_t)BPERDW);
+
+		if (Method == KMP_method)
+			count += KMP_search_word(Pattern, PatternSize,
+						 KMP_table, word, valid,
+						 kmp_i);
+		else
+			count += Naive_search_word(Pattern, PatternSize,
+						   word, valid, carry, seen);
+		seen += valid;
+	}
+}
 
+static void search_stream(snap_membus_t *din_gmem,
+			  snap_membus_t *d_ddrmem,
+			  snapu16_t InputType,
+			  snapu64_t InputAddress,
+			  snapu32_t TextSize,
+			  snapu16_t Method,
+			  const char Pattern[PATTERN_SIZE],
+			  int PatternSize,
+			  const int KMP_table[PATTERN_SIZE + 1],
+			  unsigned int &count)
+{
+	snapu32_t nb_words = (TextSize + BPERDW - 1) / BPERDW;
+	hls::stream<snap_membus_t> text_stream("text_stream");
+	// Room for two blocks: one being searched, one being read
+#pragma HLS STREAM variable=text_stream depth=128
+#pragma HLS DATAFLOW
 
-        return (unsigned int) count;
+	read_text(din_gmem, d_ddrmem, InputType, InputAddress, nb_words,
+		  text_stream);
+	search_text(text_stream, Method, Pattern, PatternSize, KMP_table,
+		    TextSize, nb_words, count);
 }
 
 //--------------------------------------------------------------------------------------------
@@ -502,87 +570,42 @@ static snapu32_t process_action(snap_membus_t *din_gmem,
                            snap_membus_t *d_ddrmem,
                            action_reg *Action_Register)
 {
-
-
-  // VARIABLES
-  snapu32_t search_size;
-  snapu32_t TextSize;
-  snapu32_t nb_blocks_to_process;
-  snapu16_t i, j ;
-  short rc = 0;
-
-  snapu64_t   InputAddress;
-  snapu32_t   InputSize;
-  snapu16_t   InputType;
-  snapu64_t   OutputAddress;
-
-  snapu64_t   rd_address_text_offset;
-
-  snap_membus_t  TextBuffer[MAX_NB_OF_WORDS_READ];   // 4KB =>64 words of 64B
-  char  Text[MAX_NB_OF_BYTES_READ]; 
-
   unsigned int nb_of_occurrences = 0;
-  snapu16_t Method;
-  unsigned int nb_pos;
-
 
   /* read pattern */
   snapu32_t   PatternSize;
   snap_membus_t  PatternBuffer[1];
   char  Pattern[PATTERN_SIZE];
+  int   KMP_table[PATTERN_SIZE + 1];
 
   PatternSize = Action_Register->Data.src_pattern.size;
-  if (PatternSize > PATTERN_SIZE) rc = 1;
+  if (PatternSize == 0 || PatternSize > PATTERN_SIZE) {
+	  Action_Register->Control.Retc = SNAP_RETC_FAILURE;
+	  return 0;
+  }
 
-  read_burst_of_data_from_mem(din_gmem, d_ddrmem, 
+  read_burst_of_data_from_mem(din_gmem, d_ddrmem,
           Action_Register->Data.src_pattern.type,
           Action_Register->Data.src_pattern.addr >> ADDR_RIGHT_SHIFT,
           PatternBuffer, BPERDW);
   // FIXME Find a way to remove this cast which is a waste of time
   mbus_to_word(PatternBuffer[0], Pattern); // convert buffer to char
+  preprocess_KMP_table(Pattern, (int)PatternSize, KMP_table);
 
-
-  /* read text in */
+  /* search the text while it is read in */
   // byte address received need to be aligned with port width
-  InputAddress = Action_Register->Data.ddr_text1.addr;
-  InputSize    = Action_Register->Data.ddr_text1.size;
-  InputType    = Action_Register->Data.ddr_text1.type;
-  Method       = Action_Register->Data.method;
-
-
-  rd_address_text_offset = 0x0;
-  TextSize = InputSize;
-
-  // buffer size is hardware limited by MAX_NB_OF_BYTES_READ
-  if(InputSize %MAX_NB_OF_BYTES_READ == 0)
-      nb_blocks_to_process = (InputSize / MAX_NB_OF_BYTES_READ);
-  else
-      nb_blocks_to_process = (InputSize / MAX_NB_OF_BYTES_READ) + 1;
-
-  // processing buffers one after the other
-  process_text_per_block:
-  for ( i = 0; i < nb_blocks_to_process; i++ ) {
-#pragma HLS UNROLL // cannot completely unroll a loop with a variable trip count
-		search_size = MIN(TextSize, (snapu32_t) MAX_NB_OF_BYTES_READ);
-
-		rc |= read_burst_of_data_from_mem(din_gmem, d_ddrmem, InputType,
-				(InputAddress >> ADDR_RIGHT_SHIFT) + rd_address_text_offset,
-				TextBuffer, search_size);
-  		// FIXME Find a way to remove this cast which is a waste of time
-		x_mbus_to_word(TextBuffer, Text); /* convert buffer to char*/
-
-		/* ********************
-		 * call search function
-		 **********************/
-		/*FIXME we may miss a pattern that could be between 2 blocks / 2 calls */
-		nb_of_occurrences +=  search(Method, Pattern, PatternSize, 
-                                            Text, search_size);
-		Action_Register->Data.nb_of_occurrences = (snapu32_t) nb_of_occurrences;
-
-		TextSize -= search_size;
-		rd_address_text_offset += (snapu64_t)(search_size >> ADDR_RIGHT_SHIFT);
+  search_stream(din_gmem, d_ddrmem,
+		Action_Register->Data.ddr_text1.type,
+		Action_Register->Data.ddr_text1.addr,
+		Action_Register->Data.ddr_text1.size,
+		Action_Register->Data.method,
+		Pattern, (int)PatternSize, KMP_table,
+		nb_of_occurrences);
+
+  printf("pattern size %d - text size %d - rc = %d \n",
+	 (int)PatternSize, (int)Action_Register->Data.ddr_text1.size,
+	 nb_of_occurrences);
 
-  }
   Action_Register->Data.nb_of_occurrences = (snapu32_t) nb_of_occurrences;
   return (snapu32_t) nb_of_occurrences;
 }
@@ -617,7 +640,7 @@ void hls_action(snap_membus_t *din_gmem,
 #pragma HLS INTERFACE s_axilite port=Action_Register bundle=ctrl_reg	offset=0x100 
 #pragma HLS INTERFACE s_axilite port=return bundle=ctrl_reg
 
-	snapu32_t result;
+	snapu32_t result = 0;
 	// Hardcoded numbers
   	/* test used to exit the action if no parameter has been set.
   	 * Used for the discovery phase of the cards */
@@ -632,7 +655,7 @@ void hls_action(snap_membus_t *din_gmem,
                 break;
         default:
                 Action_Register->Data.nb_of_occurrences = 0x0;
-		Action_Register->Control.Retc = 0x0000;
+		Action_Register->Control.Retc = SNAP_RETC_SUCCESS;
                 Action_Register->Data.next_input_addr = 0x0;
                 break;
 
@@ -684,7 +707,6 @@ void hls_action(snap_membus_t *din_gmem,
             break;
         }
 
-    Action_Register->Control.Retc = SNAP_RETC_SUCCESS;
     Action_Register->Data.nb_of_occurrences = result;
     Action_Register->Data.next_input_addr = 0x0;
 
@@ -713,78 +735,113 @@ static snap_membus_t word_to_mbus(word_t text)
         return mem;
 }
 
-int main(void)
+/*
+ * 1 MiB of text plus a partial word, patterns planted across word and
+ * MAX_NB_OF_BYTES_READ block boundaries. The counts of both methods
+ * must match a plain byte by byte count exactly.
+ */
+#define TB_TEXT_SIZE	(1024 * 1024 + 37)
+#define TB_TEXT_WORDS	((TB_TEXT_SIZE + BPERDW - 1) / BPERDW)
+#define TB_PATTERN_WORD	TB_TEXT_WORDS	/* pattern right after the text */
+#define TB_WORDS	(TB_TEXT_WORDS + 1)
+
+static snap_membus_t din_gmem [TB_WORDS];
+static snap_membus_t dout_gmem[TB_WORDS];
+static snap_membus_t d_ddrmem [TB_WORDS];
+static char text[TB_TEXT_WORDS * BPERDW];
+
+static unsigned int count_ref(const char *pattern, unsigned int psize)
 {
-    int rc = 0;
-    unsigned int i;
-    snap_membus_t  din_gmem [512];
-    snap_membus_t  dout_gmem[512];
-    snap_membus_t  d_ddrmem [512];
+    unsigned int i, count = 0;
 
-    action_reg Action_Register;
-    action_RO_config_reg Action_Config;
+    for (i = 0; i + psize <= TB_TEXT_SIZE; i++)
+        if (memcmp(&text[i], pattern, psize) == 0)
+            count++;
+    return count;
+}
 
+static void plant(const char *pattern, unsigned int offs)
+{
+    if (offs + strlen(pattern) <= TB_TEXT_SIZE)
+        memcpy(&text[offs], pattern, strlen(pattern));
+}
+
+static int run_search(action_reg *Action_Register,
+                      action_RO_config_reg *Action_Config,
+                      snapu16_t method, const char *pattern)
+{
+    word_t word_tmp;
+    unsigned int expected, psize = strlen(pattern);
     snapu32_t nb_of_occurrences;
 
-    char word_tmp[BPERDW];
-
-    FILE *fp;
-
-    int c;
-    int k=0, m=0;
-
-    /* snap_search123.txt can be put in snap/actions/hls_search/hw directory
-     * and contain the following
-123456789_123456789_123456789
-111111111_222222222_333333333
-123412312_123123123_XXXXXXXXX
-123456789_123456789_123456789
-123456789_123456789_123456789
-123456789_123456789_123456789
-18_occurrences_of_123_pattern
-     */
-
-    // read data for text
-    fp = fopen("../../../../snap_search123.txt", "r");
-    if (fp) {
-        while((c = getc(fp)) != EOF) {
-                word_tmp[k] = c;
-                k++;
-                if(k == BPERDW) {
-                        din_gmem[m] = (snap_membus_t) word_to_mbus(word_tmp);
-                        if (m < MAX_NB_OF_WORDS_READ)
-                                m++;
-                        else
-                                break;
-                        k=0;
-                }
-        }
-        if(k != BPERDW) // flush
-        {
-        	din_gmem[m] = (snap_membus_t) word_to_mbus(word_tmp);
-        }
-        if(ferror(fp)) return 1;
-        fclose(fp);
+    memset(word_tmp, 0, sizeof(word_tmp));
+    memcpy(word_tmp, pattern, psize);
+    din_gmem[TB_PATTERN_WORD] = word_to_mbus(word_tmp);
+
+    Action_Register->Data.src_pattern.addr = TB_PATTERN_WORD * BPERDW;
+    Action_Register->Data.src_pattern.size = psize;
+    Action_Register->Data.src_pattern.type = SNAP_ADDRTYPE_HOST_DRAM;
+    Action_Register->Data.method = method;
+    Action_Register->Data.step = 3;
+    Action_Register->Control.flags = 0x1;
+    hls_action(din_gmem, dout_gmem, d_ddrmem, Action_Register, Action_Config);
+
+    nb_of_occurrences = Action_Register->Data.nb_of_occurrences;
+    expected = count_ref(pattern, psize);
+    printf("--Step 3--%s \"%s\": %u occurrences, expected %u => %s\n",
+           method == KMP_method ? "KMP" : "Naive", pattern,
+           (unsigned int)nb_of_occurrences, expected,
+           (Action_Register->Control.Retc == SNAP_RETC_SUCCESS &&
+            nb_of_occurrences == expected) ? "OK" : "FAILED");
+
+    return (Action_Register->Control.Retc != SNAP_RETC_SUCCESS ||
+            nb_of_occurrences != expected);
+}
+
+int main(void)
+{
+    int rc = 0;
+    unsigned int i, m;
+    uint32_t lfsr = 0x12345678;
+    action_reg Action_Register;
+    action_RO_config_reg Action_Config;
+    static const char *patterns[] = {
+        "123",
+        "E",
+        "aaaa",
+        "ERROR_TIMEOUT",
+        "SNAP_SEARCH_PATTERN_OF_SIXTY_FOUR_BYTES_ACROSS_BLOCK_BOUNDARIES_",
+    };
+    static const snapu16_t methods[] = { NAIVE_method, KMP_method };
+
+    // Random lower case text with some runs of 'a' and digits
+    for (i = 0; i < TB_TEXT_SIZE; i++) {
+        lfsr = lfsr * 1103515245 + 12345;
+        text[i] = "abcdefgh123_ aaaa\n"[(lfsr >> 16) % 18];
     }
-    else
-    {
-        printf("ERROR: File used to look for the pattern occurrence couldn't be opened !\n");
-        return 1;
+    // Across every word and block boundary, then some more
+    for (i = BPERDW; i < TB_TEXT_SIZE; i += BPERDW) {
+        if (i % MAX_NB_OF_BYTES_READ == 0) {
+            plant(patterns[4], i - 31);
+            plant(patterns[3], i + BPERDW - 5);
+            plant("aaaaaaa", i + 2 * BPERDW - 3);
+        } else if ((i / BPERDW) % 3 == 0)
+            plant("123123", i - 2);
     }
+    plant(patterns[4], TB_TEXT_SIZE - 64);  // ends on the last byte
+    plant(patterns[3], 0);                   // starts on the first byte
 
+    for (m = 0; m < TB_TEXT_WORDS; m++)
+        din_gmem[m] = word_to_mbus(&text[m * BPERDW]);
 
     Action_Register.Data.src_text1.addr = 0;
-    Action_Register.Data.src_text1.size = (m*BPERDW) + k;
+    Action_Register.Data.src_text1.size = TB_TEXT_SIZE;
     Action_Register.Data.src_text1.type = SNAP_ADDRTYPE_HOST_DRAM;
 
     Action_Register.Data.ddr_text1.addr = 0;
-    Action_Register.Data.ddr_text1.size = (m*BPERDW) + k;
+    Action_Register.Data.ddr_text1.size = TB_TEXT_SIZE;
     Action_Register.Data.ddr_text1.type = SNAP_ADDRTYPE_CARD_DRAM;
 
-    Action_Register.Data.src_pattern.addr = 0;
-    Action_Register.Data.src_pattern.size = 3; // Take 3 first characters of din_gmem as pattern
-    Action_Register.Data.src_pattern.type = SNAP_ADDRTYPE_HOST_DRAM;
-
     Action_Register.Data.ddr_result.addr = 0;
     Action_Register.Data.ddr_result.size = 12;
     Action_Register.Data.ddr_result.type = 0x0000;
@@ -793,55 +850,24 @@ int main(void)
     Action_Register.Control.flags = 0x0;
     hls_action(din_gmem, dout_gmem, d_ddrmem, &Action_Register, &Action_Config);
 
-
-    // process the action
-    Action_Register.Data.method = NAIVE_method; //  method (NAIVE - KMP - STRM)
-    Action_Register.Control.flags = 0x1; // mandatory to have flags !=0 to have processing start
-
     // SW + HW : copy all data from Host to DDR
+    Action_Register.Control.flags = 0x1; // mandatory to have flags !=0 to have processing start
     Action_Register.Data.step = 1;
     printf("--Step 1--SW + HW : copy all data from Host to DDR--");
     hls_action(din_gmem, dout_gmem, d_ddrmem, &Action_Register, &Action_Config);
-    if (Action_Register.Control.Retc == SNAP_RETC_FAILURE)
+    if (Action_Register.Control.Retc == SNAP_RETC_FAILURE) {
 	    printf("Error in step 1\n");
-    else printf("OK\n");
+	    rc = 1;
+    } else printf("OK\n");
 
-    // SW : copy source from DDR to Host
-    Action_Register.Data.step = 2;
-    printf("--Step 2--SW : copy source from DDR to Host--");
-    hls_action(din_gmem, dout_gmem, d_ddrmem, &Action_Register, &Action_Config);
-    if (Action_Register.Control.Retc == SNAP_RETC_FAILURE)
-	    printf("Error in step 2\n");
-    else printf("OK\n");
+    // HW : search processing, every pattern with every method
+    for (m = 0; m < ARRAY_SIZE(methods); m++)
+        for (i = 0; i < ARRAY_SIZE(patterns); i++)
+            rc |= run_search(&Action_Register, &Action_Config,
+                             methods[m], patterns[i]);
 
-    // HW : search processing
-    Action_Register.Data.step = 3;
-    printf("--Step 3--HW : search processing--\n");
-    hls_action(din_gmem, dout_gmem, d_ddrmem, &Action_Register, &Action_Config);
-    nb_of_occurrences = Action_Register.Data.nb_of_occurrences;
-    if(Action_Register.Control.Retc == SNAP_RETC_FAILURE)
-	    printf("Error in step 3\n");
-    else printf("--Step 3--OK\n");
-    printf("Search : %d occurrences found",
-	   (unsigned int)nb_of_occurrences);
-    if(nb_of_occurrences == 18)
-    	printf(" => Test OK\n=============================\n ");
-    else
-    	printf(" => Test failed : Expected 18 !!\n============================= \n");
-
-/* Positions reported - not yet implemented
-    // HW : copy result array from DDR to Host
-    Action_Register.Data.step = 5;
-    printf("--Step 5--HW : copy result array from DDR to Host--");
-    hls_action(din_gmem, dout_gmem, d_ddrmem, &Action_Register, &Action_Config);
-    if(Action_Register.Control.Retc == SNAP_RETC_FAILURE)
-	    printf("Error in step 5\n");
-    else printf("OK\n");
-*/
-    if (Action_Register.Control.Retc == SNAP_RETC_FAILURE) {
-	    printf(" ==> RETURN CODE FAILURE <==\n");
-	    return 1;
-    }
+    printf("=============================\n%s\n",
+           rc ? " ==> Test failed <==" : " => Test OK");
     printf(">> ACTION TYPE = %8lx - RELEASE_LEVEL = %8lx <<\n",
 	   (unsigned long)Action_Config.action_type,
 	   (unsigned long)Action_Config.release_level);
@@ -851,7 +877,7 @@ int main(void)
 	    return 1;
     }
 
-    return 0;
+    return rc;
 }
 
 #endif
@@ -55,6 +55,7 @@ typedef enum {
         STRM_method   = 0x0,
         NAIVE_method  = 0x1,
         KMP_method    = 0x2,
+        MULTI_method  = 0x3,    /* Software only, '\n' separated patterns */
 } search_method_t;
 
 #ifdef __cplusplus
@@ -282,10 +282,12 @@ static void usage(const char *prog)
 	printf("Usage: %s [-h] [-v, --verbose] [-V, --version]\n"
 	       "  -C, --card <cardno> can be (0...3)\n"
 	       "  -s, --software         Test the software flow \n"
-	       "  -m, --method           Can be (1,2) different method search\n"
+	       "  -m, --method           Can be (1,2,3) different method search\n"
 	       "  -i, --input <data.bin> Input data.\n"
 	       "  -I, --items <items>    Max items to find.\n"
 	       "  -p, --pattern <str>    Pattern to search for\n"
+	       "  -P, --patterns <file>  Patterns to search for, one per line (-m3),\n"
+	       "                         needs -s or SNAP_CONFIG=CPU\n"
 	       "  -E, --expected <num>   Expected # of patterns to find\n"
 	       "  -t, --timeout <num>    timeout in sec (default 10 sec)\n"
 	       "  -N, --No irq           Disable Interrupts (polling)"
@@ -296,8 +298,11 @@ static void usage(const char *prog)
                " - s is used to use Step 2 and 4 : just moving data and process on CPU\n"
                "     default is     Step 1 and 3 : moving data to DDR and process on FPGA\n"
                " - m is the different search method user can use 0:Stream - 1:Naive (default) - 2:KMP\n"
+               "     3:Multi, all patterns in one pass, software only: rejected\n"
+               "       without -s or SNAP_CONFIG=CPU, the FPGA has no such method\n"
                " - The result will be the number of time the \"pattern\" is found in the text\n"
-               " (The feature to send back the position of the occurrences is not yet coded) \n"
+               " - Software searches return the first I positions, shown with -vvv\n"
+               "     SNAP_SEARCH_THREADS sets the threads of -m3, default all CPUs\n"
                "\n"
                "Useful parameters :\n"
                "-------------------\n"
@@ -339,6 +344,19 @@ static void usage(const char *prog)
 	       prog);
 }
 
+/* SNAP_CONFIG as libsnap reads it, bit 0 selects the software action */
+static int sw_action_enabled(void)
+{
+	const char *config_env = getenv("SNAP_CONFIG");
+
+	if (config_env == NULL)
+		return 0;
+	if ((strncmp(config_env, "CPU", 3) == 0) ||
+	    (strncmp(config_env, "cpu", 3) == 0))
+		return 1;
+	return strtol(config_env, (char **)NULL, 0) & 0x1;
+}
+
 /**
  * Read accelerator specific registers. Must be called as root!
  */
@@ -351,6 +369,7 @@ int main(int argc, char *argv[])
 	char device[128];
 	const char *fname = NULL;
 	const char *pattern_str = "Snap";
+	const char *pname = NULL;	/* pattern file, one per line */
 	struct snap_job cjob;
 	struct search_job sjob_in;
 	struct search_job sjob_out;
@@ -380,6 +399,7 @@ int main(int argc, char *argv[])
 			{ "method",      required_argument, NULL, 'm' },
 			{ "input",	 required_argument, NULL, 'i' },
 			{ "pattern",	 required_argument, NULL, 'p' },
+			{ "patterns",	 required_argument, NULL, 'P' },
 			{ "items",	 required_argument, NULL, 'I' },
 			{ "timeout",	 required_argument, NULL, 't' },
 			{ "expected",	 required_argument, NULL, 'E' },
@@ -391,7 +411,7 @@ int main(int argc, char *argv[])
 		};
 
 		ch = getopt_long(argc, argv,
-				 "C:E:m:i:p:I:t:sVvhN",
+				 "C:E:m:i:p:P:I:t:sVvhN",
 				 long_options, &option_index);
 		if (ch == -1)	/* all params processed ? */
 			break;
@@ -413,6 +433,10 @@ int main(int argc, char *argv[])
 		case 'p':
 			pattern_str = optarg;
 			break;
+		case 'P':
+			pname = optarg;
+			method = MULTI_method;
+			break;
 		case 'I':
 			items = strtol(optarg, (char **)NULL, 0);
 			break;
@@ -451,6 +475,15 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	/*
+	 * The hardware action has no multi pattern method, it would run
+	 * the single pattern search on the joined pattern file.
+	 */
+	if ((method == MULTI_method) && !sw && !sw_action_enabled()) {
+		fprintf(stderr, "err: -m3/-P needs -s or SNAP_CONFIG=CPU\n");
+		exit(EXIT_FAILURE);
+	}
+
 	dsize = file_size(fname);
 	if (dsize < 0)
 		goto out_error;
@@ -459,16 +492,28 @@ int main(int argc, char *argv[])
 	if (dbuff == NULL)
 		goto out_error;
 
-	psize = strlen(pattern_str);
+	if (pname) {
+		psize = file_size(pname);
+		if (psize <= 0)
+			goto out_error0;
+		pbuff = snap_malloc(psize);
+		if (pbuff == NULL)
+			goto out_error0;
+		rc = file_read(pname, pbuff, psize);
+		if (rc < 0)
+			goto out_errorX;
+	} else {
+		psize = strlen(pattern_str);
+		pbuff = snap_malloc(psize);
+		if (pbuff == NULL)
+			goto out_error0;
+		memcpy(pbuff, pattern_str, psize);
+	}
 	/* FIXME pattern is limited to 64 Bytes by hardware in this preliminary release */
-	if (psize > 64) {
+	if (!sw && (method != MULTI_method) && (psize > 64)) {
 		printf("Pattern is limited to 64 bytes\n");
-		goto out_error0;
+		goto out_errorX;
 	}
-	pbuff = snap_malloc(psize);
-	if (pbuff == NULL)
-		goto out_error0;
-	memcpy(pbuff, pattern_str, psize);
 
 	rc = file_read(fname, dbuff, dsize);
 	if (rc < 0)
@@ -550,7 +595,7 @@ int main(int argc, char *argv[])
  	 	step = 4;
 
         	sjob_out.nb_of_occurrences = run_sw_search(method, (char *)pbuff, psize,
-					(char *)dbuff, dsize);
+					(char *)dbuff, dsize, offs, items);
 
             	snap_print_search_results(&cjob, run);
         	printf("Step 4 : RESULT :  %d occurrences \n", sjob_out.nb_of_occurrences);
@@ -568,6 +613,9 @@ int main(int argc, char *argv[])
                 case(2):
                         printf(" >>> KMP method (%d) \n", method);
                         break;
+                case(3):
+                        printf(" >>> Multi method (%d), software action only \n", method);
+                        break;
                 case(0):
 #ifdef STREAMING_METHOD
                         printf(" >>> Streaming method (%d) \n", method);
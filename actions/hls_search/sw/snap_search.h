@@ -21,9 +21,21 @@
 #include <action_search.h>
 
 unsigned int run_sw_search(unsigned int Method, char *Pattern,
-           unsigned int PatternSize, char *Text, unsigned int TextSize);
-int Naive_search(char *pat, int M, char *txt, int N);
+           unsigned int PatternSize, char *Text, unsigned int TextSize,
+           uint64_t *offs, unsigned int items);
+int Naive_search(char *pat, int M, char *txt, int N,
+           uint64_t *offs, unsigned int items);
 void preprocess_KMP_table(char *pat, int M, int KMP_table[]);
-int KMP_search(char *pat, int M, char *txt, int N);
+int KMP_search(char *pat, int M, char *txt, int N,
+           uint64_t *offs, unsigned int items);
+
+/* MULTI_method, see sw_search_multi.c */
+struct search_multi;
+
+struct search_multi *search_multi_alloc(const char *patterns,
+					unsigned int size);
+void search_multi_free(struct search_multi *sm);
+uint64_t search_multi_run(const struct search_multi *sm, const char *text,
+			  uint64_t size, uint64_t *offs, uint64_t items);
 
 #endif	/* __ACTION_SEARCH_H__ */
@@ -24,6 +24,8 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/time.h>
+#include <linux/types.h>
+#include <asm/byteorder.h>
 #include <snap_tools.h>
 
 #include <libsnap.h>
@@ -68,13 +70,17 @@ void preprocess_KMP_table(char *Pattern, int PatternSize, int KMP_table[])
           KMP_table[i] = j;
    }
 }
-int KMP_search(char *Pattern, int PatternSize, char *Text, int TextSize)
+int KMP_search(char *Pattern, int PatternSize, char *Text, int TextSize,
+               uint64_t *offs, unsigned int items)
 {
    int i, j;
-   /*FIXME Pattern is currently hardware limited to 64 Bytes */
-   int KMP_table[64];
+   /* The table takes PatternSize + 1 entries, no length limit in software */
+   int *KMP_table;
    int count;
 
+   KMP_table = malloc((PatternSize + 1) * sizeof(int));
+   if (KMP_table == NULL)
+      return 0;
    preprocess_KMP_table(Pattern, PatternSize, KMP_table);
 
    i = j = 0;
@@ -88,16 +94,20 @@ int KMP_search(char *Pattern, int PatternSize, char *Text, int TextSize)
       {
          i = KMP_table[i];
          //printf("Found pattern at index %d\n", j-i-PatternSize);
+         if (offs && (unsigned int)count < items)
+            offs[count] = __cpu_to_le64(j - PatternSize);
          count++;
       }
    }
+   free(KMP_table);
    return count;
 }
 // Naive / Brute Force Searching algorithm
 // based on D. E. Knuth, J. H. Morris, Jr., and V. R. Pratt, i
 // Fast pattern matching in strings", SIAM J. Computing 6 (1977), 323--350
 //
-int Naive_search(char *Pattern, int PatternSize, char *Text, int TextSize)
+int Naive_search(char *Pattern, int PatternSize, char *Text, int TextSize,
+                 uint64_t *offs, unsigned int items)
 {
    int i, j;
    int count=0;
@@ -106,6 +116,8 @@ int Naive_search(char *Pattern, int PatternSize, char *Text, int TextSize)
       for (i = 0; i < PatternSize && Pattern[i] == Text[i + j]; ++i);
       if (i >= PatternSize)
       {
+           if (offs && (unsigned int)count < items)
+                offs[count] = __cpu_to_le64(j);
            count++;
            //printf("Pattern found at index %d \n", j);
       }
@@ -114,9 +126,11 @@ int Naive_search(char *Pattern, int PatternSize, char *Text, int TextSize)
 }
 unsigned int run_sw_search(unsigned int Method,
            char *Pattern, unsigned int PatternSize,
-           char *Text, unsigned int TextSize)
+           char *Text, unsigned int TextSize,
+           uint64_t *offs, unsigned int items)
 {
         int count;
+        struct search_multi *sm;
 
         struct timeval etime, stime;
 
@@ -126,15 +140,29 @@ unsigned int run_sw_search(unsigned int Method,
         switch (Method) {
         case(1):
 		printf("======== SW Naive method ========\n");
-                count = Naive_search (Pattern, PatternSize, Text, TextSize);
+                count = Naive_search (Pattern, PatternSize, Text, TextSize,
+                                      offs, items);
                 break;
         case(2):
 	        printf("========= SW KMP method =========\n");
-                count = KMP_search(Pattern, PatternSize, Text, TextSize);
+                count = KMP_search(Pattern, PatternSize, Text, TextSize,
+                                   offs, items);
+                break;
+        case(3):
+	        printf("======== SW Multi method ========\n");
+                sm = search_multi_alloc(Pattern, PatternSize);
+                if (sm == NULL) {
+                        fprintf(stderr, "err: cannot compile patterns: %s\n",
+                                strerror(errno));
+                        break;
+                }
+                count = search_multi_run(sm, Text, TextSize, offs, items);
+                search_multi_free(sm);
                 break;
         default:
 	        printf("=== SW Default Naive method ===\n");;
-                count = Naive_search(Pattern, PatternSize, Text, TextSize);
+                count = Naive_search(Pattern, PatternSize, Text, TextSize,
+                                     offs, items);
                 break;
         }
 
@@ -160,6 +188,8 @@ static int action_main(struct snap_sim_action *action,
 	struct search_job *js = (struct search_job *)job;
 	char *needle, *haystack;
 	unsigned int needle_len, haystack_len, method;
+	uint64_t *offs;
+	int rc = 0;
 
 	act_trace("%s(%p, %p, %d) SEARCH\n", __func__, action, job, job_len);
 	__trace_addr("src_text1",   &js->src_text1);
@@ -171,19 +201,48 @@ static int action_main(struct snap_sim_action *action,
 	if (js->src_result.addr != 0 && js->src_result.type == SNAP_ADDRTYPE_HOST_DRAM)
 		memset((uint8_t *)js->src_result.addr, 0, js->src_result.size);
 
-	haystack = (char *)(unsigned long)js->src_text1.addr;
-	haystack_len = js->src_text1.size;
-
 	needle = (char *)(unsigned long)js->src_pattern.addr;
 	needle_len = js->src_pattern.size;
 
 	method =  js->method;
 
-        if (js->step == 3) 
-		js->nb_of_occurrences = run_sw_search(method, (char *)needle, needle_len,
-                                        (char *)haystack, haystack_len);
+	/* Same steps as the hardware, card DRAM see SNAP_DRAM_SIM */
+	switch (js->step) {
+	case 1:		/* Host to DDR */
+		rc = snap_sim_memcpy(action, &js->ddr_text1, &js->src_text1,
+				     js->src_text1.size);
+		break;
+	case 2:		/* DDR to host */
+		rc = snap_sim_memcpy(action, &js->src_text1, &js->ddr_text1,
+				     js->ddr_text1.size);
+		break;
+	case 3:		/* Search in DDR */
+		haystack = snap_sim_addr(action, &js->ddr_text1);
+		if (haystack == NULL) {
+			rc = -1;
+			break;
+		}
+		haystack_len = js->ddr_text1.size;
+		/* Positions straight to the host, there is no step 5 yet */
+		offs = NULL;
+		if (js->src_result.type == SNAP_ADDRTYPE_HOST_DRAM)
+			offs = (uint64_t *)(unsigned long)js->src_result.addr;
+		js->nb_of_occurrences = run_sw_search(method, (char *)needle,
+					needle_len, (char *)haystack,
+					haystack_len, offs,
+					js->src_result.size / sizeof(*offs));
+		js->next_input_addr = 0;
+		break;
+	default:
+		break;
+	}
 
-	action->job.retc = SNAP_RETC_SUCCESS;
+	if (rc < 0) {
+		act_trace("  err: step %d: %s\n", (int)js->step,
+			  strerror(errno));
+		action->job.retc = SNAP_RETC_FAILURE;
+	} else
+		action->job.retc = SNAP_RETC_SUCCESS;
 
 	act_trace("%s SEARCH DONE retc=%x\n", __func__, action->job.retc);
 	return 0;
@@ -200,8 +259,6 @@ static struct snap_sim_action action = {
 	.priv_data = NULL,	/* this is passed back as void *card */
 	.mmio_write32 = mmio_write32,
 	.mmio_read32 = mmio_read32,
-
-	.next = NULL,
 };
 
 static void _init(void) __attribute__((constructor));
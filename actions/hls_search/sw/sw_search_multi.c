@@ -0,0 +1,403 @@
+/*
+ * Copyright 2018, International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Multi-pattern search for the software flow (MULTI_method).
+ *
+ * All patterns are compiled into one Aho-Corasick automaton, stored as a
+ * full DFA over byte classes: bytes which occur in no pattern share one
+ * class, which keeps the table small for hundreds of needles. One pass
+ * over the text finds every occurrence of every pattern, overlapping
+ * ones included, at any pattern length.
+ *
+ * While the automaton is in its root state no match can be in progress,
+ * so the scan skips ahead to the next byte which starts a pattern. With
+ * AVX2 this is a shufti style class lookup over 32 bytes at a time, else
+ * a byte loop.
+ *
+ * Large texts are cut into chunks, one thread each (SNAP_SEARCH_THREADS,
+ * default all online CPUs). A thread starts scanning the longest pattern
+ * minus one byte before its chunk and counts only matches ending inside
+ * the chunk, such that matches crossing a boundary are found once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/types.h>
+#include <asm/byteorder.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <snap_tools.h>
+#include <snap_internal.h>
+#include "snap_search.h"
+
+#define SEARCH_MULTI_THREADS_MAX	64
+#define SEARCH_MULTI_MIN_CHUNK		(1024 * 1024)	/* Bytes per thread */
+#define SEARCH_MULTI_SKIP_MAX		64	/* Start bytes to use skipping */
+
+struct search_multi {
+	unsigned int npatterns;
+	unsigned int max_len;
+	unsigned int nstates;
+	unsigned int nclasses;
+
+	uint8_t cls[256];		/* Byte to class */
+	uint8_t start[256];		/* Byte can start a pattern */
+	uint8_t lo_tbl[16];		/* shufti tables of start[] */
+	uint8_t hi_tbl[16];
+	int skip;			/* Few start bytes, skipping pays */
+
+	uint32_t *delta;		/* [nstates][nclasses] */
+	uint32_t *first_out;		/* First state with a match, or 0 */
+	uint32_t *out_link;		/* Next shorter suffix with a match */
+	uint32_t *out_len;		/* Length of the pattern ending here */
+};
+
+struct search_hits {
+	uint64_t *offs;
+	uint64_t n;
+	uint64_t alloc;
+	uint64_t max;
+};
+
+struct search_worker {
+	pthread_t tid;
+	int started;
+	const struct search_multi *sm;
+	const uint8_t *text;
+	uint64_t from;			/* Scan start, before the chunk */
+	uint64_t chunk;			/* First byte a match may end on */
+	uint64_t to;
+	uint64_t count;
+	struct search_hits hits;
+};
+
+static unsigned int search_threads(void)
+{
+	const char *env = getenv("SNAP_SEARCH_THREADS");
+	long n;
+
+	if (env != NULL)
+		n = strtol(env, (char **)NULL, 0);
+	else
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		n = 1;
+	if (n > SEARCH_MULTI_THREADS_MAX)
+		n = SEARCH_MULTI_THREADS_MAX;
+	return n;
+}
+
+/* Patterns are '\n' separated, empty lines are ignored */
+struct search_multi *search_multi_alloc(const char *patterns,
+					unsigned int size)
+{
+	struct search_multi *sm;
+	unsigned int i, j, len, c, s, t, head, tail, nbytes = 0;
+	uint32_t *queue = NULL, *fail = NULL;
+	const uint8_t *p = (const uint8_t *)patterns;
+
+	sm = calloc(1, sizeof(*sm));
+	if (sm == NULL)
+		return NULL;
+
+	/* Byte classes, class 0 is for bytes not in any pattern */
+	sm->nclasses = 1;
+	for (i = 0; i < size; i++) {
+		if ((p[i] == '\n') || sm->cls[p[i]])
+			continue;
+		sm->cls[p[i]] = sm->nclasses++;
+	}
+	for (i = 0; i < size; i = j + 1) {
+		for (j = i; (j < size) && (p[j] != '\n'); j++)
+			;
+		if (j == i)
+			continue;
+		sm->npatterns++;
+		sm->max_len = MAX(sm->max_len, j - i);
+		if (!sm->start[p[i]])
+			nbytes++;
+		sm->start[p[i]] = 1;
+	}
+	if (sm->npatterns == 0) {
+		errno = EINVAL;
+		goto out_err;
+	}
+
+	/* Upper bound of the trie size: root plus one per pattern byte */
+	sm->delta = calloc((size_t)(size + 1) * sm->nclasses,
+			   sizeof(*sm->delta));
+	sm->first_out = calloc(size + 1, sizeof(uint32_t));
+	sm->out_link = calloc(size + 1, sizeof(uint32_t));
+	sm->out_len = calloc(size + 1, sizeof(uint32_t));
+	queue = malloc((size + 1) * sizeof(uint32_t));
+	fail = calloc(size + 1, sizeof(uint32_t));
+	if (!sm->delta || !sm->first_out || !sm->out_link || !sm->out_len ||
+	    !queue || !fail)
+		goto out_err;
+
+	/* Trie, 0 in delta means no child yet, the root is nobody's child */
+	sm->nstates = 1;
+	for (i = 0; i < size; i = j + 1) {
+		for (s = 0, j = i; (j < size) && (p[j] != '\n'); j++) {
+			c = sm->cls[p[j]];
+			if (sm->delta[s * sm->nclasses + c] == 0)
+				sm->delta[s * sm->nclasses + c] =
+					sm->nstates++;
+			s = sm->delta[s * sm->nclasses + c];
+		}
+		len = j - i;
+		if (len)
+			sm->out_len[s] = len;	/* Duplicates collapse */
+	}
+
+	/*
+	 * Breadth first, a state's failure state is shallower and thus
+	 * complete when its missing transitions are copied from it.
+	 */
+	head = tail = 0;
+	for (c = 0; c < sm->nclasses; c++) {
+		t = sm->delta[c];
+		if (t) {
+			fail[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+	while (head < tail) {
+		s = queue[head++];
+		sm->out_link[s] = sm->first_out[fail[s]];
+		sm->first_out[s] = sm->out_len[s] ? s : sm->out_link[s];
+
+		for (c = 0; c < sm->nclasses; c++) {
+			uint32_t *d = &sm->delta[s * sm->nclasses + c];
+			uint32_t f = sm->delta[fail[s] * sm->nclasses + c];
+
+			if (*d) {
+				fail[*d] = f;
+				queue[tail++] = *d;
+			} else
+				*d = f;
+		}
+	}
+
+	/* Byte c is a start candidate if lo_tbl[c & 15] & hi_tbl[c >> 4] */
+	for (c = 0; c < 256; c++) {
+		if (!sm->start[c])
+			continue;
+		sm->hi_tbl[c >> 4] = 1 << ((c >> 4) & 7);
+		sm->lo_tbl[c & 15] |= 1 << ((c >> 4) & 7);
+	}
+	sm->skip = (nbytes <= SEARCH_MULTI_SKIP_MAX);
+
+	act_trace("  %s: %u patterns max %u bytes, %u states %u classes "
+		  "%u start bytes\n", __func__, sm->npatterns, sm->max_len,
+		  sm->nstates, sm->nclasses, nbytes);
+	free(queue);
+	free(fail);
+	return sm;
+
+ out_err:
+	free(queue);
+	free(fail);
+	search_multi_free(sm);
+	return NULL;
+}
+
+void search_multi_free(struct search_multi *sm)
+{
+	if (sm == NULL)
+		return;
+	free(sm->delta);
+	free(sm->first_out);
+	free(sm->out_link);
+	free(sm->out_len);
+	free(sm);
+}
+
+/* Next position >= i with a byte which can start a pattern, or to */
+static uint64_t skip_scalar(const struct search_multi *sm,
+			    const uint8_t *text, uint64_t i, uint64_t to)
+{
+	while ((i < to) && !sm->start[text[i]])
+		i++;
+	return i;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static uint64_t skip_avx2(const struct search_multi *sm,
+			  const uint8_t *text, uint64_t i, uint64_t to)
+{
+	const __m256i lo_tbl = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)sm->lo_tbl));
+	const __m256i hi_tbl = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)sm->hi_tbl));
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i v, lo, hi, r;
+	uint32_t miss;
+
+	for (; i + 32 <= to; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(text + i));
+		lo = _mm256_shuffle_epi8(lo_tbl, _mm256_and_si256(v, nibble));
+		hi = _mm256_shuffle_epi8(hi_tbl, _mm256_and_si256(
+					_mm256_srli_epi16(v, 4), nibble));
+		r = _mm256_and_si256(lo, hi);
+		miss = _mm256_movemask_epi8(_mm256_cmpeq_epi8(r, zero));
+		if (miss != 0xffffffff)	/* Candidate, may be a false one */
+			return i + __builtin_ctz(~miss);
+	}
+	return skip_scalar(sm, text, i, to);
+}
+#endif
+
+typedef uint64_t (* skip_fn_t)(const struct search_multi *sm,
+			       const uint8_t *text, uint64_t i, uint64_t to);
+
+static skip_fn_t skip_fn(void)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		return skip_avx2;
+#endif
+	return skip_scalar;
+}
+
+static void hits_add(struct search_hits *h, uint64_t pos)
+{
+	uint64_t *offs;
+	uint64_t alloc;
+
+	if (h->n >= h->max)
+		return;
+	if (h->n == h->alloc) {
+		alloc = MIN(MAX(h->alloc * 2, 64ull), h->max);
+		offs = realloc(h->offs, alloc * sizeof(*offs));
+		if (offs == NULL) {
+			h->max = h->n;	/* Keep counting, stop recording */
+			return;
+		}
+		h->offs = offs;
+		h->alloc = alloc;
+	}
+	h->offs[h->n++] = pos;
+}
+
+/*
+ * Scan text[from..to), count matches ending at or after chunk. Offsets
+ * are of the first byte of a match, in order of the match end.
+ */
+static uint64_t search_scan(const struct search_multi *sm,
+			    const uint8_t *text, uint64_t from,
+			    uint64_t chunk, uint64_t to,
+			    struct search_hits *hits)
+{
+	const uint32_t *delta = sm->delta;
+	const uint8_t *cls = sm->cls;
+	size_t nclasses = sm->nclasses;
+	skip_fn_t skip = sm->skip ? skip_fn() : NULL;
+	uint32_t state = 0, s;
+	uint64_t i, count = 0;
+
+	for (i = from; i < to; i++) {
+		if ((state == 0) && skip && !sm->start[text[i]]) {
+			i = skip(sm, text, i, to);
+			if (i >= to)
+				break;
+		}
+		state = delta[state * nclasses + cls[text[i]]];
+		s = sm->first_out[state];
+		if ((s == 0) || (i < chunk))
+			continue;
+		for (; s; s = sm->out_link[s]) {
+			count++;
+			hits_add(hits, i + 1 - sm->out_len[s]);
+		}
+	}
+	return count;
+}
+
+static void *search_worker(void *arg)
+{
+	struct search_worker *w = arg;
+
+	w->count = search_scan(w->sm, w->text, w->from, w->chunk, w->to,
+			       &w->hits);
+	return NULL;
+}
+
+/*
+ * Count all occurrences of the patterns in text. Up to items offsets go
+ * to offs as little endian 64 bit values, offs may be NULL.
+ */
+uint64_t search_multi_run(const struct search_multi *sm, const char *text,
+			  uint64_t size, uint64_t *offs, uint64_t items)
+{
+	struct search_worker w[SEARCH_MULTI_THREADS_MAX];
+	unsigned int i, n, threads = search_threads();
+	uint64_t chunk, count = 0, stored = 0, j;
+
+	if (offs == NULL)
+		items = 0;
+
+	n = MIN((uint64_t)threads, size / SEARCH_MULTI_MIN_CHUNK);
+	if (n < 1)
+		n = 1;
+	chunk = (size + n - 1) / n;
+
+	memset(w, 0, n * sizeof(w[0]));
+	for (i = 0; i < n; i++) {
+		w[i].sm = sm;
+		w[i].text = (const uint8_t *)text;
+		w[i].chunk = i * chunk;
+		w[i].to = MIN(size, w[i].chunk + chunk);
+		w[i].from = (w[i].chunk > sm->max_len - 1) ?
+			w[i].chunk - (sm->max_len - 1) : 0;
+		w[i].hits.max = items;
+
+		/* The calling thread takes the first chunk */
+		if (i > 0)
+			w[i].started = (pthread_create(&w[i].tid, NULL,
+					search_worker, &w[i]) == 0);
+	}
+	search_worker(&w[0]);
+	for (i = 1; i < n; i++) {
+		if (w[i].started)
+			pthread_join(w[i].tid, NULL);
+		else
+			search_worker(&w[i]);
+	}
+
+	act_trace("  %s: %llu bytes in %u chunks\n", __func__,
+		  (long long)size, n);
+
+	for (i = 0; i < n; i++) {
+		count += w[i].count;
+		for (j = 0; (j < w[i].hits.n) && (stored < items); j++)
+			offs[stored++] = __cpu_to_le64(w[i].hits.offs[j]);
+		free(w[i].hits.offs);
+	}
+	return count;
+}
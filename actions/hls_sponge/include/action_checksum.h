@@ -34,7 +34,10 @@ typedef enum {
 	CHECKSUM_CRC32 = 0x0,
 	CHECKSUM_ADLER32 = 0x1,
 	CHECKSUM_SPONGE = 0x2,
-	CHECKSUM_MODE_MAX = 0x3,
+	CHECKSUM_HASH_SHA3 = 0x3,	/* CPU only: hash in to out */
+	CHECKSUM_HASH_SHAKE128 = 0x4,
+	CHECKSUM_HASH_SHAKE256 = 0x5,
+	CHECKSUM_MODE_MAX = 0x6,
 } checksum_mode_t;
 
 typedef enum {
@@ -55,6 +58,7 @@ typedef struct checksum_job {
 	uint32_t freq;		/* in:  special parameter for sponge */
 	uint32_t nb_test_runs;  /* out: special parameter for sponge */
 	uint32_t nb_rounds;     /* out: special parameter for sponge */
+	struct snap_addr out;	/* out: digests of CHECKSUM_HASH_* */
 } checksum_job_t;
 
 #ifdef __cplusplus
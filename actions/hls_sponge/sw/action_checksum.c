@@ -47,11 +47,14 @@
 #include <stdint.h>
 #include <errno.h>
 #include <string.h>
+#include <endian.h>
 
 #include <libsnap.h>
+#include <snap_tools.h>
 #include <snap_internal.h>
 #include <action_checksum.h>
 #include <sha3.h>
+#include "sponge_pool.h"
 
 static int mmio_write32(struct snap_card *card,
 			uint64_t offs, uint32_t data)
@@ -308,8 +311,8 @@ static int test_sha3()
     char testvec512_1[] = "6E8B8BD195BDD560689AF2348BDC74AB7CD05ED8B9A57711E9BE71E9726FDA45"
                           "91FEE12205EDACAF82FFBBAF16DFF9E702A708862080166C2FF6BA379BC7FFC2";
 */
-    int i, fails, msg_len, sha_len;
-    uint8_t sha[64], buf[64], msg[256];
+    int i, k, fails, msg_len, sha_len;
+    uint8_t sha[64], buf[64], msg[256], md[SHA3_LANES_MAX][64];
     //uint64_t sha64[8], buf64[8], msg64[32];
 
     fails = 0;
@@ -345,6 +348,16 @@ static int test_sha3()
 */
         sha3(msg, msg_len, buf, sha_len);
 
+        // all lanes of the bulk path must agree with the reference
+        keccak_lanes(msg, msg_len, 0, SHA3_LANES_MAX, &md[0][0], sha_len,
+                     sizeof(md[0]), 200 - 2 * sha_len, SHA3_PAD);
+        for (k = 0; k < SHA3_LANES_MAX; k++)
+            if (memcmp(sha, md[k], sha_len) != 0) {
+                fprintf(stderr, "[%d] SHA3-%d, len %d lane %d test FAILED.\n",
+                    i, sha_len * 8, msg_len, k);
+                fails++;
+            }
+
         if (memcmp(sha, buf, sha_len) != 0) {
         //for(k = 0; k < sha_len; k++) {
         //        if (sha[k] != buf[k]) {
@@ -387,9 +400,9 @@ static int test_shake()
         // SHAKE256, 1600-bit test pattern
         char testhex256_1600[] = "6A1A9D7846436E4DCA5728B6F760EEF0CA92BF0BE5615E96959D767197A0BEEB";
         
-    int i, j, fails;
+    int i, j, k, fails;
     sha3_ctx_t sha3;
-    uint8_t buf[32], ref[32];
+    uint8_t buf[32], ref[32], msg[200], xof[SHA3_LANES_MAX][512];
 
 
     fails = 0;
@@ -435,8 +448,18 @@ static int test_shake()
                         break;
         }
 
+        memset(msg, 0xA3, sizeof(msg));
+        keccak_lanes(msg, i >= 2 ? sizeof(msg) : 0, 0, SHA3_LANES_MAX,
+                     &xof[0][0], sizeof(xof[0]), sizeof(xof[0]),
+                     200 - 2 * (i & 1 ? 32 : 16), SHAKE_PAD);
+        for (k = 0; k < SHA3_LANES_MAX; k++)
+            if (memcmp(&xof[k][480], ref, 32) != 0) {
+                fprintf(stderr, "[%d] SHAKE%d, len %d lane %d test FAILED.\n",
+                    i, i & 1 ? 256 : 128, i >= 2 ? 1600 : 0, k);
+                fails++;
+            }
+
         if (memcmp(buf, ref, 32) != 0) {
-        //for(k = 0; k < 32; k++) {
 /*#pragma HLS UNROLL*/
         //        if (buf[k] != ref[k]) {
             fprintf(stderr, "[%d] SHAKE%d, len %d test FAILED.\n",
@@ -449,79 +472,93 @@ static int test_shake()
     return fails;
 }
 
-// test speed of the comp
-static uint64_t test_speed(const uint64_t run_number,
-                           const uint32_t nb_elmts, 
-                           const uint32_t freq)
+/*
+ * Speed test: run r starts from st[i] = i + r, does NB_ROUNDS
+ * permutations and adds up the words, the checksum is the xor of all
+ * runs. Only runs with nb_elmts > r % freq are done, item n of the
+ * pool is the n-th of those. A worker takes sha3_lanes() runs at a
+ * time and permutes them side by side.
+ */
+struct sponge_speed {
+        uint32_t per;           /* runs done of every freq */
+        uint32_t freq;
+        uint64_t checksum[SPONGE_POOL_MAX];
+};
+
+static uint32_t speed_nb_runs(uint32_t nb_elmts, uint32_t freq)
 {
-    int i;
-    uint64_t st[25], x;
-    //uint64_t n;
-    //clock_t bg, us;
+        uint32_t per = MIN(nb_elmts, freq);
 
-//adding this test to control number of calls of this test
-    if (nb_elmts <= (run_number % freq))
-         return 0;
+        return NB_TEST_RUNS / freq * per + MIN(NB_TEST_RUNS % freq, per);
+}
 
-    for (i = 0; i < 25; i++)
-/*#pragma HLS UNROLL*/
-        //st[i] = i;
-        st[i] = i + run_number; // adding run_number to have different checksum
-
-    //bg = clock();
-    //n = 0;
-
-    //do{
-    //{
-        for (i = 0; i < NB_ROUNDS; i++)
-        {
-            // Successive tests of sha3 taking result of previous for next process
-            //sha3_keccakf(st);
-                sha3_keccakf(st, st);
+static void speed_work(void *arg, unsigned int worker,
+                       uint32_t from, uint32_t to)
+{
+    struct sponge_speed *s = (struct sponge_speed *)arg;
+    uint64_t st[SHA3_LANES_MAX][25], x, checksum = 0;
+    uint32_t item, run_number;
+    unsigned int i, k, n;
+
+    for (item = from; item < to; item += n) {
+        n = MIN(to - item, sha3_lanes());
+
+        for (k = 0; k < n; k++) {
+            run_number = (item + k) / s->per * s->freq + (item + k) % s->per;
+            for (i = 0; i < 25; i++)
+                st[k][i] = i + run_number; // adding run_number to have different checksum
         }
-        //n += i;
-        //us = clock() - bg;
-    //}
-    //} while (us < 3 * CLOCKS_PER_SEC);
-
-
-    x = 0;
-    for (i = 0; i < 25; i++)
-/*#pragma HLS PIPELINE // using UNROLL will prevent the test_speed from being synthesized !!*/
-        x += st[i];
-
 
-//    printf("(%016lX) %.3f Keccak-p[1600,24] / Second.\n",
-//              (unsigned long) x, (CLOCKS_PER_SEC * ((double) n)) / ((double) us));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        sha3_keccakf_lanes(st, n, NB_ROUNDS);
+#else
+        // the reference permutes byte swapped words here
+        for (k = 0; k < n; k++)
+            for (i = 0; i < NB_ROUNDS; i++)
+                sha3_keccakf(st[k], st[k]);
+#endif
 
-    return x;
+        for (k = 0; k < n; k++) {
+            x = 0;
+            for (i = 0; i < 25; i++)
+                x += st[k][i];
+            act_trace("      item=%d checksum=%016llx\n", item + k,
+                      (long long)x);
+            checksum ^= x;
+        }
+    }
+    s->checksum[worker] ^= checksum;
 }
 
-#if defined(CONFIG_USE_NO_PTHREADS)
 static uint64_t sha3_main(uint32_t test_choice, uint32_t nb_elmts, uint32_t freq,
-                            uint32_t threads __attribute__((unused)))
+                          uint32_t threads)
 {
-        uint32_t run_number;
-        uint64_t checksum=0;
+        struct sponge_speed *s;
+        uint32_t nb_runs;
+        unsigned int i, workers;
+        uint64_t checksum = 0;
+
+        act_trace("%s(%d, %d, %d)\n", __func__, nb_elmts, freq, threads);
+        act_trace("  NB_TEST_RUNS=%d NB_ROUNDS=%d lanes=%d\n", NB_TEST_RUNS,
+                  NB_ROUNDS, sha3_lanes());
 
-        act_trace("%s(%d, %d)\n", __func__, nb_elmts, freq);
-        act_trace("  sw: NB_TEST_RUNS=%d NB_ROUNDS=%d\n", NB_TEST_RUNS, NB_ROUNDS);
         switch(test_choice) {
         case(CHECKSUM_SPEED):
-        {
-                for (run_number = 0; run_number < NB_TEST_RUNS; run_number++) {
-                   if (nb_elmts > (run_number % freq)) {
-                       uint64_t checksum_tmp;
-
-                       act_trace("  run_number=%d\n", run_number);
-                       checksum_tmp = test_speed(run_number, nb_elmts, freq);
-                       checksum ^= checksum_tmp;
-                       act_trace("    %016llx %016llx\n",
-                               (long long)checksum_tmp,
-                               (long long)checksum);
-                   }
+                s = calloc(1, sizeof(*s));
+                if (s == NULL) {
+                        fprintf(stderr, "err: No memory available\n");
+                        return 0;
                 }
-        }
+                s->per = MIN(nb_elmts, freq);
+                s->freq = freq;
+                nb_runs = speed_nb_runs(nb_elmts, freq);
+
+                workers = sponge_pool_run(threads, nb_runs, sha3_lanes(),
+                                          speed_work, s);
+                for (i = 0; i < workers; i++)
+                        checksum ^= s->checksum[i];
+                act_trace("  runs=%d workers=%d\n", nb_runs, workers);
+                free(s);
                 break;
         case(CHECKSUM_SHA3):
                 checksum = (uint64_t)test_sha3();
@@ -542,116 +579,78 @@ static uint64_t sha3_main(uint32_t test_choice, uint32_t nb_elmts, uint32_t freq
         return checksum;
 }
 
-#else
-
-#include <pthread.h>
-
-struct thread_data {
-        pthread_t thread_id;    /* Thread id assigned by pthread_create() */
-        unsigned int run_number;
-        uint32_t test_choice;
-        uint32_t nb_elmts;
-        uint32_t freq;
-        uint64_t checksum;
-        int thread_rc;
+/*
+ * Bulk hashing: in holds nb_elmts (at least 1) messages of the same
+ * size, out gets one digest of out.size / nb_elmts bytes for each. The
+ * messages are hashed sha3_lanes() at a time on the worker pool.
+ */
+struct sponge_hash {
+	const uint8_t *in;
+	size_t msglen;
+	uint8_t *md;
+	size_t mdlen;
+	unsigned int rsiz;
+	uint8_t pad;
 };
 
-static struct thread_data *d;
-
-static void *sha3_thread(void *data)
+static void hash_work(void *arg, unsigned int worker __attribute__((unused)),
+		      uint32_t from, uint32_t to)
 {
-        struct thread_data *d = (struct thread_data *)data;
+	struct sponge_hash *h = (struct sponge_hash *)arg;
 
-        d->checksum = 0;
-        d->thread_rc = 0;
-        switch(d->test_choice) {
-        case(CHECKSUM_SPEED):
-                d->checksum = test_speed(d->run_number, d->nb_elmts, d->freq);
-                break;
-        case(CHECKSUM_SHA3):
-                d->checksum = (uint64_t)test_sha3();
-                break;
-        case(CHECKSUM_SHAKE):
-                d->checksum = (uint64_t)test_shake();
-                break;
-        case(CHECKSUM_SHA3_SHAKE):
-                d->checksum = (uint64_t)test_sha3();
-                d->checksum += (uint64_t)test_shake();
-                break;
-        default:
-                d->checksum = 1;
-                break;
-        }
-        pthread_exit(&d->thread_rc);
+	keccak_lanes(h->in + from * h->msglen, h->msglen, h->msglen,
+		     to - from, h->md + from * h->mdlen, h->mdlen, h->mdlen,
+		     h->rsiz, h->pad);
 }
-static uint64_t sha3_main(uint32_t test_choice, uint32_t nb_elmts, uint32_t freq, uint32_t _threads)
-{
-       int rc;
-        uint32_t run_number;
-        uint64_t checksum = 0;
 
-        if (_threads == 0) {
-                fprintf(stderr, "err: Min threads must be 1\n");
-                return 0;
-        }
-
-        d = calloc(_threads * sizeof(struct thread_data), 1);
-        if (d == NULL) {
-                fprintf(stderr, "err: No memory available\n");
-                return 0;
-        }
-
-        act_trace("%s(%d, %d, %d)\n", __func__, nb_elmts, freq, _threads);
-        act_trace("  NB_TEST_RUNS=%d NB_ROUNDS=%d\n", NB_TEST_RUNS, NB_ROUNDS);
-        for (run_number = 0; run_number < NB_TEST_RUNS; ) {
-                unsigned int i;
-                unsigned int remaining_run_number = NB_TEST_RUNS - run_number;
-                unsigned int threads = MIN(remaining_run_number, _threads);
-
-                act_trace("  [X] run_number=%d remaining=%d threads=%d\n",
-                          run_number, remaining_run_number, threads);
-
-                for (i = 0; i < threads; i++) {
-                        if (nb_elmts <= ((run_number + i) % freq)) 
-                                continue;
-
-                        d[i].run_number = run_number + i;
-                        d[i].test_choice = test_choice;
-                        d[i].nb_elmts = nb_elmts;
-                        d[i].freq = freq;
-                        rc = pthread_create(&d[i].thread_id, NULL,
-                                            &sha3_thread, &d[i]);
-                        if (rc != 0) {
-                                free(d);
-                                fprintf(stderr, "starting %d failed!\n", i);
-                                return EXIT_FAILURE;
-                        }
-                }
-                for (i = 0; i < threads; i++) {
-                        act_trace("      run_number=%d checksum=%016llx\n",
-                                  run_number + i, (long long)d[i].checksum);
-
-                        if (nb_elmts <= ((run_number + i) % freq))
-                                continue;
-
-                        rc = pthread_join(d[i].thread_id, NULL);
-                        if (rc != 0) {
-                                free(d);
-                                fprintf(stderr, "joining threads failed!\n");
-                                return EXIT_FAILURE;
-                        }
-                        checksum ^= d[i].checksum;
-                }
-                run_number += threads;
-        }
+static int sponge_hash(struct snap_sim_action *action,
+		       struct checksum_job *js, unsigned int threads)
+{
+	struct sponge_hash h;
+	uint32_t nmsg = js->nb_elmts ? js->nb_elmts : 1;
+	uint64_t w = 0;
+
+	h.in = snap_sim_addr(action, &js->in);
+	h.md = snap_sim_addr(action, &js->out);
+	if ((h.in == NULL) || (h.md == NULL))
+		return -1;
+	if ((js->out.size == 0) || (js->in.size % nmsg) ||
+	    (js->out.size % nmsg)) {
+		errno = EINVAL;
+		return -1;
+	}
+	h.msglen = js->in.size / nmsg;
+	h.mdlen = js->out.size / nmsg;
 
-        free(d);
+	switch (js->chk_type) {
+	case CHECKSUM_HASH_SHA3:
+		if ((h.mdlen != 28) && (h.mdlen != 32) &&
+		    (h.mdlen != 48) && (h.mdlen != 64)) {
+			errno = EINVAL;
+			return -1;
+		}
+		h.rsiz = 200 - 2 * h.mdlen;
+		h.pad = SHA3_PAD;
+		break;
+	case CHECKSUM_HASH_SHAKE128:
+		h.rsiz = 200 - 2 * 16;
+		h.pad = SHAKE_PAD;
+		break;
+	default:
+		h.rsiz = 200 - 2 * 32;
+		h.pad = SHAKE_PAD;
+		break;
+	}
 
-        act_trace("checksum=%016llx\n", (unsigned long long)checksum);
-        return checksum;
+	act_trace("  %s: %d messages of %lld bytes, %lld bytes digests\n",
+		  __func__, nmsg, (long long)h.msglen, (long long)h.mdlen);
+	sponge_pool_run(threads, nmsg, sha3_lanes(), hash_work, &h);
 
+	/* The first bytes of the first digest, to see it in the job */
+	memcpy(&w, h.md, MIN(h.mdlen, sizeof(w)));
+	js->chk_out = le64toh(w);
+	return 0;
 }
-#endif /* CONFIG_USE_NO_PTHREADS */
 
 static int action_main(struct snap_sim_action *action, void *job,
 		       unsigned int job_len)
@@ -684,6 +683,17 @@ static int action_main(struct snap_sim_action *action, void *job,
                 js->chk_out = sha3_main(js->test_choice, js->nb_elmts, js->freq, threads);
                 break;
 	}
+	case CHECKSUM_HASH_SHA3:
+	case CHECKSUM_HASH_SHAKE128:
+	case CHECKSUM_HASH_SHAKE256: {
+		unsigned int threads = js->nb_test_runs; /* misused for sw sim */
+
+		js->nb_test_runs = 0;
+		js->nb_rounds = 0;
+		if (sponge_hash(action, js, threads) != 0)
+			return 0;
+		break;
+	}
 	case CHECKSUM_CRC32:
 		/* checking parameters ... */
 		if (js->in.type != SNAP_ADDRTYPE_HOST_DRAM)
@@ -717,13 +727,17 @@ static struct snap_sim_action action = {
 	.priv_data = NULL,	/* this is passed back as void *card */
 	.mmio_write32 = mmio_write32,
 	.mmio_read32 = mmio_read32,
-
-	.next = NULL,
 };
 
 static void _init(void) __attribute__((constructor));
 
 static void _init(void)
 {
+	const char *env;
+
+	env = getenv("SNAP_SPONGE_LANES");	/* 1, 4 or 8, default best */
+	if (env != NULL)
+		sha3_lanes_select(strtoul(env, (char **)NULL, 0));
+
 	snap_action_register(&action);
 }
@@ -78,5 +78,23 @@ void shake_out(sha3_ctx_t *c, void *out, size_t len);
 
 void cast_uint8_to_uint64(uint8_t *st_in, uint64_t *st_out, unsigned int size);
 void cast_uint64_to_uint8(uint64_t *st_in, uint8_t *st_out, unsigned int size);
+
+// sha3_lanes.c: several states at once, AVX-512 8, AVX2 4, else 1
+#define SHA3_LANES_MAX 8
+#define SHA3_PAD  0x06
+#define SHAKE_PAD 0x1F
+
+unsigned int sha3_lanes(void);               // states per permutation
+unsigned int sha3_lanes_select(unsigned int max);   // 0: best one
+
+// count permutations of each of the n states
+void sha3_keccakf_lanes(uint64_t st[][25], unsigned int n,
+                        unsigned long count);
+
+// n messages of inlen bytes, in_stride apart, mdlen bytes of output
+// each, md_stride apart. rsiz = 200 - 2 * mdlen for SHA3.
+void keccak_lanes(const uint8_t *in, size_t inlen, size_t in_stride,
+                  unsigned int n, uint8_t *md, size_t mdlen, size_t md_stride,
+                  unsigned int rsiz, uint8_t pad);
 #endif
 
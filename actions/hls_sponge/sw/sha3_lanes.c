@@ -0,0 +1,160 @@
+/*
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Keccak-f[1600] on several independent states at once, for the CPU
+ * flow of the sponge action.
+ *
+ * The states are interleaved: word i of all of them is one vector, so
+ * one instruction does the same step of the permutation for every
+ * state. AVX-512 runs 8 states, AVX2 4, else one state with the rounds
+ * unrolled. The best one the CPU has is picked at runtime, the vector
+ * code uses the GCC vector extensions and is compiled for its target
+ * ISA only, such that the library still runs on any x86 CPU.
+ *
+ * sha3.c stays the reference, the self-tests compare both.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include "sha3.h"
+
+#ifndef MIN
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#endif
+
+static const uint64_t keccakf_rndc[24] = {
+	0x0000000000000001, 0x0000000000008082, 0x800000000000808a,
+	0x8000000080008000, 0x000000000000808b, 0x0000000080000001,
+	0x8000000080008081, 0x8000000000008009, 0x000000000000008a,
+	0x0000000000000088, 0x0000000080008009, 0x000000008000000a,
+	0x000000008000808b, 0x800000000000008b, 0x8000000000008089,
+	0x8000000000008003, 0x8000000000008002, 0x8000000000000080,
+	0x000000000000800a, 0x800000008000000a, 0x8000000080008081,
+	0x8000000000008080, 0x0000000080000001, 0x8000000080008008
+};
+static const int keccakf_rotc[24] = {
+	1,  3,  6,  10, 15, 21, 28, 36, 45, 55, 2,  14,
+	27, 41, 56, 8,  25, 43, 62, 18, 39, 61, 20, 44
+};
+static const int keccakf_piln[24] = {
+	10, 7,  11, 17, 18, 3, 5,  16, 8,  21, 24, 4,
+	15, 23, 19, 13, 12, 2, 20, 14, 22, 9,  6,  1
+};
+
+#define LANE_T		uint64_t
+#define LANES		1
+#define LANE(v, k)	(v)
+#define LANE_ATTR
+#define FN(name)	name ## _x1
+#include "sha3_lanes.h"
+
+#if defined(__x86_64__)
+typedef uint64_t lane4_t __attribute__((vector_size(4 * sizeof(uint64_t))));
+typedef uint64_t lane8_t __attribute__((vector_size(8 * sizeof(uint64_t))));
+
+#define LANE_T		lane4_t
+#define LANES		4
+#define LANE(v, k)	((v)[k])
+#define LANE_ATTR	__attribute__((target("avx2")))
+#define FN(name)	name ## _avx2
+#include "sha3_lanes.h"
+
+#define LANE_T		lane8_t
+#define LANES		8
+#define LANE(v, k)	((v)[k])
+#define LANE_ATTR	__attribute__((target("avx512f")))
+#define FN(name)	name ## _avx512
+#include "sha3_lanes.h"
+#endif
+
+typedef void (* permute_fn_t)(uint64_t states[][25], unsigned int n,
+			      unsigned long count);
+typedef void (* sponge_fn_t)(const uint8_t *in, size_t inlen,
+			     size_t in_stride, unsigned int n,
+			     uint8_t *out, size_t outlen, size_t out_stride,
+			     unsigned int rsiz, uint8_t pad);
+
+static unsigned int lanes = 0;
+static permute_fn_t permute_fn = permute_x1;
+static sponge_fn_t sponge_fn = sponge_x1;
+
+static unsigned int sha3_lanes_best(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return 8;
+	if (__builtin_cpu_supports("avx2"))
+		return 4;
+#endif
+	return 1;
+}
+
+unsigned int sha3_lanes_select(unsigned int max)
+{
+	unsigned int best = sha3_lanes_best();
+
+	if ((max == 0) || (max > best))
+		max = best;
+
+#if defined(__x86_64__)
+	if (max >= 8) {
+		permute_fn = permute_avx512;
+		sponge_fn = sponge_avx512;
+		return lanes = 8;
+	}
+	if (max >= 4) {
+		permute_fn = permute_avx2;
+		sponge_fn = sponge_avx2;
+		return lanes = 4;
+	}
+#endif
+	permute_fn = permute_x1;
+	sponge_fn = sponge_x1;
+	return lanes = 1;
+}
+
+unsigned int sha3_lanes(void)
+{
+	if (lanes == 0)
+		sha3_lanes_select(0);
+	return lanes;
+}
+
+void sha3_keccakf_lanes(uint64_t st[][25], unsigned int n,
+			unsigned long count)
+{
+	unsigned int k, l = sha3_lanes();
+
+	for (k = 0; k < n; k += l)
+		permute_fn(st + k, MIN(n - k, l), count);
+}
+
+void keccak_lanes(const uint8_t *in, size_t inlen, size_t in_stride,
+		  unsigned int n, uint8_t *md, size_t mdlen, size_t md_stride,
+		  unsigned int rsiz, uint8_t pad)
+{
+	unsigned int k, l = sha3_lanes();
+
+	for (k = 0; k < n; k += l)
+		sponge_fn(in + k * in_stride, inlen, in_stride,
+			  MIN(n - k, l), md + k * md_stride, mdlen, md_stride,
+			  rsiz, pad);
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Keccak-f[1600] on LANES interleaved states, included by sha3_lanes.c
+ * once per lane type. The includer defines:
+ *
+ *   LANE_T         type holding word i of all states, uint64_t or a
+ *                  vector of LANES uint64_t
+ *   LANES          number of states
+ *   LANE(v, k)     word of state k in v
+ *   LANE_ATTR      function attributes, e.g. the target ISA
+ *   FN(name)       name of the functions for this lane type
+ *
+ * No include guard, on purpose.
+ */
+
+static LANE_ATTR void FN(keccakf)(LANE_T st[25])
+{
+	LANE_T bc[5], t;
+	int i, j, r;
+
+	for (r = 0; r < KECCAKF_ROUNDS; r++) {
+		/* Theta */
+#pragma GCC unroll 5
+		for (i = 0; i < 5; i++)
+			bc[i] = st[i] ^ st[i + 5] ^ st[i + 10] ^ st[i + 15] ^
+				st[i + 20];
+#pragma GCC unroll 5
+		for (i = 0; i < 5; i++) {
+			t = bc[(i + 4) % 5] ^ ROTL64(bc[(i + 1) % 5], 1);
+#pragma GCC unroll 5
+			for (j = 0; j < 25; j += 5)
+				st[j + i] ^= t;
+		}
+
+		/* Rho Pi */
+		t = st[1];
+#pragma GCC unroll 24
+		for (i = 0; i < 24; i++) {
+			j = keccakf_piln[i];
+			bc[0] = st[j];
+			st[j] = ROTL64(t, keccakf_rotc[i]);
+			t = bc[0];
+		}
+
+		/* Chi */
+#pragma GCC unroll 5
+		for (j = 0; j < 25; j += 5) {
+#pragma GCC unroll 5
+			for (i = 0; i < 5; i++)
+				bc[i] = st[j + i];
+#pragma GCC unroll 5
+			for (i = 0; i < 5; i++)
+				st[j + i] ^= (~bc[(i + 1) % 5]) & bc[(i + 2) % 5];
+		}
+
+		/* Iota */
+		st[0] ^= keccakf_rndc[r];
+	}
+}
+
+/* count permutations of n <= LANES states */
+static LANE_ATTR void FN(permute)(uint64_t states[][25], unsigned int n,
+				  unsigned long count)
+{
+	LANE_T st[25];
+	unsigned int i, k;
+
+	memset(st, 0, sizeof(st));
+	for (i = 0; i < 25; i++)
+		for (k = 0; k < n; k++)
+			LANE(st[i], k) = states[k][i];
+
+	while (count--)
+		FN(keccakf)(st);
+
+	for (i = 0; i < 25; i++)
+		for (k = 0; k < n; k++)
+			states[k][i] = LANE(st[i], k);
+}
+
+/*
+ * Sponge over n <= LANES messages of inlen bytes each, in_stride bytes
+ * apart, squeezing outlen bytes for each to out, out_stride apart.
+ */
+static LANE_ATTR void FN(sponge)(const uint8_t *in, size_t inlen,
+				 size_t in_stride, unsigned int n,
+				 uint8_t *out, size_t outlen,
+				 size_t out_stride, unsigned int rsiz,
+				 uint8_t pad)
+{
+	LANE_T st[25];
+	uint8_t blk[200];
+	uint64_t w;
+	size_t off, len;
+	unsigned int i, k;
+
+	memset(st, 0, sizeof(st));
+
+	for (off = 0; off + rsiz <= inlen; off += rsiz) {
+		for (k = 0; k < n; k++)
+			for (i = 0; i < rsiz / 8; i++) {
+				memcpy(&w, in + k * in_stride + off + 8 * i, 8);
+				LANE(st[i], k) ^= le64toh(w);
+			}
+		FN(keccakf)(st);
+	}
+
+	/* Last, padded block, rsiz is a multiple of 8 */
+	for (k = 0; k < n; k++) {
+		memset(blk, 0, rsiz);
+		memcpy(blk, in + k * in_stride + off, inlen - off);
+		blk[inlen - off] ^= pad;
+		blk[rsiz - 1] ^= 0x80;
+		for (i = 0; i < rsiz / 8; i++) {
+			memcpy(&w, blk + 8 * i, 8);
+			LANE(st[i], k) ^= le64toh(w);
+		}
+	}
+	FN(keccakf)(st);
+
+	for (off = 0; off < outlen; off += len) {
+		len = MIN(outlen - off, (size_t)rsiz);
+		for (k = 0; k < n; k++) {
+			for (i = 0; i < (len + 7) / 8; i++) {
+				w = htole64(LANE(st[i], k));
+				memcpy(blk + 8 * i, &w, 8);
+			}
+			memcpy(out + k * out_stride + off, blk, len);
+		}
+		if (off + len < outlen)
+			FN(keccakf)(st);
+	}
+}
+
+#undef LANE_T
+#undef LANES
+#undef LANE
+#undef LANE_ATTR
+#undef FN
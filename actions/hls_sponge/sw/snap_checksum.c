@@ -33,7 +33,8 @@
 int verbose_flag = 0;
 
 static const char *version = GIT_VERSION;
-static const char *checksum_mode_str[] = { "CRC32", "ADLER32", "SPONGE" };
+static const char *checksum_mode_str[] = { "CRC32", "ADLER32", "SPONGE",
+					   "SHA3", "SHAKE128", "SHAKE256" };
 static const char *test_choice_str[] = { "SPEED", "SHA3", "SHAKE" , "SHA3_SHAKE"};
 
 /**
@@ -53,8 +54,11 @@ static void usage(const char *prog)
 	       "  -s, --size <size>         size of data.\n"
 	       "  -c, --choice <SPEED,SHA3,SHAKE,SHA3_SHAKE>  sponge specific input.\n"
 	       "  -n, --number of elements <nb_elmts> sponge specific input.\n"
+	       "                            SHA3, SHAKE*: messages in the input.\n"
 	       "  -f, --frequency <freq>        sponge specific input.(up to 65536)\n"
-	       "  -m, --mode <CRC32|ADLER32|SPONGE> mode flags.\n"
+	       "  -m, --mode <CRC32|ADLER32|SPONGE|SHA3|SHAKE128|SHAKE256> mode flags.\n"
+	       "  -o, --output <file.bin>   SHA3, SHAKE*: digests, one per message.\n"
+	       "  -d, --digest-size <bytes> SHA3, SHAKE*: per message (default 32).\n"
 	       "  -T, --test                execute a test if available.\n"
 	       "  -t, --timeout             Timeout in sec (default 3600 sec).\n"
 	       "  -N, --irq                 Disable Interrupts\n"
@@ -77,6 +81,10 @@ static void usage(const char *prog)
 	       "SNAP_CONFIG=FPGA ./snap_checksum -mSPONGE -N -t800 -cSHA3\n"
 	       "SNAP_CONFIG=FPGA ./snap_checksum -mSPONGE -N -t800 -cSHAKE\n"
 	       "SNAP_CONFIG=FPGA ./snap_checksum -mSPONGE -N -t800 -cSHA3_SHAKE\n"
+	       "\n"
+	       "CPU only, SHA3-256 of each 4KiB page of a file, 4 threads:\n"
+	       "SNAP_CONFIG=CPU ./snap_checksum -mSHA3 -i file.bin -n<pages> -d32 -x4 -o digests.bin\n"
+	       "SNAP_SPONGE_LANES=<1|4|8> limits the Keccak states hashed at once.\n"
 	       "\n",
 	       prog);
 }
@@ -87,6 +95,8 @@ static void snap_prepare_checksum(struct snap_job *cjob,
 				  void *addr_in,
 				  uint32_t size_in,
 				  uint8_t type_in,
+				  void *addr_out,
+				  uint32_t size_out,
 				  uint64_t type,
 				  uint64_t chk_in,
 				  uint32_t test_choice,
@@ -97,6 +107,10 @@ static void snap_prepare_checksum(struct snap_job *cjob,
 	snap_addr_set(&mjob_in->in, addr_in, size_in, type_in,
 		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC |
 		      SNAP_ADDRFLAG_END);
+	snap_addr_set(&mjob_in->out, addr_out, size_out,
+		      SNAP_ADDRTYPE_HOST_DRAM,
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST |
+		      SNAP_ADDRFLAG_END);
 
 	mjob_in->chk_type = type;
 	mjob_in->chk_in = chk_in;
@@ -180,6 +194,7 @@ static int do_checksum(int card_no, unsigned long timeout,
 		       unsigned int threads,
 		       unsigned long addr_in,
 		       unsigned char type_in,  unsigned long size,
+		       void *addr_out, unsigned long size_out,
 		       uint64_t checksum_start,
 		       checksum_mode_t mode,
 		       test_choice_t test_choice,
@@ -238,6 +253,7 @@ static int do_checksum(int card_no, unsigned long timeout,
 
 	snap_prepare_checksum(&cjob, &mjob_in, &mjob_out,
 			     (void *)addr_in, size, type_in,
+			      addr_out, size_out,
 			      mode, checksum_start, test_choice, nb_elmts, freq,
 			      threads);
 
@@ -276,6 +292,12 @@ static int do_checksum(int card_no, unsigned long timeout,
                  (double)(timediff_usec(&etime, &stime)));
         }
 
+	/* The digests of a failed hash job are not there */
+	if (addr_out != NULL && cjob.retc != SNAP_RETC_SUCCESS) {
+		fprintf(stderr, "err: hash job failed, no digests\n");
+		goto out_error2;
+	}
+
 	snap_detach_action(action);
 	snap_card_free(card);
 
@@ -317,6 +339,9 @@ int main(int argc, char *argv[])
 	int mode = CHECKSUM_CRC32;
 	uint64_t checksum_start = 0ull;
 	uint32_t test_choice = CHECKSUM_SPEED, nb_elmts = 0, freq = 1;
+	const char *output = NULL;
+	uint8_t *obuff = NULL;
+	unsigned long digest_size = 32, size_out = 0;
 	int test = 0;
 	unsigned int threads = 160;
         snap_action_flag_t action_irq = (SNAP_ACTION_DONE_IRQ | SNAP_ATTACH_IRQ);
@@ -337,6 +362,8 @@ int main(int argc, char *argv[])
 			{ "test_choice", required_argument, NULL, 'c' },
 			{ "nb_elmts",    required_argument, NULL, 'n' },
 			{ "freq",	 required_argument, NULL, 'f' },
+			{ "output",	 required_argument, NULL, 'o' },
+			{ "digest-size", required_argument, NULL, 'd' },
 			{ "version",	 no_argument,	    NULL, 'V' },
 			{ "verbose",	 no_argument,	    NULL, 'v' },
 			{ "help",	 no_argument,	    NULL, 'h' },
@@ -345,7 +372,7 @@ int main(int argc, char *argv[])
 		};
 
 		ch = getopt_long(argc, argv,
-				 "A:C:i:a:S:Tx:c:n:f:m:s:t:x:VqvhN",
+				 "A:C:i:a:S:Tx:c:n:f:m:s:t:x:o:d:VqvhN",
 				 long_options, &option_index);
 		if (ch == -1)
 			break;
@@ -394,6 +421,12 @@ int main(int argc, char *argv[])
 		case 'f':
 			freq =  __str_to_num(optarg);
 			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'd':
+			digest_size = __str_to_num(optarg);
+			break;
 		case 't':
 			timeout = strtol(optarg, (char **)NULL, 0);
 			break;
@@ -410,6 +443,18 @@ int main(int argc, char *argv[])
 				mode = CHECKSUM_SPONGE;
 				break;
 			}
+			if (strcmp(optarg, "SHA3") == 0) {
+				mode = CHECKSUM_HASH_SHA3;
+				break;
+			}
+			if (strcmp(optarg, "SHAKE128") == 0) {
+				mode = CHECKSUM_HASH_SHAKE128;
+				break;
+			}
+			if (strcmp(optarg, "SHAKE256") == 0) {
+				mode = CHECKSUM_HASH_SHAKE256;
+				break;
+			}
 			mode = strtol(optarg, (char **)NULL, 0);
 			break;
 			/* input data */
@@ -475,6 +520,15 @@ int main(int argc, char *argv[])
 		addr_in = (unsigned long)ibuff;
 	}
 
+	/* digests of the hash modes */
+	if ((mode == CHECKSUM_HASH_SHA3) || (mode == CHECKSUM_HASH_SHAKE128) ||
+	    (mode == CHECKSUM_HASH_SHAKE256)) {
+		size_out = (nb_elmts ? nb_elmts : 1) * digest_size;
+		obuff = memalign(page_size, size_out);
+		if (obuff == NULL)
+			goto out_error1;
+	}
+
 	if (test) {
 		switch (mode) {
 		default:
@@ -482,21 +536,35 @@ int main(int argc, char *argv[])
 		}
 	} else {
 		rc = do_checksum(card_no, timeout, threads, addr_in,
-				 type_in, size, checksum_start, mode,
+				 type_in, size, obuff, size_out,
+				 checksum_start, mode,
 				 test_choice, nb_elmts, freq, NULL, NULL, NULL,
 				 NULL, stderr, action_irq);
 		if (rc != 0)
 			goto out_error1;
 	}
 
+	if (output != NULL && obuff != NULL) {
+		fprintf(stdout, "writing output data %p %d bytes to %s\n",
+			obuff, (int)size_out, output);
+
+		rc = file_write(output, obuff, size_out);
+		if (rc < 0)
+			goto out_error1;
+	}
+
 	if (ibuff)
 		free(ibuff);
+	if (obuff)
+		free(obuff);
 
 	exit(EXIT_SUCCESS);
 
  out_error1:
 	if (ibuff)
 		free(ibuff);
+	if (obuff)
+		free(obuff);
  out_error:
 	exit(EXIT_FAILURE);
 }
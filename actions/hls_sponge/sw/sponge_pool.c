@@ -0,0 +1,248 @@
+/*
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Worker pool of the sponge action's CPU flow.
+ *
+ * The threads are started by the first job which needs them and then
+ * wait for the next one, a job only costs a wakeup. Each worker owns a
+ * range of the items, it takes grain items at a time from the front.
+ * A worker with nothing left steals the back half of the range of
+ * another one, so uneven items still keep all workers busy. Ranges
+ * are one 64 bit word, lo and hi, changed with compare and swap only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libsnap.h>
+#include <snap_tools.h>
+#include <snap_internal.h>
+#include "sponge_pool.h"
+
+#define RANGE(lo, hi)	((uint64_t)(lo) | ((uint64_t)(hi) << 32))
+#define RANGE_LO(r)	((uint32_t)(r))
+#define RANGE_HI(r)	((uint32_t)((r) >> 32))
+
+unsigned int sponge_pool_workers(unsigned int threads)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* More workers than CPUs only add switching, the work is all CPU */
+	if ((cpus > 0) && (threads > (unsigned long)cpus))
+		threads = cpus;
+	if (threads > SPONGE_POOL_MAX)
+		threads = SPONGE_POOL_MAX;
+	return threads ? threads : 1;
+}
+
+#if defined(CONFIG_USE_NO_PTHREADS)
+
+unsigned int sponge_pool_run(unsigned int workers __attribute__((unused)),
+			     uint32_t nitems,
+			     uint32_t grain __attribute__((unused)),
+			     sponge_work_fn_t fn, void *arg)
+{
+	if (nitems)
+		fn(arg, 0, 0, nitems);
+	return 1;
+}
+
+#else
+
+#include <pthread.h>
+
+struct sponge_range {
+	uint64_t r;
+} __attribute__((aligned(64)));
+
+static struct sponge_pool {
+	pthread_mutex_t job_lock;	/* One job at a time */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+
+	unsigned int nthreads;		/* Started, the caller not counted */
+	unsigned long generation;	/* Of the current job */
+	unsigned int workers;		/* Of the current job */
+	unsigned int busy;		/* Threads still working on it */
+
+	sponge_work_fn_t fn;
+	void *arg;
+	uint32_t grain;
+	struct sponge_range q[SPONGE_POOL_MAX];
+} pool = {
+	.job_lock = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Take grain items from the front of the own range */
+static int pool_take(struct sponge_range *q, uint32_t grain,
+		     uint32_t *from, uint32_t *to)
+{
+	uint64_t r = __atomic_load_n(&q->r, __ATOMIC_ACQUIRE);
+	uint32_t lo, hi;
+
+	do {
+		lo = RANGE_LO(r);
+		hi = RANGE_HI(r);
+		if (lo >= hi)
+			return 0;
+		*from = lo;
+		*to = MIN(hi - lo, grain) + lo;
+	} while (!__atomic_compare_exchange_n(&q->r, &r, RANGE(*to, hi), 0,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+	return 1;
+}
+
+/* Move the back half of another worker's range to the own one */
+static int pool_steal(unsigned int self)
+{
+	unsigned int i, v;
+	uint64_t r;
+	uint32_t lo, hi, mid;
+
+	for (i = 1; i < pool.workers; i++) {
+		v = (self + i) % pool.workers;
+		r = __atomic_load_n(&pool.q[v].r, __ATOMIC_ACQUIRE);
+		do {
+			lo = RANGE_LO(r);
+			hi = RANGE_HI(r);
+			if (lo >= hi)
+				break;
+			mid = hi - MAX((hi - lo) / 2, MIN(hi - lo, pool.grain));
+		} while (!__atomic_compare_exchange_n(&pool.q[v].r, &r,
+						      RANGE(lo, mid), 0,
+						      __ATOMIC_ACQ_REL,
+						      __ATOMIC_ACQUIRE));
+		if (lo < hi) {
+			/* Own range is empty, nobody else changes it */
+			__atomic_store_n(&pool.q[self].r, RANGE(mid, hi),
+					 __ATOMIC_RELEASE);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void pool_work(unsigned int self)
+{
+	uint32_t from, to;
+
+	do {
+		while (pool_take(&pool.q[self], pool.grain, &from, &to))
+			pool.fn(pool.arg, self, from, to);
+	} while (pool_steal(self));
+}
+
+static void *pool_thread(void *data)
+{
+	unsigned int self = (unsigned long)data;
+	unsigned long generation = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while ((pool.generation == generation) ||
+		       (self >= pool.workers)) {
+			generation = pool.generation;
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		}
+		generation = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+
+		pool_work(self);
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.busy == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	return NULL;
+}
+
+/* Start threads up to workers - 1, returns the workers there are */
+static unsigned int pool_grow(unsigned int workers)
+{
+	int rc;
+	pthread_t tid;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (pool.nthreads + 1 < workers) {
+		rc = pthread_create(&tid, &attr, pool_thread,
+				    (void *)(unsigned long)(pool.nthreads + 1));
+		if (rc != 0) {
+			fprintf(stderr, "warn: sponge worker %u: %s\n",
+				pool.nthreads + 1, strerror(rc));
+			break;
+		}
+		pool.nthreads++;
+	}
+	pthread_attr_destroy(&attr);
+	act_trace("  %s: %u threads\n", __func__, pool.nthreads);
+	return pool.nthreads + 1;
+}
+
+unsigned int sponge_pool_run(unsigned int workers, uint32_t nitems,
+			     uint32_t grain, sponge_work_fn_t fn, void *arg)
+{
+	unsigned int i;
+
+	if (nitems == 0)
+		return 0;
+	if (grain == 0)
+		grain = 1;
+	workers = MIN(sponge_pool_workers(workers),
+		      (nitems + grain - 1) / grain);
+
+	pthread_mutex_lock(&pool.job_lock);
+	if (pool.nthreads + 1 < workers)
+		workers = MIN(workers, pool_grow(workers));
+
+	for (i = 0; i < workers; i++)
+		pool.q[i].r = RANGE((uint64_t)nitems * i / workers,
+				    (uint64_t)nitems * (i + 1) / workers);
+
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.grain = grain;
+	pool.workers = workers;
+	pool.busy = workers - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+
+	pool_work(0);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.busy)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_mutex_unlock(&pool.job_lock);
+	return workers;
+}
+
+#endif /* CONFIG_USE_NO_PTHREADS */
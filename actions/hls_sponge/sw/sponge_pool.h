@@ -0,0 +1,47 @@
+#ifndef __SPONGE_POOL_H__
+#define __SPONGE_POOL_H__
+
+/*
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SPONGE_POOL_MAX		256	/* Workers, the caller included */
+
+/* Items [from, to) done by worker, 0 <= worker < workers */
+typedef void (* sponge_work_fn_t)(void *arg, unsigned int worker,
+				  uint32_t from, uint32_t to);
+
+/* Workers a job asking for threads gets */
+unsigned int sponge_pool_workers(unsigned int threads);
+
+/*
+ * Run fn over nitems items on up to workers threads, the caller is one
+ * of them. Items are handed out grain at a time. Returns the number of
+ * workers used, fn sees worker indexes below that.
+ */
+unsigned int sponge_pool_run(unsigned int workers, uint32_t nitems,
+			     uint32_t grain, sponge_work_fn_t fn, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* __SPONGE_POOL_H__ */
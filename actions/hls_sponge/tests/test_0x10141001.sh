@@ -102,11 +102,85 @@ function test_sha3_shake {
 	echo "ok"
 }
 
+function test_hash_bad_args {
+	local in=sponge_hash.bin
+
+	# 151652 bytes do not split into 37 messages, 33 is no SHA3 size
+	dd if=/dev/urandom of=${in} bs=151652 count=1 2>/dev/null
+	for args in "-n37 -d32" "-n4 -d33" ; do
+		echo -n "Doing SHA3 with bad ${args} "
+		rm -f sponge_hash.out
+		cmd="snap_checksum -C ${snap_card} -mSHA3 -N -i ${in} \
+			${args} -o sponge_hash.out"
+		eval ${cmd} > /dev/null 2>&1
+		if [ $? -eq 0 ] || [ -e sponge_hash.out ]; then
+			echo "cmd: ${cmd}"
+			echo "failed, expected an error and no output"
+			rm -f ${in} sponge_hash.out
+			exit 1
+		fi
+		echo "ok"
+	done
+	rm -f ${in} sponge_hash.out
+}
+
+# Digests of the hash modes against python's hashlib, only the software
+# action has them
+function test_hash_digests {
+	local in=sponge_hash.bin
+	local n=5
+	local msg=1013
+
+	dd if=/dev/urandom of=${in} bs=$((n * msg)) count=1 2>/dev/null
+	for args in "SHA3 28" "SHA3 32" "SHA3 64" "SHAKE128 37" \
+		    "SHAKE256 1" "SHAKE256 333" ; do
+		set -- ${args}
+		echo -n "Doing $1 with -d$2 "
+		rm -f sponge_hash.out sponge_hash.exp
+		cmd="snap_checksum -C ${snap_card} -m$1 -N -i ${in} \
+			-n${n} -d$2 -o sponge_hash.out"
+		eval ${cmd} > /dev/null 2>&1
+		if [ $? -ne 0 ]; then
+			echo "cmd: ${cmd}"
+			echo "failed"
+			rm -f ${in} sponge_hash.out
+			exit 1
+		fi
+		python3 -c '
+import hashlib, sys
+mode, d, n, msg = sys.argv[1], int(sys.argv[2]), int(sys.argv[3]), int(sys.argv[4])
+data = open(sys.argv[5], "rb").read()
+out = open(sys.argv[6], "wb")
+for i in range(n):
+    m = data[i * msg:(i + 1) * msg]
+    if mode == "SHA3":
+        out.write(hashlib.new("sha3_%d" % (d * 8), m).digest())
+    else:
+        out.write(hashlib.new(mode.lower().replace("shake", "shake_"), m).digest(d))
+' $1 $2 ${n} ${msg} ${in} sponge_hash.exp
+		if ! cmp -s sponge_hash.out sponge_hash.exp ; then
+			echo "cmd: ${cmd}"
+			echo "failed, digests differ from hashlib"
+			rm -f ${in} sponge_hash.out sponge_hash.exp
+			exit 1
+		fi
+		echo "ok"
+	done
+	rm -f ${in} sponge_hash.out sponge_hash.exp
+}
 
 if [ "$duration" = "NORMAL" ]; then
 	test_sponge
 fi
 
+if [ "$duration" = "NORMAL" ]; then
+	test_hash_bad_args
+fi
+
+if [ "$duration" = "NORMAL" ] && [ "${SNAP_CONFIG}" != "FPGA" ]; then
+	test_hash_digests
+fi
+
 if [ "$duration" = "NORMAL" ]; then
 	test_sha3_shake
 fi
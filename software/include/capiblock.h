@@ -334,6 +334,15 @@ int cblk_read(chunk_id_t chunk_id,void *buf,cflash_offset_t lba, size_t nblocks,
 /* Blocking CAPI flash write */
 int cblk_write(chunk_id_t chunk_id,void *buf,cflash_offset_t lba, size_t nblocks, int flags);
 
+/* Zero-copy CAPI flash read, bufs receives pointers into the block cache */
+int cblk_read_ref(chunk_id_t chunk_id,const void *bufs[],cflash_offset_t lba, size_t nblocks, int flags);
+
+/* Hand back a block returned by cblk_read_ref */
+int cblk_release(chunk_id_t chunk_id,const void *buf, int flags);
+
+/* Write blocks held back by the write-back cache to CAPI flash */
+int cblk_flush(chunk_id_t chunk_id, int flags);
+
 /* Asynchronous CAPI flash read */
 int cblk_aread(chunk_id_t chunk_id,void *buf,cflash_offset_t lba, size_t nblocks, int *tag, cblk_arw_status_t *status, int flags);
 
@@ -19,6 +19,7 @@
  */
 
 #include <stdint.h>
+#include <stdio.h>
 #include <snap_types.h>
 
 /**
@@ -265,6 +266,24 @@ int snap_mmio_write64(struct snap_card *card, uint64_t offset,
 int snap_mmio_read64(struct snap_card *card, uint64_t offset,
 			uint64_t *data);
 
+/*
+ * Register window access functions
+ *
+ * @card        snap_card device handle.
+ * @offset      offset of the first 32-bit register, e.g. ACTION_PARAMS_IN.
+ * @data        words to write/buffer for the words read.
+ * @words       number of consecutive 32-bit registers.
+ * @return      SNAP_OK in case of success, else error.
+ *
+ * Used to pass the job to the action and to get the results back.
+ * Writes to ACTION_PARAMS_IN skip registers which still hold the value
+ * written by the previous job of the same attachment.
+ */
+int snap_mmio_write_regs(struct snap_card *card, uint64_t offset,
+			const uint32_t *data, unsigned int words);
+int snap_mmio_read_regs(struct snap_card *card, uint64_t offset,
+			uint32_t *data, unsigned int words);
+
 /*
  * Settings for action attachement and Action completion.
  *
@@ -375,6 +394,32 @@ int snap_action_wait_interrupt(struct snap_action *action, int *rc,
 int snap_action_completed(struct snap_action *action, int *rc,
 			  int timeout_sec);
 
+/*
+ * Wait for the action to complete with a timeout in micro seconds.
+ * snap_action_completed() busy polls first, then polls with growing
+ * sleeps and, if SNAP_ACTION_DONE_IRQ is set, finally blocks on the
+ * interrupt. The busy poll budget adapts to the observed job durations
+ * of the attached action, unless snap_action_set_wait_budget() or
+ * SNAP_POLL_SPIN_USEC define a fixed one.
+ *
+ * @action        snap_action handle.
+ * @rc            MMIO error code, can be NULL.
+ * @timeout_usec  Timeout in micro seconds.
+ * @return        1 if the action is idle, 0 on timeout.
+ */
+int snap_action_completed_usec(struct snap_action *action, int *rc,
+			  unsigned long timeout_usec);
+
+/*
+ * Set fixed budgets for snap_action_completed().
+ *
+ * @action        snap_action handle.
+ * @spin_usec     Time to busy poll before sleeping.
+ * @sleep_usec    Time to poll with sleeps before blocking on the IRQ.
+ */
+void snap_action_set_wait_budget(struct snap_action *action,
+			  unsigned int spin_usec, unsigned int sleep_usec);
+
 /**
  * Synchronous way to send a job away.  First step : set registers
  * This function writes through MMIO interface the registers
@@ -472,10 +517,17 @@ int snap_card_ioctl(struct snap_card *card, unsigned int cmd, unsigned long parm
 
 /**
  * Get a streaming framework queue handle.
+ * The queue attaches the action on the first job and keeps it attached
+ * until snap_queue_free(). Jobs are put into a ring of queue_length
+ * slots and executed in submission order by the queue's completion
+ * thread.
+ *
  * @card          Valid SNAP card handle
  * @action_type   Use special action_type for the queue.
- * @return        0 success
- *                SNAP_ENODEV no matching capi device found
+ * @action_flags  Define special behavior, e.g. if interrupts should be used
+ * @queue_length  Number of jobs which can be pending before submitters block.
+ * @attach_timeout_sec Timeout for action attachement.
+ * @return        queue handle or NULL in case of error.
  */
 
 struct snap_queue *snap_queue_alloc(struct snap_card *card,
@@ -484,12 +536,17 @@ struct snap_queue *snap_queue_alloc(struct snap_card *card,
 			unsigned int queue_length,
 			unsigned int attach_timeout_sec);
 
+/**
+ * Wait for all pending jobs, detach the action and release the queue.
+ * @queue         handle to streaming framework queue
+ */
 void snap_queue_free(struct snap_queue *queue);
 
 /**
  * Synchronous way to send a job away. Blocks until job is done.
  * @queue         handle to streaming framework queue
  * @cjob          streaming framework job
+ * @timeout_sec   job execution timeout
  * @return        0 on success.
  */
 int snap_queue_sync_execute_job(struct snap_queue *queue,
@@ -497,13 +554,19 @@ int snap_queue_sync_execute_job(struct snap_queue *queue,
 			  unsigned int timeout_sec);
 
 /**
- * Asynchronous way to send a job away.
+ * Asynchronous way to send a job away. Returns once the job got a slot
+ * in the queue, blocks only if all queue_length slots are in use.
+ * cjob must stay valid until finished got called. cjob->retc is set
+ * to SNAP_RETC_TIMEOUT or SNAP_RETC_FAILURE if the job could not be
+ * executed. The callback is called from the queue's completion thread,
+ * it must not wait for the queue itself.
+ *
  * @queue         handle to streaming framework queue
  * @cjob          streaming framework job
- * @finished      callback function which is called once job is done
+ * @finished      callback function which is called once job is done,
+ *                can be NULL
  * @return        0 on success.
  */
-/* NOTE: Discuss if such a construct as suggested below really works ok */
 typedef int (*snap_job_finished_t)(struct snap_queue *queue,
 			struct snap_job *cjob);
 
@@ -511,6 +574,76 @@ int snap_async_execute_job(struct snap_queue *queue,
 			struct snap_job *cjob,
 			snap_job_finished_t finished);
 
+/**
+ * Set the execution timeout used for jobs sent by snap_async_execute_job.
+ * @queue         handle to streaming framework queue
+ * @timeout_sec   job execution timeout, default is 10 sec
+ */
+void snap_queue_set_timeout(struct snap_queue *queue,
+			unsigned int timeout_sec);
+
+/**
+ * Wait until all jobs submitted so far are completed.
+ * @queue         handle to streaming framework queue
+ * @return        0 on success.
+ */
+int snap_queue_wait(struct snap_queue *queue);
+
+/**
+ * Job metrics
+ *
+ * libsnap records per action type how long attaching, uploading the job
+ * registers, the execution and the completion wait took, and counts
+ * submitted jobs, timeouts and errors. Recording is on by default,
+ * SNAP_STATS=0 turns it off. SNAP_STATS_DUMP=<sec> prints the statistics
+ * to stderr every <sec> seconds (0: only at program exit).
+ */
+enum snap_stat_lat {
+	SNAP_STAT_ATTACH = 0,		/* snap_attach_action */
+	SNAP_STAT_SET_REGS,		/* Job register upload */
+	SNAP_STAT_EXEC,			/* snap_action_start until done */
+	SNAP_STAT_WAIT,			/* Time spent in completion wait */
+	SNAP_STAT_LAT_MAX,
+};
+
+enum snap_stat_cnt {
+	SNAP_STAT_JOBS = 0,		/* Jobs started */
+	SNAP_STAT_TIMEOUTS,		/* Completion waits which timed out */
+	SNAP_STAT_EIO,			/* Jobs failed with EIO */
+	SNAP_STAT_EFAULT,		/* Data storage faults */
+	SNAP_STAT_CNT_MAX,
+};
+
+struct snap_stat_hist {
+	uint64_t count;
+	uint64_t min_nsec;
+	uint64_t max_nsec;
+	uint64_t mean_nsec;
+	uint64_t p50_nsec;		/* Percentiles, ~6% precision */
+	uint64_t p99_nsec;
+	uint64_t p999_nsec;
+};
+
+struct snap_action_stats {
+	snap_action_type_t action_type;
+	uint64_t counter[SNAP_STAT_CNT_MAX];
+	struct snap_stat_hist lat[SNAP_STAT_LAT_MAX];
+};
+
+/**
+ * Get the job metrics of all threads in the process.
+ * @stats         array receiving one entry per action type
+ * @max_stats     number of entries in stats
+ * @return        number of entries filled in, or < 0 on error.
+ */
+int snap_get_stats(struct snap_action_stats *stats, unsigned int max_stats);
+
+/**
+ * Print the job metrics in a human readable form.
+ * @fp            stream to print to
+ */
+void snap_print_stats(FILE *fp);
+
 #ifdef __cplusplus
 }
 #endif
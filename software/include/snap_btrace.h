@@ -0,0 +1,155 @@
+#ifndef __SNAP_BTRACE_H__
+#define __SNAP_BTRACE_H__
+
+/**
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File format of the binary traces written by libsnap if SNAP_TRACE_FILE
+ * is set, see snap_trace_decode for the reader.
+ *
+ * The file starts with struct btrace_file_hdr, followed by chunks. Each
+ * chunk starts with struct btrace_chunk. BTRACE_CHUNK_FMT chunks
+ * describe one trace point: struct btrace_fmt followed by the printf
+ * format string including its terminating 0. BTRACE_CHUNK_EVENTS chunks
+ * hold the events of one thread, each event is a struct btrace_event
+ * followed by its arguments. Integers, pointers and doubles take 8 bytes,
+ * strings a 16-bit length followed by the characters. Events are padded
+ * to 8 bytes. Everything is in host byte order.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BTRACE_MAGIC		0x31435254504e53ull	/* "SNPTRC1" */
+#define BTRACE_ARGS_MAX		32
+#define BTRACE_STR_MAX		255
+#define BTRACE_EVENT_MAX	1024	/* Max. bytes per event */
+
+enum btrace_chunk_type {
+	BTRACE_CHUNK_FMT = 1,
+	BTRACE_CHUNK_EVENTS = 2,
+};
+
+enum btrace_arg {
+	BTRACE_ARG_INT = 1,	/* int, char, short, also '*' width */
+	BTRACE_ARG_LONG,	/* long, long long, size_t, ... */
+	BTRACE_ARG_PTR,
+	BTRACE_ARG_DOUBLE,
+	BTRACE_ARG_STR,
+};
+
+struct btrace_file_hdr {
+	uint64_t magic;
+	uint32_t pid;
+	uint32_t reserved;
+	uint64_t start_nsec;	/* CLOCK_MONOTONIC_RAW */
+};
+
+struct btrace_chunk {
+	uint32_t type;
+	uint32_t len;		/* Bytes following this header */
+	uint32_t tid;		/* BTRACE_CHUNK_EVENTS only */
+	uint32_t dropped;	/* Events lost before this chunk */
+};
+
+struct btrace_fmt {
+	uint16_t id;
+	char cat;		/* 'B'lock, 'C'ache, 'S'tat, 'P'refetch */
+	uint8_t reserved;
+};
+
+struct btrace_event {
+	uint64_t nsec;		/* CLOCK_MONOTONIC_RAW */
+	uint16_t id;
+	uint16_t len;		/* Including this header and padding */
+	uint32_t reserved;
+};
+
+/**
+ * Walk the conversions of a printf format string.
+ * @fmt      format string
+ * @arg      receives the enum btrace_arg of each argument consumed
+ * @max      size of arg
+ * @return   number of arguments or -1 if the format is not supported.
+ */
+static inline int btrace_parse_fmt(const char *fmt, uint8_t *arg,
+				   unsigned int max)
+{
+	unsigned int n = 0;
+	int longs;
+	const char *p;
+
+	for (p = fmt; *p; p++) {
+		if (*p != '%')
+			continue;
+		p++;
+		if (*p == '%')
+			continue;
+
+		/* flags, width, precision */
+		while (*p && strchr("-+ #0123456789.*", *p)) {
+			if (*p == '*') {
+				if (n == max)
+					return -1;
+				arg[n++] = BTRACE_ARG_INT;
+			}
+			p++;
+		}
+
+		/* length modifiers */
+		longs = 0;
+		while (*p && strchr("hlLqjzt", *p)) {
+			if (*p != 'h')
+				longs++;
+			p++;
+		}
+
+		if (n == max)
+			return -1;
+		switch (*p) {
+		case 'd': case 'i': case 'u': case 'x': case 'X':
+		case 'o': case 'c':
+			arg[n++] = longs ? BTRACE_ARG_LONG : BTRACE_ARG_INT;
+			break;
+		case 'p':
+			arg[n++] = BTRACE_ARG_PTR;
+			break;
+		case 'f': case 'F': case 'e': case 'E':
+		case 'g': case 'G': case 'a': case 'A':
+			if (longs)	/* long double */
+				return -1;
+			arg[n++] = BTRACE_ARG_DOUBLE;
+			break;
+		case 's':
+			arg[n++] = BTRACE_ARG_STR;
+			break;
+		default:
+			return -1;
+		}
+	}
+	return (int)n;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* __SNAP_BTRACE_H__ */
@@ -0,0 +1,301 @@
+#ifndef __SNAP_COLUMNAR_H__
+#define __SNAP_COLUMNAR_H__
+
+/*
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Columnar batch, a table in one buffer: the header, a descriptor for
+ * each column, then the column data.
+ *
+ * Descriptors locate the data by offsets from the start of the batch,
+ * so a batch can be copied, e.g. to card DRAM, and used where it is.
+ * A job passes it as a single struct snap_addr with
+ * SNAP_ADDRFLAG_BATCH set, the job itself does not grow.
+ *
+ * Fixed width columns are arrays of values. String columns are
+ * rows + 1 uint32_t offsets into a heap, value i being the bytes from
+ * heap[offs[i]] to heap[offs[i + 1]], not 0 terminated. A column may
+ * have a validity bitmap, LSB first, a bit set for each value there.
+ * Without bitmap all values are there. Everything is in host byte
+ * order and SNAP_BATCH_ALIGN aligned.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <snap_types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SNAP_BATCH_MAGIC	0x31424e53	/* SNB1 */
+#define SNAP_BATCH_ALIGN	64
+
+#define SNAP_COL_UTF8		0x0001	/* Offsets and heap */
+#define SNAP_COL_INT32		0x0002
+#define SNAP_COL_INT64		0x0003
+
+struct snap_col {
+	uint16_t type;		/* SNAP_COL_... */
+	uint16_t width;		/* Bytes per value, 0 for strings */
+	uint32_t values;	/* Offset of the values, strings: offsets */
+	uint32_t validity;	/* Offset of the bitmap, 0: all valid */
+	uint32_t heap;		/* Offset of the string heap */
+	uint32_t heap_size;	/* Bytes in the heap */
+	uint32_t reserved;
+};				/* 24 bytes */
+
+struct snap_batch {
+	uint32_t magic;
+	uint16_t ncols;
+	uint16_t flags;
+	uint32_t rows;		/* Values in each column */
+	uint32_t capacity;	/* Rows there is space for */
+	uint32_t size;		/* Bytes of the batch */
+	uint32_t reserved;
+	struct snap_col col[];
+};				/* 24 bytes + columns */
+
+/* What snap_batch_init() lays out for a column */
+struct snap_col_spec {
+	uint16_t type;
+	uint16_t nullable;	/* Add a validity bitmap */
+	uint32_t heap_size;	/* Strings: bytes for all values */
+};
+
+static inline uint64_t snap_batch_align(uint64_t offs)
+{
+	return (offs + SNAP_BATCH_ALIGN - 1) &
+		~(uint64_t)(SNAP_BATCH_ALIGN - 1);
+}
+
+static inline uint16_t snap_col_width(uint16_t type)
+{
+	switch (type) {
+	case SNAP_COL_INT32:
+		return 4;
+	case SNAP_COL_INT64:
+		return 8;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Bytes for capacity rows of the columns in spec. Offsets of the
+ * column data go to col when not NULL. Above 4 GiB does not fit a
+ * struct snap_addr, returns 0 then.
+ */
+static inline uint64_t snap_batch_layout(const struct snap_col_spec *spec,
+					 unsigned int ncols,
+					 uint32_t capacity,
+					 struct snap_col *col)
+{
+	uint64_t offs;
+	unsigned int c;
+	struct snap_col d;
+
+	offs = snap_batch_align(sizeof(struct snap_batch) +
+				ncols * sizeof(struct snap_col));
+	for (c = 0; c < ncols; c++) {
+		memset(&d, 0, sizeof(d));
+		d.type = spec[c].type;
+		d.width = snap_col_width(d.type);
+		d.values = offs;
+		if (d.type == SNAP_COL_UTF8)
+			offs += ((uint64_t)capacity + 1) * sizeof(uint32_t);
+		else
+			offs += (uint64_t)capacity * d.width;
+		offs = snap_batch_align(offs);
+		if (spec[c].nullable) {
+			d.validity = offs;
+			offs = snap_batch_align(offs + (capacity + 7) / 8);
+		}
+		if (d.type == SNAP_COL_UTF8) {
+			d.heap = offs;
+			d.heap_size = spec[c].heap_size;
+			offs = snap_batch_align(offs + spec[c].heap_size);
+		}
+		if (offs > UINT32_MAX)
+			return 0;
+		if (col)
+			col[c] = d;
+	}
+	return offs;
+}
+
+/* Empty batch in buf, which holds snap_batch_layout() bytes */
+static inline struct snap_batch *snap_batch_init(void *buf,
+						 const struct snap_col_spec *spec,
+						 unsigned int ncols,
+						 uint32_t capacity)
+{
+	struct snap_batch *b = (struct snap_batch *)buf;
+	uint64_t size = snap_batch_layout(spec, ncols, capacity, b->col);
+	unsigned int c;
+
+	if (size == 0)
+		return NULL;
+	b->magic = SNAP_BATCH_MAGIC;
+	b->ncols = ncols;
+	b->flags = 0;
+	b->rows = 0;
+	b->capacity = capacity;
+	b->size = size;
+	b->reserved = 0;
+	for (c = 0; c < ncols; c++) {
+		if (b->col[c].type == SNAP_COL_UTF8)
+			((uint32_t *)((uint8_t *)b + b->col[c].values))[0] = 0;
+		if (b->col[c].validity)
+			memset((uint8_t *)b + b->col[c].validity, 0,
+			       (capacity + 7) / 8);
+	}
+	return b;
+}
+
+static inline void *snap_col_values(const struct snap_batch *b,
+				    unsigned int c)
+{
+	return (uint8_t *)b + b->col[c].values;
+}
+
+static inline uint32_t *snap_col_offs(const struct snap_batch *b,
+				      unsigned int c)
+{
+	return (uint32_t *)((uint8_t *)b + b->col[c].values);
+}
+
+static inline char *snap_col_heap(const struct snap_batch *b, unsigned int c)
+{
+	return (char *)b + b->col[c].heap;
+}
+
+/* Validity bitmap or NULL */
+static inline uint8_t *snap_col_bitmap(const struct snap_batch *b,
+				       unsigned int c)
+{
+	if (b->col[c].validity == 0)
+		return NULL;
+	return (uint8_t *)b + b->col[c].validity;
+}
+
+static inline int snap_bitmap_get(const uint8_t *bitmap, uint64_t row)
+{
+	return bitmap == NULL || ((bitmap[row / 8] >> (row % 8)) & 1);
+}
+
+static inline int snap_col_valid(const struct snap_batch *b, unsigned int c,
+				 uint32_t row)
+{
+	return snap_bitmap_get(snap_col_bitmap(b, c), row);
+}
+
+static inline void snap_col_set_valid(struct snap_batch *b, unsigned int c,
+				      uint32_t row, int valid)
+{
+	uint8_t *bitmap = snap_col_bitmap(b, c);
+
+	if (bitmap == NULL)
+		return;
+	if (valid)
+		bitmap[row / 8] |= 1 << (row % 8);
+	else
+		bitmap[row / 8] &= ~(1 << (row % 8));
+}
+
+/* String of a row, NULL if not there */
+static inline const char *snap_col_str(const struct snap_batch *b,
+				       unsigned int c, uint32_t row,
+				       uint32_t *len)
+{
+	const uint32_t *offs = snap_col_offs(b, c);
+
+	if (!snap_col_valid(b, c, row)) {
+		*len = 0;
+		return NULL;
+	}
+	*len = offs[row + 1] - offs[row];
+	return snap_col_heap(b, c) + offs[row];
+}
+
+/*
+ * Set the string of row, rows are set in order, each column from
+ * row 0 on. s NULL sets no value. Returns -1 if the heap is full.
+ */
+static inline int snap_col_put_str(struct snap_batch *b, unsigned int c,
+				   uint32_t row, const char *s, uint32_t len)
+{
+	uint32_t *offs = snap_col_offs(b, c);
+
+	if (s == NULL)
+		len = 0;
+	if (len > b->col[c].heap_size - offs[row])
+		return -1;
+	if (len)
+		memcpy(snap_col_heap(b, c) + offs[row], s, len);
+	offs[row + 1] = offs[row] + len;
+	snap_col_set_valid(b, c, row, s != NULL);
+	return 0;
+}
+
+/*
+ * Checks a batch from elsewhere before it is used: it must lie within
+ * size bytes and have at least ncols columns of the given types. For
+ * strings this checks all offsets. Returns 0 if it is fine.
+ */
+static inline int snap_batch_check(const struct snap_batch *b, uint64_t size,
+				   const uint16_t *types, unsigned int ncols)
+{
+	const struct snap_col *d;
+	const uint32_t *offs;
+	unsigned int c;
+	uint32_t i;
+
+	if ((b == NULL) || (size < sizeof(*b)) ||
+	    (b->magic != SNAP_BATCH_MAGIC) || (b->size > size) ||
+	    (b->ncols < ncols) || (b->rows > b->capacity) ||
+	    (sizeof(*b) + (uint64_t)b->ncols * sizeof(*d) > b->size))
+		return -1;
+
+	for (c = 0; c < ncols; c++) {
+		d = &b->col[c];
+		if ((d->type != types[c]) || (d->width != snap_col_width(d->type)))
+			return -1;
+		if ((uint64_t)d->values + (d->width ? (uint64_t)b->capacity *
+					   d->width : ((uint64_t)b->capacity + 1) *
+					   sizeof(uint32_t)) > b->size)
+			return -1;
+		if (d->validity &&
+		    (uint64_t)d->validity + (b->capacity + 7) / 8 > b->size)
+			return -1;
+		if (d->type != SNAP_COL_UTF8)
+			continue;
+		if ((uint64_t)d->heap + d->heap_size > b->size)
+			return -1;
+		offs = snap_col_offs(b, c);
+		for (i = 0; i < b->rows; i++)
+			if ((offs[i] > offs[i + 1]) || (offs[i + 1] > d->heap_size))
+				return -1;
+	}
+	return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* __SNAP_COLUMNAR_H__ */
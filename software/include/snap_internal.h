@@ -75,6 +75,13 @@ struct snap_funcs {
 	int (* mmio_read64)(struct snap_card *card, uint64_t offset, uint64_t *data);
 	void (* card_free)(struct snap_card *card);
 	int (* card_ioctl)(struct snap_card *card, unsigned int cmd, unsigned long arg);
+	int (* wait_irq)(struct snap_card *card, unsigned long timeout_usec,
+			 int expect_irq);
+	int (* irq_pending)(struct snap_card *card);
+	int (* mmio_write_regs)(struct snap_card *card, uint64_t offset,
+				const uint32_t *data, unsigned int words);
+	int (* mmio_read_regs)(struct snap_card *card, uint64_t offset,
+			       uint32_t *data, unsigned int words);
 };
 
 static inline pid_t __gettid(void)
@@ -100,37 +107,49 @@ int pp_trace_enabled(void);
 			fprintf(stderr, "A " fmt, ## __VA_ARGS__);	\
 	} while (0)
 
-#define block_trace(fmt, ...) do {                                     \
-		if (block_trace_enabled()) {                           \
-			fprintf(stderr, "B %08x.%08x %-16lld " fmt,    \
-				getpid(), __gettid(), __get_usec(),    \
-			## __VA_ARGS__);                               \
+/*
+ * With SNAP_TRACE_FILE set, the trace points below record binary events
+ * instead of printing, see snap_btrace.c. The first call of each trace
+ * point registers its format and keeps the id in a static variable.
+ */
+#define SNAP_BTRACE_ID_NONE	0xffff
+
+int snap_btrace_enabled(void);
+uint16_t snap_btrace_register(char cat, const char *fmt);
+void snap_btrace(uint16_t id, ...);
+void snap_btrace_init(void);	/* Reads SNAP_TRACE_FILE */
+
+#define __snap_trace(cat, enabled, fmt, ...) do {                      \
+		if (enabled) {                                         \
+			if (snap_btrace_enabled()) {                   \
+				static uint16_t __bt_id;               \
+				uint16_t __id = __atomic_load_n(       \
+					&__bt_id, __ATOMIC_RELAXED);   \
+				if (__id == 0) {                       \
+					__id = snap_btrace_register(   \
+						cat, fmt);             \
+					__atomic_store_n(&__bt_id,     \
+						__id, __ATOMIC_RELAXED);\
+				}                                      \
+				snap_btrace(__id, ## __VA_ARGS__);     \
+			} else                                         \
+				fprintf(stderr, "%c %08x.%08x %-16lld " \
+					fmt, cat, getpid(), __gettid(),\
+					__get_usec(), ## __VA_ARGS__); \
 		}                                                      \
 	} while (0)
 
-#define cache_trace(fmt, ...) do {                                     \
-		if (cache_trace_enabled()) {                           \
-			fprintf(stderr, "C %08x.%08x %-16lld " fmt,    \
-				getpid(), __gettid(), __get_usec(),    \
-			## __VA_ARGS__);                               \
-		}                                                      \
-	} while (0)
+#define block_trace(fmt, ...) \
+	__snap_trace('B', block_trace_enabled(), fmt, ## __VA_ARGS__)
 
-#define stat_trace(fmt, ...) do {                                      \
-		if (stat_trace_enabled()) {                            \
-			fprintf(stderr, "S %08x.%08x %-16lld " fmt,    \
-				getpid(), __gettid(), __get_usec(),    \
-			## __VA_ARGS__);                               \
-		}                                                      \
-	} while (0)
+#define cache_trace(fmt, ...) \
+	__snap_trace('C', cache_trace_enabled(), fmt, ## __VA_ARGS__)
 
-#define pp_trace(fmt, ...) do {                                        \
-		if (pp_trace_enabled()) {                              \
-			fprintf(stderr, "P %08x.%08x %-16lld " fmt,    \
-				getpid(), __gettid(), __get_usec(),    \
-			## __VA_ARGS__);                               \
-		}                                                      \
-	} while (0)
+#define stat_trace(fmt, ...) \
+	__snap_trace('S', stat_trace_enabled(), fmt, ## __VA_ARGS__)
+
+#define pp_trace(fmt, ...) \
+	__snap_trace('P', pp_trace_enabled(), fmt, ## __VA_ARGS__)
 
 /**
  * Register a software version of the FPGA action to enable us
@@ -156,6 +175,7 @@ struct snap_sim_action {
 
 	enum snap_action_state state;
 	void *priv_data;
+	struct snap_card *card;		/* Card of this copy, set on attach */
 
 	struct snap_queue_workitem job;
 	snap_action_main_t main;
@@ -169,13 +189,78 @@ struct snap_sim_action {
 	int (* mmio_read64) (struct snap_card *card,
 			     uint64_t offset, uint64_t *data);
 
-	struct snap_sim_action *next;
+	/*
+	 * Optional. If set, starting the action calls start() on the
+	 * starting thread instead of running main(). For actions which
+	 * take new commands while older ones are still in flight, like
+	 * the NVMe action. release() frees priv_data of a card's copy.
+	 */
+	int (* start)(struct snap_card *card);
+	void (* release)(struct snap_sim_action *action);
 };
 
+/*
+ * The registered action is used as prototype. Each card gets its own
+ * copy of it when attaching, the copy is passed to main() and the
+ * mmio callbacks. Registering an action_type again replaces the older
+ * version.
+ */
 int snap_action_register(struct snap_sim_action *action);
 
 struct snap_sim_action *snap_card_to_sim_action(struct snap_card *card);
 
+/*
+ * Emulated NVMe drives for software actions, see snap_nvme_sim.c.
+ * SNAP_NVME_SIM names a file or block device per card. Requests are
+ * owned by the caller and must stay valid until done() was called,
+ * which happens on the drive thread once the configured latency and
+ * bandwidth profile allows it.
+ */
+#define SNAP_NVME_SIM_LB_SIZE	512	/* Bytes per NVMe block */
+#define SNAP_NVME_SIM_DRIVES	2
+
+struct snap_nvme_sim;
+
+struct snap_nvme_sim_req {
+	unsigned int drive;		/* 0 or 1 */
+	int write;			/* Host to NVMe if set */
+	uint64_t lba;			/* In SNAP_NVME_SIM_LB_SIZE blocks */
+	void *buf;			/* Host memory */
+	size_t size;			/* Bytes */
+	int rc;				/* 0 or errno, set before done() */
+	void (* done)(struct snap_nvme_sim_req *req);
+	void *priv;			/* For the caller */
+
+	/* Used by the drive emulation */
+	uint64_t due_nsec;
+	struct snap_nvme_sim_req *next;
+};
+
+/* NULL if the card has no emulated drives */
+struct snap_nvme_sim *snap_card_to_nvme_sim(struct snap_card *card);
+
+int snap_nvme_sim_submit(struct snap_nvme_sim *sim,
+			 struct snap_nvme_sim_req *req);
+
+/* Synchronous transfer, returns 0 or -1 with errno set */
+int snap_nvme_sim_rw(struct snap_nvme_sim *sim, unsigned int drive,
+		     int write, uint64_t lba, void *buf, size_t size);
+
+/*
+ * Emulated card DRAM for software actions, see snap_dram_sim.c. Every
+ * action of a card addresses the same memory, sized by GET_SDRAM_SIZE.
+ * snap_sim_addr() returns where a job address is in this process, for
+ * SNAP_ADDRTYPE_HOST_DRAM and SNAP_ADDRTYPE_CARD_DRAM, so the action
+ * can work on card DRAM in place. NULL with errno set if the range is
+ * not on the card or the type has no memory behind it.
+ */
+void *snap_sim_addr(struct snap_sim_action *action, const struct snap_addr *a);
+
+/* Copy size bytes like the card, honours SNAP_DRAM_SIM_MBPS, 0 or -1 */
+int snap_sim_memcpy(struct snap_sim_action *action,
+		    const struct snap_addr *dst, const struct snap_addr *src,
+		    size_t size);
+
 
 #ifdef __cplusplus
 }
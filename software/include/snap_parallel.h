@@ -0,0 +1,130 @@
+#ifndef __SNAP_PARALLEL_H__
+#define __SNAP_PARALLEL_H__
+
+/*
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Helpers the software actions share to work on tables: a hash for
+ * keys of any length and a fork/join of a function over some threads,
+ * each taking its share of the rows.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SNAP_PARALLEL_MIN		16384	/* Fewer rows use one thread */
+#define SNAP_PARALLEL_THREADS_MAX	64
+
+/* 8 bytes at a time, finished with the murmur3 mix */
+static inline uint64_t snap_hash_bytes(const char *s, uint32_t len)
+{
+	uint64_t h = len, w;
+	uint32_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, s + i, 8);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+		h ^= h >> 31;
+	}
+	if (i < len) {
+		w = 0;
+		memcpy(&w, s + i, len - i);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+struct snap_parallel_thread {
+	pthread_t tid;
+	void (* fn)(void *arg, unsigned int no);
+	void *arg;
+	unsigned int no;
+};
+
+static inline void *snap_parallel_main(void *data)
+{
+	struct snap_parallel_thread *t =
+		(struct snap_parallel_thread *)data;
+
+	t->fn(t->arg, t->no);
+	return NULL;
+}
+
+/*
+ * Run fn(arg, 0 ... threads - 1) in parallel, fn(arg, 0) on the
+ * calling thread. A thread that cannot be started has its share done
+ * by the caller. threads is at most SNAP_PARALLEL_THREADS_MAX.
+ */
+static inline void snap_parallel(unsigned int threads,
+				 void (* fn)(void *arg, unsigned int no),
+				 void *arg)
+{
+	struct snap_parallel_thread t[SNAP_PARALLEL_THREADS_MAX];
+	int started[SNAP_PARALLEL_THREADS_MAX];
+	unsigned int i;
+
+	for (i = 1; i < threads; i++) {
+		t[i].fn = fn;
+		t[i].arg = arg;
+		t[i].no = i;
+		started[i] = (pthread_create(&t[i].tid, NULL,
+					     snap_parallel_main, &t[i]) == 0);
+	}
+	fn(arg, 0);
+	for (i = 1; i < threads; i++) {
+		if (started[i])
+			pthread_join(t[i].tid, NULL);
+		else
+			fn(arg, i);	/* Do its share here */
+	}
+}
+
+/* First of the n items thread no of threads works on */
+static inline uint64_t snap_parallel_share(uint64_t n, unsigned int threads,
+					   unsigned int no)
+{
+	return n * no / threads;
+}
+
+/* Threads to use for rows, threads is what the caller asks for */
+static inline unsigned int snap_parallel_threads(unsigned int threads,
+						 uint64_t rows)
+{
+	if (rows < SNAP_PARALLEL_MIN)
+		return 1;
+	if (threads < 1)
+		return 1;
+	if (threads > SNAP_PARALLEL_THREADS_MAX)
+		return SNAP_PARALLEL_THREADS_MAX;
+	return threads;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* __SNAP_PARALLEL_H__ */
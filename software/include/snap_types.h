@@ -46,6 +46,7 @@ extern "C" {
 #define SNAP_ADDRFLAG_EXT		0x0008 /* reserved for extension */
 #define SNAP_ADDRFLAG_SRC		0x0010 /* data source */
 #define SNAP_ADDRFLAG_DST		0x0020 /* data destination */
+#define SNAP_ADDRFLAG_BATCH		0x0040 /* struct snap_batch, see snap_columnar.h */
 
 typedef uint16_t snap_addrtype_t;
 typedef uint16_t snap_addrflag_t;
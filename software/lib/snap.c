@@ -23,6 +23,8 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <endian.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/time.h>
 
 #include <libsnap.h>
@@ -33,11 +35,15 @@
 #include <snap_s_regs.h>    /* Include SNAP Slave Regs */
 #include <snap_hls_if.h>    /* Include SNAP -> HLS */
 
+#include "snap_stats.h"
+#include "snap_nvme_sim.h"
+#include "snap_dram_sim.h"
+
 
 /* Trace hardware implementation */
 static unsigned int snap_trace = 0x0;
 static unsigned int snap_config = 0x0;
-static struct snap_sim_action *actions = NULL;
+static long wait_spin_usec = -1;	/* SNAP_POLL_SPIN_USEC, -1: tune */
 
 #define snap_trace_enabled()  (snap_trace & 0x0001)
 #define reg_trace_enabled()   (snap_trace & 0x0002)
@@ -70,6 +76,7 @@ int pp_trace_enabled(void)
 }
 
 #define software_action_enabled()  (snap_config & 0x01)
+#define software_async_enabled()   (snap_config & 0x02)
 
 #define snap_trace(fmt, ...) do { \
 		if (snap_trace_enabled()) \
@@ -93,6 +100,19 @@ int pp_trace_enabled(void)
 
 #define	INVALID_SAT 0x0ffffffff
 
+/* Completion wait budget and statistics of the attached action */
+struct snap_wait {
+	unsigned int spin_usec;         /* Busy poll budget */
+	unsigned int sleep_usec;        /* Back-off budget before blocking */
+	unsigned int sleep_max_usec;    /* Largest single sleep */
+	bool tune;                      /* Adapt spin_usec to job durations */
+	unsigned long long avg_usec;    /* Average time until completion */
+	unsigned long spin_done;        /* Completed while busy polling */
+	unsigned long sleep_done;       /* Completed during back-off */
+	unsigned long irq_done;         /* Completed while blocking on IRQ */
+	unsigned long timeouts;
+};
+
 struct snap_card {
 	void *priv;
 	struct cxl_afu_h *afu_h;
@@ -116,9 +136,25 @@ struct snap_card {
 	void *errinfo;                  /* Err info Buffer */
 	struct cxl_event event;         /* Buffer to keep event from IRQ */
 	unsigned int attach_timeout_sec;
-	unsigned int queue_length;      /* unused */
+	unsigned int queue_length;      /* Slots of the job queue */
 	uint64_t cap_reg;               /* Capability Register */
 	const char *name;               /* Card name */
+
+	struct snap_wait wait;          /* See snap_action_completed */
+	uint64_t job_start_nsec;        /* For SNAP_STAT_EXEC */
+
+	/* Last values written to ACTION_PARAMS_IN, see mmio_write_regs */
+	uint32_t regs_shadow[CACHELINE_BYTES / sizeof(uint32_t)];
+	uint32_t regs_valid;            /* Bitmask of valid shadow words */
+
+	/* software simulation mode: completion of started action */
+	pthread_mutex_t sim_lock;
+	pthread_cond_t sim_cond;
+	bool sim_irq;                   /* Action done IRQ pending */
+	struct snap_card *sim_next;     /* Next card in sw_pool */
+	struct snap_nvme_sim *nvme_sim; /* Emulated NVMe drives or NULL */
+	unsigned int sim_card_no;       /* n of /dev/cxl/afu<n>.0s */
+	struct snap_dram_sim *dram_sim; /* Mapped on first use */
 };
 
 /* Translate Card ID to Name */
@@ -159,6 +195,9 @@ static const char* snap_card_id_2_name(int card_id)
 static int snap_map_funcs(struct snap_card *card,
 			  snap_action_type_t action_type);
 
+/* Reset completion wait budget and statistics */
+static void snap_wait_init(struct snap_card *card);
+
 /*	Get Time in msec */
 static unsigned long tget_ms(void)
 {
@@ -375,6 +414,75 @@ static int hw_snap_mmio_read64(struct snap_card *card,
 	return rc;
 }
 
+/*
+ * The action input registers keep their values between jobs, as long
+ * as nobody else got the action attached in between. We remember what
+ * we wrote to ACTION_PARAMS_IN and skip words which did not change.
+ * Note that the SNAP core rejects 64-bit MMIO to the action space
+ * (alignment error in mmio.vhd), so we have to stay with 32-bit stores.
+ */
+static int hw_snap_mmio_write_regs(struct snap_card *card, uint64_t offset,
+				   const uint32_t *data, unsigned int words)
+{
+	int rc = 0;
+	unsigned int i, idx, skipped = 0;
+
+	if ((!card) || (!card->afu_h)) {
+		reg_trace("  %s Error\n", __func__);
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < words; i++, offset += sizeof(uint32_t)) {
+		idx = (offset - ACTION_PARAMS_IN) / sizeof(uint32_t);
+		if ((offset >= ACTION_PARAMS_IN) &&
+		    (idx < ARRAY_SIZE(card->regs_shadow))) {
+			if ((card->regs_valid & (1u << idx)) &&
+			    (card->regs_shadow[idx] == data[i])) {
+				skipped++;
+				continue;
+			}
+			card->regs_valid &= ~(1u << idx);
+		}
+		rc = cxl_mmio_write32(card->afu_h, card->action_base + offset,
+				      data[i]);
+		if (rc != 0)
+			break;
+		if ((offset >= ACTION_PARAMS_IN) &&
+		    (idx < ARRAY_SIZE(card->regs_shadow))) {
+			card->regs_shadow[idx] = data[i];
+			card->regs_valid |= (1u << idx);
+		}
+	}
+	reg_trace("  %s(%p, %llx, %d words) skipped: %d rc: %d\n", __func__,
+		  card, (long long)offset, words, skipped, rc);
+	return rc;
+}
+
+static int hw_snap_mmio_read_regs(struct snap_card *card, uint64_t offset,
+				  uint32_t *data, unsigned int words)
+{
+	int rc = 0;
+	unsigned int i;
+
+	if ((!card) || (!card->afu_h)) {
+		reg_trace("  %s Error\n", __func__);
+		errno = EINVAL;
+		return -1;
+	}
+
+	offset += card->action_base;
+	for (i = 0; i < words; i++) {
+		rc = cxl_mmio_read32(card->afu_h,
+				     offset + i * sizeof(uint32_t), &data[i]);
+		if (rc != 0)
+			break;
+	}
+	reg_trace("  %s(%p, %llx, %d words) rc: %d\n", __func__, card,
+		  (long long)offset, words, rc);
+	return rc;
+}
+
 static void hw_snap_card_free(struct snap_card *card)
 {
 	if (!card)
@@ -391,20 +499,26 @@ static void hw_snap_card_free(struct snap_card *card)
 	__free(card);
 }
 
-static int hw_wait_irq(struct snap_card *card, int timeout_sec, int expect_irq)
+static int hw_irq_pending(struct snap_card *card)
+{
+	return cxl_event_pending(card->afu_h);
+}
+
+static int hw_wait_irq(struct snap_card *card, unsigned long timeout_usec,
+		       int expect_irq)
 {
 	fd_set  set;
 	struct  timeval timeout;
 	int rc = 0;
 
-	snap_trace("  %s: Enter fd: %d Flags: 0x%x Expect irq: %d Timeout: %d sec\n",
+	snap_trace("  %s: Enter fd: %d Flags: 0x%x Expect irq: %d Timeout: %ld usec\n",
 		__func__, card->afu_fd,
-		card->flags, expect_irq, timeout_sec);
+		card->flags, expect_irq, timeout_usec);
 
 __hw_wait_irq_retry:
 	if (!cxl_event_pending(card->afu_h)) {
-		timeout.tv_sec = timeout_sec;
-		timeout.tv_usec = 0;
+		timeout.tv_sec = timeout_usec / 1000000;
+		timeout.tv_usec = timeout_usec % 1000000;
 		FD_ZERO(&set);
 		FD_SET(card->afu_fd, &set);
 
@@ -448,6 +562,9 @@ __hw_wait_irq_retry:
 			snap_trace("      flags=%04x addr=%08llx dsisr=%08llx\n",
 				ds->flags, (long long)ds->addr, (long long)ds->dsisr);
 			rc = EFAULT;
+			if (snap_stats_enabled)
+				snap_stats_inc(card->action_type,
+					       SNAP_STAT_EFAULT);
 			break;
 		}
 
@@ -562,7 +679,8 @@ static struct snap_action *hw_attach_action(struct snap_card *card,
 	}
 
 	if (SNAP_ATTACH_IRQ & card->flags)
-		rc = hw_wait_irq(card, timeout_sec, SNAP_ATTACH_IRQ_NUM);
+		rc = hw_wait_irq(card, timeout_sec * 1000000UL,
+				 SNAP_ATTACH_IRQ_NUM);
 	else {
 		t0 = tget_ms();
 		dt = 0;
@@ -579,6 +697,7 @@ static struct snap_action *hw_attach_action(struct snap_card *card,
 	/* Return Pointer if all went well */
 	if (0 == rc) {
 		card->action_base = ACTION_BASE_S;
+		card->regs_valid = 0;	/* Someone else might have used it */
 		action = (struct snap_action *)card;
 	}
 	snap_trace("%s Exit rc: %d Action: %p Base: 0x%x\n", __func__,
@@ -632,6 +751,7 @@ static int hw_detach_action(struct snap_action *action)
 	}
 
 	card->action_base = 0;              /* FIXME use action_*32 instead */
+	card->regs_valid = 0;
 	snap_trace("%s Exit: rc: %d CSR 0x%llx after: %d msec\n",
 		   __func__, rc, (long long)data, dt);
 	return rc;
@@ -710,6 +830,10 @@ static struct snap_funcs hardware_funcs = {
 	.mmio_read64 = hw_snap_mmio_read64,
 	.card_free = hw_snap_card_free,
 	.card_ioctl = hw_card_ioctl,
+	.wait_irq = hw_wait_irq,
+	.irq_pending = hw_irq_pending,
+	.mmio_write_regs = hw_snap_mmio_write_regs,
+	.mmio_read_regs = hw_snap_mmio_read_regs,
 };
 
 /* We access the hardware via this function pointer struct */
@@ -727,10 +851,26 @@ struct snap_action *snap_attach_action(struct snap_card *card,
 				       snap_action_flag_t action_flags,
 				       int timeout_ms)
 {
+	struct snap_action *action;
+	uint64_t t0 = 0;
+
+	/* Different action, start over with the wait statistics */
+	if ((card->action_type != action_type) ||
+	    (card->wait.sleep_max_usec == 0))
+		snap_wait_init(card);
+
+	if (snap_stats_enabled)
+		t0 = snap_stats_now();
+
 	if (software_action_enabled())
 		snap_map_funcs(card, action_type);
 
-	return df->attach_action(card, action_type, action_flags, timeout_ms);
+	action = df->attach_action(card, action_type, action_flags, timeout_ms);
+
+	if (snap_stats_enabled && action)
+		snap_stats_lat(action_type, SNAP_STAT_ATTACH,
+			       snap_stats_now() - t0);
+	return action;
 }
 
 int snap_detach_action(struct snap_action *action)
@@ -807,6 +947,26 @@ int snap_mmio_read64(struct snap_card *_card,
 }
 
 
+int snap_mmio_write_regs(struct snap_card *_card, uint64_t offset,
+			 const uint32_t *data, unsigned int words)
+{
+	if (offset % sizeof(uint32_t)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	return df->mmio_write_regs(_card, offset, data, words);
+}
+
+int snap_mmio_read_regs(struct snap_card *_card, uint64_t offset,
+			uint32_t *data, unsigned int words)
+{
+	if (offset % sizeof(uint32_t)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	return df->mmio_read_regs(_card, offset, data, words);
+}
+
 void snap_card_free(struct snap_card *_card)
 {
 	df->card_free(_card);
@@ -821,44 +981,304 @@ int snap_card_ioctl(struct snap_card *_card, unsigned int cmd, unsigned long arg
  * JOB QUEUE Operations
  *****************************************************************************/
 
+/*
+ * The queue keeps the action attached for its whole lifetime and feeds
+ * jobs to it from a ring of queue_length slots. Submitters only put the
+ * job into a free slot, the completion thread uploads the registers,
+ * starts the action, waits for completion and calls the finished
+ * callback. Like that callers can prepare the next jobs while the
+ * current one is running, and we do not pay the attach/detach cost
+ * per job anymore.
+ */
+#define SNAP_QUEUE_TIMEOUT_SEC	10	/* Default for async jobs */
+
+struct snap_queue_slot {
+	struct snap_job *cjob;
+	snap_job_finished_t finished;	/* NULL for sync jobs */
+	unsigned int timeout_sec;
+	uint16_t seq;			/* Seq Number used for the job */
+	int *rc;			/* Sync jobs: where to store rc */
+};
+
+struct snap_queue {
+	struct snap_card *card;
+	struct snap_action *action;	/* NULL if not attached */
+	unsigned int queue_length;
+	unsigned int timeout_sec;	/* Used for async jobs */
+
+	struct snap_queue_slot *slots;
+	unsigned long head;		/* Next slot to submit to */
+	unsigned long tail;		/* Next slot to execute */
+	unsigned long completed;	/* Number of completed jobs */
+
+	pthread_mutex_t lock;
+	pthread_cond_t submit_cond;	/* Slot got free */
+	pthread_cond_t exec_cond;	/* Job got submitted */
+	pthread_cond_t done_cond;	/* Job got completed */
+	pthread_t completion_thread;
+	bool exit;
+};
+
+/*
+ * Check the seq the action reports back against the one we passed. A
+ * different one is a stale completion or one of another job.
+ */
+static int __snap_queue_check_seq(struct snap_card *card, uint16_t seq)
+{
+	struct snap_queue_workitem w;
+	uint32_t data = 0;
+
+	if (snap_mmio_read32(card, ACTION_PARAMS_OUT, &data) != 0) {
+		snap_trace("  %s: Error reading seq\n", __func__);
+		errno = EIO;
+		return SNAP_EIO;
+	}
+	memcpy(&w, &data, sizeof(data));
+	if (w.seq != seq) {
+		snap_trace("  %s: Seq mismatch got %x expected %x\n",
+			   __func__, w.seq, seq);
+		errno = EIO;
+		return SNAP_EIO;
+	}
+	return 0;
+}
+
+static int __snap_queue_exec(struct snap_queue *queue,
+			     struct snap_queue_slot *slot)
+{
+	int rc;
+	struct snap_card *card = queue->card;
+
+	if (queue->action == NULL) {
+		queue->action = snap_attach_action(card, card->action_typeq,
+						   card->action_flags,
+						   card->attach_timeout_sec);
+		if (queue->action == NULL) {
+			snap_trace("%s: Error Can not attach to Action 0x%x\n",
+				   __func__, card->action_typeq);
+			errno = ETIME;
+			return SNAP_EATTACH;
+		}
+	}
+
+	slot->seq = card->seq;	/* set_regs uses and increments it */
+	rc = snap_action_sync_execute_job_set_regs(queue->action, slot->cjob);
+	if (rc != 0)
+		return rc;
+
+	snap_action_start(queue->action);
+	rc = snap_action_sync_execute_job_check_completion(queue->action,
+							   slot->cjob,
+							   slot->timeout_sec);
+	if (rc == 0)
+		rc = __snap_queue_check_seq(card, slot->seq);
+	return rc;
+}
+
+static void *__snap_queue_thread(void *arg)
+{
+	int rc;
+	struct snap_queue *queue = (struct snap_queue *)arg;
+	struct snap_queue_slot *slot;
+
+	pthread_mutex_lock(&queue->lock);
+	while (1) {
+		while (!queue->exit && (queue->tail == queue->head))
+			pthread_cond_wait(&queue->exec_cond, &queue->lock);
+		if (queue->tail == queue->head)
+			break;	/* exit requested and queue drained */
+
+		slot = &queue->slots[queue->tail % queue->queue_length];
+		pthread_mutex_unlock(&queue->lock);
+
+		snap_trace("%s: Exec job %p Slot: %ld\n", __func__,
+			   slot->cjob, queue->tail % queue->queue_length);
+		rc = __snap_queue_exec(queue, slot);
+		if (rc != 0) {
+			if (rc == SNAP_ETIMEDOUT)
+				slot->cjob->retc = SNAP_RETC_TIMEOUT;
+			else	slot->cjob->retc = SNAP_RETC_FAILURE;
+		}
+		if (slot->finished)
+			slot->finished(queue, slot->cjob);
+
+		pthread_mutex_lock(&queue->lock);
+		if (slot->rc)
+			*slot->rc = rc;
+		queue->tail++;
+		queue->completed++;
+		pthread_cond_broadcast(&queue->done_cond);
+		pthread_cond_broadcast(&queue->submit_cond);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return NULL;
+}
+
 struct snap_queue *snap_queue_alloc(struct snap_card *card,
 				    snap_action_type_t action_type,
 				    snap_action_flag_t action_flags,
-				    unsigned int queue_length __unused,
+				    unsigned int queue_length,
 				    unsigned int attach_timeout_sec)
 {
+	int rc;
+	struct snap_queue *queue;
+
+	if (card == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (queue_length == 0)
+		queue_length = 1;
+
 	card->action_typeq = action_type;     /* Save Action Type */
 	card->action_flags = action_flags;
 	card->queue_length = queue_length;
 	card->attach_timeout_sec = attach_timeout_sec;
 
-	return (struct snap_queue *)card;
+	queue = calloc(1, sizeof(*queue));
+	if (queue == NULL)
+		return NULL;
+
+	queue->slots = calloc(queue_length, sizeof(*queue->slots));
+	if (queue->slots == NULL)
+		goto __snap_queue_alloc_err;
+
+	queue->card = card;
+	queue->queue_length = queue_length;
+	queue->timeout_sec = SNAP_QUEUE_TIMEOUT_SEC;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->submit_cond, NULL);
+	pthread_cond_init(&queue->exec_cond, NULL);
+	pthread_cond_init(&queue->done_cond, NULL);
+
+	rc = pthread_create(&queue->completion_thread, NULL,
+			    &__snap_queue_thread, queue);
+	if (rc != 0) {
+		errno = rc;
+		goto __snap_queue_alloc_err;
+	}
+
+	snap_trace("%s: Queue %p Action: 0x%x Length: %d\n", __func__,
+		   queue, action_type, queue_length);
+	return queue;
+
+ __snap_queue_alloc_err:
+	__free(queue->slots);
+	__free(queue);
+	return NULL;
+}
+
+/* Put job into the next free slot, blocks while the queue is full */
+static void __snap_queue_submit(struct snap_queue *queue,
+				struct snap_job *cjob,
+				snap_job_finished_t finished,
+				unsigned int timeout_sec,
+				int *rc)
+{
+	struct snap_queue_slot *slot;
+
+	pthread_mutex_lock(&queue->lock);
+	while (queue->head - queue->tail >= queue->queue_length)
+		pthread_cond_wait(&queue->submit_cond, &queue->lock);
+
+	slot = &queue->slots[queue->head % queue->queue_length];
+	slot->cjob = cjob;
+	slot->finished = finished;
+	slot->timeout_sec = timeout_sec;
+	slot->rc = rc;
+	queue->head++;
+
+	pthread_cond_signal(&queue->exec_cond);
+	/* Returns with queue->lock held, caller must unlock */
 }
 
-/*
- * @note At this point in time we emulate a real queue behavior by
- * doing the same as we do when using snap_sync_execute_job directly.
- * This is basically a queue of length 1. Once there are use-cases
- * which will profit from a real hardware job queue, this must be
- * changed along with a real hardware queue implementation.
- */
 int snap_queue_sync_execute_job(struct snap_queue *queue,
                           struct snap_job *cjob,
                           unsigned int timeout_sec)
 {
-	struct snap_card *card = (struct snap_card *)queue;
+	int rc = 0;
+	unsigned long ticket;
+
+	if ((queue == NULL) || (cjob == NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+
+	__snap_queue_submit(queue, cjob, NULL, timeout_sec, &rc);
+	/* Our job is done once this many jobs got completed */
+	ticket = queue->head;
+	while (queue->completed < ticket)
+		pthread_cond_wait(&queue->done_cond, &queue->lock);
+	pthread_mutex_unlock(&queue->lock);
 
-	return snap_sync_execute_job(card, card->action_typeq, /* Uses Save Action type */
-				     card->action_flags,
-				     cjob,
-				     card->attach_timeout_sec,
-				     timeout_sec);
+	return rc;
 }
 
-void snap_queue_free(struct snap_queue *queue __unused)
+int snap_async_execute_job(struct snap_queue *queue,
+			   struct snap_job *cjob,
+			   snap_job_finished_t finished)
 {
-	struct snap_card *card = (struct snap_card *)queue;
+	if ((queue == NULL) || (cjob == NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+
+	__snap_queue_submit(queue, cjob, finished, queue->timeout_sec, NULL);
+	pthread_mutex_unlock(&queue->lock);
+	return SNAP_OK;
+}
+
+void snap_queue_set_timeout(struct snap_queue *queue, unsigned int timeout_sec)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->timeout_sec = timeout_sec;
+	pthread_mutex_unlock(&queue->lock);
+}
+
+int snap_queue_wait(struct snap_queue *queue)
+{
+	unsigned long ticket;
+
+	if (queue == NULL) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+
+	pthread_mutex_lock(&queue->lock);
+	ticket = queue->head;
+	while (queue->completed < ticket)
+		pthread_cond_wait(&queue->done_cond, &queue->lock);
+	pthread_mutex_unlock(&queue->lock);
+
+	return SNAP_OK;
+}
+
+void snap_queue_free(struct snap_queue *queue)
+{
+	struct snap_card *card;
+
+	if (queue == NULL)
+		return;
+
+	/* Let the completion thread finish all pending jobs */
+	pthread_mutex_lock(&queue->lock);
+	queue->exit = true;
+	pthread_cond_signal(&queue->exec_cond);
+	pthread_mutex_unlock(&queue->lock);
+	pthread_join(queue->completion_thread, NULL);
+
+	card = queue->card;
+	if (queue->action)
+		snap_detach_action(queue->action);
 	card->action_type = 0xffffffff;
+
+	pthread_cond_destroy(&queue->done_cond);
+	pthread_cond_destroy(&queue->exec_cond);
+	pthread_cond_destroy(&queue->submit_cond);
+	pthread_mutex_destroy(&queue->lock);
+	__free(queue->slots);
+	__free(queue);
 }
 
 /*****************************************************************************
@@ -877,6 +1297,10 @@ int snap_action_start(struct snap_action *action)
 		snap_mmio_write32(card, ACTION_IRQ_APP, ACTION_IRQ_APP_DONE);
 		snap_mmio_write32(card, ACTION_IRQ_CONTROL, ACTION_IRQ_CONTROL_ON);
 	}
+	if (snap_stats_enabled) {
+		snap_stats_inc(card->action_type, SNAP_STAT_JOBS);
+		card->job_start_nsec = snap_stats_now();
+	}
 	return snap_mmio_write32(card, ACTION_CONTROL, ACTION_CONTROL_START);
 }
 
@@ -904,7 +1328,7 @@ int snap_action_wait_interrupt(struct snap_action *action, int *rc, int timeout)
 	int _rc = 0;
 	//uint32_t action_data = 0;
 	struct snap_card *card = (struct snap_card *)action;
- 	hw_wait_irq(card, timeout, SNAP_ACTION_IRQ_NUM);
+ 	df->wait_irq(card, timeout * 1000000UL, SNAP_ACTION_IRQ_NUM);
 	//snap_mmio_write32(card, ACTION_IRQ_STATUS, ACTION_IRQ_STATUS_DONE);
 	//snap_mmio_write32(card, ACTION_IRQ_APP, 0);
 	//snap_mmio_write32(card, ACTION_IRQ_CONTROL, ACTION_IRQ_CONTROL_OFF);
@@ -914,37 +1338,169 @@ int snap_action_wait_interrupt(struct snap_action *action, int *rc, int timeout)
         return _rc;
 }
 
-int snap_action_completed(struct snap_action *action, int *rc, int timeout)
+/*
+ * Waiting for the action runs in three phases. First we busy poll for
+ * wait.spin_usec, which gives the lowest latency for short jobs. Then we
+ * poll with exponentially growing sleeps up to wait.sleep_max_usec. With
+ * interrupts enabled, we finally block on the AFU file descriptor once
+ * wait.sleep_usec has passed. In polling mode the back-off continues until
+ * the timeout. Unless a fixed budget got configured, the spin budget
+ * follows the average job duration we observed for this action.
+ */
+#define SNAP_WAIT_SPIN_USEC		20	/* Initial busy poll budget */
+#define SNAP_WAIT_SPIN_MIN_USEC		2
+#define SNAP_WAIT_SPIN_MAX_USEC		200
+#define SNAP_WAIT_SLEEP_USEC		1000	/* Back-off before blocking */
+#define SNAP_WAIT_SLEEP_MAX_USEC	256	/* Largest single sleep */
+
+static unsigned long long tget_usec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000ull +
+		(unsigned long long)now.tv_nsec / 1000;
+}
+
+static void snap_wait_init(struct snap_card *card)
+{
+	memset(&card->wait, 0, sizeof(card->wait));
+	card->wait.spin_usec = SNAP_WAIT_SPIN_USEC;
+	card->wait.sleep_usec = SNAP_WAIT_SLEEP_USEC;
+	card->wait.sleep_max_usec = SNAP_WAIT_SLEEP_MAX_USEC;
+	card->wait.tune = true;
+
+	if (wait_spin_usec >= 0) {
+		card->wait.spin_usec = wait_spin_usec;
+		card->wait.tune = false;
+	}
+}
+
+static void snap_wait_tune(struct snap_card *card, unsigned long long dt)
+{
+	struct snap_wait *w = &card->wait;
+
+	if (w->avg_usec == 0)
+		w->avg_usec = dt;
+	else	w->avg_usec = (w->avg_usec * 7 + dt) / 8;
+
+	if (!w->tune)
+		return;
+
+	/* Spin a bit longer than a typical job, but only for short jobs */
+	if (w->avg_usec <= SNAP_WAIT_SPIN_MAX_USEC)
+		w->spin_usec = MIN(w->avg_usec + w->avg_usec / 2 + 1,
+				   (unsigned long long)SNAP_WAIT_SPIN_MAX_USEC);
+	else	w->spin_usec = SNAP_WAIT_SPIN_MIN_USEC;
+}
+
+/* Returns true if the action is done, or the IRQ telling so is there */
+static bool snap_wait_check(struct snap_card *card, bool irq, int *rc,
+			    uint32_t *action_data)
+{
+	if (irq)
+		return df->irq_pending(card);
+
+	*rc = snap_mmio_read32(card, ACTION_CONTROL, action_data);
+	return (*rc != 0) ||
+		((*action_data & ACTION_CONTROL_IDLE) == ACTION_CONTROL_IDLE);
+}
+
+int snap_action_completed_usec(struct snap_action *action, int *rc,
+			       unsigned long timeout_usec)
 {
 	int _rc = 0;
 	uint32_t action_data = 0;
 	struct snap_card *card = (struct snap_card *)action;
-	unsigned long t0;
-	int dt, timeout_ms;
+	struct snap_wait *w = &card->wait;
+	bool irq = (SNAP_ACTION_DONE_IRQ & card->flags);
+	bool done = false;
+	unsigned long long t0, dt = 0;
+	unsigned long sleep_usec = 1;
+	struct timespec ts;
+
+	t0 = tget_usec();
+
+	/* Phase 1: busy poll */
+	while (!done && (dt < w->spin_usec) && (dt < timeout_usec)) {
+		done = snap_wait_check(card, irq, &_rc, &action_data);
+		dt = tget_usec() - t0;
+	}
+	if (done)
+		w->spin_done++;
+
+	/* Phase 2: poll with exponential back-off */
+	while (!done && (dt < timeout_usec) &&
+	       (!irq || (dt < (unsigned long long)w->spin_usec + w->sleep_usec))) {
+		sleep_usec = MIN(sleep_usec, timeout_usec - dt);
+		ts.tv_sec = sleep_usec / 1000000;
+		ts.tv_nsec = (sleep_usec % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+		sleep_usec = MIN(sleep_usec * 2, w->sleep_max_usec);
+
+		done = snap_wait_check(card, irq, &_rc, &action_data);
+		dt = tget_usec() - t0;
+		if (done)
+			w->sleep_done++;
+	}
+
+	if (irq) {
+		bool polled = done;
 
-	if (SNAP_ACTION_DONE_IRQ & card->flags) {
-		hw_wait_irq(card, timeout, SNAP_ACTION_IRQ_NUM);
+		/* Phase 3: block, consumes the pending event in any case */
+		df->wait_irq(card, (dt < timeout_usec) ? timeout_usec - dt : 0,
+			     SNAP_ACTION_IRQ_NUM);
 		snap_mmio_write32(card, ACTION_IRQ_STATUS, ACTION_IRQ_STATUS_DONE);
 		snap_mmio_write32(card, ACTION_IRQ_APP, 0);
 		snap_mmio_write32(card, ACTION_IRQ_CONTROL, ACTION_IRQ_CONTROL_OFF);
 		_rc = snap_mmio_read32(card, ACTION_CONTROL, &action_data);
-	} else {
-		/* Busy poll timout sec */
-		t0 = tget_ms();
-		dt = 0;
-		timeout_ms = timeout * 1000;
-		while (dt < timeout_ms) {
-			_rc = snap_mmio_read32(card, ACTION_CONTROL, &action_data);
-			if ((action_data & ACTION_CONTROL_IDLE) == ACTION_CONTROL_IDLE)
-				break;
-			dt = (int)(tget_ms() - t0);
-		}
+		dt = tget_usec() - t0;
+		/* A wait that timed out only counts in timeouts */
+		if (!polled && (action_data & ACTION_CONTROL_IDLE) ==
+		    ACTION_CONTROL_IDLE)
+			w->irq_done++;
+	}
+
+	done = (action_data & ACTION_CONTROL_IDLE) == ACTION_CONTROL_IDLE;
+	if (done)
+		snap_wait_tune(card, dt);
+	else	w->timeouts++;
+
+	if (snap_stats_enabled) {
+		snap_stats_lat(card->action_type, SNAP_STAT_WAIT, dt * 1000);
+		if (!done)
+			snap_stats_inc(card->action_type, SNAP_STAT_TIMEOUTS);
+		else if (card->job_start_nsec)
+			snap_stats_lat(card->action_type, SNAP_STAT_EXEC,
+				snap_stats_now() - card->job_start_nsec);
+		card->job_start_nsec = 0;
 	}
+
+	poll_trace("%s: done: %d after %lld usec spin: %d usec avg: %lld usec "
+		   "spin/sleep/irq/timeout: %ld/%ld/%ld/%ld\n", __func__,
+		   done, dt, w->spin_usec, w->avg_usec, w->spin_done,
+		   w->sleep_done, w->irq_done, w->timeouts);
 	if (rc)
 		*rc = _rc;
 
 	// Test the rc in calling function for normal or timeout (rc=0) termination
-	return (action_data & ACTION_CONTROL_IDLE) == ACTION_CONTROL_IDLE;
+	return done;
+}
+
+int snap_action_completed(struct snap_action *action, int *rc, int timeout)
+{
+	return snap_action_completed_usec(action, rc, timeout * 1000000UL);
+}
+
+void snap_action_set_wait_budget(struct snap_action *action,
+				 unsigned int spin_usec,
+				 unsigned int sleep_usec)
+{
+	struct snap_card *card = (struct snap_card *)action;
+
+	card->wait.spin_usec = spin_usec;
+	card->wait.sleep_usec = sleep_usec;
+	card->wait.tune = false;
 }
 
 /**
@@ -961,12 +1517,10 @@ int snap_action_sync_execute_job_set_regs(struct snap_action *action,
 				 struct snap_job *cjob)
 {
 	int rc = 0;
-	unsigned int i;
 	struct snap_card *card = (struct snap_card *)action;
 	struct snap_queue_workitem job;
-	uint32_t action_addr;
-	uint32_t *job_data;
 	unsigned int mmio_in, mmio_out;
+	uint64_t t0 = 0;
 
 	/* Size must be less than addr[6] */
 	if (cjob->wout_size > SNAP_JOBSIZE) {
@@ -1015,15 +1569,14 @@ int snap_action_sync_execute_job_set_regs(struct snap_action *action,
 
 	/* Pass action control and job to the action, should be 128
 	   bytes or a little less */
-	job_data = (uint32_t *)(unsigned long)&job;
-	for (i = 0, action_addr = ACTION_PARAMS_IN; i < mmio_in;
-		i++, action_addr += sizeof(uint32_t)) {
-		rc = snap_mmio_write32(card, action_addr, job_data[i]);
-		if (rc != 0)
-			goto __snap_action_sync_execute_job_exit;
-	}
+	if (snap_stats_enabled)
+		t0 = snap_stats_now();
+	rc = snap_mmio_write_regs(card, ACTION_PARAMS_IN,
+				  (uint32_t *)(unsigned long)&job, mmio_in);
+	if (snap_stats_enabled)
+		snap_stats_lat(card->action_type, SNAP_STAT_SET_REGS,
+			       snap_stats_now() - t0);
 
-__snap_action_sync_execute_job_exit:
 	snap_action_stop(action);
 	return rc;
 }
@@ -1043,11 +1596,9 @@ int snap_action_sync_execute_job_check_completion(struct snap_action *action,
 				 unsigned int timeout_sec)
 {
 	int rc;
-	unsigned int i;
 	int completed;
 	struct snap_card *card = (struct snap_card *)action;
 	struct snap_queue_workitem job;
-	uint32_t action_addr;
 	uint32_t *job_data;
 	unsigned int mmio_out;
 
@@ -1057,6 +1608,8 @@ int snap_action_sync_execute_job_check_completion(struct snap_action *action,
 		snap_trace("%s: EIO rc=%d completed=%d\n", __func__,
 			   rc, completed);
 		rc = SNAP_EIO;
+		if (snap_stats_enabled)
+			snap_stats_inc(card->action_type, SNAP_STAT_EIO);
 		goto __snap_action_sync_execute_job_exit;
 	}
 	if (completed == 0) {
@@ -1106,14 +1659,8 @@ int snap_action_sync_execute_job_check_completion(struct snap_action *action,
 	}
 
 	/* No need to read back 0x190, 0x194, 0x198 and 0x19c .... */
-	for (i = 0, action_addr = ACTION_PARAMS_OUT+0x10; i < mmio_out;
-	     i++, action_addr += sizeof(uint32_t)) {
-		rc = snap_mmio_read32(card, action_addr, &job_data[i]);
-		if (rc != 0)
-			goto __snap_action_sync_execute_job_exit;
-		snap_trace("  %s: %d Addr: %x Data: %x\n", __func__, i,
-			   action_addr, job_data[i]);
-	}
+	rc = snap_mmio_read_regs(card, ACTION_PARAMS_OUT + 0x10,
+				 job_data, mmio_out);
 
 __snap_action_sync_execute_job_exit:
 	snap_action_stop(action);
@@ -1182,15 +1729,52 @@ int snap_sync_execute_job(struct snap_card *card,
  * SOFTWARE EMULATION OF FPGA ACTIONS
  *****************************************************************************/
 
+/*
+ * Registered software actions are prototypes. Each card which attaches
+ * to an action type gets its own copy, such that multiple cards or
+ * threads in one process do not share the job registers and state.
+ *
+ * The registry is an open addressing hash table indexed by action type.
+ * Entries are only added or replaced, never removed, which allows
+ * lookups without taking a lock.
+ */
+#define SIM_ACTIONS_BITS	6
+#define SIM_ACTIONS_MAX		(1 << SIM_ACTIONS_BITS)
+
+static struct snap_sim_action *sim_actions[SIM_ACTIONS_MAX];
+
+static inline unsigned int sim_action_hash(snap_action_type_t action_type)
+{
+	return (action_type * 0x9e3779b1u) >> (32 - SIM_ACTIONS_BITS);
+}
+
 int snap_action_register(struct snap_sim_action *new_action)
 {
+	unsigned int i, idx;
+	struct snap_sim_action *a;
+
 	if (new_action == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
-	new_action->next = actions;
-	actions = new_action;
-	return 0;
+
+	idx = sim_action_hash(new_action->action_type);
+	for (i = 0; i < SIM_ACTIONS_MAX; i++) {
+		struct snap_sim_action **slot =
+			&sim_actions[(idx + i) & (SIM_ACTIONS_MAX - 1)];
+
+		a = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+		while ((a == NULL) ||
+		       (a->action_type == new_action->action_type)) {
+			/* Free slot or newer version of the same action */
+			if (__atomic_compare_exchange_n(slot, &a, new_action,
+					false, __ATOMIC_RELEASE,
+					__ATOMIC_ACQUIRE))
+				return 0;
+		}
+	}
+	errno = ENOSPC;
+	return -1;
 }
 
 struct snap_sim_action *snap_card_to_sim_action(struct snap_card *card)
@@ -1198,19 +1782,89 @@ struct snap_sim_action *snap_card_to_sim_action(struct snap_card *card)
 	return card->action;
 }
 
+struct snap_nvme_sim *snap_card_to_nvme_sim(struct snap_card *card)
+{
+	return card->nvme_sim;
+}
+
+struct snap_dram_sim *snap_card_to_dram_sim(struct snap_card *card)
+{
+	struct snap_dram_sim *sim;
+
+	sim = __atomic_load_n(&card->dram_sim, __ATOMIC_ACQUIRE);
+	if (sim)
+		return sim;
+
+	/* SET_SDRAM_SIZE is honoured until the DRAM is first used */
+	pthread_mutex_lock(&card->sim_lock);
+	sim = card->dram_sim;
+	if (sim == NULL) {
+		sim = snap_dram_sim_open(card->sim_card_no,
+					 (card->cap_reg >> 16) & 0xffff);
+		__atomic_store_n(&card->dram_sim, sim, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&card->sim_lock);
+	return sim;
+}
+
 static struct snap_sim_action *find_action(snap_action_type_t action_type)
 {
+	unsigned int i, idx;
 	struct snap_sim_action *a;
 
 	snap_trace("  %s: Searching action_type %x\n", __func__, action_type);
 
-	for (a = actions; a != NULL; a = a->next) {
+	idx = sim_action_hash(action_type);
+	for (i = 0; i < SIM_ACTIONS_MAX; i++) {
+		a = __atomic_load_n(&sim_actions[(idx + i) &
+						 (SIM_ACTIONS_MAX - 1)],
+				    __ATOMIC_ACQUIRE);
+		if (a == NULL)
+			break;
 		if (a->action_type == action_type)
 			return a;
 	}
 	return NULL;
 }
 
+/* Create the per card instance of a registered action */
+static struct snap_sim_action *sim_action_clone(struct snap_sim_action *proto)
+{
+	struct snap_sim_action *a;
+
+	a = malloc(sizeof(*a));
+	if (a == NULL)
+		return NULL;
+
+	*a = *proto;
+	memset(&a->job, 0, sizeof(a->job));
+	a->job.retc = SNAP_RETC_FAILURE;
+	a->state = ACTION_IDLE;
+	return a;
+}
+
+static void sim_action_free(struct snap_card *card)
+{
+	struct snap_sim_action *a = card->action;
+
+	if (a == NULL)
+		return;
+
+	/* A pool worker may still run the action on it, wait for that */
+	pthread_mutex_lock(&card->sim_lock);
+	while (__atomic_load_n(&a->state, __ATOMIC_ACQUIRE) == ACTION_RUNNING) {
+		snap_trace("  %s: Waiting for action %p to finish\n",
+			   __func__, a);
+		pthread_cond_wait(&card->sim_cond, &card->sim_lock);
+	}
+	pthread_mutex_unlock(&card->sim_lock);
+
+	if (a->release)
+		a->release(a);
+	card->action = NULL;
+	__free(a);
+}
+
 static int snap_map_funcs(struct snap_card *card,
 			  snap_action_type_t action_type)
 {
@@ -1220,6 +1874,10 @@ static int snap_map_funcs(struct snap_card *card,
 
 	card->action_type = action_type;
 
+	/* Keep the instance this card already has */
+	if (card->action && (card->action->action_type == action_type))
+		return SNAP_OK;
+
 	/* search action and map in its mmios */
 	a = find_action(action_type);
 	if (a == NULL) {
@@ -1228,15 +1886,22 @@ static int snap_map_funcs(struct snap_card *card,
 		return SNAP_ENOENT;
 	}
 
-	snap_trace("  %s: Action found %p.\n", __func__, a);
-	card->action = a;
+	sim_action_free(card);
+	card->action = sim_action_clone(a);
+	if (card->action == NULL)
+		return SNAP_ENOENT;
+	card->action->card = card;
+
+	snap_trace("  %s: Action found %p instance %p.\n", __func__,
+		   a, card->action);
 	return SNAP_OK;
 }
 
-static void *sw_card_alloc_dev(const char *path __unused,
+static void *sw_card_alloc_dev(const char *path,
 			       uint16_t vendor_id __unused,
 			       uint16_t device_id __unused)
 {
+	unsigned int card_no = 0;
 	struct snap_card *dn;
 
 	dn = calloc(1, sizeof(*dn));
@@ -1247,6 +1912,15 @@ static void *sw_card_alloc_dev(const char *path __unused,
 	dn->vendor_id = vendor_id;
 	dn->device_id = device_id;
 	dn->name = snap_card_id_2_name(vendor_id); /* Makes invalid name */ 
+	pthread_mutex_init(&dn->sim_lock, NULL);
+	pthread_cond_init(&dn->sim_cond, NULL);
+
+	/* Drives of "/dev/cxl/afu<card_no>.0s", see SNAP_NVME_SIM */
+	if (path != NULL)
+		sscanf(path, "/dev/cxl/afu%u", &card_no);
+	dn->nvme_sim = snap_nvme_sim_open(card_no);
+	dn->sim_card_no = card_no;
+	dn->cap_reg = (uint64_t)snap_dram_sim_size_mb() << 16;
 	return (struct snap_card *)dn;
 
  __snap_alloc_err:
@@ -1255,9 +1929,165 @@ static void *sw_card_alloc_dev(const char *path __unused,
 
 static void sw_card_free(struct snap_card *card)
 {
+	if (!card)
+		return;
+
+	sim_action_free(card);
+	snap_nvme_sim_close(card->nvme_sim);
+	snap_dram_sim_close(card->dram_sim);
+	pthread_cond_destroy(&card->sim_cond);
+	pthread_mutex_destroy(&card->sim_lock);
 	__free(card);
 }
 
+/*
+ * Software actions run either inline on the thread which writes
+ * ACTION_CONTROL, or, if SNAP_CONFIG has 0x02 set, on a pool of worker
+ * threads. In the latter case snap_action_start() returns immediately,
+ * ACTION_CONTROL reports RUN until the action is done and completion
+ * is signalled like a hardware action would do it: ACTION_CONTROL goes
+ * IDLE and, if enabled, the action done interrupt is raised.
+ */
+struct sw_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct snap_card *head;         /* Cards with a started action */
+	struct snap_card *tail;
+	unsigned int threads;
+	bool started;
+};
+
+static struct sw_pool sw_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.head = NULL,
+	.tail = NULL,
+	.threads = 0,
+	.started = false,
+};
+
+static void sw_action_run(struct snap_card *card)
+{
+	struct snap_sim_action *a = card->action;
+	struct snap_queue_workitem *w = &a->job;
+
+	/* __hexdump(stdout, &w->user, sizeof(w->user)); */
+	a->main(a, &w->user, sizeof(w->user));
+
+	pthread_mutex_lock(&card->sim_lock);
+	__atomic_store_n(&a->state, ACTION_IDLE, __ATOMIC_RELEASE);
+	if (SNAP_ACTION_DONE_IRQ & card->flags)
+		__atomic_store_n(&card->sim_irq, true, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&card->sim_cond);
+	pthread_mutex_unlock(&card->sim_lock);
+}
+
+static void *sw_pool_worker(void *arg __unused)
+{
+	struct snap_card *card;
+
+	while (1) {
+		pthread_mutex_lock(&sw_pool.lock);
+		while (sw_pool.head == NULL)
+			pthread_cond_wait(&sw_pool.cond, &sw_pool.lock);
+		card = sw_pool.head;
+		sw_pool.head = card->sim_next;
+		if (sw_pool.head == NULL)
+			sw_pool.tail = NULL;
+		pthread_mutex_unlock(&sw_pool.lock);
+
+		sim_trace("  %s: running action %p for card %p\n", __func__,
+			  card->action, card);
+		sw_action_run(card);
+	}
+	return NULL;
+}
+
+/* Start the worker threads on first use, must hold sw_pool.lock */
+static int sw_pool_start(void)
+{
+	unsigned int i;
+	pthread_t tid;
+	const char *threads_env;
+	long threads = 0;
+
+	threads_env = getenv("SNAP_SIM_THREADS");
+	if (threads_env != NULL)
+		threads = strtol(threads_env, (char **)NULL, 0);
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+
+	for (i = 0; i < (unsigned int)threads; i++) {
+		if (pthread_create(&tid, NULL, &sw_pool_worker, NULL) != 0)
+			break;
+		pthread_detach(tid);
+	}
+	if (i == 0)
+		return -1;
+
+	sim_trace("  %s: %d worker threads\n", __func__, i);
+	sw_pool.threads = i;
+	sw_pool.started = true;
+	return 0;
+}
+
+static int sw_pool_submit(struct snap_card *card)
+{
+	pthread_mutex_lock(&sw_pool.lock);
+	if (!sw_pool.started && (sw_pool_start() != 0)) {
+		pthread_mutex_unlock(&sw_pool.lock);
+		return -1;
+	}
+	card->sim_next = NULL;
+	if (sw_pool.tail)
+		sw_pool.tail->sim_next = card;
+	else	sw_pool.head = card;
+	sw_pool.tail = card;
+	pthread_cond_signal(&sw_pool.cond);
+	pthread_mutex_unlock(&sw_pool.lock);
+	return 0;
+}
+
+static int sw_irq_pending(struct snap_card *card)
+{
+	return __atomic_load_n(&card->sim_irq, __ATOMIC_ACQUIRE);
+}
+
+static int sw_wait_irq(struct snap_card *card, unsigned long timeout_usec,
+		       int expect_irq)
+{
+	int rc = 0;
+	struct timespec ts;
+
+	/* Software actions are attached without the job manager */
+	if (expect_irq != SNAP_ACTION_IRQ_NUM)
+		return 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_usec / 1000000;
+	ts.tv_nsec += (timeout_usec % 1000000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&card->sim_lock);
+	while (!card->sim_irq && (rc == 0))
+		rc = pthread_cond_timedwait(&card->sim_cond, &card->sim_lock, &ts);
+	if (card->sim_irq) {
+		card->sim_irq = false;
+		rc = 0;
+	} else {
+		snap_trace("    Timeout......\n");
+		rc = EBUSY;
+	}
+	pthread_mutex_unlock(&card->sim_lock);
+
+	return rc;
+}
+
 static int sw_mmio_write32(struct snap_card *card,
 			   uint64_t offs, uint32_t data)
 {
@@ -1278,19 +2108,31 @@ static int sw_mmio_write32(struct snap_card *card,
 	}
 	w = &a->job;
 
+	if ((offs == ACTION_CONTROL) && a->start)
+		return a->start(card);
+
 	if (offs == ACTION_CONTROL) {
+		if (__atomic_load_n(&a->state, __ATOMIC_ACQUIRE) ==
+		    ACTION_RUNNING) {
+			snap_trace("  action already running!!\n");
+			return 0;
+		}
 		snap_trace("  starting action!!\n");
-		a->state = ACTION_RUNNING;
-		/* __hexdump(stdout, &w->user, sizeof(w->user)); */
-		a->main(a, &w->user, sizeof(w->user));
-		a->state = ACTION_IDLE;
+		pthread_mutex_lock(&card->sim_lock);
+		card->sim_irq = false;
+		__atomic_store_n(&a->state, ACTION_RUNNING, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&card->sim_lock);
 
+		if (software_async_enabled() && (sw_pool_submit(card) == 0))
+			return 0;
+
+		sw_action_run(card);
 		return 0;
 	}
 
 	if ((offs >= ACTION_PARAMS_IN) &&
 	    (offs < ACTION_PARAMS_IN + CACHELINE_BYTES)) {
-		((uint32_t *)&a->job)[(offs - ACTION_PARAMS_IN)/4] = data;
+		((uint32_t *)w)[(offs - ACTION_PARAMS_IN)/4] = data;
 	}
 
 	if (a->mmio_write32)
@@ -1320,7 +2162,7 @@ static int sw_mmio_read32(struct snap_card *card,
 
 	switch (offs) {
 	case ACTION_CONTROL:
-		switch (a->state) {
+		switch (__atomic_load_n(&a->state, __ATOMIC_ACQUIRE)) {
 		case ACTION_IDLE:
 			*data = ACTION_CONTROL_IDLE; break;
 		case ACTION_RUNNING:
@@ -1376,6 +2218,63 @@ static int sw_mmio_read64(struct snap_card *card,
 	return rc;
 }
 
+/* Register window access: copy directly from/to the action's workitem */
+static int sw_mmio_write_regs(struct snap_card *card, uint64_t offs,
+			      const uint32_t *data, unsigned int words)
+{
+	int rc = 0;
+	unsigned int i;
+	struct snap_sim_action *a = card->action;
+
+	if (a == NULL) {
+		errno = EFAULT;
+		return -1;
+	}
+	if ((offs < ACTION_PARAMS_IN) || (offs + words * sizeof(uint32_t) >
+					  ACTION_PARAMS_IN + CACHELINE_BYTES)) {
+		for (i = 0; (i < words) && (rc == 0); i++)
+			rc = sw_mmio_write32(card, offs + i * sizeof(uint32_t),
+					     data[i]);
+		return rc;
+	}
+
+	snap_trace("  %s(%p, %llx, %d words) a=%p\n", __func__, card,
+		   (long long)offs, words, a);
+	memcpy((uint8_t *)&a->job + (offs - ACTION_PARAMS_IN), data,
+	       words * sizeof(uint32_t));
+	if (a->mmio_write32)
+		for (i = 0; (i < words) && (rc == 0); i++)
+			rc = a->mmio_write32(card, offs + i * sizeof(uint32_t),
+					     data[i]);
+	return rc;
+}
+
+static int sw_mmio_read_regs(struct snap_card *card, uint64_t offs,
+			     uint32_t *data, unsigned int words)
+{
+	int rc = 0;
+	unsigned int i;
+	struct snap_sim_action *a = card->action;
+
+	if (a == NULL) {
+		errno = EFAULT;
+		return -1;
+	}
+	if ((offs < ACTION_PARAMS_OUT) || (offs + words * sizeof(uint32_t) >
+					   ACTION_PARAMS_OUT + sizeof(a->job))) {
+		for (i = 0; (i < words) && (rc == 0); i++)
+			rc = sw_mmio_read32(card, offs + i * sizeof(uint32_t),
+					    &data[i]);
+		return rc;
+	}
+
+	memcpy(data, (uint8_t *)&a->job + (offs - ACTION_PARAMS_OUT),
+	       words * sizeof(uint32_t));
+	snap_trace("  %s(%p, %llx, %d words) a=%p\n", __func__, card,
+		   (long long)offs, words, a);
+	return rc;
+}
+
 static struct snap_action *sw_attach_action(struct snap_card *card,
 					    snap_action_type_t action_type,
 					    snap_action_flag_t action_flags,
@@ -1384,6 +2283,7 @@ static struct snap_action *sw_attach_action(struct snap_card *card,
 	snap_trace("  %s(%p, %x %d %d)\n", __func__,
 		   card, action_type, action_flags, timeout_ms);
 
+	card->flags = action_flags;    /* Save Flags */
 	return (struct snap_action *)card;
 }
 
@@ -1408,10 +2308,10 @@ static int sw_card_ioctl(struct snap_card *card, unsigned int cmd, unsigned long
 		*arg = 255;    /* Some Unknown */
 		break;
 	case GET_NVME_ENABLED:
-		*arg  = 0;     /* No NVME in SW Mode */
+		*arg = (card->nvme_sim != NULL); /* See SNAP_NVME_SIM */
 		break;
 	case GET_SDRAM_SIZE:
-		*arg = 0;      /* No Card Ram in SW Mode */
+		*arg = (card->cap_reg >> 16) & 0xffff; /* See SNAP_DRAM_SIM */
 		break;
 	case GET_DMA_ALIGN:
 		*arg = 1 << 6; /* 64 Bytes Aligned */
@@ -1444,6 +2344,10 @@ static struct snap_funcs software_funcs = {
 	.mmio_read64 = sw_mmio_read64,
 	.card_free = sw_card_free,
 	.card_ioctl = sw_card_ioctl,
+	.wait_irq = sw_wait_irq,
+	.irq_pending = sw_irq_pending,
+	.mmio_write_regs = sw_mmio_write_regs,
+	.mmio_read_regs = sw_mmio_read_regs,
 };
 
 /**********************************************************************
@@ -1456,16 +2360,27 @@ static void _init(void)
 {
 	const char *trace_env;
 	const char *config_env;
+	const char *spin_env;
 
 	trace_env = getenv("SNAP_TRACE");
 	if (trace_env != NULL)
 		snap_trace = strtol(trace_env, (char **)NULL, 0);
 
+	snap_stats_init();
+	snap_btrace_init();
+
+	spin_env = getenv("SNAP_POLL_SPIN_USEC");
+	if (spin_env != NULL)
+		wait_spin_usec = strtol(spin_env, (char **)NULL, 0);
+
 	config_env = getenv("SNAP_CONFIG");
 	if (config_env != NULL) {
 		if ( (strcmp(config_env, "FPGA") == 0) ||
 			(strcmp(config_env, "fpga") == 0) )
 			snap_config = 0x0;
+		else if ( (strcmp(config_env, "CPU_ASYNC") == 0) ||
+			(strcmp(config_env, "cpu_async") == 0) )
+			snap_config = 0x3;
 		else if ( (strcmp(config_env, "CPU") == 0) ||
 			(strcmp(config_env, "cpu") == 0) )
 			snap_config = 0x1;
@@ -1474,6 +2389,9 @@ static void _init(void)
 		}
 	}
 
-	if (software_action_enabled())
+	if (software_action_enabled()) {
 		df = &software_funcs; /* Map Software Functions */
+		snap_nvme_sim_init();
+		snap_dram_sim_init();
+	}
 }
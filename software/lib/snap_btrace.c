@@ -0,0 +1,414 @@
+/**
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Binary tracing for block_trace, cache_trace, stat_trace and pp_trace.
+ *
+ * If SNAP_TRACE_FILE is set, the trace macros do not format anything.
+ * Each trace point registers its format string once and then only
+ * stores a timestamp, its id and the raw arguments in a ring buffer
+ * owned by the calling thread. A background thread copies the rings
+ * into the trace file. Events are dropped and counted if a ring is full
+ * or their format could not be registered.
+ * A thread's ring is flushed and freed when the thread exits.
+ * Use snap_trace_decode to turn the file into text or Chrome trace JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <snap_internal.h>
+#include <snap_btrace.h>
+
+#define BTRACE_FMTS_MAX		1024
+#define BTRACE_RING_SIZE	(1024 * 1024)	/* Default, per thread */
+#define BTRACE_FLUSH_USEC	10000
+
+struct btrace_fmt_info {
+	char cat;
+	const char *fmt;
+	unsigned int nargs;
+	uint8_t arg[BTRACE_ARGS_MAX];
+};
+
+struct btrace_ring {
+	struct btrace_ring *next;
+	uint32_t tid;
+	uint32_t dropped;	/* Written by the owner */
+	uint32_t dropped_seen;	/* Written by the flusher */
+	uint64_t head;		/* Bytes produced, written by the owner */
+	uint64_t tail;		/* Bytes consumed, written by the flusher */
+	uint8_t *buf;
+};
+
+static int btrace_fd = -1;
+static size_t btrace_ring_size = BTRACE_RING_SIZE;
+
+static pthread_mutex_t btrace_fmt_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct btrace_fmt_info btrace_fmts[BTRACE_FMTS_MAX];
+static unsigned int btrace_nfmts = 1;	/* id 0 means not registered */
+
+static pthread_mutex_t btrace_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int btrace_fmts_flushed = 1;
+static struct btrace_ring *btrace_rings = NULL;	/* Under btrace_flush_lock */
+static pthread_key_t btrace_key;
+static pthread_once_t btrace_key_once = PTHREAD_ONCE_INIT;
+static __thread struct btrace_ring *btrace_self = NULL;
+
+static inline uint64_t btrace_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+int snap_btrace_enabled(void)
+{
+	return btrace_fd >= 0;
+}
+
+uint16_t snap_btrace_register(char cat, const char *fmt)
+{
+	int nargs;
+	uint16_t id = SNAP_BTRACE_ID_NONE;
+	struct btrace_fmt_info *f;
+
+	pthread_mutex_lock(&btrace_fmt_lock);
+	if (btrace_nfmts == BTRACE_FMTS_MAX)
+		goto out;
+
+	f = &btrace_fmts[btrace_nfmts];
+	nargs = btrace_parse_fmt(fmt, f->arg, ARRAY_SIZE(f->arg));
+	if (nargs < 0)
+		goto out;
+	f->cat = cat;
+	f->fmt = fmt;
+	f->nargs = nargs;
+
+	id = btrace_nfmts;
+	__atomic_store_n(&btrace_nfmts, btrace_nfmts + 1, __ATOMIC_RELEASE);
+ out:
+	pthread_mutex_unlock(&btrace_fmt_lock);
+	if (id == SNAP_BTRACE_ID_NONE)
+		fprintf(stderr, "err: trace format not registered, its events "
+			"count as dropped: %s", fmt);
+	return id;
+}
+
+static void btrace_flush_fmts(void);
+static void btrace_flush_ring(struct btrace_ring *r);
+
+/* Thread exit: write out what is left in the ring, then free it */
+static void btrace_ring_exit(void *arg)
+{
+	struct btrace_ring **p, *r = arg;
+
+	pthread_mutex_lock(&btrace_flush_lock);
+	btrace_flush_fmts();
+	btrace_flush_ring(r);
+	for (p = &btrace_rings; *p != NULL; p = &(*p)->next)
+		if (*p == r) {
+			*p = r->next;
+			break;
+		}
+	pthread_mutex_unlock(&btrace_flush_lock);
+
+	free(r->buf);
+	free(r);
+	btrace_self = NULL;
+}
+
+static void btrace_key_init(void)
+{
+	if (pthread_key_create(&btrace_key, btrace_ring_exit) != 0)
+		fprintf(stderr, "err: no trace key, thread rings leak\n");
+}
+
+static struct btrace_ring *btrace_ring_get(void)
+{
+	struct btrace_ring *r = btrace_self;
+
+	if (r)
+		return r;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+	r->buf = malloc(btrace_ring_size);
+	if (r->buf == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->tid = __gettid();
+	pthread_once(&btrace_key_once, btrace_key_init);
+	pthread_setspecific(btrace_key, r);
+
+	pthread_mutex_lock(&btrace_flush_lock);
+	r->next = btrace_rings;
+	btrace_rings = r;
+	pthread_mutex_unlock(&btrace_flush_lock);
+	btrace_self = r;
+	return r;
+}
+
+void snap_btrace(uint16_t id, ...)
+{
+	va_list ap;
+	unsigned int i, len, offs;
+	uint64_t tail, v;
+	double d;
+	const char *s;
+	size_t slen;
+	struct btrace_fmt_info *f;
+	struct btrace_ring *r;
+	struct btrace_event *e;
+	uint8_t rec[BTRACE_EVENT_MAX] __attribute__((aligned(8)));
+
+	r = btrace_ring_get();
+	if (r == NULL)
+		return;
+	/* Format not registered, the decoder could not show the event */
+	if (id >= __atomic_load_n(&btrace_nfmts, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	f = &btrace_fmts[id];
+	e = (struct btrace_event *)rec;
+	e->nsec = btrace_now();
+	e->id = id;
+	e->reserved = 0;
+	len = sizeof(*e);
+
+	va_start(ap, id);
+	for (i = 0; i < f->nargs; i++) {
+		switch (f->arg[i]) {
+		case BTRACE_ARG_INT:
+			v = (uint64_t)(int64_t)va_arg(ap, int);
+			break;
+		case BTRACE_ARG_LONG:
+			v = (uint64_t)va_arg(ap, long long);
+			break;
+		case BTRACE_ARG_PTR:
+			v = (uint64_t)(uintptr_t)va_arg(ap, void *);
+			break;
+		case BTRACE_ARG_DOUBLE:
+			d = va_arg(ap, double);
+			memcpy(&v, &d, sizeof(v));
+			break;
+		case BTRACE_ARG_STR:
+		default:
+			s = va_arg(ap, const char *);
+			if (s == NULL)
+				s = "(null)";
+			slen = strnlen(s, BTRACE_STR_MAX);
+			/* Leave room for the other args and padding */
+			slen = MIN(slen, sizeof(rec) - len - sizeof(uint16_t) -
+				   (f->nargs - i) * sizeof(uint64_t));
+			*(uint16_t *)(rec + len) = (uint16_t)slen;
+			memcpy(rec + len + sizeof(uint16_t), s, slen);
+			len += sizeof(uint16_t) + slen;
+			continue;
+		}
+		memcpy(rec + len, &v, sizeof(v));
+		len += sizeof(v);
+	}
+	va_end(ap);
+
+	/* Pad to 8 bytes */
+	while (len & 7)
+		rec[len++] = 0;
+	e->len = len;
+
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (btrace_ring_size - (r->head - tail) < len) {
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	offs = r->head % btrace_ring_size;
+	if (offs + len <= btrace_ring_size)
+		memcpy(r->buf + offs, rec, len);
+	else {
+		memcpy(r->buf + offs, rec, btrace_ring_size - offs);
+		memcpy(r->buf, rec + btrace_ring_size - offs,
+		       len - (btrace_ring_size - offs));
+	}
+	__atomic_store_n(&r->head, r->head + len, __ATOMIC_RELEASE);
+}
+
+static int btrace_write(const void *data, size_t len)
+{
+	ssize_t rc;
+	const uint8_t *p = data;
+
+	while (len) {
+		rc = write(btrace_fd, p, len);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+static void btrace_flush_fmts(void)
+{
+	unsigned int i, nfmts;
+	struct btrace_chunk c;
+	struct btrace_fmt f;
+	size_t flen;
+
+	nfmts = __atomic_load_n(&btrace_nfmts, __ATOMIC_ACQUIRE);
+	for (i = btrace_fmts_flushed; i < nfmts; i++) {
+		flen = strlen(btrace_fmts[i].fmt) + 1;
+		c.type = BTRACE_CHUNK_FMT;
+		c.len = sizeof(f) + flen;
+		c.tid = 0;
+		c.dropped = 0;
+		f.id = i;
+		f.cat = btrace_fmts[i].cat;
+		f.reserved = 0;
+
+		btrace_write(&c, sizeof(c));
+		btrace_write(&f, sizeof(f));
+		btrace_write(btrace_fmts[i].fmt, flen);
+	}
+	btrace_fmts_flushed = nfmts;
+}
+
+static void btrace_flush_ring(struct btrace_ring *r)
+{
+	uint64_t head, tail;
+	uint32_t dropped;
+	size_t len, offs;
+	struct btrace_chunk c;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	tail = r->tail;
+	dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	if ((head == tail) && (dropped == r->dropped_seen))
+		return;
+
+	len = head - tail;
+	c.type = BTRACE_CHUNK_EVENTS;
+	c.len = len;
+	c.tid = r->tid;
+	c.dropped = dropped - r->dropped_seen;
+	btrace_write(&c, sizeof(c));
+
+	offs = tail % btrace_ring_size;
+	if (offs + len <= btrace_ring_size)
+		btrace_write(r->buf + offs, len);
+	else {
+		btrace_write(r->buf + offs, btrace_ring_size - offs);
+		btrace_write(r->buf, len - (btrace_ring_size - offs));
+	}
+
+	r->dropped_seen = dropped;
+	__atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+}
+
+static void btrace_flush(void)
+{
+	struct btrace_ring *r;
+
+	pthread_mutex_lock(&btrace_flush_lock);
+	/* Formats first, every event we see was registered before */
+	btrace_flush_fmts();
+	for (r = btrace_rings; r != NULL; r = r->next)
+		btrace_flush_ring(r);
+	pthread_mutex_unlock(&btrace_flush_lock);
+}
+
+static void *btrace_flush_thread(void *arg __unused)
+{
+	struct timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = BTRACE_FLUSH_USEC * 1000,
+	};
+
+	while (1) {
+		nanosleep(&ts, NULL);
+		btrace_flush();
+	}
+	return NULL;
+}
+
+static void btrace_exit(void)
+{
+	btrace_flush();
+}
+
+void snap_btrace_init(void)
+{
+	int fd;
+	pthread_t tid;
+	const char *env;
+	struct btrace_file_hdr hdr;
+	size_t size;
+
+	env = getenv("SNAP_TRACE_FILE");
+	if (env == NULL)
+		return;
+
+	fd = open(env, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "err: cannot open trace file %s: %s\n",
+			env, strerror(errno));
+		return;
+	}
+
+	/* SNAP_TRACE_BUFSIZE in KiB, rounded down to a power of 2 */
+	env = getenv("SNAP_TRACE_BUFSIZE");
+	if (env != NULL) {
+		size = strtoul(env, (char **)NULL, 0) * 1024;
+		if (size >= 2 * BTRACE_EVENT_MAX) {
+			btrace_ring_size = 1;
+			while (btrace_ring_size * 2 <= size)
+				btrace_ring_size *= 2;
+		}
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = BTRACE_MAGIC;
+	hdr.pid = getpid();
+	hdr.start_nsec = btrace_now();
+
+	btrace_fd = fd;
+	if (btrace_write(&hdr, sizeof(hdr)) < 0) {
+		btrace_fd = -1;
+		close(fd);
+		return;
+	}
+
+	atexit(btrace_exit);
+	if (pthread_create(&tid, NULL, &btrace_flush_thread, NULL) == 0)
+		pthread_detach(tid);
+}
@@ -0,0 +1,293 @@
+/**
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Emulated card DRAM for the software actions.
+ *
+ * The DRAM of card n is a sparse file, mapped shared into the process.
+ * Only pages which were written take space, every action of the card
+ * addresses the same memory and the content stays for the next process,
+ * like on a card which keeps its DRAM between two jobs. SNAP_DRAM_SIM is
+ * a ',' separated list of file names, entry n for card n. The default is
+ * DRAM_SIM_FILE in the current directory. The size is what
+ * GET_SDRAM_SIZE reports, it is fixed once the memory is first used.
+ *
+ * Copies from and to the card DRAM take at least as long as
+ * SNAP_DRAM_SIM_MBPS allows, all copies of a card share the bandwidth.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libsnap.h>
+#include <snap_tools.h>
+#include <snap_internal.h>
+#include "snap_dram_sim.h"
+
+#define DRAM_SIM_CARDS_MAX	8
+#define DRAM_SIM_FILE		"snap_card%u_dram.bin"
+#define DRAM_SIM_SIZE_MB	4096	/* Default for GET_SDRAM_SIZE */
+
+struct snap_dram_sim {
+	unsigned int card_no;
+	unsigned int users;
+	int fd;
+	uint8_t *mem;
+	uint64_t size;
+
+	pthread_mutex_t lock;
+	uint64_t link_free_nsec;	/* Earlier copies done by then */
+	unsigned long copies;
+	uint64_t bytes;
+};
+
+static char *dram_sim_names[DRAM_SIM_CARDS_MAX];
+static unsigned int dram_sim_ncards = 0;
+static unsigned long dram_sim_size_mb = DRAM_SIM_SIZE_MB;
+static unsigned int dram_sim_mbps = 0;		/* 0: no limit */
+
+static pthread_mutex_t dram_sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snap_dram_sim *dram_sims[DRAM_SIM_CARDS_MAX];
+
+static inline uint64_t dram_sim_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+unsigned long snap_dram_sim_size_mb(void)
+{
+	return dram_sim_size_mb;
+}
+
+struct snap_dram_sim *snap_dram_sim_open(unsigned int card_no,
+					 unsigned long size_mb)
+{
+	char fname[128];
+	const char *name;
+	struct stat st;
+	struct snap_dram_sim *sim;
+
+	if ((card_no >= DRAM_SIM_CARDS_MAX) || (size_mb == 0)) {
+		errno = ENODEV;
+		return NULL;
+	}
+	if ((card_no < dram_sim_ncards) && *dram_sim_names[card_no])
+		name = dram_sim_names[card_no];
+	else {
+		snprintf(fname, sizeof(fname), DRAM_SIM_FILE, card_no);
+		name = fname;
+	}
+
+	pthread_mutex_lock(&dram_sim_lock);
+	sim = dram_sims[card_no];
+	if (sim) {
+		sim->users++;
+		goto out;
+	}
+
+	sim = calloc(1, sizeof(*sim));
+	if (sim == NULL)
+		goto out;
+
+	sim->card_no = card_no;
+	sim->users = 1;
+	sim->size = (uint64_t)size_mb * 1024 * 1024;
+	sim->fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (sim->fd < 0) {
+		fprintf(stderr, "err: cannot open card DRAM file %s: %s\n",
+			name, strerror(errno));
+		goto out_free;
+	}
+
+	/* Sparse, grows only, the content of a smaller card stays */
+	if ((fstat(sim->fd, &st) < 0) ||
+	    (((uint64_t)st.st_size < sim->size) &&
+	     (ftruncate(sim->fd, sim->size) < 0))) {
+		fprintf(stderr, "err: cannot size card DRAM file %s: %s\n",
+			name, strerror(errno));
+		goto out_close;
+	}
+
+	sim->mem = mmap(NULL, sim->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_NORESERVE, sim->fd, 0);
+	if (sim->mem == MAP_FAILED) {
+		fprintf(stderr, "err: cannot map card DRAM file %s: %s\n",
+			name, strerror(errno));
+		goto out_close;
+	}
+
+	pthread_mutex_init(&sim->lock, NULL);
+	act_trace("  %s: card %u %s %lu MiB %u MB/s\n", __func__, card_no,
+		  name, size_mb, dram_sim_mbps);
+	dram_sims[card_no] = sim;
+	goto out;
+
+ out_close:
+	close(sim->fd);
+ out_free:
+	free(sim);
+	sim = NULL;
+ out:
+	pthread_mutex_unlock(&dram_sim_lock);
+	return sim;
+}
+
+void snap_dram_sim_close(struct snap_dram_sim *sim)
+{
+	if (sim == NULL)
+		return;
+
+	pthread_mutex_lock(&dram_sim_lock);
+	if (--sim->users) {
+		pthread_mutex_unlock(&dram_sim_lock);
+		return;
+	}
+	dram_sims[sim->card_no] = NULL;
+	pthread_mutex_unlock(&dram_sim_lock);
+
+	act_trace("  %s: card %u copies=%lu bytes=%lld\n", __func__,
+		  sim->card_no, sim->copies, (long long)sim->bytes);
+
+	munmap(sim->mem, sim->size);
+	close(sim->fd);
+	pthread_mutex_destroy(&sim->lock);
+	free(sim);
+}
+
+/* Translate a job address, NULL with errno set if it is not valid */
+static void *sim_addr(struct snap_sim_action *action, uint64_t addr,
+		      uint64_t size, snap_addrtype_t type)
+{
+	struct snap_dram_sim *sim;
+
+	switch (type) {
+	case SNAP_ADDRTYPE_HOST_DRAM:
+		return (void *)(unsigned long)addr;
+	case SNAP_ADDRTYPE_CARD_DRAM:
+		sim = snap_card_to_dram_sim(action->card);
+		if (sim == NULL)
+			return NULL;
+		if ((addr > sim->size) || (size > sim->size - addr)) {
+			act_trace("  %s: %llx+%llx not in card DRAM\n",
+				  __func__, (long long)addr, (long long)size);
+			errno = EFAULT;
+			return NULL;
+		}
+		return sim->mem + addr;
+	default:
+		errno = EINVAL;
+		return NULL;
+	}
+}
+
+void *snap_sim_addr(struct snap_sim_action *action, const struct snap_addr *a)
+{
+	return sim_addr(action, a->addr, a->size, a->type);
+}
+
+/* Delay the caller until the card has copied size bytes */
+static void dram_sim_throttle(struct snap_dram_sim *sim, size_t size)
+{
+	uint64_t now, due;
+	struct timespec ts;
+
+	pthread_mutex_lock(&sim->lock);
+	sim->copies++;
+	sim->bytes += size;
+	if (dram_sim_mbps == 0) {
+		pthread_mutex_unlock(&sim->lock);
+		return;
+	}
+	now = dram_sim_now();
+	due = MAX(now, sim->link_free_nsec) +
+		(uint64_t)size * 1000 / dram_sim_mbps;	/* MB/s: B/usec */
+	sim->link_free_nsec = due;
+	pthread_mutex_unlock(&sim->lock);
+
+	if (due <= now)
+		return;
+	ts.tv_sec = due / 1000000000ull;
+	ts.tv_nsec = due % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+int snap_sim_memcpy(struct snap_sim_action *action,
+		    const struct snap_addr *dst, const struct snap_addr *src,
+		    size_t size)
+{
+	void *d, *s;
+
+	if (size == 0)
+		return 0;
+
+	d = sim_addr(action, dst->addr, size, dst->type);
+	s = sim_addr(action, src->addr, size, src->type);
+	if ((d == NULL) || (s == NULL))
+		return -1;
+
+	act_trace("  %s: copy %p to %p %lld bytes\n", __func__, s, d,
+		  (long long)size);
+	memmove(d, s, size);
+
+	if ((dst->type == SNAP_ADDRTYPE_CARD_DRAM) ||
+	    (src->type == SNAP_ADDRTYPE_CARD_DRAM))
+		dram_sim_throttle(snap_card_to_dram_sim(action->card), size);
+	return 0;
+}
+
+void snap_dram_sim_init(void)
+{
+	char *names, *s, *save = NULL;
+	const char *env;
+
+	env = getenv("SNAP_DRAM_SIM");
+	if (env != NULL) {
+		names = strdup(env);
+		/* strtok would skip empty entries, cards using the default */
+		for (s = names; (s != NULL) &&
+			     (dram_sim_ncards < DRAM_SIM_CARDS_MAX); s = save) {
+			save = strchr(s, ',');
+			if (save)
+				*save++ = 0;
+			dram_sim_names[dram_sim_ncards++] = s;
+		}
+	}
+
+	env = getenv("SNAP_DRAM_SIM_SIZE");
+	if (env != NULL)
+		dram_sim_size_mb = strtoul(env, (char **)NULL, 0);
+	if (dram_sim_size_mb > 0xffff)	/* 16 bits in the capability reg */
+		dram_sim_size_mb = 0xffff;
+
+	env = getenv("SNAP_DRAM_SIM_MBPS");
+	if (env != NULL)
+		dram_sim_mbps = strtoul(env, (char **)NULL, 0);
+}
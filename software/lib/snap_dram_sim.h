@@ -0,0 +1,45 @@
+/**
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __SNAP_DRAM_SIM_H__
+#define __SNAP_DRAM_SIM_H__
+
+#include <snap_internal.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct snap_dram_sim;
+
+/* Called from library initialization, reads SNAP_DRAM_SIM* */
+void snap_dram_sim_init(void);
+
+/* DRAM size in MiB a card starts with */
+unsigned long snap_dram_sim_size_mb(void);
+
+struct snap_dram_sim *snap_dram_sim_open(unsigned int card_no,
+					 unsigned long size_mb);
+void snap_dram_sim_close(struct snap_dram_sim *sim);
+
+/* In snap.c, maps the DRAM on first use */
+struct snap_dram_sim *snap_card_to_dram_sim(struct snap_card *card);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* __SNAP_DRAM_SIM_H__ */
@@ -0,0 +1,510 @@
+/**
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Emulated NVMe drives for the software actions.
+ *
+ * SNAP_NVME_SIM is a ',' separated list of files or block devices,
+ * entry n holds the drives of card n. Drive 0 uses the lower half,
+ * drive 1 the upper half. With SNAP_NVME_SIM_DIRECT=1 they are opened
+ * with O_DIRECT, such that the page cache does not hide the device.
+ *
+ * Each card has one drive thread. It does the transfer right away and
+ * completes the request once it is due: transfers of a drive share its
+ * bandwidth and are serialized, the latency of the profile is added on
+ * top and overlaps with other requests, like it does on a real drive
+ * with a deep queue. If the backing store is slower, requests complete
+ * when the transfer is done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>		/* BLKGETSIZE64 */
+
+#include <snap_tools.h>
+#include <snap_internal.h>
+#include "snap_nvme_sim.h"
+
+#define NVME_SIM_CARDS_MAX	8
+#define NVME_SIM_SIZE_GIB	4	/* Size of a new, empty file */
+#define NVME_SIM_SPIN_NSEC	20000	/* Busy wait if due earlier */
+#define NVME_SIM_ALIGN		4096	/* O_DIRECT buffer alignment */
+
+struct nvme_sim_profile {
+	const char *name;
+	unsigned int read_usec;
+	unsigned int write_usec;
+	unsigned int read_mbps;		/* 0: no limit */
+	unsigned int write_mbps;
+};
+
+static const struct nvme_sim_profile nvme_sim_profiles[] = {
+	{ .name = "NONE",   .read_usec =   0, .write_usec =  0,
+	  .read_mbps =    0, .write_mbps =    0 },
+	{ .name = "NVME",   .read_usec =  80, .write_usec = 20,
+	  .read_mbps = 3000, .write_mbps = 2000 },
+	{ .name = "SATA",   .read_usec = 120, .write_usec = 60,
+	  .read_mbps =  530, .write_mbps =  500 },
+	{ .name = "OPTANE", .read_usec =  10, .write_usec = 10,
+	  .read_mbps = 2500, .write_mbps = 2200 },
+};
+
+struct nvme_sim_drive {
+	uint64_t offset;		/* Bytes into the backing store */
+	uint64_t nblocks;
+	uint64_t link_free_nsec;	/* Earlier transfers done by then */
+};
+
+struct snap_nvme_sim {
+	unsigned int card_no;
+	unsigned int users;
+	int fd;
+	struct nvme_sim_drive drive[SNAP_NVME_SIM_DRIVES];
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct snap_nvme_sim_req *head;		/* Submitted */
+	struct snap_nvme_sim_req *tail;
+	struct snap_nvme_sim_req *pending;	/* Transferred, by due time */
+	bool stopping;
+	pthread_t tid;
+
+	void *bounce;				/* Unaligned O_DIRECT buffers */
+	size_t bounce_size;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long errors;
+};
+
+static struct nvme_sim_profile nvme_sim_prof;
+static char *nvme_sim_names[NVME_SIM_CARDS_MAX];
+static unsigned int nvme_sim_ncards = 0;
+static uint64_t nvme_sim_size = 0;	/* 0: keep the size of the file */
+static bool nvme_sim_direct = false;
+
+static pthread_mutex_t nvme_sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snap_nvme_sim *nvme_sims[NVME_SIM_CARDS_MAX];
+
+static inline uint64_t nvme_sim_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static int nvme_sim_io(struct snap_nvme_sim *sim,
+		       struct snap_nvme_sim_req *req)
+{
+	ssize_t rc;
+	size_t done = 0;
+	uint8_t *p = req->buf;
+	off_t offs = sim->drive[req->drive].offset +
+		req->lba * SNAP_NVME_SIM_LB_SIZE;
+
+	if (nvme_sim_direct && ((uintptr_t)p & (NVME_SIM_ALIGN - 1))) {
+		if (sim->bounce_size < req->size) {
+			free(sim->bounce);
+			sim->bounce_size = 0;
+			if (posix_memalign(&sim->bounce, NVME_SIM_ALIGN,
+					   req->size) != 0) {
+				sim->bounce = NULL;
+				return ENOMEM;
+			}
+			sim->bounce_size = req->size;
+		}
+		p = sim->bounce;
+		if (req->write)
+			memcpy(p, req->buf, req->size);
+	}
+
+	while (done < req->size) {
+		if (req->write)
+			rc = pwrite(sim->fd, p + done, req->size - done,
+				    offs + done);
+		else
+			rc = pread(sim->fd, p + done, req->size - done,
+				   offs + done);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (rc == 0)
+			return EIO;
+		done += rc;
+	}
+
+	if ((p != req->buf) && !req->write)
+		memcpy(req->buf, p, req->size);
+	return 0;
+}
+
+/* Keep pending sorted by due time, must hold sim->lock */
+static void nvme_sim_pend(struct snap_nvme_sim *sim,
+			  struct snap_nvme_sim_req *req)
+{
+	struct snap_nvme_sim_req **pp = &sim->pending;
+
+	while (*pp && ((*pp)->due_nsec <= req->due_nsec))
+		pp = &(*pp)->next;
+	req->next = *pp;
+	*pp = req;
+}
+
+static void *nvme_sim_thread(void *arg)
+{
+	uint64_t now;
+	struct timespec ts;
+	struct snap_nvme_sim *sim = arg;
+	struct snap_nvme_sim_req *req;
+
+	pthread_mutex_lock(&sim->lock);
+	while (1) {
+		/* Transfer first, the due time runs already */
+		req = sim->head;
+		if (req) {
+			sim->head = req->next;
+			if (sim->head == NULL)
+				sim->tail = NULL;
+			pthread_mutex_unlock(&sim->lock);
+
+			req->rc = nvme_sim_io(sim, req);
+
+			pthread_mutex_lock(&sim->lock);
+			if (req->rc)
+				sim->errors++;
+			else if (req->write)
+				sim->writes++;
+			else
+				sim->reads++;
+			nvme_sim_pend(sim, req);
+			continue;
+		}
+
+		req = sim->pending;
+		if (req == NULL) {
+			if (sim->stopping)
+				break;
+			pthread_cond_wait(&sim->cond, &sim->lock);
+			continue;
+		}
+
+		now = nvme_sim_now();
+		if (req->due_nsec <= now) {
+			sim->pending = req->next;
+			pthread_mutex_unlock(&sim->lock);
+			req->done(req);
+			pthread_mutex_lock(&sim->lock);
+			continue;
+		}
+
+		/* Sleeping is too coarse for short latencies */
+		if (req->due_nsec - now < NVME_SIM_SPIN_NSEC) {
+			pthread_mutex_unlock(&sim->lock);
+			while (nvme_sim_now() < req->due_nsec)
+				sched_yield();
+			pthread_mutex_lock(&sim->lock);
+			continue;
+		}
+
+		ts.tv_sec = req->due_nsec / 1000000000ull;
+		ts.tv_nsec = req->due_nsec % 1000000000ull;
+		pthread_cond_timedwait(&sim->cond, &sim->lock, &ts);
+	}
+	pthread_mutex_unlock(&sim->lock);
+	return NULL;
+}
+
+int snap_nvme_sim_submit(struct snap_nvme_sim *sim,
+			 struct snap_nvme_sim_req *req)
+{
+	uint64_t now, start, xfer = 0;
+	unsigned int mbps, usec;
+	struct nvme_sim_drive *d;
+
+	if ((sim == NULL) || (req == NULL) || (req->done == NULL) ||
+	    (req->drive >= SNAP_NVME_SIM_DRIVES) || (req->size == 0) ||
+	    (req->size % SNAP_NVME_SIM_LB_SIZE)) {
+		errno = EINVAL;
+		return -1;
+	}
+	d = &sim->drive[req->drive];
+	if ((req->lba > d->nblocks) ||
+	    (req->size / SNAP_NVME_SIM_LB_SIZE > d->nblocks - req->lba)) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	mbps = req->write ? nvme_sim_prof.write_mbps : nvme_sim_prof.read_mbps;
+	usec = req->write ? nvme_sim_prof.write_usec : nvme_sim_prof.read_usec;
+	if (mbps)
+		xfer = (uint64_t)req->size * 1000 / mbps;	/* MB/s: B/usec */
+
+	pthread_mutex_lock(&sim->lock);
+	now = nvme_sim_now();
+	start = MAX(now, d->link_free_nsec);
+	d->link_free_nsec = start + xfer;
+	req->due_nsec = start + xfer + usec * 1000ull;
+	req->rc = 0;
+	req->next = NULL;
+
+	if (sim->tail)
+		sim->tail->next = req;
+	else	sim->head = req;
+	sim->tail = req;
+	pthread_cond_signal(&sim->cond);
+	pthread_mutex_unlock(&sim->lock);
+	return 0;
+}
+
+static void nvme_sim_rw_done(struct snap_nvme_sim_req *req)
+{
+	sem_post((sem_t *)req->priv);
+}
+
+int snap_nvme_sim_rw(struct snap_nvme_sim *sim, unsigned int drive,
+		     int write, uint64_t lba, void *buf, size_t size)
+{
+	int rc;
+	sem_t done;
+	struct snap_nvme_sim_req req = {
+		.drive = drive,
+		.write = write,
+		.lba = lba,
+		.buf = buf,
+		.size = size,
+		.done = nvme_sim_rw_done,
+		.priv = &done,
+	};
+
+	sem_init(&done, 0, 0);
+	rc = snap_nvme_sim_submit(sim, &req);
+	if (rc == 0) {
+		while ((sem_wait(&done) < 0) && (errno == EINTR))
+			;
+		if (req.rc) {
+			errno = req.rc;
+			rc = -1;
+		}
+	}
+	sem_destroy(&done);
+	return rc;
+}
+
+static int nvme_sim_size_of(struct snap_nvme_sim *sim, const char *name,
+			    uint64_t *size)
+{
+	struct stat st;
+
+	if (fstat(sim->fd, &st) < 0)
+		return -1;
+
+	if (S_ISBLK(st.st_mode))
+		return ioctl(sim->fd, BLKGETSIZE64, size);
+
+	*size = st.st_size;
+	if ((nvme_sim_size == 0) && (*size != 0))
+		return 0;
+
+	/* Sparse, only blocks written take space */
+	*size = nvme_sim_size ? nvme_sim_size :
+		NVME_SIM_SIZE_GIB * 1024ull * 1024 * 1024;
+	if ((uint64_t)st.st_size < *size) {
+		act_trace("  %s: %s grows to %lld bytes\n", __func__, name,
+			  (long long)*size);
+		return ftruncate(sim->fd, *size);
+	}
+	return 0;
+}
+
+struct snap_nvme_sim *snap_nvme_sim_open(unsigned int card_no)
+{
+	unsigned int i;
+	uint64_t size = 0, half;
+	const char *name;
+	pthread_condattr_t attr;
+	struct snap_nvme_sim *sim;
+
+	if ((card_no >= nvme_sim_ncards) || (*nvme_sim_names[card_no] == 0))
+		return NULL;
+	name = nvme_sim_names[card_no];
+
+	pthread_mutex_lock(&nvme_sim_lock);
+	sim = nvme_sims[card_no];
+	if (sim) {
+		sim->users++;
+		goto out;
+	}
+
+	sim = calloc(1, sizeof(*sim));
+	if (sim == NULL)
+		goto out;
+
+	sim->card_no = card_no;
+	sim->users = 1;
+	sim->fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC |
+		       (nvme_sim_direct ? O_DIRECT : 0), 0644);
+	if (sim->fd < 0) {
+		fprintf(stderr, "err: cannot open NVMe drive file %s: %s\n",
+			name, strerror(errno));
+		goto out_free;
+	}
+	if (nvme_sim_size_of(sim, name, &size) < 0) {
+		fprintf(stderr, "err: cannot size NVMe drive file %s: %s\n",
+			name, strerror(errno));
+		goto out_close;
+	}
+
+	half = size / SNAP_NVME_SIM_DRIVES / SNAP_NVME_SIM_LB_SIZE;
+	for (i = 0; i < SNAP_NVME_SIM_DRIVES; i++) {
+		sim->drive[i].offset = i * half * SNAP_NVME_SIM_LB_SIZE;
+		sim->drive[i].nblocks = half;
+	}
+
+	pthread_mutex_init(&sim->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sim->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&sim->tid, NULL, &nvme_sim_thread, sim) != 0) {
+		fprintf(stderr, "err: cannot start NVMe drive thread\n");
+		pthread_cond_destroy(&sim->cond);
+		pthread_mutex_destroy(&sim->lock);
+		goto out_close;
+	}
+
+	act_trace("  %s: card %u %s %lld blocks per drive, %s %u/%u usec "
+		  "%u/%u MB/s%s\n", __func__, card_no, name, (long long)half,
+		  nvme_sim_prof.name, nvme_sim_prof.read_usec,
+		  nvme_sim_prof.write_usec, nvme_sim_prof.read_mbps,
+		  nvme_sim_prof.write_mbps, nvme_sim_direct ? " O_DIRECT" : "");
+	nvme_sims[card_no] = sim;
+	goto out;
+
+ out_close:
+	close(sim->fd);
+ out_free:
+	free(sim);
+	sim = NULL;
+ out:
+	pthread_mutex_unlock(&nvme_sim_lock);
+	return sim;
+}
+
+void snap_nvme_sim_close(struct snap_nvme_sim *sim)
+{
+	if (sim == NULL)
+		return;
+
+	pthread_mutex_lock(&nvme_sim_lock);
+	if (--sim->users) {
+		pthread_mutex_unlock(&nvme_sim_lock);
+		return;
+	}
+	nvme_sims[sim->card_no] = NULL;
+	pthread_mutex_unlock(&nvme_sim_lock);
+
+	/* Requests still queued complete before the thread ends */
+	pthread_mutex_lock(&sim->lock);
+	sim->stopping = true;
+	pthread_cond_signal(&sim->cond);
+	pthread_mutex_unlock(&sim->lock);
+	pthread_join(sim->tid, NULL);
+
+	act_trace("  %s: card %u reads=%lu writes=%lu errors=%lu\n",
+		  __func__, sim->card_no, sim->reads, sim->writes,
+		  sim->errors);
+
+	pthread_cond_destroy(&sim->cond);
+	pthread_mutex_destroy(&sim->lock);
+	close(sim->fd);
+	free(sim->bounce);
+	free(sim);
+}
+
+static unsigned int nvme_sim_env(const char *name, unsigned int val)
+{
+	const char *env = getenv(name);
+
+	if (env == NULL)
+		return val;
+	return strtoul(env, (char **)NULL, 0);
+}
+
+void snap_nvme_sim_init(void)
+{
+	unsigned int i;
+	char *names, *s, *save = NULL;
+	const char *env;
+
+	env = getenv("SNAP_NVME_SIM");
+	if (env == NULL)
+		return;
+
+	names = strdup(env);
+	if (names == NULL)
+		return;
+
+	/* strtok would skip empty entries, cards without drives */
+	for (s = names; (s != NULL) && (nvme_sim_ncards < NVME_SIM_CARDS_MAX);
+	     s = save) {
+		save = strchr(s, ',');
+		if (save)
+			*save++ = 0;
+		nvme_sim_names[nvme_sim_ncards++] = s;
+	}
+
+	nvme_sim_prof = nvme_sim_profiles[1];	/* NVME */
+	env = getenv("SNAP_NVME_SIM_PROFILE");
+	if (env != NULL) {
+		for (i = 0; i < ARRAY_SIZE(nvme_sim_profiles); i++)
+			if (strcasecmp(env, nvme_sim_profiles[i].name) == 0)
+				break;
+		if (i < ARRAY_SIZE(nvme_sim_profiles))
+			nvme_sim_prof = nvme_sim_profiles[i];
+		else
+			fprintf(stderr, "err: unknown SNAP_NVME_SIM_PROFILE %s, "
+				"using %s\n", env, nvme_sim_prof.name);
+	}
+
+	nvme_sim_prof.read_usec = nvme_sim_env("SNAP_NVME_SIM_READ_USEC",
+					       nvme_sim_prof.read_usec);
+	nvme_sim_prof.write_usec = nvme_sim_env("SNAP_NVME_SIM_WRITE_USEC",
+						nvme_sim_prof.write_usec);
+	nvme_sim_prof.read_mbps = nvme_sim_env("SNAP_NVME_SIM_READ_MBPS",
+					       nvme_sim_prof.read_mbps);
+	nvme_sim_prof.write_mbps = nvme_sim_env("SNAP_NVME_SIM_WRITE_MBPS",
+						nvme_sim_prof.write_mbps);
+
+	nvme_sim_size = nvme_sim_env("SNAP_NVME_SIM_SIZE", 0) *
+		1024ull * 1024 * 1024;
+	nvme_sim_direct = nvme_sim_env("SNAP_NVME_SIM_DIRECT", 0);
+}
@@ -0,0 +1,37 @@
+/**
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __SNAP_NVME_SIM_H__
+#define __SNAP_NVME_SIM_H__
+
+#include <snap_internal.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Called from library initialization, reads SNAP_NVME_SIM* */
+void snap_nvme_sim_init(void);
+
+/* Drives of card card_no, NULL if SNAP_NVME_SIM has no entry for it */
+struct snap_nvme_sim *snap_nvme_sim_open(unsigned int card_no);
+void snap_nvme_sim_close(struct snap_nvme_sim *sim);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* __SNAP_NVME_SIM_H__ */
@@ -0,0 +1,423 @@
+/**
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Per action type job metrics.
+ *
+ * Every thread gets its own set of histograms and counters on first
+ * use. Only the owning thread writes them, so recording needs neither
+ * locks nor atomic read-modify-write operations. snap_get_stats() walks
+ * the list of all thread records and merges them. When a thread exits,
+ * its record is folded into one for the threads gone and freed, so
+ * hosts which start a thread per request do not grow. The histograms use
+ * log-linear buckets like HdrHistogram: values below 32 nsec have their
+ * own bucket, above that each power of two is split into 16 buckets,
+ * giving about 6% precision.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <libsnap.h>
+#include <snap_tools.h>
+#include "snap_stats.h"
+
+#define HIST_SUB_BITS		4
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS		40	/* ~18 minutes in nsec */
+#define HIST_BUCKETS		((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define STATS_ACTIONS		16	/* Action types per thread */
+
+struct stats_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+struct stats_entry {
+	snap_action_type_t action_type;
+	uint64_t counter[SNAP_STAT_CNT_MAX];
+	struct stats_hist lat[SNAP_STAT_LAT_MAX];
+};
+
+struct stats_thread {
+	struct stats_thread *next;
+	unsigned int entries;
+	struct stats_entry *entry[STATS_ACTIONS];
+};
+
+int snap_stats_enabled = 1;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_thread *stats_threads = NULL;	/* Under stats_lock */
+static struct stats_thread stats_gone;			/* Under stats_lock */
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_thread *stats_self = NULL;
+static const char *stats_lat_name[SNAP_STAT_LAT_MAX] = {
+	"attach", "set_regs", "exec", "wait",
+};
+
+static inline void stat_add(uint64_t *p, uint64_t v)
+{
+	__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v,
+			 __ATOMIC_RELAXED);
+}
+
+static inline unsigned int hist_index(uint64_t v)
+{
+	unsigned int msb, shift;
+
+	if (v < 2 * HIST_SUB)
+		return (unsigned int)v;
+	if (v >= (1ull << HIST_MAX_BITS))
+		v = (1ull << HIST_MAX_BITS) - 1;
+
+	msb = 63 - __builtin_clzll(v);
+	shift = msb - HIST_SUB_BITS;
+	return shift * HIST_SUB + (unsigned int)(v >> shift);
+}
+
+/* Highest value which ends up in the same bucket */
+static inline uint64_t hist_value(unsigned int idx)
+{
+	unsigned int shift;
+	uint64_t sub;
+
+	if (idx < 2 * HIST_SUB)
+		return idx;
+
+	shift = idx / HIST_SUB - 1;
+	sub = (idx % HIST_SUB) + HIST_SUB;
+	return ((sub + 1) << shift) - 1;
+}
+
+/* Find or add the entry of action_type, t is ours or stats_gone */
+static struct stats_entry *stats_entry_find(struct stats_thread *t,
+					    snap_action_type_t action_type)
+{
+	unsigned int i;
+	struct stats_entry *e;
+
+	for (i = 0; i < t->entries; i++)
+		if (t->entry[i]->action_type == action_type)
+			return t->entry[i];
+
+	if (t->entries == STATS_ACTIONS)
+		return NULL;
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL)
+		return NULL;
+	e->action_type = action_type;
+	for (i = 0; i < SNAP_STAT_LAT_MAX; i++)
+		e->lat[i].min = UINT64_MAX;
+
+	t->entry[t->entries] = e;
+	__atomic_store_n(&t->entries, t->entries + 1, __ATOMIC_RELEASE);
+	return e;
+}
+
+/* Thread exit: fold the record into stats_gone, then free it */
+static void stats_thread_exit(void *arg)
+{
+	unsigned int i, k, l;
+	struct stats_thread **p, *t = arg;
+	struct stats_entry *src, *dst;
+
+	pthread_mutex_lock(&stats_lock);
+	for (p = &stats_threads; *p != NULL; p = &(*p)->next)
+		if (*p == t) {
+			*p = t->next;
+			break;
+		}
+
+	for (i = 0; i < t->entries; i++) {
+		src = t->entry[i];
+		dst = stats_entry_find(&stats_gone, src->action_type);
+		if (dst == NULL)
+			goto free_entry;	/* Too many action types */
+
+		for (k = 0; k < SNAP_STAT_CNT_MAX; k++)
+			dst->counter[k] += src->counter[k];
+		for (k = 0; k < SNAP_STAT_LAT_MAX; k++) {
+			struct stats_hist *d = &dst->lat[k];
+			struct stats_hist *h = &src->lat[k];
+
+			for (l = 0; l < HIST_BUCKETS; l++)
+				d->bucket[l] += h->bucket[l];
+			d->sum += h->sum;
+			d->min = MIN(d->min, h->min);
+			d->max = MAX(d->max, h->max);
+			d->count += h->count;
+		}
+	free_entry:
+		free(src);
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	free(t);
+	stats_self = NULL;
+}
+
+static void stats_key_init(void)
+{
+	if (pthread_key_create(&stats_key, stats_thread_exit) != 0)
+		fprintf(stderr, "err: no stats key, thread records leak\n");
+}
+
+static struct stats_entry *stats_entry_get(snap_action_type_t action_type)
+{
+	struct stats_thread *t = stats_self;
+
+	if (t == NULL) {
+		t = calloc(1, sizeof(*t));
+		if (t == NULL)
+			return NULL;
+		pthread_once(&stats_key_once, stats_key_init);
+		pthread_setspecific(stats_key, t);
+
+		pthread_mutex_lock(&stats_lock);
+		t->next = stats_threads;
+		stats_threads = t;
+		pthread_mutex_unlock(&stats_lock);
+		stats_self = t;
+	}
+	return stats_entry_find(t, action_type);
+}
+
+void snap_stats_lat(snap_action_type_t action_type,
+		    enum snap_stat_lat lat, uint64_t nsec)
+{
+	struct stats_entry *e;
+	struct stats_hist *h;
+
+	e = stats_entry_get(action_type);
+	if (e == NULL)
+		return;
+
+	h = &e->lat[lat];
+	stat_add(&h->bucket[hist_index(nsec)], 1);
+	stat_add(&h->sum, nsec);
+	if (nsec < h->min)
+		__atomic_store_n(&h->min, nsec, __ATOMIC_RELAXED);
+	if (nsec > h->max)
+		__atomic_store_n(&h->max, nsec, __ATOMIC_RELAXED);
+	/* count last, readers use it to see complete samples */
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+void snap_stats_inc(snap_action_type_t action_type, enum snap_stat_cnt cnt)
+{
+	struct stats_entry *e;
+
+	e = stats_entry_get(action_type);
+	if (e == NULL)
+		return;
+	stat_add(&e->counter[cnt], 1);
+}
+
+static uint64_t hist_percentile(const uint64_t *bucket, uint64_t count,
+				double pct)
+{
+	unsigned int i;
+	uint64_t seen = 0;
+	uint64_t want = (uint64_t)((double)count * pct / 100.0 + 0.5);
+
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += bucket[i];
+		if (seen >= want)
+			return hist_value(i);
+	}
+	return hist_value(HIST_BUCKETS - 1);
+}
+
+/* Add the entries of t to stats, n of max_stats are used so far */
+static void stats_merge(struct stats_thread *t, struct snap_action_stats *stats,
+			uint64_t (*bucket)[SNAP_STAT_LAT_MAX][HIST_BUCKETS],
+			unsigned int *n, unsigned int max_stats)
+{
+	unsigned int i, j, k, l;
+	unsigned int entries = __atomic_load_n(&t->entries, __ATOMIC_ACQUIRE);
+	struct stats_entry *e;
+	uint64_t v;
+
+	for (i = 0; i < entries; i++) {
+		e = t->entry[i];
+
+		for (j = 0; j < *n; j++)
+			if (stats[j].action_type == e->action_type)
+				break;
+		if (j == *n) {
+			if (*n == max_stats)
+				continue;
+			stats[j].action_type = e->action_type;
+			for (k = 0; k < SNAP_STAT_LAT_MAX; k++)
+				stats[j].lat[k].min_nsec = UINT64_MAX;
+			(*n)++;
+		}
+
+		for (k = 0; k < SNAP_STAT_CNT_MAX; k++)
+			stats[j].counter[k] += __atomic_load_n(
+				&e->counter[k], __ATOMIC_RELAXED);
+
+		for (k = 0; k < SNAP_STAT_LAT_MAX; k++) {
+			struct stats_hist *h = &e->lat[k];
+			struct snap_stat_hist *s = &stats[j].lat[k];
+
+			if (__atomic_load_n(&h->count, __ATOMIC_ACQUIRE) == 0)
+				continue;
+			for (l = 0; l < HIST_BUCKETS; l++) {
+				v = __atomic_load_n(&h->bucket[l],
+						    __ATOMIC_RELAXED);
+				bucket[j][k][l] += v;
+				s->count += v;
+			}
+			s->mean_nsec += __atomic_load_n(&h->sum,
+							__ATOMIC_RELAXED);
+			s->min_nsec = MIN(s->min_nsec,
+				__atomic_load_n(&h->min, __ATOMIC_RELAXED));
+			s->max_nsec = MAX(s->max_nsec,
+				__atomic_load_n(&h->max, __ATOMIC_RELAXED));
+		}
+	}
+}
+
+int snap_get_stats(struct snap_action_stats *stats, unsigned int max_stats)
+{
+	unsigned int j, k, n = 0;
+	struct stats_thread *t;
+	uint64_t (*bucket)[SNAP_STAT_LAT_MAX][HIST_BUCKETS];
+
+	if ((stats == NULL) && (max_stats != 0)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+
+	bucket = calloc(max_stats ? max_stats : 1, sizeof(*bucket));
+	if (bucket == NULL)
+		return SNAP_ENOENT;
+	memset(stats, 0, max_stats * sizeof(*stats));
+
+	pthread_mutex_lock(&stats_lock);
+	for (t = stats_threads; t != NULL; t = t->next)
+		stats_merge(t, stats, bucket, &n, max_stats);
+	stats_merge(&stats_gone, stats, bucket, &n, max_stats);
+	pthread_mutex_unlock(&stats_lock);
+
+	for (j = 0; j < n; j++) {
+		for (k = 0; k < SNAP_STAT_LAT_MAX; k++) {
+			struct snap_stat_hist *s = &stats[j].lat[k];
+
+			if (s->count == 0) {
+				s->min_nsec = 0;
+				continue;
+			}
+			s->mean_nsec /= s->count;	/* held the sum so far */
+			s->p50_nsec = hist_percentile(bucket[j][k], s->count, 50.0);
+			s->p99_nsec = hist_percentile(bucket[j][k], s->count, 99.0);
+			s->p999_nsec = hist_percentile(bucket[j][k], s->count, 99.9);
+
+			/* Bucket bounds may lie outside the seen values */
+			s->p50_nsec = MIN(MAX(s->p50_nsec, s->min_nsec), s->max_nsec);
+			s->p99_nsec = MIN(MAX(s->p99_nsec, s->min_nsec), s->max_nsec);
+			s->p999_nsec = MIN(MAX(s->p999_nsec, s->min_nsec), s->max_nsec);
+		}
+	}
+
+	free(bucket);
+	return (int)n;
+}
+
+void snap_print_stats(FILE *fp)
+{
+	int i, n;
+	unsigned int k;
+	struct snap_action_stats stats[STATS_ACTIONS];
+
+	n = snap_get_stats(stats, ARRAY_SIZE(stats));
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "Action 0x%08x jobs: %lld timeouts: %lld "
+			"eio: %lld efault: %lld\n", stats[i].action_type,
+			(long long)stats[i].counter[SNAP_STAT_JOBS],
+			(long long)stats[i].counter[SNAP_STAT_TIMEOUTS],
+			(long long)stats[i].counter[SNAP_STAT_EIO],
+			(long long)stats[i].counter[SNAP_STAT_EFAULT]);
+
+		for (k = 0; k < SNAP_STAT_LAT_MAX; k++) {
+			struct snap_stat_hist *s = &stats[i].lat[k];
+
+			if (s->count == 0)
+				continue;
+			fprintf(fp, "  %-8s n: %-10lld usec min: %.3f "
+				"mean: %.3f p50: %.3f p99: %.3f p999: %.3f "
+				"max: %.3f\n", stats_lat_name[k],
+				(long long)s->count, s->min_nsec / 1000.0,
+				s->mean_nsec / 1000.0, s->p50_nsec / 1000.0,
+				s->p99_nsec / 1000.0, s->p999_nsec / 1000.0,
+				s->max_nsec / 1000.0);
+		}
+	}
+}
+
+static unsigned int stats_dump_sec = 0;
+
+static void *stats_dump_thread(void *arg __attribute__((unused)))
+{
+	while (1) {
+		sleep(stats_dump_sec);
+		snap_print_stats(stderr);
+	}
+	return NULL;
+}
+
+static void stats_dump_exit(void)
+{
+	snap_print_stats(stderr);
+}
+
+void snap_stats_init(void)
+{
+	pthread_t tid;
+	const char *env;
+
+	env = getenv("SNAP_STATS");
+	if (env != NULL)
+		snap_stats_enabled = strtol(env, (char **)NULL, 0);
+
+	env = getenv("SNAP_STATS_DUMP");
+	if ((env == NULL) || !snap_stats_enabled)
+		return;
+
+	/* Dump when the program ends and every n seconds if n > 0 */
+	atexit(stats_dump_exit);
+	stats_dump_sec = strtol(env, (char **)NULL, 0);
+	if (stats_dump_sec == 0)
+		return;
+	if (pthread_create(&tid, NULL, &stats_dump_thread, NULL) == 0)
+		pthread_detach(tid);
+}
@@ -0,0 +1,55 @@
+#ifndef __SNAP_STATS_H__
+#define __SNAP_STATS_H__
+
+/**
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Job metrics, private to libsnap. Each thread records into its own
+ * histograms and counters, snap_get_stats() sums them up.
+ */
+
+#include <stdint.h>
+#include <time.h>
+#include <libsnap.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int snap_stats_enabled;
+
+static inline uint64_t snap_stats_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+void snap_stats_lat(snap_action_type_t action_type,
+		    enum snap_stat_lat lat, uint64_t nsec);
+void snap_stats_inc(snap_action_type_t action_type,
+		    enum snap_stat_cnt cnt);
+
+/* Called from library initialization, reads SNAP_STATS* */
+void snap_stats_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* __SNAP_STATS_H__ */
@@ -0,0 +1,451 @@
+/*
+ * Copyright 2018, International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Decoder for the binary traces libsnap writes when SNAP_TRACE_FILE is
+ * set. Prints the events as text, like the traces would have looked
+ * on stderr, or as Chrome trace JSON which can be loaded into
+ * chrome://tracing or https://ui.perfetto.dev.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include <snap_tools.h>
+#include <snap_btrace.h>
+
+#define FMTS_MAX	0x10000
+#define MSG_MAX		8192
+
+struct fmt_info {
+	char cat;
+	const char *fmt;
+	int nargs;
+	uint8_t arg[BTRACE_ARGS_MAX];
+};
+
+struct event {
+	uint64_t nsec;
+	uint32_t tid;
+	const struct btrace_event *e;
+};
+
+static const char *version = GIT_VERSION;
+static struct fmt_info fmts[FMTS_MAX];
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-h] [-V] [-t] [-o <out>] <tracefile>\n"
+	       "  -t, --text                print text instead of JSON.\n"
+	       "  -o, --output <file>       output file, default is stdout.\n"
+	       "  -V, --version             print version.\n"
+	       "Example:\n"
+	       "  $ SNAP_TRACE=0x20 SNAP_TRACE_FILE=snap.trc snap_cblk ...\n"
+	       "  $ %s -o snap.json snap.trc\n\n",
+	       prog, prog);
+}
+
+static const char *cat_name(char cat)
+{
+	switch (cat) {
+	case 'B': return "block";
+	case 'C': return "cache";
+	case 'S': return "stat";
+	case 'P': return "prefetch";
+	default:  return "other";
+	}
+}
+
+/*
+ * Format one event. If name is not NULL, it gets the first string
+ * argument, which is the function name for most trace points.
+ */
+static int format_event(const struct btrace_event *e, char *msg,
+			size_t msg_size, char *name, size_t name_size)
+{
+	const struct fmt_info *f = &fmts[e->id];
+	const uint8_t *a = (const uint8_t *)(e + 1);
+	const uint8_t *end = (const uint8_t *)e + e->len;
+	const char *p, *start;
+	char spec[64];
+	size_t pos = 0, n;
+	int i = 0, rc;
+	uint64_t v;
+	double d;
+	uint16_t slen;
+	char str[BTRACE_STR_MAX + 1];
+
+	if (name)
+		*name = 0;
+
+#define NEXT_U64() ({						\
+		if (a + sizeof(uint64_t) > end)			\
+			return -1;				\
+		memcpy(&v, a, sizeof(v));			\
+		a += sizeof(v);					\
+		i++;						\
+		v; })
+
+	for (p = f->fmt; *p && (pos + 1 < msg_size); p++) {
+		if (*p != '%') {
+			msg[pos++] = *p;
+			continue;
+		}
+		start = p++;
+		if (*p == '%') {
+			msg[pos++] = '%';
+			continue;
+		}
+
+		/* Copy flags, width and precision, resolve '*' */
+		n = 0;
+		spec[n++] = '%';
+		while (*p && strchr("-+ #0123456789.*", *p)) {
+			if (*p == '*') {
+				NEXT_U64();
+				n += snprintf(spec + n, sizeof(spec) - n,
+					      "%d", (int)v);
+			} else
+				spec[n++] = *p;
+			p++;
+			if (n >= sizeof(spec) - 4)
+				return -1;
+		}
+		while (*p && strchr("hlLqjzt", *p))
+			p++;
+
+		switch (*p) {
+		case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+			NEXT_U64();
+			if (f->arg[i - 1] == BTRACE_ARG_INT) {
+				/* Print as the int it was */
+				if (strchr("di", *p))
+					v = (uint64_t)(int64_t)(int32_t)v;
+				else
+					v = (uint32_t)v;
+			}
+			spec[n++] = 'l';
+			spec[n++] = 'l';
+			spec[n++] = *p;
+			spec[n] = 0;
+			rc = snprintf(msg + pos, msg_size - pos, spec, v);
+			break;
+		case 'c':
+			NEXT_U64();
+			spec[n++] = 'c';
+			spec[n] = 0;
+			rc = snprintf(msg + pos, msg_size - pos, spec, (int)v);
+			break;
+		case 'p':
+			NEXT_U64();
+			spec[n++] = 'p';
+			spec[n] = 0;
+			rc = snprintf(msg + pos, msg_size - pos, spec,
+				      (void *)(uintptr_t)v);
+			break;
+		case 'f': case 'F': case 'e': case 'E':
+		case 'g': case 'G': case 'a': case 'A':
+			NEXT_U64();
+			memcpy(&d, &v, sizeof(d));
+			spec[n++] = *p;
+			spec[n] = 0;
+			rc = snprintf(msg + pos, msg_size - pos, spec, d);
+			break;
+		case 's':
+			if (a + sizeof(slen) > end)
+				return -1;
+			memcpy(&slen, a, sizeof(slen));
+			a += sizeof(slen);
+			if ((slen > BTRACE_STR_MAX) || (a + slen > end))
+				return -1;
+			memcpy(str, a, slen);
+			str[slen] = 0;
+			a += slen;
+			if (name && (i == 0)) {
+				size_t l = MIN((size_t)slen, name_size - 1);
+
+				memcpy(name, str, l);
+				name[l] = 0;
+			}
+			i++;
+			spec[n++] = 's';
+			spec[n] = 0;
+			rc = snprintf(msg + pos, msg_size - pos, spec, str);
+			break;
+		default:
+			fprintf(stderr, "err: unsupported format %s\n", start);
+			return -1;
+		}
+		if (rc < 0)
+			return -1;
+		pos = MIN(pos + rc, msg_size - 1);
+	}
+#undef NEXT_U64
+
+	msg[pos] = 0;
+	return 0;
+}
+
+static void json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		switch (*s) {
+		case '"':  fputs("\\\"", fp); break;
+		case '\\': fputs("\\\\", fp); break;
+		case '\n': fputs("\\n", fp);  break;
+		case '\t': fputs("\\t", fp);  break;
+		default:
+			if ((unsigned char)*s < 0x20)
+				fprintf(fp, "\\u%04x", *s);
+			else
+				fputc(*s, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+static int event_cmp(const void *_a, const void *_b)
+{
+	const struct event *a = _a, *b = _b;
+
+	if (a->nsec != b->nsec)
+		return (a->nsec < b->nsec) ? -1 : 1;
+	return 0;
+}
+
+static uint8_t *read_file(const char *fname, size_t *size)
+{
+	FILE *fp;
+	uint8_t *buf = NULL, *nbuf;
+	size_t len = 0, alloc = 0, n;
+
+	fp = fopen(fname, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "err: cannot open %s: %s\n", fname,
+			strerror(errno));
+		return NULL;
+	}
+	do {
+		if (len == alloc) {
+			alloc = alloc ? alloc * 2 : 1024 * 1024;
+			nbuf = realloc(buf, alloc);
+			if (nbuf == NULL) {
+				free(buf);
+				fclose(fp);
+				return NULL;
+			}
+			buf = nbuf;
+		}
+		n = fread(buf + len, 1, alloc - len, fp);
+		len += n;
+	} while (n);
+
+	fclose(fp);
+	*size = len;
+	return buf;
+}
+
+int main(int argc, char *argv[])
+{
+	int ch, rc = EXIT_SUCCESS;
+	int text = 0, first = 1;
+	const char *fname, *oname = NULL;
+	FILE *out = stdout;
+	uint8_t *buf;
+	size_t size, offs;
+	const struct btrace_file_hdr *hdr;
+	const struct btrace_chunk *c;
+	const struct btrace_fmt *bf;
+	const struct btrace_event *e;
+	struct event *events = NULL, *nevents;
+	size_t nr = 0, max = 0, i, o;
+	unsigned long dropped = 0, bad = 0;
+	char msg[MSG_MAX], name[128];
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "text",	 no_argument,	    NULL, 't' },
+			{ "output",	 required_argument, NULL, 'o' },
+			{ "version",	 no_argument,	    NULL, 'V' },
+			{ "help",	 no_argument,	    NULL, 'h' },
+			{ 0,		 no_argument,	    NULL, 0   },
+		};
+
+		ch = getopt_long(argc, argv, "to:Vh",
+				 long_options, &option_index);
+		if (ch == -1)	/* all params processed ? */
+			break;
+
+		switch (ch) {
+		case 't':
+			text = 1;
+			break;
+		case 'o':
+			oname = optarg;
+			break;
+		case 'V':
+			printf("%s\n", version);
+			exit(EXIT_SUCCESS);
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	fname = argv[optind];
+
+	buf = read_file(fname, &size);
+	if (buf == NULL)
+		exit(EXIT_FAILURE);
+
+	hdr = (const struct btrace_file_hdr *)buf;
+	if ((size < sizeof(*hdr)) || (hdr->magic != BTRACE_MAGIC)) {
+		fprintf(stderr, "err: %s is no SNAP trace file\n", fname);
+		rc = EXIT_FAILURE;
+		goto out_free;
+	}
+
+	/* Collect formats and events, formats may follow their events */
+	for (offs = sizeof(*hdr); offs + sizeof(*c) <= size;
+	     offs += sizeof(*c) + c->len) {
+		c = (const struct btrace_chunk *)(buf + offs);
+		if (offs + sizeof(*c) + c->len > size) {
+			fprintf(stderr, "warn: truncated trace file\n");
+			break;
+		}
+
+		switch (c->type) {
+		case BTRACE_CHUNK_FMT:
+			bf = (const struct btrace_fmt *)(c + 1);
+			fmts[bf->id].cat = bf->cat;
+			fmts[bf->id].fmt = (const char *)(bf + 1);
+			fmts[bf->id].nargs = btrace_parse_fmt(
+				fmts[bf->id].fmt, fmts[bf->id].arg,
+				ARRAY_SIZE(fmts[bf->id].arg));
+			break;
+
+		case BTRACE_CHUNK_EVENTS:
+			dropped += c->dropped;
+			for (o = 0; o + sizeof(*e) <= c->len; o += e->len) {
+				e = (const struct btrace_event *)
+					((const uint8_t *)(c + 1) + o);
+				if ((e->len < sizeof(*e)) ||
+				    (o + e->len > c->len))
+					break;
+				if (nr == max) {
+					max = max ? max * 2 : 4096;
+					nevents = realloc(events,
+							  max * sizeof(*events));
+					if (nevents == NULL) {
+						rc = EXIT_FAILURE;
+						goto out_free;
+					}
+					events = nevents;
+				}
+				events[nr].nsec = e->nsec;
+				events[nr].tid = c->tid;
+				events[nr].e = e;
+				nr++;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* Threads are flushed one after the other, sort by time */
+	qsort(events, nr, sizeof(*events), event_cmp);
+
+	if (oname) {
+		out = fopen(oname, "w");
+		if (out == NULL) {
+			fprintf(stderr, "err: cannot open %s: %s\n", oname,
+				strerror(errno));
+			rc = EXIT_FAILURE;
+			goto out_free;
+		}
+	}
+
+	if (!text)
+		fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+	for (i = 0; i < nr; i++) {
+		const struct fmt_info *f;
+
+		e = events[i].e;
+		f = &fmts[e->id];
+		if ((f->fmt == NULL) || (f->nargs < 0) ||
+		    (format_event(e, msg, sizeof(msg), name,
+				  sizeof(name)) < 0)) {
+			bad++;
+			continue;
+		}
+
+		if (text) {
+			fprintf(out, "%c %08x.%08x %-16lld %s", f->cat,
+				hdr->pid, events[i].tid,
+				(long long)(e->nsec / 1000), msg);
+			continue;
+		}
+
+		/* Drop the trailing newline */
+		o = strlen(msg);
+		while (o && (msg[o - 1] == '\n'))
+			msg[--o] = 0;
+
+		fprintf(out, "%s{\"name\":", first ? "" : ",\n");
+		first = 0;
+		json_string(out, *name ? name : cat_name(f->cat));
+		fprintf(out, ",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+			"\"ts\":%.3f,\"pid\":%u,\"tid\":%u,\"args\":{\"msg\":",
+			cat_name(f->cat),
+			(double)(int64_t)(e->nsec - hdr->start_nsec) / 1000.0,
+			hdr->pid, events[i].tid);
+		json_string(out, msg);
+		fprintf(out, "}}");
+	}
+
+	if (!text)
+		fprintf(out, "\n]}\n");
+
+	if (dropped)
+		fprintf(stderr, "warn: %lu events were dropped, the ring "
+			"was full (SNAP_TRACE_BUFSIZE) or their format was "
+			"not registered\n", dropped);
+	if (bad)
+		fprintf(stderr, "warn: %lu events could not be decoded\n",
+			bad);
+
+	if (out != stdout)
+		fclose(out);
+ out_free:
+	free(events);
+	free(buf);
+	exit(rc);
+}